@@ -5,10 +5,14 @@ import java.io.File
 class Builder {
     private val blocks = mutableListOf<BlockBuilder>()
 
-    private fun build(): List<Byte> {
-        val result = mutableListOf<Byte>()
+    private fun blockOffsets(): Map<String, Int> {
         val blockSizes = blocks.map { it.size() }
-        val blockOffsets = blocks.zip(blockSizes.scan(0) { acc, size -> acc + size }) { block, offset -> block.name to offset }.toMap()
+
+        return blocks.zip(blockSizes.scan(0) { acc, size -> acc + size }) { block, offset -> block.name to offset }.toMap()
+    }
+
+    private fun build(blockOffsets: Map<String, Int>): List<Byte> {
+        val result = mutableListOf<Byte>()
 
         for (block in blocks) {
             result.addAll(block.build(blockOffsets))
@@ -17,11 +21,18 @@ class Builder {
         return result
     }
 
+    // Writes a version 2 container with each block named in its symbols.
     fun writeTo(file: File) {
+        val blockOffsets = blockOffsets()
+
         file.delete()
-        file.appendBytes(build().toByteArray())
+        file.appendBytes(encode(build(blockOffsets).toByteArray(), blockOffsets))
     }
 
+    // The instructions of the block with the given name, as they are written.
+    internal fun instructions(name: String): List<Byte> =
+        blocks.first { it.name == name }.build(blockOffsets())
+
     fun createBlock(name: String): BlockBuilder {
         val builder = BlockBuilder(name, this)
         blocks.add(builder)
@@ -42,6 +53,9 @@ class BlockBuilder(val name: String, val builder: Builder) {
         for ((index, label) in patches) {
             val offset = offsets[label] ?: ((labels[label] ?: throw Exception("Unknown label $label")) + myOffset)
             result[index] = offset.toByte()
+            result[index + 1] = (offset shr 8).toByte()
+            result[index + 2] = (offset shr 16).toByte()
+            result[index + 3] = (offset shr 24).toByte()
         }
         return result
     }
@@ -19,17 +19,87 @@ fun compileTo(input: String, fileName: String) {
     compileTo(input, File(fileName))
 }
 
-data class Binding(val depth: Int, val offset: Int)
+sealed class Binding
 
-data class Environment(val variables: Map<String, Binding>, val depth: Int = 0, val nextOffset: Int = 0) {
-    fun openScope(): Environment =
-        Environment(variables, depth + 1, 0)
+data class LocalBinding(val offset: Int) : Binding()
+
+data class FreeBinding(val index: Int) : Binding()
+
+data class Environment(val variables: Map<String, Binding>, val nextOffset: Int = 0) {
+    fun openScope(free: List<String>): Environment =
+        Environment(free.withIndex().associate { (index, name) -> name to FreeBinding(index) }, 0)
 
     fun bind(name: String): Environment =
-        Environment(variables + Pair(name, Binding(depth, nextOffset)), depth, nextOffset + 1)
+        Environment(variables + Pair(name, LocalBinding(nextOffset)), nextOffset + 1)
 }
 
-private fun compile(toplevel: Expression, builder: Builder) {
+/*
+ * The variables that e refers to without binding them, in the order in which
+ * they first appear.  A lambda captures exactly these variables of its body.
+ */
+fun freeVariables(e: Expression): Set<String> =
+    when (e) {
+        is AppExpression -> freeVariables(e.e1) + freeVariables(e.e2)
+        is IfExpression -> freeVariables(e.e1) + freeVariables(e.e2) + freeVariables(e.e3)
+        is LamExpression -> freeVariables(e.e) - e.n
+        is LetExpression -> {
+            var bound = emptySet<String>()
+            var free = emptySet<String>()
+
+            for (d in e.decls) {
+                free = free + (freeVariables(d.e) - bound)
+                bound = bound + d.n
+            }
+
+            free + (freeVariables(e.e) - bound)
+        }
+        is LetRecExpression ->
+            (e.decls.fold(freeVariables(e.e)) { free, d -> free + freeVariables(d.e) }) - e.decls.map { it.n }.toSet()
+        is VarExpression -> setOf(e.name)
+        is LIntExpression -> emptySet()
+        is LBoolExpression -> emptySet()
+        is LTupleExpression -> e.es.fold(emptySet()) { free, expr -> free + freeVariables(expr) }
+        is OpExpression -> freeVariables(e.e1) + freeVariables(e.e2)
+    }
+
+fun capturedVariables(e: LamExpression): List<String> =
+    freeVariables(e).toList()
+
+/*
+ * The lambda that e evaluates to, looking through any lets around it, and
+ * those of names that the lets leave in scope at the lambda.
+ */
+fun valueLambda(e: Expression, names: Set<String>): Pair<LamExpression, Set<String>>? =
+    when (e) {
+        is LamExpression -> Pair(e, names)
+        is LetExpression -> valueLambda(e.e, names - e.decls.map { it.n }.toSet())
+        else -> null
+    }
+
+/*
+ * Those of names that e refers to other than from inside the lambda that it
+ * evaluates to.  Only that lambda's closure can be patched once a let rec
+ * group is stored, so a member that refers to itself or a later member in
+ * any other way would read it before it is defined.
+ */
+fun unpatchableReferences(e: Expression, names: Set<String>): Set<String> =
+    when (e) {
+        is LamExpression -> emptySet()
+        is LetExpression -> {
+            var pending = names
+            var found = emptySet<String>()
+
+            for (d in e.decls) {
+                found = found + freeVariables(d.e).intersect(pending)
+                pending = pending - d.n
+            }
+
+            found + unpatchableReferences(e.e, pending)
+        }
+        else -> freeVariables(e).intersect(names)
+    }
+
+internal fun compile(toplevel: Expression, builder: Builder) {
     var labelNameGenerator = 0
 
     fun nextLabelName() = "L${labelNameGenerator++}"
@@ -48,12 +118,27 @@ private fun compile(toplevel: Expression, builder: Builder) {
             is OpExpression -> enterSize(e.e1) + enterSize(e.e2)
         }
 
-    fun compileExpression(e: Expression, bb: BlockBuilder, env: Environment) {
+    fun compileVariable(name: String, bb: BlockBuilder, env: Environment) {
+        when (val binding = env.variables[name] ?: throw Exception("Unknown variable $name")) {
+            is LocalBinding -> {
+                bb.writeOpCode(InstructionOpCode.PUSH_VAR)
+                bb.writeInt(0)
+                bb.writeInt(binding.offset)
+            }
+
+            is FreeBinding -> {
+                bb.writeOpCode(InstructionOpCode.PUSH_FREE)
+                bb.writeInt(binding.index)
+            }
+        }
+    }
+
+    fun compileExpression(e: Expression, bb: BlockBuilder, env: Environment, tail: Boolean = false) {
         when (e) {
             is AppExpression -> {
                 compileExpression(e.e1, bb, env)
                 compileExpression(e.e2, bb, env)
-                bb.writeOpCode(InstructionOpCode.SWAP_CALL)
+                bb.writeOpCode(if (tail) InstructionOpCode.TAIL_CALL else InstructionOpCode.SWAP_CALL)
             }
 
             is IfExpression -> {
@@ -64,12 +149,12 @@ private fun compile(toplevel: Expression, builder: Builder) {
                 bb.writeOpCode(InstructionOpCode.JMP_TRUE)
                 bb.writeLabel(thenLabel)
 
-                compileExpression(e.e3, bb, env)
+                compileExpression(e.e3, bb, env, tail)
                 bb.writeOpCode(InstructionOpCode.JMP)
                 bb.writeLabel(nextLabel)
 
                 bb.markLabel(thenLabel)
-                compileExpression(e.e2, bb, env)
+                compileExpression(e.e2, bb, env, tail)
 
                 bb.markLabel(nextLabel)
             }
@@ -102,11 +187,16 @@ private fun compile(toplevel: Expression, builder: Builder) {
                 lambdaBlock.writeInt(1 + enterSize(e.e))
                 lambdaBlock.writeOpCode(InstructionOpCode.STORE_VAR)
                 lambdaBlock.writeInt(0)
-                compileExpression(e.e, lambdaBlock, env.openScope().bind(e.n))
+                val captured = capturedVariables(e)
+                compileExpression(e.e, lambdaBlock, env.openScope(captured).bind(e.n), true)
                 lambdaBlock.writeOpCode(InstructionOpCode.RET)
 
-                bb.writeOpCode(InstructionOpCode.PUSH_CLOSURE)
+                for (n in captured) {
+                    compileVariable(n, bb, env)
+                }
+                bb.writeOpCode(InstructionOpCode.MAKE_CLOSURE)
                 bb.writeLabel(name)
+                bb.writeInt(captured.size)
             }
 
             is LetExpression -> {
@@ -117,14 +207,21 @@ private fun compile(toplevel: Expression, builder: Builder) {
 
                     newEnv = newEnv.bind(d.n)
                     bb.writeOpCode(InstructionOpCode.STORE_VAR)
-                    bb.writeInt(newEnv.variables[d.n]!!.offset)
+                    bb.writeInt((newEnv.variables[d.n] as LocalBinding).offset)
                 }
 
-                compileExpression(e.e, bb, newEnv)
+                compileExpression(e.e, bb, newEnv, tail)
             }
             is LetRecExpression -> {
                 var newEnv = env
 
+                for ((i, d) in e.decls.withIndex()) {
+                    val early = unpatchableReferences(d.e, e.decls.drop(i).map { it.n }.toSet())
+
+                    if (early.isNotEmpty())
+                        throw Exception("Let rec member ${d.n} refers to ${early.first()} before it is defined")
+                }
+
                 for (d in e.decls) {
                     newEnv = newEnv.bind(d.n)
                 }
@@ -132,10 +229,27 @@ private fun compile(toplevel: Expression, builder: Builder) {
                 for (d in e.decls) {
                     compileExpression(d.e, bb, newEnv)
                     bb.writeOpCode(InstructionOpCode.STORE_VAR)
-                    bb.writeInt(newEnv.variables[d.n]!!.offset)
+                    bb.writeInt((newEnv.variables[d.n] as LocalBinding).offset)
+                }
+
+                // The lambda that a member evaluates to captures the members
+                // of its group that are not yet stored, itself included, as
+                // they are when it is made, so patch them into its closure
+                // once every member is stored.
+                for ((i, d) in e.decls.withIndex()) {
+                    val (lambda, later) = valueLambda(d.e, e.decls.drop(i).map { it.n }.toSet()) ?: continue
+
+                    for ((index, n) in capturedVariables(lambda).withIndex()) {
+                        if (n in later) {
+                            compileVariable(d.n, bb, newEnv)
+                            compileVariable(n, bb, newEnv)
+                            bb.writeOpCode(InstructionOpCode.STORE_FREE)
+                            bb.writeInt(index)
+                        }
+                    }
                 }
 
-                compileExpression(e.e, bb, newEnv)
+                compileExpression(e.e, bb, newEnv, tail)
             }
 
             is OpExpression -> {
@@ -150,12 +264,8 @@ private fun compile(toplevel: Expression, builder: Builder) {
                 }
             }
 
-            is VarExpression -> {
-                val binding = env.variables[e.name] ?: throw Exception("Unknown variable ${e.name}")
-                bb.writeOpCode(InstructionOpCode.PUSH_VAR)
-                bb.writeInt(env.depth - binding.depth)
-                bb.writeInt(binding.offset)
-            }
+            is VarExpression ->
+                compileVariable(e.name, bb, env)
         }
     }
 
@@ -166,6 +276,6 @@ private fun compile(toplevel: Expression, builder: Builder) {
         bb.writeInt(es)
     }
 
-    compileExpression(toplevel, bb, Environment(emptyMap(), 0))
+    compileExpression(toplevel, bb, Environment(emptyMap()), true)
     bb.writeOpCode(InstructionOpCode.RET)
 }
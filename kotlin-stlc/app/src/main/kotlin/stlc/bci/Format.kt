@@ -0,0 +1,110 @@
+package stlc.bci
+
+// Version 2 of the bytecode format wraps a compact encoding of the version 1
+// block in a container of sections.  See stlc-bci/c/src/format.h for the
+// layout.
+
+const val FORMAT_VERSION = 2
+
+private const val HEADER_SIZE = 8
+private const val SECTION_ENTRY_SIZE = 12
+
+private const val SECTION_CODE = 1
+private const val SECTION_CONSTANTS = 2
+private const val SECTION_SYMBOLS = 3
+
+private val opCodes = InstructionOpCode.values().associateBy { it.code }
+
+private fun readInt(block: ByteArray, at: Int): Int =
+    (block[at].toInt() and 0xFF) or
+            ((block[at + 1].toInt() and 0xFF) shl 8) or
+            ((block[at + 2].toInt() and 0xFF) shl 16) or
+            ((block[at + 3].toInt() and 0xFF) shl 24)
+
+private fun MutableList<Byte>.writeVarint(v: Int) {
+    var n = v
+    while (n and 0x7F.inv() != 0) {
+        add(((n and 0x7F) or 0x80).toByte())
+        n = n ushr 7
+    }
+    add(n.toByte())
+}
+
+private fun MutableList<Byte>.writeSigned(v: Int) =
+    writeVarint((v shl 1) xor (v shr 31))
+
+private fun MutableList<Byte>.writeU32(v: Int) {
+    add(v.toByte())
+    add((v shr 8).toByte())
+    add((v shr 16).toByte())
+    add((v shr 24).toByte())
+}
+
+// Labels become instruction indices and every distinct PUSH_INT literal is
+// kept once in the constant pool.  Symbols are written in order of offset.
+fun encode(block: ByteArray, symbols: Map<String, Int>): ByteArray {
+    val indexAt = mutableMapOf<Int, Int>()
+    var offset = 0
+    while (offset < block.size) {
+        val opCode = opCodes[block[offset]] ?: throw Exception("Unknown opcode ${block[offset]} at $offset")
+        indexAt[offset] = indexAt.size
+        offset += 1 + opCode.parameters.size * 4
+    }
+    indexAt[offset] = indexAt.size
+
+    fun indexOf(offset: Int): Int =
+        indexAt[offset] ?: throw Exception("Label $offset does not start an instruction")
+
+    val constants = mutableMapOf<Int, Int>()
+    val code = mutableListOf<Byte>()
+    code.writeVarint(indexAt.size - 1)
+    offset = 0
+    while (offset < block.size) {
+        val opCode = opCodes[block[offset]]!!
+        code.add(opCode.code)
+        for ((i, parameter) in opCode.parameters.withIndex()) {
+            val operand = readInt(block, offset + 1 + i * 4)
+            when {
+                parameter == OpParameter.OPLabel -> code.writeVarint(indexOf(operand))
+                opCode == InstructionOpCode.PUSH_INT -> code.writeVarint(constants.getOrPut(operand) { constants.size })
+                else -> code.writeSigned(operand)
+            }
+        }
+        offset += 1 + opCode.parameters.size * 4
+    }
+
+    val pool = mutableListOf<Byte>()
+    pool.writeVarint(constants.size)
+    for (constant in constants.keys) {
+        pool.writeSigned(constant)
+    }
+
+    val names = mutableListOf<Byte>()
+    names.writeVarint(symbols.size)
+    for ((name, at) in symbols.entries.sortedBy { it.value }) {
+        val bytes = name.toByteArray(Charsets.UTF_8)
+        names.writeVarint(indexOf(at))
+        names.writeVarint(bytes.size)
+        names.addAll(bytes.toList())
+    }
+
+    val sections = listOf(SECTION_CODE to code, SECTION_CONSTANTS to pool, SECTION_SYMBOLS to names)
+    val result = mutableListOf<Byte>(0x7F, 'B'.code.toByte(), 'C'.code.toByte(), 'I'.code.toByte())
+    result.add(FORMAT_VERSION.toByte())
+    result.add((FORMAT_VERSION shr 8).toByte())
+    result.add(sections.size.toByte())
+    result.add((sections.size shr 8).toByte())
+
+    var sectionOffset = HEADER_SIZE + sections.size * SECTION_ENTRY_SIZE
+    for ((kind, data) in sections) {
+        result.writeU32(kind)
+        result.writeU32(sectionOffset)
+        result.writeU32(data.size)
+        sectionOffset += data.size
+    }
+    for ((_, data) in sections) {
+        result.addAll(data)
+    }
+
+    return result.toByteArray()
+}
@@ -1,21 +1,30 @@
 package stlc.bci
 
-enum class InstructionOpCode(val code: Byte) {
+enum class OpParameter {
+    OPInt,
+    OPLabel
+}
+
+enum class InstructionOpCode(val code: Byte, vararg val parameters: OpParameter) {
     PUSH_TRUE(0),
     PUSH_FALSE(1),
-    PUSH_INT(2),
-    PUSH_VAR(3),
-    PUSH_CLOSURE(4),
+    PUSH_INT(2, OpParameter.OPInt),
+    PUSH_VAR(3, OpParameter.OPInt, OpParameter.OPInt),
+    PUSH_CLOSURE(4, OpParameter.OPLabel),
     PUSH_TUPLE(5),
     ADD(6),
     SUB(7),
     MUL(8),
     DIV(9),
     EQ(10),
-    JMP(11),
-    JMP_TRUE(12),
+    JMP(11, OpParameter.OPLabel),
+    JMP_TRUE(12, OpParameter.OPLabel),
     SWAP_CALL(13),
-    ENTER(14),
+    ENTER(14, OpParameter.OPInt),
     RET(15),
-    STORE_VAR(16)
+    STORE_VAR(16, OpParameter.OPInt),
+    TAIL_CALL(17),
+    MAKE_CLOSURE(18, OpParameter.OPLabel, OpParameter.OPInt),
+    PUSH_FREE(19, OpParameter.OPInt),
+    STORE_FREE(20, OpParameter.OPInt)
 }
\ No newline at end of file
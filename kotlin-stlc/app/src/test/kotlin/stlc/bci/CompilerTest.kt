@@ -1,10 +1,89 @@
 package stlc.bci
 
+import stlc.LamExpression
+import stlc.LetRecExpression
+import stlc.parse
 import kotlin.test.Test
+import kotlin.test.assertEquals
+import kotlin.test.assertFailsWith
+import kotlin.test.assertTrue
 
 class CompilerTest {
     @Test
     fun checkCompile() {
         compileTo("let rec isOdd n = if (n == 0) False else isEven (n - 1); isEven n = if (n == 0) True else isOdd (n - 1) in isOdd 10", "output.bin")
     }
+
+    @Test
+    fun freeVariablesOfLambda() {
+        assertEquals(listOf("b", "a"), capturedVariables(parse("\\x -> b x + a x + b 1") as LamExpression))
+        assertEquals(setOf("a"), freeVariables(parse("\\x -> let y = a in \\z -> x + y + z")))
+    }
+
+    @Test
+    fun freeVariablesOfLetRec() {
+        val e = parse("let rec f n = g n; g n = f n + h in f 1")
+
+        assertEquals(setOf("h"), freeVariables(e))
+        assertEquals(listOf(setOf("g"), setOf("f", "h")), (e as LetRecExpression).decls.map { freeVariables(it.e) })
+    }
+
+    @Test
+    fun patchMutuallyRecursiveLambdas() {
+        val instructions = disassemble("let rec isOdd n = if (n == 0) False else isEven (n - 1); isEven n = if (n == 0) True else isOdd (n - 1) in isOdd 10")
+
+        assertContains(instructions, listOf("PUSH_VAR 0 0", "PUSH_VAR 0 1", "STORE_FREE 0"))
+        assertEquals(1, instructions.count { it.startsWith("STORE_FREE") })
+    }
+
+    @Test
+    fun patchLambdaUnderLet() {
+        val instructions = disassemble("let rec f = (let u = 1 in \\x -> g x + u); g y = y in f 1")
+
+        assertContains(instructions, listOf("PUSH_VAR 0 0", "PUSH_VAR 0 1", "STORE_FREE 0"))
+    }
+
+    @Test
+    fun rejectEarlyReferences() {
+        assertFailsWith<Exception> {
+            disassemble("let rec f = if (True) (\\x -> g x) else (\\x -> x); g y = y in f 1")
+        }
+        assertFailsWith<Exception> {
+            disassemble("let rec x = y + 1; y = 2 in x")
+        }
+        assertFailsWith<Exception> {
+            disassemble("let rec f = (let u = g in \\x -> u x); g y = y in f 1")
+        }
+    }
+}
+
+private fun disassemble(input: String): List<String> {
+    val builder = Builder()
+
+    compile(parse(input), builder)
+
+    val bytes = builder.instructions("L0")
+    val result = mutableListOf<String>()
+    var ip = 0
+
+    fun readInt(): Int {
+        val v = (bytes[ip].toInt() and 0xff) or
+                ((bytes[ip + 1].toInt() and 0xff) shl 8) or
+                ((bytes[ip + 2].toInt() and 0xff) shl 16) or
+                ((bytes[ip + 3].toInt() and 0xff) shl 24)
+        ip += 4
+        return v
+    }
+
+    while (ip < bytes.size) {
+        val opCode = InstructionOpCode.values().first { it.code == bytes[ip] }
+        ip += 1
+        result.add((listOf(opCode.name) + opCode.parameters.map { readInt().toString() }).joinToString(" "))
+    }
+
+    return result
+}
+
+private fun assertContains(instructions: List<String>, sequence: List<String>) {
+    assertTrue(instructions.windowed(sequence.size).contains(sequence), "$sequence not in $instructions")
 }
@@ -0,0 +1,369 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/code.h"
+#include "../src/memory.h"
+#include "../src/op.h"
+#include "../src/run.h"
+#include "../src/scheduler.h"
+#include "../src/verify.h"
+
+/*
+ * Measures the cost and fairness of running thousands of programs as fibers
+ * on one thread.  Every fiber runs sum SUM_N, a non tail recursive sum, with
+ * its own small heap so that thousands fit in memory.  For each number of
+ * fibers the programs are first run one after the other to completion, and
+ * then round robin with each quantum, reporting:
+ *
+ * - the time taken, and the overhead over running one after the other,
+ * - the number of switches and the cost of each,
+ * - the fairness, as Jain's index of the instructions that each fiber had
+ *   executed when the first finished, 1.0 being perfectly fair, and
+ * - the time until the short programs have all finished when a long program,
+ *   a tail recursive count down from LONG_N, is spawned ahead of them, which
+ *   without preemption includes all of the long program.
+ */
+
+#define RUNS 3
+#define SUM_N 1000
+#define LONG_N 2000000
+#define NURSERY_SIZE (16 * 1024)
+#define FRAME_STACK_SIZE (64 * 1024)
+
+static int fiberCounts[] = {1000, 4000};
+static int64_t quanta[] = {100, 1000, 10000};
+
+typedef struct
+{
+    unsigned char bytes[256];
+    int32_t size;
+} Block;
+
+typedef struct
+{
+    Fiber **fibers;
+    int32_t count;
+    int64_t switches;
+    double firstFinished;
+    double shortFinished;
+    int32_t shortRemaining;
+    double fairness;
+    char *expected;
+    int failures;
+} Run;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/*
+ * Emits an instruction, returning the offset of its first operand so that a
+ * label can be patched in once it is known.
+ */
+static int32_t emit(Block *block, InstructionOpCode opcode, int32_t arity, int32_t a, int32_t b)
+{
+    int32_t operands[2] = {a, b};
+    int32_t offset = block->size + 1;
+
+    block->bytes[block->size++] = opcode;
+    for (int i = 0; i < arity; i++)
+    {
+        for (int j = 0; j < 4; j++)
+            block->bytes[block->size++] = (unsigned char)((uint32_t)operands[i] >> (8 * j));
+    }
+
+    return offset;
+}
+
+static void patch(Block *block, int32_t offset, int32_t label)
+{
+    for (int j = 0; j < 4; j++)
+        block->bytes[offset + j] = (unsigned char)((uint32_t)label >> (8 * j));
+}
+
+/*
+ * let sum n = let rec total i = if (i == n) i else i + (total (i + 1)) in total 0 in sum n
+ */
+static Block sumProgram(int32_t n)
+{
+    Block block;
+
+    block.size = 0;
+
+    emit(&block, ENTER, 1, 1, 0);
+    int32_t sum = emit(&block, PUSH_CLOSURE, 1, 0, 0);
+    emit(&block, STORE_VAR, 1, 0, 0);
+    emit(&block, PUSH_VAR, 2, 0, 0);
+    emit(&block, PUSH_INT, 1, n, 0);
+    emit(&block, SWAP_CALL, 0, 0, 0);
+    emit(&block, RET, 0, 0, 0);
+
+    patch(&block, sum, block.size);
+    emit(&block, ENTER, 1, 2, 0);
+    emit(&block, STORE_VAR, 1, 0, 0);
+    int32_t total = emit(&block, PUSH_CLOSURE, 1, 0, 0);
+    emit(&block, STORE_VAR, 1, 1, 0);
+    emit(&block, PUSH_VAR, 2, 0, 1);
+    emit(&block, PUSH_INT, 1, 0, 0);
+    emit(&block, SWAP_CALL, 0, 0, 0);
+    emit(&block, RET, 0, 0, 0);
+
+    patch(&block, total, block.size);
+    emit(&block, ENTER, 1, 1, 0);
+    emit(&block, STORE_VAR, 1, 0, 0);
+    emit(&block, PUSH_VAR, 2, 0, 0);
+    emit(&block, PUSH_VAR, 2, 1, 0);
+    emit(&block, EQ, 0, 0, 0);
+    int32_t then = emit(&block, JMP_TRUE, 1, 0, 0);
+    emit(&block, PUSH_VAR, 2, 0, 0);
+    emit(&block, PUSH_VAR, 2, 1, 1);
+    emit(&block, PUSH_VAR, 2, 0, 0);
+    emit(&block, PUSH_INT, 1, 1, 0);
+    emit(&block, ADD, 0, 0, 0);
+    emit(&block, SWAP_CALL, 0, 0, 0);
+    emit(&block, ADD, 0, 0, 0);
+    int32_t continuation = emit(&block, JMP, 1, 0, 0);
+    patch(&block, then, block.size);
+    emit(&block, PUSH_VAR, 2, 0, 0);
+    patch(&block, continuation, block.size);
+    emit(&block, RET, 0, 0, 0);
+
+    return block;
+}
+
+/*
+ * let rec count i = if (i == 0) 0 else count (i - 1) in count n
+ */
+static Block countProgram(int32_t n)
+{
+    Block block;
+
+    block.size = 0;
+
+    emit(&block, ENTER, 1, 1, 0);
+    int32_t count = emit(&block, PUSH_CLOSURE, 1, 0, 0);
+    emit(&block, STORE_VAR, 1, 0, 0);
+    emit(&block, PUSH_VAR, 2, 0, 0);
+    emit(&block, PUSH_INT, 1, n, 0);
+    emit(&block, SWAP_CALL, 0, 0, 0);
+    emit(&block, RET, 0, 0, 0);
+
+    patch(&block, count, block.size);
+    emit(&block, ENTER, 1, 1, 0);
+    emit(&block, STORE_VAR, 1, 0, 0);
+    emit(&block, PUSH_VAR, 2, 0, 0);
+    emit(&block, PUSH_INT, 1, 0, 0);
+    emit(&block, EQ, 0, 0, 0);
+    int32_t then = emit(&block, JMP_TRUE, 1, 0, 0);
+    emit(&block, PUSH_VAR, 2, 1, 0);
+    emit(&block, PUSH_VAR, 2, 0, 0);
+    emit(&block, PUSH_INT, 1, 1, 0);
+    emit(&block, SUB, 0, 0, 0);
+    emit(&block, SWAP_CALL, 0, 0, 0);
+    int32_t continuation = emit(&block, JMP, 1, 0, 0);
+    patch(&block, then, block.size);
+    emit(&block, PUSH_INT, 1, 0, 0);
+    patch(&block, continuation, block.size);
+    emit(&block, RET, 0, 0, 0);
+
+    return block;
+}
+
+static Code load(Block *block, int *verified)
+{
+    Code code = code_decode(block->bytes, block->size);
+
+    code_rewriteTailCalls(&code);
+    *verified = verify(&code);
+    code_fuse(&code);
+
+    return code;
+}
+
+static RunOptions *newOptions(int verified)
+{
+    RunOptions *options = ALLOCATE(RunOptions, 1);
+
+    options->debug = 0;
+    options->gcPolicy = value_defaultGCPolicy();
+    options->gcPolicy.nurserySize = NURSERY_SIZE;
+    options->gcPolicy.frameStackSize = FRAME_STACK_SIZE;
+    options->ngrams = NULL;
+    options->profile = NULL;
+    options->trace = NULL;
+    options->verified = verified;
+    options->jitThreshold = 0;
+    options->registers = 0;
+    options->dispatched = NULL;
+    options->output = stringbuilder_new();
+    options->instructionLimit = 0;
+    options->memoryLimit = 0;
+
+    return options;
+}
+
+static double jainIndex(Fiber **fibers, int32_t count)
+{
+    double sum = 0.0;
+    double squares = 0.0;
+
+    for (int32_t i = 0; i < count; i++)
+    {
+        double executed = (double)run_executed(fibers[i]);
+
+        sum += executed;
+        squares += executed * executed;
+    }
+
+    return squares == 0.0 ? 1.0 : sum * sum / (count * squares);
+}
+
+static double started;
+
+static void finished(Fiber *fiber, void *context)
+{
+    Run *run = context;
+
+    if (run->firstFinished < 0.0)
+    {
+        run->firstFinished = now() - started;
+        run->fairness = jainIndex(run->fibers, run->count);
+    }
+    if (fiber != run->fibers[0] && --run->shortRemaining == 0)
+        run->shortFinished = now() - started;
+}
+
+/*
+ * Runs count fibers, the first running the long program should long be
+ * given, round robin with quantum, and returns the time taken.  The results
+ * of the short programs are checked against expected.
+ */
+static double schedule(Code *shortCode, Code *longCode, int verified, int32_t count, int64_t quantum, Run *run)
+{
+    Scheduler scheduler;
+    RunOptions **options = ALLOCATE(RunOptions *, count);
+
+    run->fibers = ALLOCATE(Fiber *, count);
+    run->count = count;
+    run->firstFinished = -1.0;
+    run->shortFinished = 0.0;
+    run->shortRemaining = longCode == NULL ? count : count - 1;
+    run->fairness = 0.0;
+
+    scheduler_initialise(&scheduler, quantum);
+    for (int32_t i = 0; i < count; i++)
+    {
+        options[i] = newOptions(verified);
+        run->fibers[i] = run_newFiber(i == 0 && longCode != NULL ? longCode : shortCode, options[i]);
+        scheduler_spawn(&scheduler, run->fibers[i]);
+    }
+
+    started = now();
+    scheduler_run(&scheduler, finished, run);
+    double elapsed = now() - started;
+
+    run->switches = scheduler.switches;
+
+    for (int32_t i = 0; i < count; i++)
+    {
+        char *result = stringbuilder_free_use(options[i]->output);
+
+        if ((i > 0 || longCode == NULL) && strcmp(result, run->expected) != 0)
+            run->failures++;
+        FREE(result);
+        FREE(options[i]);
+        run_freeFiber(run->fibers[i]);
+    }
+    FREE(options);
+    FREE(run->fibers);
+    scheduler_destroy(&scheduler);
+
+    run->fibers = NULL;
+
+    return elapsed;
+}
+
+static void report(char *quantumName, int32_t count, double elapsed, double sequential, Run *run, double starved)
+{
+    int64_t switches = run->switches;
+    double nsPerSwitch = switches > count ? (elapsed - sequential) * 1000000.0 / (switches - count) : 0.0;
+
+    printf("%6d fibers, quantum %10s: %8.2fms %+6.1f%%, %9lld switches, %7.1fns per switch, fairness %.3f, short programs done after %8.2fms\n",
+           count, quantumName, elapsed, (elapsed - sequential) * 100.0 / sequential, (long long)switches, nsPerSwitch, run->fairness, starved);
+}
+
+int main(void)
+{
+    Block shortBlock = sumProgram(SUM_N);
+    Block longBlock = countProgram(LONG_N);
+    int shortVerified, longVerified;
+    Code shortCode = load(&shortBlock, &shortVerified);
+    Code longCode = load(&longBlock, &longVerified);
+    char expected[32];
+    Run run;
+
+    snprintf(expected, sizeof(expected), "%d: Int\n", SUM_N * (SUM_N + 1) / 2);
+    run.expected = expected;
+    run.failures = 0;
+
+    printf("sum %d on fibers, with a count down from %d ahead of them for the time until they are done\n", SUM_N, LONG_N);
+
+    for (size_t c = 0; c < sizeof(fiberCounts) / sizeof(fiberCounts[0]); c++)
+    {
+        int32_t count = fiberCounts[c];
+        double sequential = 0.0;
+        Run best;
+
+        for (int r = 0; r < RUNS; r++)
+        {
+            double elapsed = schedule(&shortCode, NULL, shortVerified, count, INT64_MAX, &run);
+            if (r == 0 || elapsed < sequential)
+            {
+                sequential = elapsed;
+                best = run;
+            }
+        }
+        double starved = 0.0;
+        schedule(&shortCode, &longCode, shortVerified && longVerified, count, INT64_MAX, &run);
+        starved = run.shortFinished;
+        report("none", count, sequential, sequential, &best, starved);
+
+        for (size_t q = 0; q < sizeof(quanta) / sizeof(quanta[0]); q++)
+        {
+            char quantumName[16];
+            double elapsed = 0.0;
+
+            for (int r = 0; r < RUNS; r++)
+            {
+                double time = schedule(&shortCode, NULL, shortVerified, count, quanta[q], &run);
+                if (r == 0 || time < elapsed)
+                {
+                    elapsed = time;
+                    best = run;
+                }
+            }
+            schedule(&shortCode, &longCode, shortVerified && longVerified, count, quanta[q], &run);
+            starved = run.shortFinished;
+
+            snprintf(quantumName, sizeof(quantumName), "%lld", (long long)quanta[q]);
+            report(quantumName, count, elapsed, sequential, &best, starved);
+        }
+    }
+
+    code_destroy(&shortCode);
+    code_destroy(&longCode);
+
+    if (run.failures > 0)
+    {
+        printf("%d runs gave the wrong result\n", run.failures);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,145 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/jit.h"
+#include "../src/memory.h"
+#include "../src/op.h"
+#include "../src/run.h"
+#include "../src/verify.h"
+
+/*
+ * Compares the interpreter against the JIT, both at its default threshold and
+ * compiling every function on its first call.  Each program named on the
+ * command line is run repeatedly with its output discarded.  Every run starts
+ * with nothing compiled so the cost of compiling is included in the times.
+ * Programs that verify are run with the verified interpreter and JIT.
+ */
+
+#define RUNS 5
+#define MINIMUM_BATCH_MS 100.0
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static unsigned char *readProgram(char *fileName, int32_t *size)
+{
+    FILE *fp = fopen(fileName, "rb");
+    if (fp == NULL)
+    {
+        printf("File not found: %s\n", fileName);
+        exit(1);
+    }
+
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    unsigned char *block = ALLOCATE(unsigned char, *size);
+    if (fread(block, *size, 1, fp) != 1)
+    {
+        printf("Unable to read: %s\n", fileName);
+        exit(1);
+    }
+    fclose(fp);
+
+    return block;
+}
+
+/*
+ * Returns the best time, in microseconds, for a single run of the program
+ * taken over RUNS batches.  The batch size is calibrated so that each batch
+ * takes at least MINIMUM_BATCH_MS.
+ */
+static double benchmark(Code *code, RunOptions *options, int jitThreshold)
+{
+    int batch = 1;
+
+    options->jitThreshold = jitThreshold;
+
+    while (1)
+    {
+        double start = now();
+        for (int i = 0; i < batch; i++)
+            execute(code, options);
+        if (now() - start >= MINIMUM_BATCH_MS)
+            break;
+        batch *= 2;
+    }
+
+    double best = 0.0;
+    for (int run = 0; run < RUNS; run++)
+    {
+        double start = now();
+        for (int i = 0; i < batch; i++)
+            execute(code, options);
+        double elapsed = (now() - start) * 1000.0 / batch;
+
+        if (run == 0 || elapsed < best)
+            best = elapsed;
+    }
+
+    return best;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s <file.bin> ...\n", argv[0]);
+        printf("Assemble the scenarios first with tasks/dev bin.\n");
+        return 1;
+    }
+
+    RunOptions options;
+    options.debug = 0;
+    options.gcPolicy = value_defaultGCPolicy();
+    options.ngrams = NULL;
+    options.profile = NULL;
+    options.trace = NULL;
+    options.registers = 0;
+    options.dispatched = NULL;
+    options.output = NULL;
+    options.instructionLimit = 0;
+    options.memoryLimit = 0;
+
+    int out = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+
+    for (int i = 1; i < argc; i++)
+    {
+        int32_t size;
+        unsigned char *block = readProgram(argv[i], &size);
+        Code code = code_decode(block, size);
+        code_rewriteTailCalls(&code);
+        options.verified = verify(&code);
+        code_fuse(&code);
+
+        fflush(stdout);
+        dup2(null, STDOUT_FILENO);
+
+        double interpreted = benchmark(&code, &options, 0);
+        double jit = benchmark(&code, &options, JIT_DEFAULT_THRESHOLD);
+        double eager = benchmark(&code, &options, 1);
+
+        fflush(stdout);
+        dup2(out, STDOUT_FILENO);
+
+        printf("%-40s interpreter %10.2fus, jit %10.2fus, speedup %5.2fx, threshold=1 %10.2fus, speedup %5.2fx\n", argv[i], interpreted, jit, interpreted / jit, eager, interpreted / eager);
+
+        code_destroy(&code);
+        FREE(block);
+    }
+
+    close(null);
+    close(out);
+
+    return 0;
+}
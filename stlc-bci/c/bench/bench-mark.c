@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../src/memory.h"
+#include "../src/value.h"
+
+/*
+ * Measures the time taken to mark deep object graphs:
+ *
+ * - chain: a chain of activations each holding a closure over its parent,
+ *   mirroring the heap shape of a deeply recursive program such as sum,
+ * - spine: activations reachable only through a closure stored after a leaf
+ *   closure, so that every level leaves an entry on the mark stack, and
+ * - overflow: the spine marked with a mark stack too small to hold it, which
+ *   exercises the overflow recovery,
+ * - captured: closures that outlive the calls that made them, each holding on
+ *   to its call's activation, locals and all, as PUSH_CLOSURE makes them, and
+ * - flat: the same closures made by MAKE_CLOSURE, holding a copy of the one
+ *   local that they refer to.
+ */
+
+#define DEFAULT_DEPTH 1000000
+#define RUNS 5
+#define LOCALS 4
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void storeClosure(int index, Value *previousActivation, int ip, MemoryState *mm)
+{
+    Value *closure = value_newClosure(previousActivation, ip, mm);
+
+    mm->activation->data.a.state[index] = closure;
+    value_writeBarrier(mm->activation, closure, mm);
+    popN(1, mm);
+}
+
+static void buildChain(int depth, MemoryState *mm)
+{
+    mm->activation = value_newActivation(NULL, NULL, -1, mm);
+    popN(1, mm);
+
+    for (int i = 0; i < depth; i++)
+    {
+        Value *activation = value_newActivation(mm->activation, NULL, -1, mm);
+        popN(1, mm);
+        mm->activation = activation;
+        value_newState(1, mm);
+
+        storeClosure(0, mm->activation->data.a.parentActivation, i, mm);
+    }
+}
+
+static void buildSpine(int depth, MemoryState *mm)
+{
+    mm->activation = value_newActivation(NULL, NULL, -1, mm);
+    popN(1, mm);
+
+    for (int i = 0; i < depth; i++)
+    {
+        push(mm->activation, mm);
+        Value *activation = value_newActivation(NULL, NULL, -1, mm);
+        popN(1, mm);
+        mm->activation = activation;
+        value_newState(2, mm);
+
+        storeClosure(0, NULL, i, mm);
+        storeClosure(1, peek(0, mm), i, mm);
+        popN(1, mm);
+    }
+}
+
+static void buildCaptured(int depth, MemoryState *mm)
+{
+    mm->activation = value_newActivation(NULL, NULL, -1, mm);
+    popN(1, mm);
+    value_newState(depth, mm);
+
+    for (int i = 0; i < depth; i++)
+    {
+        mm->activation = value_newActivation(mm->activation, NULL, -1, mm);
+        value_newState(LOCALS, mm);
+        for (int j = 0; j < LOCALS; j++)
+            mm->activation->data.a.state[j] = value_fromInt(i + j);
+        mm->activation = mm->activation->data.a.parentActivation;
+
+        storeClosure(i, peek(0, mm), i, mm);
+        popN(1, mm);
+    }
+}
+
+static void buildFlat(int depth, MemoryState *mm)
+{
+    mm->activation = value_newActivation(NULL, NULL, -1, mm);
+    popN(1, mm);
+    value_newState(depth, mm);
+
+    for (int i = 0; i < depth; i++)
+    {
+        push(value_fromInt(i), mm);
+        Value *closure = value_newFlatClosure(i, 1, mm);
+
+        mm->activation->data.a.state[i] = closure;
+        value_writeBarrier(mm->activation, closure, mm);
+        popN(1, mm);
+    }
+}
+
+static void benchmark(char *name, int depth, void (*build)(int depth, MemoryState *mm), int markStackLimit)
+{
+    MemoryState mm = value_newMemoryManager(256, value_defaultGCPolicy());
+
+    build(depth, &mm);
+
+    if (markStackLimit > 0)
+        mm.markStackLimit = markStackLimit;
+
+    double best = 0.0;
+    double total = 0.0;
+    for (int i = 0; i < RUNS; i++)
+    {
+        double start = now();
+        forceGC(&mm);
+        double elapsed = now() - start;
+
+        if (i == 0 || elapsed < best)
+            best = elapsed;
+        total += elapsed;
+    }
+
+    printf("%-10s depth %8d: %8d live objects, mark stack limit %8d, best %8.2fms, mean %8.2fms\n", name, depth, mm.size, mm.markStackLimit, best, total / RUNS);
+
+    value_destroyMemoryManager(&mm);
+}
+
+int main(int argc, char *argv[])
+{
+    int depth = argc > 1 ? atoi(argv[1]) : DEFAULT_DEPTH;
+
+    benchmark("chain", depth, buildChain, 0);
+    benchmark("spine", depth, buildSpine, 0);
+    benchmark("overflow", depth, buildSpine, depth / 16);
+    benchmark("captured", depth, buildCaptured, 0);
+    benchmark("flat", depth, buildFlat, 0);
+
+    return 0;
+}
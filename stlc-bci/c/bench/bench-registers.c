@@ -0,0 +1,170 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/memory.h"
+#include "../src/ngrams.h"
+#include "../src/op.h"
+#include "../src/regcode.h"
+#include "../src/run.h"
+#include "../src/verify.h"
+
+/*
+ * Compares the stack interpreter against the register interpreter.  Each
+ * program named on the command line is run once by each engine counting the
+ * instructions it dispatches, the stack engine counting the instructions of
+ * the block through the n-gram loop, and then repeatedly with its output
+ * discarded.  The stack engine is timed on fused code, as bci run runs it, and
+ * the register engine's times include translating the code on every run.
+ * Only programs that verify can be run on registers.
+ */
+
+#define RUNS 5
+#define MINIMUM_BATCH_MS 100.0
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static unsigned char *readProgram(char *fileName, int32_t *size)
+{
+    FILE *fp = fopen(fileName, "rb");
+    if (fp == NULL)
+    {
+        printf("File not found: %s\n", fileName);
+        exit(1);
+    }
+
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    unsigned char *block = ALLOCATE(unsigned char, *size);
+    if (fread(block, *size, 1, fp) != 1)
+    {
+        printf("Unable to read: %s\n", fileName);
+        exit(1);
+    }
+    fclose(fp);
+
+    return block;
+}
+
+/*
+ * Returns the best time, in microseconds, for a single run of the program
+ * taken over RUNS batches.  The batch size is calibrated so that each batch
+ * takes at least MINIMUM_BATCH_MS.
+ */
+static double benchmark(Code *code, RunOptions *options)
+{
+    int batch = 1;
+
+    while (1)
+    {
+        double start = now();
+        for (int i = 0; i < batch; i++)
+            execute(code, options);
+        if (now() - start >= MINIMUM_BATCH_MS)
+            break;
+        batch *= 2;
+    }
+
+    double best = 0.0;
+    for (int run = 0; run < RUNS; run++)
+    {
+        double start = now();
+        for (int i = 0; i < batch; i++)
+            execute(code, options);
+        double elapsed = (now() - start) * 1000.0 / batch;
+
+        if (run == 0 || elapsed < best)
+            best = elapsed;
+    }
+
+    return best;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s <file.bin> ...\n", argv[0]);
+        printf("Assemble the scenarios first with tasks/dev bin.\n");
+        return 1;
+    }
+
+    RunOptions options;
+    options.debug = 0;
+    options.gcPolicy = value_defaultGCPolicy();
+    options.jitThreshold = 0;
+    options.output = NULL;
+    options.instructionLimit = 0;
+    options.memoryLimit = 0;
+
+    int out = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+
+    for (int i = 1; i < argc; i++)
+    {
+        int32_t size;
+        unsigned char *block = readProgram(argv[i], &size);
+        Code code = code_decode(block, size);
+        code_rewriteTailCalls(&code);
+        options.verified = verify(&code);
+
+        if (!options.verified)
+        {
+            printf("%-40s not verified, cannot run on registers\n", argv[i]);
+            code_destroy(&code);
+            FREE(block);
+            continue;
+        }
+
+        NGrams ngrams;
+        uint64_t dispatched = 0;
+
+        ngrams_initialise(&ngrams);
+
+        fflush(stdout);
+        dup2(null, STDOUT_FILENO);
+
+        options.ngrams = &ngrams;
+        options.registers = 0;
+        options.dispatched = NULL;
+        execute(&code, &options);
+
+        options.ngrams = NULL;
+        options.profile = NULL;
+        options.trace = NULL;
+        options.registers = 1;
+        options.dispatched = &dispatched;
+        execute(&code, &options);
+
+        code_fuse(&code);
+        options.dispatched = NULL;
+        options.registers = 0;
+        double stack = benchmark(&code, &options);
+        options.registers = 1;
+        double registers = benchmark(&code, &options);
+
+        fflush(stdout);
+        dup2(out, STDOUT_FILENO);
+
+        printf("%-40s stack %12lld instructions %10.2fus, registers %12llu instructions %10.2fus, %5.2fx fewer, speedup %5.2fx\n", argv[i], (long long)ngrams.length, stack, (unsigned long long)dispatched, registers, (double)ngrams.length / dispatched, stack / registers);
+
+        ngrams_destroy(&ngrams);
+        code_destroy(&code);
+        FREE(block);
+    }
+
+    close(null);
+    close(out);
+
+    return 0;
+}
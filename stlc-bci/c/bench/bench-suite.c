@@ -0,0 +1,356 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/memory.h"
+#include "../src/op.h"
+#include "../src/run.h"
+#include "../src/verify.h"
+
+/*
+ * Runs each program named on the command line, as bci run would, RUNS times
+ * after one run to warm up and reports its median and best wall time along
+ * with the instructions it executes, the instructions per second at the
+ * median, and the allocations, frames evacuated into the heap among them,
+ * collections, time spent collecting and peak heap of the median run.
+ * Instructions are counted once by a profiled run of the unfused code so that
+ * superinstructions count as the instructions they replace.  Every run must
+ * give the same result, and the one in the program's .out file should there
+ * be one.
+ *
+ * The results are written as JSON, one benchmark to a line, to standard
+ * output or the --output file.  Given a --baseline written by an earlier run
+ * each benchmark's median is compared against the baseline's, on standard
+ * error, and any that is slower by more than the --threshold percentage is a
+ * regression that fails the run.
+ */
+
+#define RUNS 5
+#define THRESHOLD 10.0
+
+typedef struct
+{
+    double wall;
+    GCStats stats;
+} Run;
+
+typedef struct
+{
+    char *name;
+    double median;
+} Baseline;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static unsigned char *readFile(char *fileName, int32_t *size)
+{
+    FILE *fp = fopen(fileName, "rb");
+    if (fp == NULL)
+        return NULL;
+
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    unsigned char *block = ALLOCATE(unsigned char, *size + 1);
+    if (*size > 0 && fread(block, *size, 1, fp) != 1)
+    {
+        printf("Unable to read: %s\n", fileName);
+        exit(1);
+    }
+    block[*size] = '\0';
+    fclose(fp);
+
+    return block;
+}
+
+/*
+ * A benchmark is named by its file name without the directory or extension.
+ */
+static char *nameOf(char *fileName)
+{
+    char *start = strrchr(fileName, '/');
+    start = start == NULL ? fileName : start + 1;
+
+    char *end = strrchr(start, '.');
+    int32_t length = end == NULL ? (int32_t)strlen(start) : (int32_t)(end - start);
+
+    char *name = ALLOCATE(char, length + 1);
+    memcpy(name, start, length);
+    name[length] = '\0';
+
+    return name;
+}
+
+static char *expectedOf(char *fileName)
+{
+    char *end = strrchr(fileName, '.');
+    int32_t length = end == NULL ? (int32_t)strlen(fileName) : (int32_t)(end - fileName);
+    char *outName = ALLOCATE(char, length + 5);
+
+    memcpy(outName, fileName, length);
+    strcpy(outName + length, ".out");
+
+    int32_t size;
+    char *expected = (char *)readFile(outName, &size);
+    FREE(outName);
+
+    return expected;
+}
+
+static char *runOnce(Code *code, RunOptions *options)
+{
+    StringBuilder *sb = stringbuilder_new();
+
+    options->output = sb;
+    execute(code, options);
+    options->output = NULL;
+
+    return stringbuilder_free_use(sb);
+}
+
+static uint64_t countInstructions(unsigned char *block, int32_t size, RunOptions *options)
+{
+    Code code = code_decode(block, size);
+    Profile profile;
+
+    code_rewriteTailCalls(&code);
+    profile_initialise(&profile, &code);
+    options->profile = &profile;
+    FREE(runOnce(&code, options));
+    options->profile = NULL;
+
+    uint64_t instructions = profile.instructions;
+    profile_destroy(&profile);
+    code_destroy(&code);
+
+    return instructions;
+}
+
+static int compareRuns(const void *a, const void *b)
+{
+    const Run *x = a;
+    const Run *y = b;
+
+    return x->wall < y->wall ? -1 : x->wall > y->wall ? 1 : 0;
+}
+
+/*
+ * Reads the name and median of each benchmark from a file that this harness
+ * wrote, returning the number found.
+ */
+static int32_t readBaseline(char *fileName, Baseline **baselines)
+{
+    int32_t size;
+    char *text = (char *)readFile(fileName, &size);
+    if (text == NULL)
+    {
+        printf("Unable to read baseline: %s\n", fileName);
+        exit(1);
+    }
+
+    int32_t count = 0;
+    int32_t capacity = 8;
+    *baselines = ALLOCATE(Baseline, capacity);
+
+    for (char *line = text; line != NULL && *line != '\0';)
+    {
+        char *next = strchr(line, '\n');
+        if (next != NULL)
+            *next++ = '\0';
+
+        char *name = strstr(line, "\"name\": \"");
+        char *median = strstr(line, "\"wall_ms\": ");
+        if (name != NULL && median != NULL)
+        {
+            name += strlen("\"name\": \"");
+            char *end = strchr(name, '"');
+
+            if (count == capacity)
+            {
+                capacity *= 2;
+                *baselines = REALLOCATE(*baselines, Baseline, capacity);
+            }
+            (*baselines)[count].name = ALLOCATE(char, end - name + 1);
+            memcpy((*baselines)[count].name, name, end - name);
+            (*baselines)[count].name[end - name] = '\0';
+            (*baselines)[count].median = atof(median + strlen("\"wall_ms\": "));
+            count++;
+        }
+        line = next;
+    }
+    FREE(text);
+
+    return count;
+}
+
+static Baseline *findBaseline(Baseline *baselines, int32_t count, char *name)
+{
+    for (int32_t i = 0; i < count; i++)
+    {
+        if (strcmp(baselines[i].name, name) == 0)
+            return &baselines[i];
+    }
+
+    return NULL;
+}
+
+static void usage(char *program)
+{
+    printf("Usage: %s [--runs=N] [--output=FILE] [--baseline=FILE] [--threshold=PERCENT] <file.bin> ...\n", program);
+    printf("Assemble the workloads first with tasks/dev suite.\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int runs = RUNS;
+    double threshold = THRESHOLD;
+    char *outputName = NULL;
+    char *baselineName = NULL;
+    int first = 1;
+
+    for (; first < argc && strncmp(argv[first], "--", 2) == 0; first++)
+    {
+        if (strncmp(argv[first], "--runs=", 7) == 0)
+            runs = atoi(argv[first] + 7);
+        else if (strncmp(argv[first], "--output=", 9) == 0)
+            outputName = argv[first] + 9;
+        else if (strncmp(argv[first], "--baseline=", 11) == 0)
+            baselineName = argv[first] + 11;
+        else if (strncmp(argv[first], "--threshold=", 12) == 0)
+            threshold = atof(argv[first] + 12);
+        else
+            usage(argv[0]);
+    }
+    if (first == argc || runs < 1 || threshold < 0.0)
+        usage(argv[0]);
+
+    Baseline *baselines = NULL;
+    int32_t baselineCount = baselineName == NULL ? 0 : readBaseline(baselineName, &baselines);
+
+    FILE *out = stdout;
+    if (outputName != NULL && (out = fopen(outputName, "w")) == NULL)
+    {
+        printf("Unable to write: %s\n", outputName);
+        return 1;
+    }
+
+    RunOptions options;
+    options.debug = 0;
+    options.gcPolicy = value_defaultGCPolicy();
+    options.ngrams = NULL;
+    options.profile = NULL;
+    options.trace = NULL;
+    options.verified = 0;
+    options.jitThreshold = 0;
+    options.registers = 0;
+    options.dispatched = NULL;
+    options.output = NULL;
+    options.instructionLimit = 0;
+    options.memoryLimit = 0;
+
+    Run *results = ALLOCATE(Run, runs);
+    int regressions = 0;
+
+    fprintf(out, "{\n  \"runs\": %d,\n  \"benchmarks\": [\n", runs);
+    for (int i = first; i < argc; i++)
+    {
+        int32_t size;
+        unsigned char *block = readFile(argv[i], &size);
+        if (block == NULL)
+        {
+            printf("File not found: %s\n", argv[i]);
+            return 1;
+        }
+
+        char *name = nameOf(argv[i]);
+        char *expected = expectedOf(argv[i]);
+        uint64_t instructions = countInstructions(block, size, &options);
+
+        Code code = code_decode(block, size);
+        code_rewriteTailCalls(&code);
+        options.verified = verify(&code);
+        code_fuse(&code);
+
+        char *result = runOnce(&code, &options);
+        if (expected != NULL && strcmp(result, expected) != 0)
+        {
+            printf("%s: gave %s rather than %s", argv[i], result, expected);
+            return 1;
+        }
+
+        for (int run = 0; run < runs; run++)
+        {
+            results[run].stats = (GCStats){0, 0, 0, 0, 0};
+            options.gcPolicy.stats = &results[run].stats;
+
+            double start = now();
+            char *again = runOnce(&code, &options);
+            results[run].wall = now() - start;
+
+            options.gcPolicy.stats = NULL;
+            if (strcmp(again, result) != 0)
+            {
+                printf("%s: run %d gave %s rather than %s", argv[i], run, again, result);
+                return 1;
+            }
+            FREE(again);
+        }
+        qsort(results, runs, sizeof(Run), compareRuns);
+
+        Run *median = &results[runs / 2];
+        fprintf(out,
+                "    {\"name\": \"%s\", \"wall_ms\": %.3f, \"best_ms\": %.3f, \"instructions\": %llu, \"instructions_per_second\": %.0f, "
+                "\"allocations\": %lld, \"minor_collections\": %lld, \"major_collections\": %lld, \"gc_ms\": %.3f, \"peak_heap_bytes\": %lld}%s\n",
+                name, median->wall, results[0].wall, (unsigned long long)instructions, instructions * 1000.0 / median->wall,
+                (long long)median->stats.allocations, (long long)median->stats.minorCollections, (long long)median->stats.majorCollections,
+                median->stats.gcTime / 1000000.0, (long long)median->stats.peakHeap, i + 1 < argc ? "," : "");
+        fflush(out);
+
+        Baseline *baseline = findBaseline(baselines, baselineCount, name);
+        if (baseline != NULL)
+        {
+            double change = (median->wall - baseline->median) * 100.0 / baseline->median;
+            int regressed = change > threshold;
+
+            fprintf(stderr, "%-20s %10.3fms against %10.3fms %+7.1f%%%s\n", name, median->wall, baseline->median, change, regressed ? "  REGRESSION" : "");
+            regressions += regressed;
+        }
+        else if (baselineName != NULL)
+            fprintf(stderr, "%-20s %10.3fms not in the baseline\n", name, median->wall);
+
+        code_destroy(&code);
+        FREE(result);
+        if (expected != NULL)
+            FREE(expected);
+        FREE(name);
+        FREE(block);
+    }
+    fprintf(out, "  ]\n}\n");
+
+    if (out != stdout)
+        fclose(out);
+    for (int32_t i = 0; i < baselineCount; i++)
+        FREE(baselines[i].name);
+    if (baselines != NULL)
+        FREE(baselines);
+    FREE(results);
+
+    if (regressions > 0)
+    {
+        fprintf(stderr, "%d of %d benchmarks slower than the baseline by more than %.1f%%\n", regressions, argc - first, threshold);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,188 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/memory.h"
+#include "../src/vm.h"
+
+/*
+ * Measures how the throughput of independent VMs scales with the number of
+ * threads running them.  Each thread creates its own VM, loads the program
+ * into it and runs it a fixed number of times, checking every result against
+ * that of a run on the main thread.  The number of runs is calibrated so that
+ * a single thread takes at least MINIMUM_BATCH_MS.  The thread counts double
+ * up to the number of processors online, and to at least MINIMUM_THREADS so
+ * that VMs run side by side even on a single processor.
+ */
+
+#define RUNS 3
+#define MINIMUM_BATCH_MS 200.0
+#define MINIMUM_THREADS 4
+
+typedef struct
+{
+    unsigned char *block;
+    int32_t size;
+    char *expected;
+    int runs;
+    int failures;
+    pthread_t thread;
+} Worker;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static unsigned char *readProgram(char *fileName, int32_t *size)
+{
+    FILE *fp = fopen(fileName, "rb");
+    if (fp == NULL)
+    {
+        printf("File not found: %s\n", fileName);
+        exit(1);
+    }
+
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    unsigned char *block = ALLOCATE(unsigned char, *size);
+    if (fread(block, *size, 1, fp) != 1)
+    {
+        printf("Unable to read: %s\n", fileName);
+        exit(1);
+    }
+    fclose(fp);
+
+    return block;
+}
+
+static void *work(void *argument)
+{
+    Worker *worker = argument;
+    BciVM *vm = bci_vm_new(value_defaultGCPolicy());
+
+    bci_vm_load(vm, worker->block, worker->size);
+    for (int i = 0; i < worker->runs; i++)
+    {
+        char *result = bci_vm_run(vm);
+
+        if (strcmp(result, worker->expected) != 0)
+            worker->failures++;
+        FREE(result);
+    }
+    bci_vm_free(vm);
+
+    return NULL;
+}
+
+/*
+ * Returns the best time, in milliseconds, for threads threads each running
+ * the program runs times, over RUNS attempts.
+ */
+static double benchmark(Worker *workers, int threads, int runs, int *failures)
+{
+    double best = 0.0;
+
+    for (int run = 0; run < RUNS; run++)
+    {
+        double start = now();
+        for (int i = 0; i < threads; i++)
+        {
+            workers[i].runs = runs;
+            if (pthread_create(&workers[i].thread, NULL, work, &workers[i]) != 0)
+            {
+                printf("Unable to create thread\n");
+                exit(1);
+            }
+        }
+        for (int i = 0; i < threads; i++)
+        {
+            pthread_join(workers[i].thread, NULL);
+            *failures += workers[i].failures;
+            workers[i].failures = 0;
+        }
+        double elapsed = now() - start;
+
+        if (run == 0 || elapsed < best)
+            best = elapsed;
+    }
+
+    return best;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s <file.bin> ...\n", argv[0]);
+        printf("Assemble the scenarios first with tasks/dev bin.\n");
+        return 1;
+    }
+
+    int processors = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int maximumThreads = processors > MINIMUM_THREADS ? processors : MINIMUM_THREADS;
+
+    printf("%d processors\n", processors);
+
+    for (int i = 1; i < argc; i++)
+    {
+        int32_t size;
+        unsigned char *block = readProgram(argv[i], &size);
+
+        BciVM *vm = bci_vm_new(value_defaultGCPolicy());
+        char *error = bci_vm_load(vm, block, size);
+        if (error != NULL)
+        {
+            printf("%s: %s\n", argv[i], error);
+            exit(1);
+        }
+        char *expected = bci_vm_run(vm);
+        bci_vm_free(vm);
+
+        Worker *workers = ALLOCATE(Worker, maximumThreads);
+        for (int j = 0; j < maximumThreads; j++)
+        {
+            workers[j].block = block;
+            workers[j].size = size;
+            workers[j].expected = expected;
+            workers[j].failures = 0;
+        }
+
+        int runs = 1;
+        int failures = 0;
+        while (benchmark(workers, 1, runs, &failures) < MINIMUM_BATCH_MS)
+            runs *= 2;
+
+        double single = 0.0;
+        for (int threads = 1; threads <= maximumThreads; threads *= 2)
+        {
+            double elapsed = benchmark(workers, threads, runs, &failures);
+            double throughput = threads * runs * 1000.0 / elapsed;
+
+            if (threads == 1)
+                single = throughput;
+
+            printf("%-40s threads %3d %12.1f runs/s, scaling %5.2fx\n", argv[i], threads, throughput, throughput / single);
+        }
+
+        if (failures > 0)
+        {
+            printf("%s: %d runs gave a result other than %s", argv[i], failures, expected);
+            return 1;
+        }
+
+        FREE(workers);
+        FREE(expected);
+        FREE(block);
+    }
+
+    return 0;
+}
@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "memory.h"
+
+#include "aot.h"
+#include "op.h"
+#include "verify.h"
+
+typedef struct
+{
+    Code *code;
+    FILE *out;
+    int32_t *targets;
+
+    char *entry;
+    char *reachable;
+    char *labelled;
+    int32_t *worklist;
+} Translator;
+
+static void mark(Translator *t, int32_t ip, int32_t *size)
+{
+    if (!t->reachable[ip])
+    {
+        t->reachable[ip] = 1;
+        t->worklist[(*size)++] = ip;
+    }
+}
+
+/*
+ * Mark the instructions of the function with the given entry, those that can
+ * be reached from it without a call, and the jump targets among them that
+ * need a label.
+ */
+static void findBody(Translator *t, int32_t entry)
+{
+    Code *code = t->code;
+    int32_t size = 0;
+
+    for (int32_t i = 0; i <= code->size; i++)
+    {
+        t->reachable[i] = 0;
+        t->labelled[i] = 0;
+    }
+
+    mark(t, entry, &size);
+    while (size > 0)
+    {
+        int32_t ip = t->worklist[--size];
+        Op *op = &code->ops[ip];
+
+        switch (op->opcode)
+        {
+        case JMP:
+            t->labelled[op->operand[0]] = 1;
+            mark(t, op->operand[0], &size);
+            break;
+        case JMP_TRUE:
+            t->labelled[op->operand[0]] = 1;
+            mark(t, op->operand[0], &size);
+            mark(t, ip + 1, &size);
+            break;
+        case RET:
+        case TAIL_CALL:
+        case PUSH_TUPLE:
+        case CODE_INVALID:
+            break;
+        default:
+            mark(t, ip + 1, &size);
+            break;
+        }
+    }
+}
+
+/*
+ * The message that the interpreter reports on reaching an instruction that it
+ * cannot execute.
+ */
+static void invalid(Translator *t, int32_t ip)
+{
+    Code *code = t->code;
+    int32_t offset = code->offsets[ip];
+
+    fprintf(t->out, "    aot_fail(\"");
+    if (offset >= code->blockSize)
+        fprintf(t->out, "Run: ip=%d: End of code", offset);
+    else
+    {
+        const Instruction *instruction = find(code->block[offset]);
+        if (instruction == NULL)
+            fprintf(t->out, "Run: Invalid opcode: %d", code->block[offset]);
+        else
+            fprintf(t->out, "Run: ip=%d: Unknown opcode: %s (%d)", offset, instruction->name, instruction->opcode);
+    }
+    fprintf(t->out, "\");\n");
+}
+
+static void binary(Translator *t, char *name, char *result)
+{
+    fprintf(t->out, "    {\n");
+    fprintf(t->out, "        Value *b = aot_pop(mm);\n");
+    fprintf(t->out, "        Value *a = aot_pop(mm);\n");
+    fprintf(t->out, "        aot_checkInts(a, b, \"Run: %s: not an int\");\n", name);
+    fprintf(t->out, "        aot_push(%s, mm);\n", result);
+    fprintf(t->out, "    }\n");
+}
+
+static void translateInstruction(Translator *t, int32_t ip)
+{
+    FILE *out = t->out;
+    Op *op = &t->code->ops[ip];
+
+    switch (op->opcode)
+    {
+    case PUSH_TRUE:
+        fprintf(out, "    aot_push(value_True, mm);\n");
+        break;
+    case PUSH_FALSE:
+        fprintf(out, "    aot_push(value_False, mm);\n");
+        break;
+    case PUSH_INT:
+        fprintf(out, "    aot_push(value_fromInt(%d), mm);\n", op->operand[0]);
+        break;
+    case PUSH_VAR:
+        fprintf(out, "    aot_push(aot_loadVar(%d, %d, mm), mm);\n", op->operand[0], op->operand[1]);
+        break;
+    case PUSH_CLOSURE:
+        fprintf(out, "    value_newClosure(mm->activation, %d, mm);\n", op->operand[0]);
+        break;
+    case MAKE_CLOSURE:
+        fprintf(out, "    aot_makeClosure(%d, %d, mm);\n", op->operand[0], op->operand[1]);
+        break;
+    case PUSH_FREE:
+        fprintf(out, "    aot_push(aot_loadFree(%d, mm), mm);\n", op->operand[0]);
+        break;
+    case STORE_FREE:
+        fprintf(out, "    {\n");
+        fprintf(out, "        Value *v = aot_pop(mm);\n");
+        fprintf(out, "        aot_storeFree(aot_pop(mm), %d, v, mm);\n", op->operand[0]);
+        fprintf(out, "    }\n");
+        break;
+    case ADD:
+        binary(t, "ADD", "value_fromInt(value_asInt(a) + value_asInt(b))");
+        break;
+    case SUB:
+        binary(t, "SUB", "value_fromInt(value_asInt(a) - value_asInt(b))");
+        break;
+    case MUL:
+        binary(t, "MUL", "value_fromInt(value_asInt(a) * value_asInt(b))");
+        break;
+    case DIV:
+        binary(t, "DIV", "value_fromInt(aot_divide(value_asInt(a), value_asInt(b)))");
+        break;
+    case EQ:
+        binary(t, "EQ", "value_fromBool(value_asInt(a) == value_asInt(b))");
+        break;
+    case JMP:
+        fprintf(out, "    goto i%d;\n", op->operand[0]);
+        break;
+    case JMP_TRUE:
+        fprintf(out, "    if (aot_bool(aot_pop(mm)))\n");
+        fprintf(out, "        goto i%d;\n", op->operand[0]);
+        break;
+    case SWAP_CALL:
+        if (t->targets[ip] >= 0)
+        {
+            fprintf(out, "    aot_swapCall(%d, mm);\n", ip + 1);
+            fprintf(out, "    aot_run(f%d(mm), mm);\n", t->targets[ip]);
+        }
+        else
+            fprintf(out, "    aot_run(aot_swapCall(%d, mm), mm);\n", ip + 1);
+        break;
+    case TAIL_CALL:
+        fprintf(out, "    return aot_tailCall(mm);\n");
+        break;
+    case ENTER:
+        fprintf(out, "    aot_enter(%d, mm);\n", op->operand[0]);
+        break;
+    case RET:
+        fprintf(out, "    return aot_return(offsets, mm);\n");
+        break;
+    case STORE_VAR:
+        fprintf(out, "    aot_storeVar(%d, aot_pop(mm), mm);\n", op->operand[0]);
+        break;
+    default:
+        invalid(t, ip);
+        break;
+    }
+}
+
+/*
+ * The body is laid out in the order of the block so an instruction that falls
+ * through is always followed by the next, and only a function whose body
+ * starts before its entry needs to jump to it.  An instruction that cannot be
+ * executed ends the program so nothing falls out of the end of the function.
+ */
+static void translateFunction(Translator *t, int32_t entry)
+{
+    Code *code = t->code;
+    FILE *out = t->out;
+    int32_t first = 0;
+
+    findBody(t, entry);
+    while (!t->reachable[first])
+        first++;
+
+    fprintf(out, "\nstatic int32_t f%d(MemoryState *mm)\n{\n", entry);
+    if (first != entry)
+    {
+        t->labelled[entry] = 1;
+        fprintf(out, "    goto i%d;\n", entry);
+    }
+    for (int32_t ip = first; ip <= code->size; ip++)
+    {
+        if (!t->reachable[ip])
+            continue;
+
+        if (t->labelled[ip])
+            fprintf(out, "i%d:\n", ip);
+        translateInstruction(t, ip);
+    }
+    fprintf(out, "}\n");
+}
+
+static void translateOffsets(Translator *t)
+{
+    Code *code = t->code;
+    FILE *out = t->out;
+
+    fprintf(out, "\nstatic int32_t offsets[] = {");
+    for (int32_t i = 0; i <= code->size; i++)
+    {
+        if (i % 12 == 0)
+            fprintf(out, "\n   ");
+        fprintf(out, " %d,", code->offsets[i]);
+    }
+    fprintf(out, "\n};\n");
+}
+
+void aot(Code *code, char *source, char *outputFile)
+{
+    Translator t;
+
+    t.code = code;
+    t.targets = ALLOCATE(int32_t, code->size + 1);
+    t.entry = ALLOCATE(char, code->size + 1);
+    t.reachable = ALLOCATE(char, code->size + 1);
+    t.labelled = ALLOCATE(char, code->size + 1);
+    t.worklist = ALLOCATE(int32_t, code->size + 1);
+
+    int verified = verify_callTargets(code, t.targets);
+
+    FILE *out = outputFile == NULL ? stdout : fopen(outputFile, "w");
+    if (out == NULL)
+    {
+        printf("Unable to write: %s\n", outputFile);
+        exit(1);
+    }
+    t.out = out;
+
+    for (int32_t i = 0; i <= code->size; i++)
+        t.entry[i] = i == 0;
+    for (int32_t i = 0; i < code->size; i++)
+    {
+        if (code->ops[i].opcode == PUSH_CLOSURE || code->ops[i].opcode == MAKE_CLOSURE)
+            t.entry[code->ops[i].operand[0]] = 1;
+    }
+
+    fprintf(out, "/*\n * Translated from %s by bci aot.\n */\n\n", source);
+    fprintf(out, "#define AOT_CHECKED %d\n\n", !verified);
+    fprintf(out, "#include \"aotruntime.h\"\n");
+
+    translateOffsets(&t);
+
+    fprintf(out, "\n");
+    for (int32_t i = 0; i <= code->size; i++)
+    {
+        if (t.entry[i])
+            fprintf(out, "static int32_t f%d(MemoryState *mm);\n", i);
+    }
+
+    for (int32_t i = 0; i <= code->size; i++)
+    {
+        if (t.entry[i])
+            translateFunction(&t, i);
+    }
+
+    fprintf(out, "\nstatic int32_t aot_dispatch(int32_t entry, MemoryState *mm)\n{\n");
+    fprintf(out, "    switch (entry)\n    {\n");
+    for (int32_t i = 0; i <= code->size; i++)
+    {
+        if (t.entry[i])
+            fprintf(out, "    case %d:\n        return f%d(mm);\n", i, i);
+    }
+    fprintf(out, "    default:\n        aot_fail(\"Run: no function at entry\");\n");
+    fprintf(out, "        return AOT_RETURNED;\n    }\n}\n");
+
+    fprintf(out, "\nint main(void)\n{\n    return aot_main();\n}\n");
+
+    if (out != stdout)
+        fclose(out);
+
+    FREE(t.targets);
+    FREE(t.entry);
+    FREE(t.reachable);
+    FREE(t.labelled);
+    FREE(t.worklist);
+}
@@ -0,0 +1,19 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include "code.h"
+
+/*
+ * Translate decoded code into a C program that runs it without an interpreter
+ * loop.  The top level and every function that a PUSH_CLOSURE or
+ * MAKE_CLOSURE creates become a C function in which jumps are gotos and each
+ * instruction is a call into aotruntime.h.  A call is a direct C call when the verifier has proven which
+ * function is called and otherwise goes through a switch on the closure's
+ * entry.  The code is verified first, so code that the verifier rejects is
+ * rejected as it is by run, and code proven to pass every check is translated
+ * without them.  The program is written to outputFile, or to standard output
+ * should it be NULL.
+ */
+extern void aot(Code *code, char *source, char *outputFile);
+
+#endif
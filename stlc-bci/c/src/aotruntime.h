@@ -0,0 +1,346 @@
+#ifndef AOTRUNTIME_H
+#define AOTRUNTIME_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "memory.h"
+#include "value.h"
+
+/*
+ * The runtime of a program translated into C by bci aot, which is compiled
+ * into the program and linked against the interpreter's value, heap and
+ * memory modules.  The program works on the same stack, frames and heap as
+ * the interpreter and reports errors with the interpreter's messages.
+ *
+ * A program defines AOT_CHECKED as 0 when the verifier has proven that every
+ * check passes, so that they are compiled out, and otherwise as 1.  It then
+ * defines aot_dispatch to call the function with the given entry, the top
+ * level having the entry 0, and a main that calls aot_main.
+ *
+ * Each function returns AOT_RETURNED once it has returned, or the entry of the
+ * function that it tail calls having already replaced its activation.
+ * aot_run keeps calling until a function returns so that a tail recursive
+ * loop runs in constant C stack.
+ */
+
+#ifndef AOT_CHECKED
+#define AOT_CHECKED 1
+#endif
+
+#define AOT_RETURNED -1
+
+#define AOT_INITIAL_STACK_SIZE 256
+
+/*
+ * Calls that are not tail calls nest on the C stack, so programs run on a
+ * thread with a stack that is large enough for deep recursion.  The memory
+ * is only committed as it is used.
+ */
+#define AOT_C_STACK_SIZE ((size_t)1 << 30)
+
+static int32_t aot_dispatch(int32_t entry, MemoryState *mm);
+
+static void aot_fail(char *message)
+{
+    printf("%s\n", message);
+    exit(1);
+}
+
+static inline void aot_push(Value *value, MemoryState *mm)
+{
+    if (mm->phase == GC_MARKING || mm->sp == mm->stackSize)
+        push(value, mm);
+    else
+        mm->stack[mm->sp++] = value;
+}
+
+static inline Value *aot_pop(MemoryState *mm)
+{
+    return AOT_CHECKED && mm->sp == 0 ? pop(mm) : popUnchecked(mm);
+}
+
+static inline Value *aot_peek(int offset, MemoryState *mm)
+{
+    return AOT_CHECKED ? peek(offset, mm) : peekUnchecked(offset, mm);
+}
+
+static inline void aot_checkInts(Value *a, Value *b, char *message)
+{
+    if (AOT_CHECKED && (value_getType(a) != VInt || value_getType(b) != VInt))
+        aot_fail(message);
+}
+
+static inline int32_t aot_divide(int32_t a, int32_t b)
+{
+    if (b == 0)
+        aot_fail("Run: DIV: division by zero");
+
+    return value_divide(a, b);
+}
+
+static inline int aot_bool(Value *v)
+{
+    if (AOT_CHECKED && value_getType(v) != VBool)
+        aot_fail("Run: JMP_TRUE: not a bool");
+
+    return value_asBool(v);
+}
+
+static inline Value *aot_loadVar(int32_t index, int32_t offset, MemoryState *mm)
+{
+    Value *a = mm->activation;
+
+    if (!AOT_CHECKED)
+    {
+        for (int32_t i = index; i > 0; i--)
+            a = a->data.a.closure->data.c.previousActivation;
+
+        return a->data.a.state[offset];
+    }
+
+    while (index > 0)
+    {
+        if (value_getType(a) != VActivation)
+        {
+            printf("Run: PUSH_VAR: intermediate not an activation record: %d\n", index);
+            exit(1);
+        }
+        if (a->data.a.closure == NULL || a->data.a.closure->data.c.previousActivation == NULL)
+        {
+            printf("Run: PUSH_VAR: no enclosing activation: %d\n", index);
+            exit(1);
+        }
+        a = a->data.a.closure->data.c.previousActivation;
+        index--;
+    }
+    if (value_getType(a) != VActivation)
+    {
+        printf("Run: PUSH_VAR: not an activation record: %d\n", index);
+        exit(1);
+    }
+    if (a->data.a.state == NULL)
+        aot_fail("Run: PUSH_VAR: activation has no state");
+    if (offset >= a->data.a.stateSize)
+    {
+        printf("Run: PUSH_VAR: offset out of bounds: %d >= %d\n", offset, a->data.a.stateSize);
+        exit(1);
+    }
+
+    return a->data.a.state[offset];
+}
+
+static inline void aot_makeClosure(int32_t ip, int32_t freeSize, MemoryState *mm)
+{
+    if (AOT_CHECKED && freeSize < 0)
+    {
+        printf("Run: MAKE_CLOSURE: negative size: %d\n", freeSize);
+        exit(1);
+    }
+    if (AOT_CHECKED && freeSize > mm->sp)
+        aot_fail("Run: MAKE_CLOSURE: stack is too small");
+
+    value_newFlatClosure(ip, freeSize, mm);
+}
+
+static inline Value *aot_loadFree(int32_t index, MemoryState *mm)
+{
+    Value *closure = mm->activation->data.a.closure;
+
+    if (AOT_CHECKED && closure == NULL)
+        aot_fail("Run: PUSH_FREE: activation has no closure");
+    if (AOT_CHECKED && (index < 0 || index >= closure->data.c.freeSize))
+    {
+        printf("Run: PUSH_FREE: index out of bounds: %d >= %d\n", index, closure->data.c.freeSize);
+        exit(1);
+    }
+
+    return closure->data.c.free[index];
+}
+
+static inline void aot_storeFree(Value *closure, int32_t index, Value *value, MemoryState *mm)
+{
+    if (AOT_CHECKED && (closure == NULL || value_getType(closure) != VClosure))
+        aot_fail("Run: STORE_FREE: not a closure");
+    if (AOT_CHECKED && (index < 0 || index >= closure->data.c.freeSize))
+    {
+        printf("Run: STORE_FREE: index out of bounds: %d >= %d\n", index, closure->data.c.freeSize);
+        exit(1);
+    }
+
+    closure->data.c.free[index] = value;
+    value_writeBarrier(closure, value, mm);
+}
+
+/*
+ * ENTER and the calls allocate from the frame stack in line, as
+ * value_newState and value_newFrame do, leaving the runtime to handle a full
+ * frame stack, an activation that is not a frame and incremental marking.
+ */
+static inline void aot_enter(int32_t size, MemoryState *mm)
+{
+    Value *activation = mm->activation;
+    Value **state;
+
+    if (AOT_CHECKED && activation->data.a.state != NULL)
+        aot_fail("Run: ENTER: activation already has state");
+
+    if (mm->phase == GC_MARKING || !frames_contains(&mm->frames, activation) ||
+        (state = frames_allocate(&mm->frames, size * sizeof(Value *))) == NULL)
+    {
+        value_newState(size, mm);
+        return;
+    }
+
+    if (mm->frameCursor == (char *)state)
+        mm->frameCursor = mm->frames.top;
+    for (int32_t i = 0; i < size; i++)
+        state[i] = NULL;
+
+    activation->data.a.stateSize = size;
+    activation->data.a.state = state;
+}
+
+static inline Value *aot_newFrame(Value *parentActivation, Value *closure, int32_t nextIP, MemoryState *mm)
+{
+    Value *v;
+
+    if (mm->phase == GC_MARKING || (AOT_CHECKED && (closure == NULL || value_getType(closure) != VClosure)) ||
+        (v = frames_allocate(&mm->frames, sizeof(Value))) == NULL)
+        return value_newFrame(parentActivation, closure, nextIP, mm);
+
+    v->type = VActivation | VALUE_REMEMBERED;
+    v->data.a.parentActivation = parentActivation;
+    v->data.a.closure = closure;
+    v->data.a.nextIP = nextIP;
+    v->data.a.stateSize = -1;
+    v->data.a.state = NULL;
+
+    return v;
+}
+
+static inline void aot_storeVar(int32_t index, Value *value, MemoryState *mm)
+{
+    Value *activation = mm->activation;
+
+    if (AOT_CHECKED && activation->data.a.state == NULL)
+        aot_fail("Run: STORE_VAR: activation has no state");
+    if (AOT_CHECKED && index >= activation->data.a.stateSize)
+    {
+        printf("Run: STORE_VAR: index out of bounds: %d\n", index);
+        exit(1);
+    }
+
+    activation->data.a.state[index] = value;
+    value_writeBarrier(activation, value, mm);
+}
+
+/*
+ * Replace the closure and argument on the stack with the argument, in a new
+ * activation for the closure, and return the entry of the closure.
+ */
+static inline int32_t aot_swapCall(int32_t nextIP, MemoryState *mm)
+{
+    Value *newActivation = aot_newFrame(mm->activation, aot_peek(1, mm), nextIP, mm);
+    Value *argument = aot_pop(mm);
+    Value *closure = aot_pop(mm);
+
+    mm->activation = newActivation;
+    aot_push(argument, mm);
+
+    return closure->data.c.ip;
+}
+
+static inline int32_t aot_tailCall(MemoryState *mm)
+{
+    Value *activation = mm->activation;
+    Value *parentActivation = activation->data.a.parentActivation;
+    int32_t nextIP = activation->data.a.nextIP;
+
+    value_return(mm);
+
+    Value *newActivation = aot_newFrame(parentActivation, aot_peek(1, mm), nextIP, mm);
+    Value *argument = aot_pop(mm);
+    Value *closure = aot_pop(mm);
+
+    mm->activation = newActivation;
+    aot_push(argument, mm);
+
+    return closure->data.c.ip;
+}
+
+static inline void aot_run(int32_t entry, MemoryState *mm)
+{
+    while (entry != AOT_RETURNED)
+        entry = aot_dispatch(entry, mm);
+}
+
+/*
+ * Returning from the top level prints the result and ends the program.
+ */
+static int32_t aot_return(int32_t *offsets, MemoryState *mm)
+{
+    if (mm->activation->data.a.parentActivation != NULL)
+    {
+        value_return(mm);
+        return AOT_RETURNED;
+    }
+
+    Value *v = aot_pop(mm);
+    switch (value_getType(v))
+    {
+    case VInt:
+        printf("%d: Int\n", value_asInt(v));
+        break;
+    case VBool:
+        printf("%s: Bool\n", value_asBool(v) ? "true" : "false");
+        break;
+    case VClosure:
+    case VActivation:
+    {
+        char *s = value_toStringWithOffsets(v, offsets);
+
+        printf("%s\n", s);
+        FREE(s);
+        break;
+    }
+    }
+    if (mm->policy.pauseBudget > 0)
+        value_reportGCPauses(mm);
+    value_destroyMemoryManager(mm);
+
+    exit(0);
+}
+
+static void *aot_thread(void *unused)
+{
+    MemoryState mm = value_newMemoryManager(AOT_INITIAL_STACK_SIZE, value_defaultGCPolicy());
+
+    (void)unused;
+    mm.activation = value_newActivation(NULL, NULL, -1, &mm);
+    aot_run(aot_dispatch(0, &mm), &mm);
+
+    return NULL;
+}
+
+/*
+ * Run the program from the top level, on the main thread should a thread
+ * with a large stack not be available.
+ */
+static int aot_main(void)
+{
+    pthread_attr_t attributes;
+    pthread_t thread;
+
+    pthread_attr_init(&attributes);
+    pthread_attr_setstacksize(&attributes, AOT_C_STACK_SIZE);
+    if (pthread_create(&thread, &attributes, aot_thread, NULL) == 0)
+        pthread_join(thread, NULL);
+    else
+        aot_thread(NULL);
+
+    return 0;
+}
+
+#endif
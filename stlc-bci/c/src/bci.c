@@ -1,73 +1,411 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <unistd.h>
 
+#include "aot.h"
+#include "code.h"
 #include "dis.h"
+#include "jit.h"
+#include "mapping.h"
 #include "op.h"
 #include "memory.h"
 #include "run.h"
+#include "serve.h"
+#include "trace.h"
 #include "value.h"
+#include "verify.h"
 
-void readBinaryFile(char *fileName, unsigned char **block, int32_t *size)
+static Mapping mapFile(char *fileName)
 {
-  FILE *fp = fopen(fileName, "rb");
-  if (fp == NULL)
+  Mapping mapping;
+  char *error = mapping_open(fileName, &mapping);
+
+  if (error != NULL)
+  {
+    printf("%s\n", error);
+    FREE(error);
+    exit(1);
+  }
+
+  return mapping;
+}
+
+static void usage(char *name)
+{
+  printf("Usage: %s [dis | run] [-d] [run options] [gc options] <file>\n", name);
+  printf("       %s aot <file> [-o <file.c>]\n", name);
+  printf("       %s trace <file> <trace file>\n", name);
+  printf("       %s serve [serve options] [gc options]\n", name);
+  printf("Run options:\n");
+  printf("  --ngrams=FILE        count executed instruction sequences, accumulating them in FILE\n");
+  printf("  --profile            report the instructions executed and the calls, instructions and time of each function\n");
+  printf("  --profile-stacks=FILE profile, writing the time spent in each calling context to FILE as collapsed stacks\n");
+  printf("  --no-fuse            do not fuse instruction sequences into superinstructions\n");
+  printf("  --no-verify          do not verify the code, running it with every check in place\n");
+  printf("  --jit=MODE           off, on or threshold=N to compile functions called N times into native code\n");
+  printf("  --registers          run verified code translated into register based instructions\n");
+  printf("  --trace=FILE         record the last instructions, allocations and collections, writing them to FILE at exit, on a crash or on SIGUSR1\n");
+  printf("  --trace-events=N     events that --trace keeps, %d by default\n", TRACE_DEFAULT_EVENTS);
+  printf("Aot options:\n");
+  printf("  -o FILE              write the C program to FILE rather than to standard output\n");
+  printf("Serve options:\n");
+  printf("  --workers=N          threads to run programs on, one per processor by default\n");
+  printf("  --socket=PATH        read programs from connections to the Unix domain socket PATH rather than standard input\n");
+  printf("  --max-instructions=N stop a program once it has executed N instructions\n");
+  printf("  --max-memory=N       stop a program once it holds more than N bytes of heap and stack\n");
+  printf("GC options:\n");
+  printf("  --gc-initial-heap=N  objects allocated before the first collection (env BCI_GC_INITIAL_HEAP)\n");
+  printf("  --gc-nursery=N       bytes in the nursery that young objects are allocated from (env BCI_GC_NURSERY)\n");
+  printf("  --gc-growth=F        factor by which the heap grows when too full (env BCI_GC_GROWTH)\n");
+  printf("  --gc-target=F        heap occupancy to aim for after a collection (env BCI_GC_TARGET)\n");
+  printf("  --gc-stress          collect on every allocation (env BCI_GC_STRESS)\n");
+  printf("  --gc-pause-budget=US collect incrementally in pauses of about US microseconds and report them (env BCI_GC_PAUSE_BUDGET)\n");
+  printf("  --gc-frame-stack=N   bytes in the stack that activations are pushed onto, 0 to allocate them on the heap (env BCI_GC_FRAME_STACK)\n");
+}
+
+static int parseInt(char *name, char *value)
+{
+  char *end;
+  long result = strtol(value, &end, 10);
+
+  if (*value == '\0' || *end != '\0')
+  {
+    printf("Invalid value for %s: %s\n", name, value);
+    exit(1);
+  }
+
+  return (int)result;
+}
+
+static int64_t parseLong(char *name, char *value)
+{
+  char *end;
+  long long result = strtoll(value, &end, 10);
+
+  if (*value == '\0' || *end != '\0' || result < 0)
+  {
+    printf("Invalid value for %s: %s\n", name, value);
+    exit(1);
+  }
+
+  return (int64_t)result;
+}
+
+static double parseDouble(char *name, char *value)
+{
+  char *end;
+  double result = strtod(value, &end);
+
+  if (*value == '\0' || *end != '\0')
   {
-    printf("File not found: %s\n", fileName);
+    printf("Invalid value for %s: %s\n", name, value);
     exit(1);
   }
 
-  fseek(fp, 0, SEEK_END);
-  *size = ftell(fp);
-  fseek(fp, 0, SEEK_SET);
-  *block = ALLOCATE(unsigned char, *size);
-  fread(*block, *size, 1, fp);
-  fclose(fp);
+  return result;
+}
+
+static int parseJit(char *value)
+{
+  if (strcmp(value, "off") == 0)
+    return 0;
+  if (strcmp(value, "on") == 0)
+    return JIT_DEFAULT_THRESHOLD;
+  if (strncmp(value, "threshold=", 10) == 0)
+  {
+    int threshold = parseInt("--jit=threshold", value + 10);
+    if (threshold > 0)
+      return threshold;
+  }
+
+  printf("Invalid value for --jit: %s\n", value);
+  exit(1);
+}
+
+static void gcPolicyFromEnvironment(GCPolicy *policy)
+{
+  char *value;
+
+  if ((value = getenv("BCI_GC_INITIAL_HEAP")) != NULL)
+    policy->initialHeap = parseInt("BCI_GC_INITIAL_HEAP", value);
+  if ((value = getenv("BCI_GC_NURSERY")) != NULL)
+    policy->nurserySize = parseInt("BCI_GC_NURSERY", value);
+  if ((value = getenv("BCI_GC_GROWTH")) != NULL)
+    policy->growthFactor = parseDouble("BCI_GC_GROWTH", value);
+  if ((value = getenv("BCI_GC_TARGET")) != NULL)
+    policy->targetOccupancy = parseDouble("BCI_GC_TARGET", value);
+  if ((value = getenv("BCI_GC_STRESS")) != NULL)
+    policy->stress = parseInt("BCI_GC_STRESS", value) != 0;
+  if ((value = getenv("BCI_GC_PAUSE_BUDGET")) != NULL)
+    policy->pauseBudget = parseInt("BCI_GC_PAUSE_BUDGET", value);
+  if ((value = getenv("BCI_GC_FRAME_STACK")) != NULL)
+    policy->frameStackSize = parseInt("BCI_GC_FRAME_STACK", value);
+}
+
+enum
+{
+  OPT_GC_INITIAL_HEAP = 256,
+  OPT_GC_NURSERY,
+  OPT_GC_GROWTH,
+  OPT_GC_TARGET,
+  OPT_GC_STRESS,
+  OPT_GC_PAUSE_BUDGET,
+  OPT_GC_FRAME_STACK,
+  OPT_NGRAMS,
+  OPT_PROFILE,
+  OPT_PROFILE_STACKS,
+  OPT_NO_FUSE,
+  OPT_NO_VERIFY,
+  OPT_JIT,
+  OPT_REGISTERS,
+  OPT_TRACE,
+  OPT_TRACE_EVENTS,
+  OPT_WORKERS,
+  OPT_SOCKET,
+  OPT_MAX_INSTRUCTIONS,
+  OPT_MAX_MEMORY
+};
+
+static struct option runOptions[] = {
+    {"gc-initial-heap", required_argument, NULL, OPT_GC_INITIAL_HEAP},
+    {"gc-nursery", required_argument, NULL, OPT_GC_NURSERY},
+    {"gc-growth", required_argument, NULL, OPT_GC_GROWTH},
+    {"gc-target", required_argument, NULL, OPT_GC_TARGET},
+    {"gc-stress", no_argument, NULL, OPT_GC_STRESS},
+    {"gc-pause-budget", required_argument, NULL, OPT_GC_PAUSE_BUDGET},
+    {"gc-frame-stack", required_argument, NULL, OPT_GC_FRAME_STACK},
+    {"ngrams", required_argument, NULL, OPT_NGRAMS},
+    {"profile", no_argument, NULL, OPT_PROFILE},
+    {"profile-stacks", required_argument, NULL, OPT_PROFILE_STACKS},
+    {"no-fuse", no_argument, NULL, OPT_NO_FUSE},
+    {"no-verify", no_argument, NULL, OPT_NO_VERIFY},
+    {"jit", required_argument, NULL, OPT_JIT},
+    {"registers", no_argument, NULL, OPT_REGISTERS},
+    {"trace", required_argument, NULL, OPT_TRACE},
+    {"trace-events", required_argument, NULL, OPT_TRACE_EVENTS},
+    {NULL, 0, NULL, 0}};
+
+static struct option serveOptions[] = {
+    {"gc-initial-heap", required_argument, NULL, OPT_GC_INITIAL_HEAP},
+    {"gc-nursery", required_argument, NULL, OPT_GC_NURSERY},
+    {"gc-growth", required_argument, NULL, OPT_GC_GROWTH},
+    {"gc-target", required_argument, NULL, OPT_GC_TARGET},
+    {"gc-stress", no_argument, NULL, OPT_GC_STRESS},
+    {"gc-pause-budget", required_argument, NULL, OPT_GC_PAUSE_BUDGET},
+    {"gc-frame-stack", required_argument, NULL, OPT_GC_FRAME_STACK},
+    {"workers", required_argument, NULL, OPT_WORKERS},
+    {"socket", required_argument, NULL, OPT_SOCKET},
+    {"max-instructions", required_argument, NULL, OPT_MAX_INSTRUCTIONS},
+    {"max-memory", required_argument, NULL, OPT_MAX_MEMORY},
+    {NULL, 0, NULL, 0}};
+
+/*
+ * Apply the GC option opt, returning 0 should it not be one.
+ */
+static int gcOption(int opt, GCPolicy *policy)
+{
+  switch (opt)
+  {
+  case OPT_GC_INITIAL_HEAP:
+    policy->initialHeap = parseInt("--gc-initial-heap", optarg);
+    return 1;
+  case OPT_GC_NURSERY:
+    policy->nurserySize = parseInt("--gc-nursery", optarg);
+    return 1;
+  case OPT_GC_GROWTH:
+    policy->growthFactor = parseDouble("--gc-growth", optarg);
+    return 1;
+  case OPT_GC_TARGET:
+    policy->targetOccupancy = parseDouble("--gc-target", optarg);
+    return 1;
+  case OPT_GC_STRESS:
+    policy->stress = 1;
+    return 1;
+  case OPT_GC_PAUSE_BUDGET:
+    policy->pauseBudget = parseInt("--gc-pause-budget", optarg);
+    return 1;
+  case OPT_GC_FRAME_STACK:
+    policy->frameStackSize = parseInt("--gc-frame-stack", optarg);
+    return 1;
+  default:
+    return 0;
+  }
 }
 
 int32_t main(int argc, char *argv[])
 {
   if (argc == 0 || argc == 1)
   {
-    printf("Usage: %s [dis | run] [-d] <file>\n", argv[0]);
+    usage(argv[0]);
     exit(1);
   }
   if (strcmp(argv[1], "run") == 0)
   {
-    int debug = 0;
+    RunOptions options;
+    options.debug = 0;
+    options.gcPolicy = value_defaultGCPolicy();
+    options.ngrams = NULL;
+    options.profile = NULL;
+    options.trace = NULL;
+    options.verified = 0;
+    options.jitThreshold = 0;
+    options.registers = 0;
+    options.dispatched = NULL;
+    options.output = NULL;
+    options.instructionLimit = 0;
+    options.memoryLimit = 0;
+    gcPolicyFromEnvironment(&options.gcPolicy);
+
+    char *ngramsFile = NULL;
+    int profile = 0;
+    char *stacksFile = NULL;
+    int fuse = 1;
+    int verifyCode = 1;
+    char *traceFile = NULL;
+    int traceEvents = TRACE_DEFAULT_EVENTS;
+
     int opt;
-    while ((opt = getopt(argc - 1, argv + 1, "d")) != -1)
+    while ((opt = getopt_long(argc - 1, argv + 1, "d", runOptions, NULL)) != -1)
     {
       switch (opt)
       {
       case 'd':
-        debug = 1;
+        options.debug = 1;
+        break;
+      case OPT_NGRAMS:
+        ngramsFile = optarg;
+        break;
+      case OPT_PROFILE:
+        profile = 1;
+        break;
+      case OPT_PROFILE_STACKS:
+        profile = 1;
+        stacksFile = optarg;
+        break;
+      case OPT_NO_FUSE:
+        fuse = 0;
+        break;
+      case OPT_NO_VERIFY:
+        verifyCode = 0;
+        break;
+      case OPT_JIT:
+        options.jitThreshold = parseJit(optarg);
+        break;
+      case OPT_REGISTERS:
+        options.registers = 1;
+        break;
+      case OPT_TRACE:
+        traceFile = optarg;
+        break;
+      case OPT_TRACE_EVENTS:
+        traceEvents = parseInt("--trace-events", optarg);
         break;
       default:
-        printf("Usage: %s [dis | run] [-d] <file>\n", argv[0]);
-        return 1;
+        if (!gcOption(opt, &options.gcPolicy))
+        {
+          usage(argv[0]);
+          return 1;
+        }
       }
     }
 
-    unsigned char *block = NULL;
-    int32_t size;
+    char *policyError = value_validateGCPolicy(&options.gcPolicy);
+    if (policyError != NULL)
+    {
+      printf("Invalid GC policy: %s\n", policyError);
+      return 1;
+    }
+
+    if (traceEvents < 1)
+    {
+      printf("Invalid value for --trace-events: %d\n", traceEvents);
+      return 1;
+    }
+
+    if (optind + 1 >= argc)
+    {
+      usage(argv[0]);
+      return 1;
+    }
 
-    readBinaryFile(argv[optind + 1], &block, &size);
+    Mapping mapping = mapFile(argv[optind + 1]);
 
     int start_memory_allocated = memory_allocated();
 
-    op_initialise();
-    value_initialise();
+    Code code = code_decode(mapping.block, mapping.size);
+    NGrams ngrams;
 
-    execute(block, debug);
+    if (ngramsFile != NULL)
+    {
+      ngrams_initialise(&ngrams);
+      ngrams_load(&ngrams, ngramsFile);
+      options.ngrams = &ngrams;
+    }
+
+    if (!options.debug)
+      code_rewriteTailCalls(&code);
+    if (verifyCode)
+      options.verified = verify(&code);
+    if (fuse && !options.debug && options.ngrams == NULL && !profile)
+      code_fuse(&code);
+
+    Profile runProfile;
+
+    if (profile)
+    {
+      profile_initialise(&runProfile, &code);
+      options.profile = &runProfile;
+    }
+
+    Trace trace;
+    int traceFd = -1;
+
+    if (traceFile != NULL)
+    {
+      traceFd = open(traceFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (traceFd < 0)
+      {
+        printf("Unable to write trace: %s\n", traceFile);
+        return 1;
+      }
+      trace_initialise(&trace, traceEvents);
+      options.trace = &trace;
+      trace_writeOnCrash(&trace, traceFd);
+    }
+
+    execute(&code, &options);
+
+    if (traceFile != NULL)
+    {
+      trace_writeOnCrash(NULL, -1);
+      if (trace_write(&trace, traceFd) < 0)
+        printf("Unable to write trace: %s\n", traceFile);
+      close(traceFd);
+      trace_destroy(&trace);
+    }
+
+    if (profile)
+    {
+      profile_report(&runProfile, stdout);
+      if (stacksFile != NULL)
+        profile_writeStacks(&runProfile, stacksFile);
+      profile_destroy(&runProfile);
+    }
 
-    value_finalise();
-    op_finalise();
+    if (ngramsFile != NULL)
+    {
+      ngrams_save(&ngrams, ngramsFile);
+      ngrams_destroy(&ngrams);
+    }
+    code_destroy(&code);
+    mapping_close(&mapping);
 
     int end_memory_allocated = memory_allocated();
 
-    if (debug)
+    if (options.debug)
     {
       printf(". Memory allocated delta: %d\n", end_memory_allocated - start_memory_allocated);
 
@@ -79,16 +417,126 @@ int32_t main(int argc, char *argv[])
 
     return 0;
   }
+  else if (strcmp(argv[1], "aot") == 0)
+  {
+    char *outputFile = NULL;
+
+    int opt;
+    while ((opt = getopt(argc - 1, argv + 1, "o:")) != -1)
+    {
+      switch (opt)
+      {
+      case 'o':
+        outputFile = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+      }
+    }
+
+    if (optind + 1 >= argc)
+    {
+      usage(argv[0]);
+      return 1;
+    }
+
+    Mapping mapping = mapFile(argv[optind + 1]);
+
+    Code code = code_decode(mapping.block, mapping.size);
+    code_rewriteTailCalls(&code);
+
+    aot(&code, argv[optind + 1], outputFile);
+
+    code_destroy(&code);
+    mapping_close(&mapping);
+
+    return 0;
+  }
+  else if (strcmp(argv[1], "serve") == 0)
+  {
+    ServeOptions options;
+    options.gcPolicy = value_defaultGCPolicy();
+    options.workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    options.socketPath = NULL;
+    options.instructionLimit = 0;
+    options.memoryLimit = 0;
+    gcPolicyFromEnvironment(&options.gcPolicy);
+
+    int opt;
+    while ((opt = getopt_long(argc - 1, argv + 1, "", serveOptions, NULL)) != -1)
+    {
+      switch (opt)
+      {
+      case OPT_WORKERS:
+        options.workers = parseInt("--workers", optarg);
+        break;
+      case OPT_SOCKET:
+        options.socketPath = optarg;
+        break;
+      case OPT_MAX_INSTRUCTIONS:
+        options.instructionLimit = parseLong("--max-instructions", optarg);
+        break;
+      case OPT_MAX_MEMORY:
+        options.memoryLimit = parseLong("--max-memory", optarg);
+        break;
+      default:
+        if (!gcOption(opt, &options.gcPolicy))
+        {
+          usage(argv[0]);
+          return 1;
+        }
+      }
+    }
+
+    char *policyError = value_validateGCPolicy(&options.gcPolicy);
+    if (policyError != NULL)
+    {
+      printf("Invalid GC policy: %s\n", policyError);
+      return 1;
+    }
+    if (options.workers < 1)
+    {
+      printf("Invalid value for --workers: %d\n", options.workers);
+      return 1;
+    }
+    if (optind + 1 < argc)
+    {
+      usage(argv[0]);
+      return 1;
+    }
+
+    return serve(&options);
+  }
+  else if (strcmp(argv[1], "trace") == 0)
+  {
+    if (argc < 4)
+    {
+      usage(argv[0]);
+      return 1;
+    }
+
+    Mapping mapping = mapFile(argv[2]);
+    Code code = code_decode(mapping.block, mapping.size);
+
+    trace_print(&code, argv[3]);
+    code_destroy(&code);
+    mapping_close(&mapping);
+
+    return 0;
+  }
   else if (strcmp(argv[1], "dis") == 0)
   {
-    unsigned char *block = NULL;
-    int32_t size;
+    if (argc < 3)
+    {
+      usage(argv[0]);
+      return 1;
+    }
 
-    readBinaryFile(argv[2], &block, &size);
+    Mapping mapping = mapFile(argv[2]);
 
-    op_initialise();
-    dis(block, size);
-    op_finalise();
+    dis(mapping.block, mapping.size);
+    mapping_close(&mapping);
 
     return 0;
   }
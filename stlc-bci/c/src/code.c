@@ -0,0 +1,321 @@
+#include <stdio.h>
+
+#include "memory.h"
+
+#include "code.h"
+#include "error.h"
+#include "format.h"
+
+#define TAIL_CALL_JUMP_LIMIT 8
+
+int32_t code_readIntFrom(Code *code, int32_t offset)
+{
+    unsigned char *block = code->block;
+
+    return (int32_t)(block[offset] |
+                     ((block[offset + 1]) << 8) |
+                     ((block[offset + 2]) << 16) |
+                     ((block[offset + 3]) << 24));
+}
+
+/*
+ * Decoding stops at the first unknown opcode as its operands, and so where the
+ * next instruction starts, are unknown.  The sentinel then takes its place so
+ * that the error is reported should execution ever reach it.
+ */
+Code code_decode(unsigned char *block, int32_t blockSize)
+{
+    Code code;
+
+    if (format_isContainer(block, blockSize))
+        return format_decode(block, blockSize);
+
+    code.ownsBlock = 0;
+    code.symbols = NULL;
+    code.symbolCount = 0;
+    code.block = block;
+    code.blockSize = blockSize;
+    code.size = 0;
+    code.ops = ALLOCATE(Op, blockSize + 1);
+    code.offsets = ALLOCATE(int32_t, blockSize + 1);
+
+    int32_t *indexAt = ALLOCATE(int32_t, blockSize + 1);
+    for (int32_t i = 0; i <= blockSize; i++)
+        indexAt[i] = -1;
+
+    int32_t offset = 0;
+    while (offset < blockSize)
+    {
+        const Instruction *instruction = find(block[offset]);
+        if (instruction == NULL)
+            break;
+
+        if (offset + 1 + instruction->arity * 4 > blockSize)
+        {
+            FREE(code.ops);
+            FREE(code.offsets);
+            FREE(indexAt);
+            error_raise("Code: ip=%d: %s: truncated instruction", offset, instruction->name);
+        }
+
+        Op *op = &code.ops[code.size];
+        op->opcode = instruction->opcode;
+        for (int i = 0; i < 3; i++)
+            op->operand[i] = i < instruction->arity ? code_readIntFrom(&code, offset + 1 + i * 4) : 0;
+
+        indexAt[offset] = code.size;
+        code.offsets[code.size] = offset;
+        code.size++;
+
+        offset += 1 + instruction->arity * 4;
+    }
+
+    Op *sentinel = &code.ops[code.size];
+    sentinel->opcode = CODE_INVALID;
+    sentinel->operand[0] = sentinel->operand[1] = sentinel->operand[2] = 0;
+    code.offsets[code.size] = offset;
+
+    for (int32_t i = 0; i < code.size; i++)
+    {
+        const Instruction *instruction = find(code.ops[i].opcode);
+
+        for (int j = 0; j < instruction->arity; j++)
+        {
+            if (instruction->parameters[j] == OPLabel)
+            {
+                int32_t target = code.ops[i].operand[j];
+                int32_t index = target >= 0 && target <= blockSize ? indexAt[target] : -1;
+
+                code.ops[i].operand[j] = index == -1 ? code.size : index;
+            }
+        }
+    }
+
+    FREE(indexAt);
+
+    return code;
+}
+
+void code_destroy(Code *code)
+{
+    FREE(code->ops);
+    FREE(code->offsets);
+    if (code->ownsBlock)
+    {
+        FREE(code->block);
+        FREE(code->symbols);
+    }
+
+    code->ops = NULL;
+    code->offsets = NULL;
+    code->size = 0;
+    code->ownsBlock = 0;
+    code->symbols = NULL;
+    code->symbolCount = 0;
+}
+
+char *code_symbolAt(Code *code, int32_t offset)
+{
+    int32_t low = 0;
+    int32_t high = code->symbolCount;
+
+    while (low < high)
+    {
+        int32_t middle = low + (high - low) / 2;
+
+        if (code->symbols[middle].offset < offset)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low < code->symbolCount && code->symbols[low].offset == offset ? code->symbols[low].name : NULL;
+}
+
+static int isVar(Op *op)
+{
+    return op->opcode == PUSH_VAR &&
+           op->operand[0] >= 0 && op->operand[0] <= CODE_VAR_LIMIT &&
+           op->operand[1] >= 0 && op->operand[1] <= CODE_VAR_LIMIT;
+}
+
+static int matches(Op *ops, int32_t length, InstructionOpCode *opcodes)
+{
+    for (int32_t i = 0; i < length; i++)
+    {
+        if (ops[i].opcode != (int32_t)opcodes[i])
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Returns 1 if the instruction at ip returns, either directly or after a chain
+ * of no more than TAIL_CALL_JUMP_LIMIT jumps.
+ */
+static int returns(Op *ops, int32_t ip)
+{
+    for (int32_t jumps = 0; jumps <= TAIL_CALL_JUMP_LIMIT; jumps++)
+    {
+        if (ops[ip].opcode == RET)
+            return 1;
+        if (ops[ip].opcode != JMP)
+            return 0;
+
+        ip = ops[ip].operand[0];
+    }
+    return 0;
+}
+
+/*
+ * Rewrite every SWAP_CALL whose result is returned straight away into a
+ * TAIL_CALL, so that code compiled before TAIL_CALL existed also runs tail
+ * recursion in constant space.  The compiler leaves the result of a call in the
+ * else branch of a conditional to jump to the RET after the then branch so the
+ * jumps between the call and the RET are followed.  The RET is left in place
+ * as it may be reached some other way.
+ */
+void code_rewriteTailCalls(Code *code)
+{
+    for (int32_t i = 0; i < code->size; i++)
+    {
+        if (code->ops[i].opcode == SWAP_CALL && returns(code->ops, i + 1))
+            code->ops[i].opcode = TAIL_CALL;
+    }
+}
+
+/*
+ * Rewrite the hot sequences emitted by the compiler into superinstructions.
+ * The superinstruction replaces the first instruction of its sequence and
+ * skips over the rest, which are left in place so that instruction indices,
+ * and with them every label and offset, are unchanged.  A sequence is only
+ * fused when nothing other than its first instruction can be jumped to, called
+ * or returned to.
+ */
+void code_fuse(Code *code)
+{
+    Op *ops = code->ops;
+    char *isTarget = ALLOCATE(char, code->size + 1);
+
+    for (int32_t i = 0; i <= code->size; i++)
+        isTarget[i] = 0;
+
+    for (int32_t i = 0; i < code->size; i++)
+    {
+        switch (ops[i].opcode)
+        {
+        case JMP:
+        case JMP_TRUE:
+        case PUSH_CLOSURE:
+        case MAKE_CLOSURE:
+            isTarget[ops[i].operand[0]] = 1;
+            break;
+        case SWAP_CALL:
+            isTarget[i + 1] = 1;
+            break;
+        }
+    }
+
+    for (int32_t i = 0; i < code->size; i++)
+    {
+        int32_t length = 1;
+
+        while (i + length < code->size && length < 4 && !isTarget[i + length])
+            length++;
+
+        Op *op = &ops[i];
+
+        if (length >= 4 && isVar(&ops[i]) && isVar(&ops[i + 1]) && matches(ops + i + 2, 2, (InstructionOpCode[]){EQ, JMP_TRUE}))
+        {
+            int32_t target = ops[i + 3].operand[0];
+
+            op->opcode = CODE_PUSH_VAR_PUSH_VAR_EQ_JMP_TRUE;
+            op->operand[0] = code_packVar(ops[i].operand[0], ops[i].operand[1]);
+            op->operand[1] = code_packVar(ops[i + 1].operand[0], ops[i + 1].operand[1]);
+            op->operand[2] = target;
+            i += 3;
+        }
+        else if (length >= 4 && isVar(&ops[i]) && matches(ops + i + 1, 3, (InstructionOpCode[]){PUSH_INT, EQ, JMP_TRUE}))
+        {
+            int32_t value = ops[i + 1].operand[0];
+            int32_t target = ops[i + 3].operand[0];
+
+            op->opcode = CODE_PUSH_VAR_PUSH_INT_EQ_JMP_TRUE;
+            op->operand[0] = code_packVar(op->operand[0], op->operand[1]);
+            op->operand[1] = value;
+            op->operand[2] = target;
+            i += 3;
+        }
+        else if (length >= 3 && matches(ops + i, 3, (InstructionOpCode[]){PUSH_VAR, PUSH_INT, SWAP_CALL}))
+        {
+            op->opcode = CODE_PUSH_VAR_PUSH_INT_SWAP_CALL;
+            op->operand[2] = ops[i + 1].operand[0];
+            i += 2;
+        }
+        else if (length >= 2 && matches(ops + i, 2, (InstructionOpCode[]){ENTER, STORE_VAR}))
+        {
+            op->opcode = CODE_ENTER_STORE_VAR;
+            op->operand[1] = ops[i + 1].operand[0];
+            i += 1;
+        }
+        else if (length >= 2 && matches(ops + i, 2, (InstructionOpCode[]){PUSH_INT, ADD}))
+        {
+            op->opcode = CODE_PUSH_INT_ADD;
+            i += 1;
+        }
+        else if (length >= 2 && matches(ops + i, 2, (InstructionOpCode[]){PUSH_INT, SUB}))
+        {
+            op->opcode = CODE_PUSH_INT_SUB;
+            i += 1;
+        }
+    }
+
+    FREE(isTarget);
+}
+
+int32_t code_fusedLength(int32_t opcode)
+{
+    switch (opcode)
+    {
+    case CODE_PUSH_VAR_PUSH_VAR_EQ_JMP_TRUE:
+    case CODE_PUSH_VAR_PUSH_INT_EQ_JMP_TRUE:
+        return 4;
+    case CODE_PUSH_VAR_PUSH_INT_SWAP_CALL:
+        return 3;
+    case CODE_ENTER_STORE_VAR:
+    case CODE_PUSH_INT_ADD:
+    case CODE_PUSH_INT_SUB:
+        return 2;
+    default:
+        return 1;
+    }
+}
+
+void code_printInstruction(Code *code, int32_t ip)
+{
+    int32_t offset = code->offsets[ip];
+    char *symbol = code_symbolAt(code, offset);
+
+    if (symbol != NULL)
+        printf(":%s\n", symbol);
+    printf("%d: ", offset);
+    const Instruction *instruction = offset < code->blockSize ? find(code->block[offset]) : NULL;
+    if (offset >= code->blockSize)
+        printf("End of code");
+    else if (instruction == NULL)
+        printf("Unknown opcode: %d", code->block[offset]);
+    else
+    {
+        printf("%s", instruction->name);
+        if (instruction->arity > 0)
+        {
+            printf(" ");
+            for (int i = 0; i < instruction->arity; i++)
+            {
+                if (i > 0)
+                    printf(" ");
+                printf("%d", code_readIntFrom(code, offset + 1 + i * 4));
+            }
+        }
+    }
+}
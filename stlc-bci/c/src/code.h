@@ -0,0 +1,112 @@
+#ifndef CODE_H
+#define CODE_H
+
+#include <stdint.h>
+
+#include "op.h"
+
+/*
+ * Opcodes that are only ever produced by decoding.  CODE_INVALID stands for an
+ * unknown opcode in the block and for the end of the code.  The PUSH_VAR
+ * variants are quickened forms that a run loop rewrites a PUSH_VAR into once
+ * it has executed, specialised on the number of scopes it walks out.  The
+ * rest are superinstructions, introduced by code_fuse, each of which performs
+ * a common sequence of instructions with a single dispatch.
+ */
+typedef enum
+{
+    CODE_INVALID = STORE_FREE + 1,
+    CODE_PUSH_LOCAL,
+    CODE_PUSH_PARENT,
+    CODE_PUSH_DEPTH,
+    CODE_ENTER_STORE_VAR,
+    CODE_PUSH_VAR_PUSH_VAR_EQ_JMP_TRUE,
+    CODE_PUSH_VAR_PUSH_INT_EQ_JMP_TRUE,
+    CODE_PUSH_INT_ADD,
+    CODE_PUSH_INT_SUB,
+    CODE_PUSH_VAR_PUSH_INT_SWAP_CALL,
+    CODE_OPCODES
+} CodeOpCode;
+
+/*
+ * A superinstruction that needs both operands of more than one PUSH_VAR packs
+ * each pair into a single operand.
+ */
+#define CODE_VAR_LIMIT 0xFFFF
+
+static inline int32_t code_packVar(int32_t index, int32_t offset)
+{
+    return (index << 16) | offset;
+}
+
+static inline int32_t code_varIndex(int32_t var)
+{
+    return (var >> 16) & CODE_VAR_LIMIT;
+}
+
+static inline int32_t code_varOffset(int32_t var)
+{
+    return var & CODE_VAR_LIMIT;
+}
+
+typedef struct
+{
+    int32_t opcode;
+    int32_t operand[3];
+} Op;
+
+/*
+ * A block of bytecode decoded into a dense array of fixed size instructions.
+ * Operands are decoded once and label operands are rewritten from byte offsets
+ * into instruction indices.  The array ends with a CODE_INVALID sentinel,
+ * which is also where any label that does not fall on an instruction leads.
+ * The byte offset of every instruction, the sentinel included, is kept in
+ * offsets so that traces, disassembly and printed values can still refer to
+ * the original block.
+ *
+ * A version 2 container is decoded by format_decode, which also writes the
+ * block that it encodes for the code to own, and its symbols are kept sorted
+ * by offset.  code_symbolAt returns the name of the symbol at a byte offset,
+ * or NULL should there be none.
+ */
+typedef struct
+{
+    int32_t offset;
+    char *name;
+} Symbol;
+
+typedef struct
+{
+    unsigned char *block;
+    int32_t blockSize;
+    int ownsBlock;
+
+    int32_t size;
+    Op *ops;
+    int32_t *offsets;
+
+    Symbol *symbols;
+    int32_t symbolCount;
+} Code;
+
+extern Code code_decode(unsigned char *block, int32_t blockSize);
+extern void code_destroy(Code *code);
+
+extern char *code_symbolAt(Code *code, int32_t offset);
+
+extern void code_rewriteTailCalls(Code *code);
+extern void code_fuse(Code *code);
+
+/*
+ * code_fusedLength returns the number of instructions that a superinstruction
+ * performs, and 1 for any other opcode.  code_printInstruction prints the
+ * instruction at an index as it appears in the block, by byte offset and with
+ * its operands as they were before decoding, after the symbol naming it
+ * should the code have one.
+ */
+extern int32_t code_fusedLength(int32_t opcode);
+extern void code_printInstruction(Code *code, int32_t ip);
+
+extern int32_t code_readIntFrom(Code *code, int32_t offset);
+
+#endif
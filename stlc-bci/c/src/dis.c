@@ -1,41 +1,46 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "code.h"
+#include "memory.h"
 #include "op.h"
 
-static int32_t readIntFrom(unsigned char *block, int *offset)
+/*
+ * Symbols are listed, as labels are written in assembly, ahead of the
+ * instruction that they name.
+ */
+static int32_t disSymbols(Code *code, int32_t symbol, int32_t offset)
 {
-    int32_t size = (int32_t)(block[*offset] |
-                             ((block[*offset + 1]) << 8) |
-                             ((block[*offset + 2]) << 16) |
-                             ((block[*offset + 3]) << 24));
+    for (; symbol < code->symbolCount && code->symbols[symbol].offset <= offset; symbol++)
+        printf(":%s\n", code->symbols[symbol].name);
 
-    *offset += 4;
-
-    return size;
+    return symbol;
 }
 
-void dis(unsigned char *code, int codeLength)
+void dis(unsigned char *block, int blockSize)
 {
-    int i = 0;
-    while (i < codeLength)
-    {
-        printf("% 6d: ", i);
+    Code code = code_decode(block, blockSize);
+    int32_t symbol = 0;
 
-        unsigned char opcode = code[i++];
+    for (int32_t i = 0; i < code.size; i++)
+    {
+        int32_t offset = code.offsets[i];
+        const Instruction *instruction = find(code.ops[i].opcode);
 
-        Instruction *instruction = find(opcode);
-        if (instruction == NULL)
-        {
-            printf("Unknown opcode: %d\n", (int)opcode);
-            exit(1);
-        }
-        printf("%s", instruction->name);
+        symbol = disSymbols(&code, symbol, offset);
+        printf("% 6d: %s", offset, instruction->name);
         for (int j = 0; j < instruction->arity; j++)
-        {
-            int operand = readIntFrom(code, &i);
-            printf(" %d", operand);
-        }
+            printf(" %d", code_readIntFrom(&code, offset + 1 + j * 4));
         printf("\n");
     }
+
+    int32_t end = code.offsets[code.size];
+    disSymbols(&code, symbol, end);
+    if (end < code.blockSize)
+    {
+        printf("% 6d: Unknown opcode: %d\n", end, (int)code.block[end]);
+        exit(1);
+    }
+
+    code_destroy(&code);
 }
@@ -1,6 +1,6 @@
 #ifndef DIS_H
 #define DIS_H
 
-extern void dis(unsigned char *code, int codeLength);
+extern void dis(unsigned char *block, int blockSize);
 
 #endif
@@ -0,0 +1,39 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "error.h"
+
+_Thread_local ErrorTrap *error_trap = NULL;
+
+void error_setTrap(ErrorTrap *trap)
+{
+    error_trap = trap;
+}
+
+void error_clearTrap(void)
+{
+    error_trap = NULL;
+}
+
+_Noreturn void error_raise(char *format, ...)
+{
+    char message[ERROR_MESSAGE_SIZE];
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    if (error_trap == NULL)
+    {
+        printf("%s\n", message);
+        exit(1);
+    }
+
+    ErrorTrap *trap = error_trap;
+
+    error_trap = NULL;
+    snprintf(trap->message, sizeof(trap->message), "%s", message);
+    longjmp(trap->target, 1);
+}
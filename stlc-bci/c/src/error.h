@@ -0,0 +1,37 @@
+#ifndef ERROR_H
+#define ERROR_H
+
+#include <setjmp.h>
+
+/*
+ * An error found in a program prints its message and ends the process.  A
+ * thread that must outlive the programs that it loads, as a worker of bci
+ * serve does, first sets a trap with error_setTrap and then calls setjmp on
+ * the trap's target as the whole controlling expression of an if, the only
+ * way that C allows its result to be used:
+ *
+ *     error_setTrap(&trap);
+ *     if (setjmp(trap.target))
+ *         ...
+ *
+ * setjmp returns 0 and then returns again with 1 should an error be raised
+ * before error_clearTrap.  The message is then in the trap rather than
+ * printed.  Whatever raises the error frees what it has allocated first so
+ * that nothing leaks when it is trapped.
+ */
+#define ERROR_MESSAGE_SIZE 256
+
+typedef struct
+{
+    jmp_buf target;
+    char message[ERROR_MESSAGE_SIZE];
+} ErrorTrap;
+
+extern _Thread_local ErrorTrap *error_trap;
+
+extern void error_setTrap(ErrorTrap *trap);
+extern void error_clearTrap(void);
+
+extern _Noreturn void error_raise(char *format, ...);
+
+#endif
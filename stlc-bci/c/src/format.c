@@ -0,0 +1,305 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+
+#include "error.h"
+#include "format.h"
+
+#define HEADER_SIZE 8
+#define SECTION_ENTRY_SIZE 12
+
+/*
+ * Reads a section of a container, holding whatever has been allocated so far
+ * so that it can be freed should the container prove to be malformed.
+ */
+typedef struct
+{
+    unsigned char *at;
+    unsigned char *end;
+    char *section;
+
+    Code *code;
+    int32_t *constants;
+    Symbol *symbols;
+} Decoder;
+
+static _Noreturn void fail(Decoder *decoder, char *format, ...)
+{
+    char message[ERROR_MESSAGE_SIZE];
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    if (decoder->constants != NULL)
+        FREE(decoder->constants);
+    if (decoder->symbols != NULL)
+        FREE(decoder->symbols);
+    if (decoder->code != NULL)
+    {
+        FREE(decoder->code->ops);
+        FREE(decoder->code->offsets);
+    }
+
+    error_raise("Code: container: %s", message);
+}
+
+static uint32_t readU16(unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t readU32(unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void writeInt(unsigned char *p, int32_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = (value >> 24) & 0xFF;
+}
+
+static inline unsigned char readByte(Decoder *decoder)
+{
+    if (decoder->at >= decoder->end)
+        fail(decoder, "%s: truncated", decoder->section);
+
+    return *decoder->at++;
+}
+
+static inline uint32_t readVarint(Decoder *decoder)
+{
+    uint32_t value = 0;
+
+    for (int shift = 0; shift < 35; shift += 7)
+    {
+        unsigned char byte = readByte(decoder);
+
+        value |= (uint32_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+            return value;
+    }
+
+    fail(decoder, "%s: number too long", decoder->section);
+}
+
+static inline int32_t readSigned(Decoder *decoder)
+{
+    uint32_t value = readVarint(decoder);
+
+    return (int32_t)((value >> 1) ^ (0 - (value & 1)));
+}
+
+/*
+ * Every element of a section takes at least a byte so a count larger than
+ * what remains of the section cannot be right.
+ */
+static uint32_t readCount(Decoder *decoder)
+{
+    uint32_t count = readVarint(decoder);
+
+    if (count > (uint32_t)(decoder->end - decoder->at))
+        fail(decoder, "%s: count too large: %u", decoder->section, count);
+
+    return count;
+}
+
+int format_isContainer(unsigned char *block, int32_t size)
+{
+    return size >= 4 && block[0] == 0x7F && block[1] == 'B' && block[2] == 'C' && block[3] == 'I';
+}
+
+static int section(unsigned char *container, int32_t containerSize, uint32_t kind, Decoder *decoder)
+{
+    uint32_t sections = readU16(container + 6);
+    int found = 0;
+
+    if ((int64_t)HEADER_SIZE + (int64_t)sections * SECTION_ENTRY_SIZE > containerSize)
+        fail(decoder, "truncated section table");
+
+    for (uint32_t i = 0; i < sections; i++)
+    {
+        unsigned char *entry = container + HEADER_SIZE + i * SECTION_ENTRY_SIZE;
+        uint32_t offset = readU32(entry + 4);
+        uint32_t size = readU32(entry + 8);
+
+        if ((int64_t)offset + size > containerSize)
+            fail(decoder, "section %u out of bounds", readU32(entry));
+        if (readU32(entry) == kind)
+        {
+            decoder->at = container + offset;
+            decoder->end = container + offset + size;
+            found = 1;
+        }
+    }
+
+    return found;
+}
+
+static int compareSymbols(const void *a, const void *b)
+{
+    const Symbol *x = a;
+    const Symbol *y = b;
+
+    if (x->offset != y->offset)
+        return x->offset < y->offset ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+/*
+ * The symbols and their names are a single allocation, the names following
+ * the array.  Writers list symbols in order so they are only sorted should
+ * they not be.
+ */
+static void decodeSymbols(Decoder *decoder, Code *code)
+{
+    uint32_t count = readCount(decoder);
+    int32_t namesSize = (int32_t)(decoder->end - decoder->at);
+    Symbol *symbols = (Symbol *)ALLOCATE(char, sizeof(Symbol) * count + namesSize + 1);
+    char *names = (char *)(symbols + count);
+    int sorted = 1;
+
+    decoder->symbols = symbols;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t index = readVarint(decoder);
+        uint32_t length = readVarint(decoder);
+
+        if (index > (uint32_t)code->size || length > (uint32_t)(decoder->end - decoder->at))
+            fail(decoder, "symbols: symbol %u out of range", i);
+
+        symbols[i].offset = code->offsets[index];
+        symbols[i].name = names;
+        memcpy(names, decoder->at, length);
+        names[length] = '\0';
+        names += length + 1;
+        decoder->at += length;
+
+        if (i > 0 && symbols[i - 1].offset > symbols[i].offset)
+            sorted = 0;
+    }
+
+    if (!sorted)
+        qsort(symbols, count, sizeof(Symbol), compareSymbols);
+
+    decoder->symbols = NULL;
+    code->symbols = symbols;
+    code->symbolCount = (int32_t)count;
+}
+
+/*
+ * Labels in a container are already instruction indices, so the instructions
+ * are decoded in a single pass with their offsets in the version 1 block
+ * counted as they go.  The block is then written from the instructions.
+ */
+Code format_decode(unsigned char *container, int32_t containerSize)
+{
+    Code code;
+    Decoder decoder = {NULL, NULL, "header", NULL, NULL, NULL};
+
+    if (containerSize < HEADER_SIZE)
+        fail(&decoder, "truncated header");
+    if (readU16(container + 4) != FORMAT_VERSION)
+        fail(&decoder, "unsupported version: %u", readU16(container + 4));
+
+    uint32_t constantCount = 0;
+    decoder.section = "constants";
+    if (section(container, containerSize, FORMAT_CONSTANTS, &decoder))
+    {
+        constantCount = readCount(&decoder);
+        decoder.constants = ALLOCATE(int32_t, constantCount > 0 ? constantCount : 1);
+        for (uint32_t i = 0; i < constantCount; i++)
+            decoder.constants[i] = readSigned(&decoder);
+    }
+
+    decoder.section = "code";
+    if (!section(container, containerSize, FORMAT_CODE, &decoder))
+        fail(&decoder, "no code section");
+
+    uint32_t count = readCount(&decoder);
+    code.size = (int32_t)count;
+    code.ops = ALLOCATE(Op, count + 1);
+    code.offsets = ALLOCATE(int32_t, count + 1);
+    decoder.code = &code;
+
+    int64_t offset = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        Op *op = &code.ops[i];
+        unsigned char opcode = readByte(&decoder);
+        const Instruction *instruction = find(opcode);
+
+        if (instruction == NULL)
+            fail(&decoder, "instruction %u: unknown opcode: %d", i, opcode);
+
+        op->opcode = instruction->opcode;
+        for (int j = 0; j < 3; j++)
+        {
+            if (j >= instruction->arity)
+                op->operand[j] = 0;
+            else if (instruction->parameters[j] == OPLabel)
+            {
+                uint32_t target = readVarint(&decoder);
+
+                if (target > count)
+                    fail(&decoder, "instruction %u: %s: label out of range: %u", i, instruction->name, target);
+                op->operand[j] = (int32_t)target;
+            }
+            else if (instruction->opcode == PUSH_INT)
+            {
+                uint32_t index = readVarint(&decoder);
+
+                if (index >= constantCount)
+                    fail(&decoder, "instruction %u: PUSH_INT: constant out of range: %u", i, index);
+                op->operand[j] = decoder.constants[index];
+            }
+            else
+                op->operand[j] = readSigned(&decoder);
+        }
+
+        code.offsets[i] = (int32_t)offset;
+        offset += 1 + instruction->arity * 4;
+        if (offset > INT32_MAX)
+            fail(&decoder, "code too large");
+    }
+
+    Op *sentinel = &code.ops[count];
+    sentinel->opcode = CODE_INVALID;
+    sentinel->operand[0] = sentinel->operand[1] = sentinel->operand[2] = 0;
+    code.offsets[count] = (int32_t)offset;
+
+    code.symbols = NULL;
+    code.symbolCount = 0;
+    decoder.section = "symbols";
+    if (section(container, containerSize, FORMAT_SYMBOLS, &decoder))
+        decodeSymbols(&decoder, &code);
+    else
+        code.symbols = (Symbol *)ALLOCATE(char, 1);
+
+    if (decoder.constants != NULL)
+        FREE(decoder.constants);
+
+    code.blockSize = (int32_t)offset;
+    code.block = ALLOCATE(unsigned char, offset > 0 ? offset : 1);
+    code.ownsBlock = 1;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        Op *op = &code.ops[i];
+        const Instruction *instruction = find(op->opcode);
+        unsigned char *p = code.block + code.offsets[i];
+
+        *p++ = (unsigned char)op->opcode;
+        for (int j = 0; j < instruction->arity; j++, p += 4)
+            writeInt(p, instruction->parameters[j] == OPLabel ? code.offsets[op->operand[j]] : op->operand[j]);
+    }
+
+    return code;
+}
@@ -0,0 +1,50 @@
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <stdint.h>
+
+#include "code.h"
+
+/*
+ * Bytecode files come in two versions.  Version 1 is the bare block of
+ * instructions, each an opcode byte followed by its operands as 4 byte little
+ * endian integers, with labels as byte offsets into the block.  Version 2
+ * wraps a compact encoding of the same instructions in a container:
+ *
+ * - a header of the magic bytes 0x7F B C I, the version as a 2 byte and the
+ *   number of sections as a 2 byte little endian integer,
+ * - a section table holding the kind, offset from the start of the file and
+ *   size of each section as 4 byte little endian integers, and
+ * - the sections, of which only the code is required.
+ *
+ * Within the sections every number is a varint: 7 bits to a byte, least
+ * significant first, with the top bit set on every byte but the last.  Signed
+ * numbers are zigzag encoded first so that small negative numbers stay small.
+ *
+ * - FORMAT_CODE is the number of instructions followed by each instruction's
+ *   opcode byte and operands.  A label is the index of the instruction that it
+ *   leads to, the number of instructions leading to the end of the code.  The
+ *   literal of PUSH_INT is the index of its value in the constant pool and
+ *   every other operand is a signed number.
+ * - FORMAT_CONSTANTS is the number of constants followed by each as a signed
+ *   number, every distinct literal appearing once.
+ * - FORMAT_SYMBOLS is the number of symbols followed by each as the index of
+ *   the instruction that it names, the length of its name and the name.
+ *
+ * No opcode is 0x7F so the first byte tells the two apart.  format_decode
+ * decodes a container straight into code and also writes the version 1 block
+ * that it encodes, so that the rest of the interpreter, and every offset that
+ * it reports, is the same for both.  Symbols name the byte offset of their
+ * instruction in that block.  A container that is malformed is reported
+ * through error_raise.
+ */
+#define FORMAT_VERSION 2
+
+#define FORMAT_CODE 1
+#define FORMAT_CONSTANTS 2
+#define FORMAT_SYMBOLS 3
+
+extern int format_isContainer(unsigned char *block, int32_t size);
+extern Code format_decode(unsigned char *container, int32_t containerSize);
+
+#endif
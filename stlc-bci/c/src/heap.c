@@ -0,0 +1,389 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "memory.h"
+#include "value.h"
+
+#include "heap.h"
+
+#define PAGE_HEADER_SIZE 512
+#define SLOTS_PER_PAGE ((int32_t)((HEAP_PAGE_SIZE - PAGE_HEADER_SIZE) / sizeof(Value)))
+#define BITMAP_WORDS ((SLOTS_PER_PAGE + 63) / 64)
+
+typedef struct FreeSlot
+{
+    struct FreeSlot *next;
+} FreeSlot;
+
+struct Page
+{
+    struct Page *next;
+
+    int32_t bump;
+    FreeSlot *freeList;
+
+    uint64_t allocated[BITMAP_WORDS];
+    uint64_t marked[BITMAP_WORDS];
+};
+
+_Static_assert(sizeof(struct Page) <= PAGE_HEADER_SIZE, "heap: page header does not fit");
+
+static inline Page *pageOf(Value *v)
+{
+    return (Page *)((uintptr_t)v & ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+}
+
+static inline Value *slotAt(Page *page, int32_t index)
+{
+    return (Value *)((char *)page + PAGE_HEADER_SIZE) + index;
+}
+
+static inline int32_t indexOf(Page *page, Value *v)
+{
+    return (int32_t)(v - slotAt(page, 0));
+}
+
+static Page *newPage(Heap *heap)
+{
+    char *raw = mmap(NULL, 2 * HEAP_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+    {
+        printf("Out of memory %s:%d\n", __FILE__, __LINE__);
+        exit(1);
+    }
+
+    char *aligned = (char *)(((uintptr_t)raw + HEAP_PAGE_SIZE - 1) & ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+    char *end = aligned + HEAP_PAGE_SIZE;
+
+    if (aligned > raw)
+        munmap(raw, aligned - raw);
+    if (raw + 2 * HEAP_PAGE_SIZE > end)
+        munmap(end, raw + 2 * HEAP_PAGE_SIZE - end);
+
+    Page *page = (Page *)aligned;
+
+    page->next = NULL;
+    page->bump = 0;
+    page->freeList = NULL;
+
+    heap->pageCount++;
+    if (heap->pageCount > heap->peakPageCount)
+        heap->peakPageCount = heap->pageCount;
+
+    return page;
+}
+
+static void releasePage(Heap *heap, Page *page)
+{
+    munmap(page, HEAP_PAGE_SIZE);
+    heap->pageCount--;
+}
+
+static void finalise(Value *v)
+{
+    if (value_getType(v) == VActivation && v->data.a.state != NULL)
+    {
+        FREE(v->data.a.state);
+        v->data.a.state = NULL;
+    }
+    else if (value_getType(v) == VClosure && v->data.c.free != NULL)
+    {
+        FREE(v->data.c.free);
+        v->data.c.free = NULL;
+    }
+    v->type = 0;
+}
+
+/*
+ * Release every allocated but unmarked slot on the page and rebuild the page's
+ * free list from the gaps below the bump pointer.  Returns the number of live
+ * slots left on the page.
+ */
+static int32_t sweepPage(Page *page)
+{
+    int32_t live = 0;
+
+    for (int32_t w = 0; w < BITMAP_WORDS; w++)
+    {
+        uint64_t dead = page->allocated[w] & ~page->marked[w];
+
+        while (dead != 0)
+        {
+            finalise(slotAt(page, w * 64 + __builtin_ctzll(dead)));
+            dead &= dead - 1;
+        }
+
+        page->allocated[w] &= page->marked[w];
+        page->marked[w] = 0;
+        live += __builtin_popcountll(page->allocated[w]);
+    }
+
+    page->freeList = NULL;
+    if (live == 0)
+    {
+        page->bump = 0;
+    }
+    else
+    {
+        for (int32_t w = (page->bump - 1) / 64; w >= 0; w--)
+        {
+            uint64_t free = ~page->allocated[w];
+
+            if (w == (page->bump - 1) / 64 && page->bump % 64 != 0)
+                free &= ((uint64_t)1 << (page->bump % 64)) - 1;
+
+            while (free != 0)
+            {
+                int32_t bit = 63 - __builtin_clzll(free);
+                FreeSlot *slot = (FreeSlot *)slotAt(page, w * 64 + bit);
+
+                slot->next = page->freeList;
+                page->freeList = slot;
+                free &= ~((uint64_t)1 << bit);
+            }
+        }
+    }
+
+    return live;
+}
+
+static inline int hasSpace(Page *page)
+{
+    return page->freeList != NULL || page->bump < SLOTS_PER_PAGE;
+}
+
+void heap_initialise(Heap *heap)
+{
+    heap->swept = NULL;
+    heap->unswept = NULL;
+    heap->current = NULL;
+    heap->pageCount = 0;
+    heap->peakPageCount = 0;
+}
+
+static void destroyPages(Heap *heap, Page *page)
+{
+    while (page != NULL)
+    {
+        Page *next = page->next;
+
+        for (int32_t w = 0; w < BITMAP_WORDS; w++)
+        {
+            uint64_t allocated = page->allocated[w];
+
+            while (allocated != 0)
+            {
+                finalise(slotAt(page, w * 64 + __builtin_ctzll(allocated)));
+                allocated &= allocated - 1;
+            }
+        }
+
+        releasePage(heap, page);
+        page = next;
+    }
+}
+
+void heap_destroy(Heap *heap)
+{
+    destroyPages(heap, heap->swept);
+    destroyPages(heap, heap->unswept);
+
+    heap_initialise(heap);
+}
+
+static Value *allocateFrom(Page *page)
+{
+    Value *v;
+
+    if (page->freeList != NULL)
+    {
+        v = (Value *)page->freeList;
+        page->freeList = page->freeList->next;
+    }
+    else
+    {
+        v = slotAt(page, page->bump++);
+    }
+
+    int32_t index = indexOf(page, v);
+    page->allocated[index / 64] |= (uint64_t)1 << (index % 64);
+
+    return v;
+}
+
+/*
+ * The current page is full so lazily sweep pages left over from the last
+ * collection until one with space turns up, only mapping a fresh page once
+ * every page has been swept.
+ */
+static Value *allocateSlow(Heap *heap)
+{
+    while (heap->unswept != NULL)
+    {
+        Page *page = heap->unswept;
+        heap->unswept = page->next;
+
+        sweepPage(page);
+
+        page->next = heap->swept;
+        heap->swept = page;
+
+        if (hasSpace(page))
+        {
+            heap->current = page;
+            return allocateFrom(page);
+        }
+    }
+
+    Page *page = newPage(heap);
+    page->next = heap->swept;
+    heap->swept = page;
+    heap->current = page;
+
+    return allocateFrom(page);
+}
+
+Value *heap_allocate(Heap *heap)
+{
+    Page *page = heap->current;
+
+    if (page != NULL && hasSpace(page))
+        return allocateFrom(page);
+
+    return allocateSlow(heap);
+}
+
+int heap_mark(Value *v)
+{
+    Page *page = pageOf(v);
+    int32_t index = indexOf(page, v);
+    uint64_t bit = (uint64_t)1 << (index % 64);
+
+    if (page->marked[index / 64] & bit)
+        return 0;
+
+    page->marked[index / 64] |= bit;
+    return 1;
+}
+
+int heap_isMarked(Value *v)
+{
+    Page *page = pageOf(v);
+    int32_t index = indexOf(page, v);
+
+    return (page->marked[index / 64] & ((uint64_t)1 << (index % 64))) != 0;
+}
+
+void heap_forEachMarked(Heap *heap, void (*f)(Value *v, void *context), void *context)
+{
+    for (Page *page = heap->swept; page != NULL; page = page->next)
+    {
+        for (int32_t w = 0; w < BITMAP_WORDS; w++)
+        {
+            uint64_t marked = page->allocated[w] & page->marked[w];
+
+            while (marked != 0)
+            {
+                f(slotAt(page, w * 64 + __builtin_ctzll(marked)), context);
+                marked &= marked - 1;
+            }
+        }
+    }
+}
+
+/*
+ * Marking has completed so every page is queued to be swept lazily as the
+ * allocator needs space.
+ */
+void heap_startSweep(Heap *heap)
+{
+    Page *page = heap->swept;
+
+    while (page != NULL)
+    {
+        Page *next = page->next;
+        page->next = heap->unswept;
+        heap->unswept = page;
+        page = next;
+    }
+
+    heap->swept = NULL;
+    heap->current = NULL;
+}
+
+/*
+ * Sweep one outstanding page, returning it to the operating system if it no
+ * longer holds any live objects.  Returns 0 once there is nothing left to
+ * sweep so that an incremental collection can spread the sweep out.
+ */
+int heap_sweepStep(Heap *heap)
+{
+    Page *page = heap->unswept;
+
+    if (page == NULL)
+        return 0;
+
+    heap->unswept = page->next;
+
+    if (sweepPage(page) == 0)
+    {
+        releasePage(heap, page);
+    }
+    else
+    {
+        page->next = heap->swept;
+        heap->swept = page;
+    }
+
+    return heap->unswept != NULL;
+}
+
+/*
+ * Sweep all outstanding pages.  Called before marking starts so that all mark
+ * bits are clear.
+ */
+void heap_finishSweep(Heap *heap)
+{
+    while (heap_sweepStep(heap))
+        ;
+}
+
+void nursery_initialise(Nursery *nursery, int size)
+{
+    size = (size + 7) & ~7;
+
+    nursery->start = ALLOCATE(char, size);
+    nursery->top = nursery->start;
+    nursery->end = nursery->start + size;
+    nursery->limit = nursery->end;
+}
+
+void nursery_destroy(Nursery *nursery)
+{
+    FREE(nursery->start);
+
+    nursery->start = NULL;
+    nursery->top = NULL;
+    nursery->limit = NULL;
+    nursery->end = NULL;
+}
+
+void frames_initialise(FrameStack *frames, int size)
+{
+    size = (size + 7) & ~7;
+
+    frames->start = size > 0 ? ALLOCATE(char, size) : NULL;
+    frames->top = frames->start;
+    frames->end = size > 0 ? frames->start + size : NULL;
+}
+
+void frames_destroy(FrameStack *frames)
+{
+    if (frames->start != NULL)
+        FREE(frames->start);
+
+    frames->start = NULL;
+    frames->top = NULL;
+    frames->end = NULL;
+}
@@ -0,0 +1,121 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <stdint.h>
+
+/*
+ * The heap is a collection of page sized slabs, each holding fixed size Value
+ * slots.  A page is aligned on its own size so that the page, and therefore
+ * the mark bit, of any Value can be found by masking its address.
+ */
+#define HEAP_PAGE_SIZE (64 * 1024)
+
+typedef struct Page Page;
+
+typedef struct
+{
+    Page *swept;
+    Page *unswept;
+    Page *current;
+
+    int pageCount;
+    int peakPageCount;
+} Heap;
+
+/*
+ * The nursery is a single contiguous region that young objects are bump
+ * allocated from.  Survivors are copied out into the paged heap so the whole
+ * region can be reused after every minor collection.  Only the region up to
+ * limit is allocated from, so that the memory manager can use less of the
+ * nursery than it has.
+ */
+typedef struct
+{
+    char *start;
+    char *top;
+    char *limit;
+    char *end;
+} Nursery;
+
+/*
+ * The frame stack is a single contiguous region that activations, along with
+ * their state, are pushed onto by a call and popped off by the return.  Unlike
+ * the nursery it is not emptied by a collection: a frame lives until its
+ * function returns or it is evacuated into the paged heap.
+ */
+typedef struct
+{
+    char *start;
+    char *top;
+    char *end;
+} FrameStack;
+
+extern void heap_initialise(Heap *heap);
+extern void heap_destroy(Heap *heap);
+
+extern struct Value *heap_allocate(Heap *heap);
+
+extern int heap_mark(struct Value *v);
+extern int heap_isMarked(struct Value *v);
+
+extern void heap_forEachMarked(Heap *heap, void (*f)(struct Value *v, void *context), void *context);
+
+extern void heap_startSweep(Heap *heap);
+extern int heap_sweepStep(Heap *heap);
+extern void heap_finishSweep(Heap *heap);
+
+extern void nursery_initialise(Nursery *nursery, int size);
+extern void nursery_destroy(Nursery *nursery);
+
+static inline void *nursery_allocate(Nursery *nursery, int size)
+{
+    char *result = nursery->top;
+
+    if (size > nursery->limit - result)
+        return NULL;
+
+    nursery->top = result + ((size + 7) & ~7);
+    return result;
+}
+
+static inline int nursery_contains(Nursery *nursery, void *p)
+{
+    return (char *)p >= nursery->start && (char *)p < nursery->end;
+}
+
+static inline void nursery_reset(Nursery *nursery)
+{
+    nursery->top = nursery->start;
+}
+
+static inline int nursery_limit(Nursery *nursery)
+{
+    return (int)(nursery->limit - nursery->start);
+}
+
+static inline void nursery_setLimit(Nursery *nursery, int size)
+{
+    size = (size + 7) & ~7;
+    nursery->limit = size < nursery->end - nursery->start ? nursery->start + size : nursery->end;
+}
+
+extern void frames_initialise(FrameStack *frames, int size);
+extern void frames_destroy(FrameStack *frames);
+
+static inline void *frames_allocate(FrameStack *frames, int size)
+{
+    char *result = frames->top;
+
+    if (size > frames->end - result)
+        return NULL;
+
+    frames->top = result + ((size + 7) & ~7);
+    return result;
+}
+
+static inline int frames_contains(FrameStack *frames, void *p)
+{
+    return (char *)p >= frames->start && (char *)p < frames->end;
+}
+
+#endif
@@ -0,0 +1,1248 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "memory.h"
+
+#include "jit.h"
+
+Jit *jit_new(Code *code, int threshold, int verified)
+{
+    Jit *jit = ALLOCATE(Jit, 1);
+
+    jit->code = code_decode(code->block, code->blockSize);
+    code_rewriteTailCalls(&jit->code);
+    jit->verified = verified;
+
+    jit->counts = ALLOCATE(int32_t, jit->code.size + 1);
+    jit->entries = ALLOCATE(JitEntry, jit->code.size + 1);
+    jit->resume = ALLOCATE(void *, jit->code.size + 1);
+    for (int32_t i = 0; i <= jit->code.size; i++)
+    {
+        jit->counts[i] = threshold;
+        jit->entries[i] = NULL;
+        jit->resume[i] = NULL;
+    }
+
+    jit->regionCount = 0;
+    jit->regionCapacity = 0;
+    jit->regions = NULL;
+
+    return jit;
+}
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+/*
+ * Compiled code keeps the MemoryState in rbx, the base of the stack in r12,
+ * the stack pointer in r13, the Jit in r14 and the lowest the stack pointer
+ * has been in r15, all of which are preserved across calls into the runtime.
+ * The stack pointer and low water are written back to the MemoryState, and
+ * the stack base reloaded, around every call that may use the stack.
+ */
+enum
+{
+    RAX,
+    RCX,
+    RDX,
+    RBX,
+    RSP,
+    RBP,
+    RSI,
+    RDI,
+    R8,
+    R9,
+    R10,
+    R11,
+    R12,
+    R13,
+    R14,
+    R15
+};
+
+#define MM RBX
+#define STACK R12
+#define SP R13
+#define JIT R14
+#define LOW_WATER R15
+
+#define CC_B 0x2
+#define CC_AE 0x3
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_A 0x7
+#define CC_L 0xC
+#define CC_LE 0xE
+
+#define NO_INDEX -1
+
+#define MEMORY_OFFSET(field) ((int32_t)offsetof(MemoryState, field))
+#define ACTIVATION_OFFSET(field) ((int32_t)offsetof(Value, data.a.field))
+#define CLOSURE_OFFSET(field) ((int32_t)offsetof(Value, data.c.field))
+#define FRAMES_OFFSET(field) ((int32_t)(offsetof(MemoryState, frames) + offsetof(FrameStack, field)))
+#define TYPE_OFFSET ((int32_t)offsetof(Value, type))
+#define FRAME_SIZE ((int32_t)((sizeof(Value) + 7) & ~7))
+
+/*
+ * ENTER allocates state of up to this many variables from the frame stack
+ * without calling into the runtime.
+ */
+#define JIT_INLINE_STATE_LIMIT 16
+
+/*
+ * Operands beyond this are left to the interpreter so that every state offset
+ * fits in a displacement.
+ */
+#define JIT_OPERAND_LIMIT 0xFFFFFF
+
+typedef enum
+{
+    TO_INSTRUCTION,
+    TO_DEOPTIMISE,
+    TO_EXIT
+} FixupKind;
+
+typedef struct
+{
+    int32_t at;
+    FixupKind kind;
+    int32_t target;
+} Fixup;
+
+/*
+ * Forward jumps to a label that is yet to be placed.
+ */
+typedef struct
+{
+    int32_t count;
+    int32_t at[8];
+} Jumps;
+
+typedef struct
+{
+    unsigned char *bytes;
+    int32_t size;
+    int32_t capacity;
+
+    int32_t fixupCount;
+    int32_t fixupCapacity;
+    Fixup *fixups;
+} Assembler;
+
+static void emitByte(Assembler *a, int byte)
+{
+    if (a->size == a->capacity)
+    {
+        a->capacity *= 2;
+        a->bytes = REALLOCATE(a->bytes, unsigned char, a->capacity);
+    }
+
+    a->bytes[a->size++] = (unsigned char)byte;
+}
+
+static void emitInt32(Assembler *a, int32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        emitByte(a, ((uint32_t)value >> (i * 8)) & 0xFF);
+}
+
+static void emitInt64(Assembler *a, int64_t value)
+{
+    for (int i = 0; i < 8; i++)
+        emitByte(a, ((uint64_t)value >> (i * 8)) & 0xFF);
+}
+
+static void patchInt32(Assembler *a, int32_t at, int32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        a->bytes[at + i] = ((uint32_t)value >> (i * 8)) & 0xFF;
+}
+
+static void emitRex(Assembler *a, int wide, int reg, int index, int base)
+{
+    if (wide || reg >= R8 || index >= R8 || base >= R8)
+        emitByte(a, 0x40 | (wide << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3));
+}
+
+static void emitOpcode(Assembler *a, int opcode)
+{
+    if (opcode > 0xFF)
+        emitByte(a, opcode >> 8);
+    emitByte(a, opcode & 0xFF);
+}
+
+/*
+ * An instruction with a register and a [base + index * (1 << scale) + disp]
+ * operand, always encoded with a 32 bit displacement.
+ */
+static void opMemory(Assembler *a, int wide, int opcode, int reg, int base, int index, int scale, int32_t disp)
+{
+    emitRex(a, wide, reg, index == NO_INDEX ? 0 : index, base);
+    emitOpcode(a, opcode);
+
+    if (index == NO_INDEX && (base & 7) != RSP)
+    {
+        emitByte(a, 0x80 | ((reg & 7) << 3) | (base & 7));
+    }
+    else
+    {
+        emitByte(a, 0x80 | ((reg & 7) << 3) | RSP);
+        emitByte(a, (scale << 6) | ((index == NO_INDEX ? RSP : index) & 7) << 3 | (base & 7));
+    }
+    emitInt32(a, disp);
+}
+
+static void opRegister(Assembler *a, int wide, int opcode, int reg, int rm)
+{
+    emitRex(a, wide, reg, 0, rm);
+    emitOpcode(a, opcode);
+    emitByte(a, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static void load(Assembler *a, int dst, int base, int32_t disp)
+{
+    opMemory(a, 1, 0x8B, dst, base, NO_INDEX, 0, disp);
+}
+
+static void store(Assembler *a, int base, int32_t disp, int src)
+{
+    opMemory(a, 1, 0x89, src, base, NO_INDEX, 0, disp);
+}
+
+/*
+ * The stack slot offset words from the top, 0 being the first free slot.
+ */
+static void loadSlot(Assembler *a, int dst, int32_t offset)
+{
+    opMemory(a, 1, 0x8B, dst, STACK, SP, 3, -8 * offset);
+}
+
+static void storeSlot(Assembler *a, int32_t offset, int src)
+{
+    opMemory(a, 1, 0x89, src, STACK, SP, 3, -8 * offset);
+}
+
+static void moveImmediate(Assembler *a, int dst, int64_t value)
+{
+    if (value >= 0 && value <= INT32_MAX)
+    {
+        emitRex(a, 0, 0, 0, dst);
+        emitByte(a, 0xB8 + (dst & 7));
+        emitInt32(a, (int32_t)value);
+    }
+    else
+    {
+        emitRex(a, 1, 0, 0, dst);
+        emitByte(a, 0xB8 + (dst & 7));
+        emitInt64(a, value);
+    }
+}
+
+static void move(Assembler *a, int dst, int src)
+{
+    opRegister(a, 1, 0x89, src, dst);
+}
+
+static void compareImmediate(Assembler *a, int reg, int32_t value)
+{
+    opRegister(a, 1, 0x81, 7, reg);
+    emitInt32(a, value);
+}
+
+static void compareMemory32(Assembler *a, int base, int32_t disp, int32_t value)
+{
+    opMemory(a, 0, 0x81, 7, base, NO_INDEX, 0, disp);
+    emitInt32(a, value);
+}
+
+static void compareMemory64(Assembler *a, int base, int32_t disp, int32_t value)
+{
+    opMemory(a, 1, 0x81, 7, base, NO_INDEX, 0, disp);
+    emitInt32(a, value);
+}
+
+static void compareRegisterMemory(Assembler *a, int reg, int base, int32_t disp)
+{
+    opMemory(a, 1, 0x3B, reg, base, NO_INDEX, 0, disp);
+}
+
+static void storeImmediate(Assembler *a, int wide, int base, int32_t disp, int32_t value)
+{
+    opMemory(a, wide, 0xC7, 0, base, NO_INDEX, 0, disp);
+    emitInt32(a, value);
+}
+
+static void load32(Assembler *a, int dst, int base, int32_t disp)
+{
+    opMemory(a, 0, 0x8B, dst, base, NO_INDEX, 0, disp);
+}
+
+static void store32(Assembler *a, int base, int32_t disp, int src)
+{
+    opMemory(a, 0, 0x89, src, base, NO_INDEX, 0, disp);
+}
+
+static void testImmediate(Assembler *a, int reg, int32_t value)
+{
+    opRegister(a, 0, 0xF7, 0, reg);
+    emitInt32(a, value);
+}
+
+static void addImmediate(Assembler *a, int reg, int32_t value)
+{
+    opRegister(a, 1, 0x81, value < 0 ? 5 : 0, reg);
+    emitInt32(a, value < 0 ? -value : value);
+}
+
+static void orOne(Assembler *a, int reg)
+{
+    opRegister(a, 1, 0x83, 1, reg);
+    emitByte(a, 1);
+}
+
+static void shift(Assembler *a, int right, int reg, int count)
+{
+    opRegister(a, 1, 0xC1, right ? 7 : 4, reg);
+    emitByte(a, count);
+}
+
+static void pushRegister(Assembler *a, int reg)
+{
+    emitRex(a, 0, 0, 0, reg);
+    emitByte(a, 0x50 + (reg & 7));
+}
+
+static void popRegister(Assembler *a, int reg)
+{
+    emitRex(a, 0, 0, 0, reg);
+    emitByte(a, 0x58 + (reg & 7));
+}
+
+static void callFunction(Assembler *a, void (*function)(void))
+{
+    moveImmediate(a, RAX, (int64_t)(intptr_t)function);
+    emitByte(a, 0xFF);
+    emitByte(a, 0xD0);
+}
+
+static int32_t jumpForward(Assembler *a, int condition)
+{
+    if (condition < 0)
+        emitByte(a, 0xE9);
+    else
+    {
+        emitByte(a, 0x0F);
+        emitByte(a, 0x80 | condition);
+    }
+    emitInt32(a, 0);
+
+    return a->size - 4;
+}
+
+static void landHere(Assembler *a, int32_t at)
+{
+    patchInt32(a, at, a->size - (at + 4));
+}
+
+static void jumpLater(Assembler *a, Jumps *jumps, int condition)
+{
+    jumps->at[jumps->count++] = jumpForward(a, condition);
+}
+
+static void landAll(Assembler *a, Jumps *jumps)
+{
+    for (int32_t i = 0; i < jumps->count; i++)
+        landHere(a, jumps->at[i]);
+    jumps->count = 0;
+}
+
+static void jumpTo(Assembler *a, int condition, FixupKind kind, int32_t target)
+{
+    if (a->fixupCount == a->fixupCapacity)
+    {
+        a->fixupCapacity *= 2;
+        a->fixups = REALLOCATE(a->fixups, Fixup, a->fixupCapacity);
+    }
+
+    Fixup *fixup = &a->fixups[a->fixupCount++];
+    fixup->at = jumpForward(a, condition);
+    fixup->kind = kind;
+    fixup->target = target;
+}
+
+static void flush(Assembler *a)
+{
+    opMemory(a, 0, 0x89, SP, MM, NO_INDEX, 0, MEMORY_OFFSET(sp));
+    opMemory(a, 0, 0x89, LOW_WATER, MM, NO_INDEX, 0, MEMORY_OFFSET(stackLowWater));
+}
+
+static void reload(Assembler *a)
+{
+    load(a, STACK, MM, MEMORY_OFFSET(stack));
+    opMemory(a, 1, 0x63, SP, MM, NO_INDEX, 0, MEMORY_OFFSET(sp));
+    opMemory(a, 1, 0x63, LOW_WATER, MM, NO_INDEX, 0, MEMORY_OFFSET(stackLowWater));
+}
+
+static void lowerWater(Assembler *a)
+{
+    opRegister(a, 1, 0x39, SP, LOW_WATER);
+    opRegister(a, 1, 0x0F4F, LOW_WATER, SP);
+}
+
+static void returnToInterpreter(Assembler *a)
+{
+    popRegister(a, LOW_WATER);
+    popRegister(a, JIT);
+    popRegister(a, SP);
+    popRegister(a, STACK);
+    popRegister(a, MM);
+    emitByte(a, 0xC3);
+}
+
+/*
+ * Continue from the instruction whose index a call into the runtime has
+ * returned in eax, jumping straight to it when it has been compiled.
+ */
+static void continueAt(Assembler *a)
+{
+    load(a, RCX, JIT, (int32_t)offsetof(Jit, resume));
+    opRegister(a, 0, 0x89, RAX, RDX);
+    opMemory(a, 1, 0x8B, RCX, RCX, RDX, 3, 0);
+    opRegister(a, 1, 0x85, RCX, RCX);
+    int32_t interpreted = jumpForward(a, CC_E);
+    opRegister(a, 0, 0xFF, 4, RCX);
+    landHere(a, interpreted);
+    returnToInterpreter(a);
+}
+
+/*
+ * Push rax, which is already known to be on the stack, shading it should
+ * incremental marking be in progress.
+ */
+static void pushShaded(Assembler *a)
+{
+    storeSlot(a, 0, RAX);
+    addImmediate(a, SP, 1);
+
+    compareMemory32(a, MM, MEMORY_OFFSET(phase), GC_MARKING);
+    int32_t idle = jumpForward(a, CC_NE);
+    flush(a);
+    move(a, RDI, RAX);
+    move(a, RSI, MM);
+    callFunction(a, (void (*)(void))value_shadeGrey);
+    reload(a);
+    landHere(a, idle);
+}
+
+static void pushImmediate(Assembler *a, Value *value)
+{
+    moveImmediate(a, RAX, (int64_t)(intptr_t)value);
+    storeSlot(a, 0, RAX);
+    addImmediate(a, SP, 1);
+}
+
+static void loadActivation(Assembler *a, int dst)
+{
+    load(a, dst, MM, MEMORY_OFFSET(activation));
+}
+
+/*
+ * The helpers that compiled code calls for the instructions that transfer
+ * control, each returning the index of the instruction to continue from.
+ */
+static int32_t jitCall(Jit *jit, MemoryState *mm, int32_t nextIP)
+{
+    Value *newActivation = value_newFrame(mm->activation, peek(1, mm), nextIP, mm);
+    Value *argument = pop(mm);
+    Value *closure = pop(mm);
+    int32_t ip = closure->data.c.ip;
+
+    mm->activation = newActivation;
+    push(argument, mm);
+    jit_count(jit, ip);
+
+    return ip;
+}
+
+static int32_t jitTailCall(Jit *jit, MemoryState *mm)
+{
+    Value *newActivation = value_newTailFrame(peek(1, mm), mm);
+    Value *argument = pop(mm);
+    Value *closure = pop(mm);
+    int32_t ip = closure->data.c.ip;
+
+    mm->activation = newActivation;
+    push(argument, mm);
+    jit_count(jit, ip);
+
+    return ip;
+}
+
+static int32_t jitReturn(MemoryState *mm)
+{
+    int32_t ip = mm->activation->data.a.nextIP;
+
+    value_return(mm);
+
+    return ip;
+}
+
+static void jitWriteBarrier(Value *object, Value *value, MemoryState *mm)
+{
+    value_writeBarrier(object, value, mm);
+}
+
+static int32_t jitCount(Jit *jit, int32_t ip)
+{
+    jit_count(jit, ip);
+
+    return ip;
+}
+
+/*
+ * The fast paths of ENTER, the calls and RET work directly on the frame stack
+ * as value_newState, value_newFrame and value_return do.  Anything else - the
+ * activation not being a frame, the frame stack being full or incremental
+ * marking needing the barriers - takes the slow path through the runtime.
+ */
+static void jumpUnlessFrame(Assembler *a, int reg, Jumps *slow)
+{
+    compareRegisterMemory(a, reg, MM, FRAMES_OFFSET(start));
+    jumpLater(a, slow, CC_B);
+    compareRegisterMemory(a, reg, MM, FRAMES_OFFSET(end));
+    jumpLater(a, slow, CC_AE);
+}
+
+static void jumpIfMarking(Assembler *a, Jumps *slow)
+{
+    compareMemory32(a, MM, MEMORY_OFFSET(phase), GC_MARKING);
+    jumpLater(a, slow, CC_E);
+}
+
+static void jumpUnlessClosure(Assembler *a, int reg, Jumps *slow)
+{
+    opRegister(a, 1, 0x85, reg, reg);
+    jumpLater(a, slow, CC_E);
+    testImmediate(a, reg, VALUE_TAG_MASK);
+    jumpLater(a, slow, CC_NE);
+    load32(a, RDX, reg, TYPE_OFFSET);
+    opRegister(a, 0, 0x81, 4, RDX);
+    emitInt32(a, VALUE_TYPE_MASK);
+    opRegister(a, 0, 0x81, 7, RDX);
+    emitInt32(a, VClosure);
+    jumpLater(a, slow, CC_NE);
+}
+
+static void jumpUnlessFrameRoom(Assembler *a, Jumps *slow)
+{
+    load(a, RAX, MM, FRAMES_OFFSET(top));
+    opMemory(a, 1, 0x8D, RDX, RAX, NO_INDEX, 0, FRAME_SIZE);
+    compareRegisterMemory(a, RDX, MM, FRAMES_OFFSET(end));
+    jumpLater(a, slow, CC_A);
+}
+
+/*
+ * Pop the activation in rax, whose parent is in rdi, off the frame stack
+ * should it be a frame.
+ */
+static void popFrame(Assembler *a)
+{
+    Jumps notFrame = {0, {0}};
+    Jumps useStart = {0, {0}};
+
+    jumpUnlessFrame(a, RAX, &notFrame);
+    load(a, RDX, MM, FRAMES_OFFSET(start));
+    opRegister(a, 1, 0x39, RDX, RDI);
+    jumpLater(a, &useStart, CC_B);
+    compareRegisterMemory(a, RDI, MM, FRAMES_OFFSET(end));
+    jumpLater(a, &useStart, CC_AE);
+    move(a, RDX, RDI);
+    landAll(a, &useStart);
+
+    store(a, MM, FRAMES_OFFSET(top), RAX);
+    compareRegisterMemory(a, RDX, MM, MEMORY_OFFSET(framesLowWater));
+    int32_t higher = jumpForward(a, CC_AE);
+    store(a, MM, MEMORY_OFFSET(framesLowWater), RDX);
+    landHere(a, higher);
+    compareRegisterMemory(a, RAX, MM, MEMORY_OFFSET(frameCursor));
+    int32_t below = jumpForward(a, CC_AE);
+    store(a, MM, MEMORY_OFFSET(frameCursor), RAX);
+    landHere(a, below);
+
+    landAll(a, &notFrame);
+}
+
+/*
+ * Push a frame for a call of the closure in rcx, which is known to fit, and
+ * make it the current activation.  The parent is in rdi and the index of the
+ * instruction to return to in esi.
+ */
+static void pushFrame(Assembler *a)
+{
+    load(a, RAX, MM, FRAMES_OFFSET(top));
+    opMemory(a, 1, 0x8D, RDX, RAX, NO_INDEX, 0, FRAME_SIZE);
+    store(a, MM, FRAMES_OFFSET(top), RDX);
+
+    storeImmediate(a, 0, RAX, TYPE_OFFSET, VActivation | VALUE_REMEMBERED);
+    store(a, RAX, ACTIVATION_OFFSET(parentActivation), RDI);
+    store(a, RAX, ACTIVATION_OFFSET(closure), RCX);
+    store32(a, RAX, ACTIVATION_OFFSET(nextIP), RSI);
+    storeImmediate(a, 0, RAX, ACTIVATION_OFFSET(stateSize), -1);
+    storeImmediate(a, 1, RAX, ACTIVATION_OFFSET(state), 0);
+    store(a, MM, MEMORY_OFFSET(activation), RAX);
+}
+
+/*
+ * Replace the closure and argument on the stack with the argument and continue
+ * at the entry of the closure in rcx, counting the call.
+ */
+static void enterCallee(Assembler *a)
+{
+    loadSlot(a, RDX, 1);
+    addImmediate(a, SP, -2);
+    lowerWater(a);
+    storeSlot(a, 0, RDX);
+    addImmediate(a, SP, 1);
+
+    load32(a, RAX, RCX, CLOSURE_OFFSET(ip));
+    load(a, RDX, JIT, (int32_t)offsetof(Jit, counts));
+    opMemory(a, 0, 0x81, 7, RDX, RAX, 2, 0);
+    emitInt32(a, 0);
+    int32_t counted = jumpForward(a, CC_LE);
+    flush(a);
+    move(a, RDI, JIT);
+    opRegister(a, 0, 0x89, RAX, RSI);
+    callFunction(a, (void (*)(void))jitCount);
+    reload(a);
+    landHere(a, counted);
+
+    flush(a);
+    continueAt(a);
+}
+
+/*
+ * The extent of the function entered at entry: the depth of the stack, above
+ * the point it was at before the argument was pushed, at each instruction,
+ * which is -1 for an instruction outside the function, and the deepest the
+ * stack gets.  Returns 0 if the function cannot be compiled.
+ */
+static int measure(Code *code, int32_t entry, int32_t *depth, int32_t *deepest)
+{
+    int32_t *worklist = ALLOCATE(int32_t, code->size + 1);
+    int32_t worklistSize = 0;
+    int result = 1;
+
+    for (int32_t i = 0; i <= code->size; i++)
+        depth[i] = -1;
+
+    depth[entry] = 1;
+    worklist[worklistSize++] = entry;
+    *deepest = 1;
+
+    while (result && worklistSize > 0)
+    {
+        int32_t ip = worklist[--worklistSize];
+        Op *op = &code->ops[ip];
+        int32_t d = depth[ip];
+        int32_t next[2] = {ip + 1, -1};
+        int32_t pops = 0;
+        int32_t pushes = 0;
+
+        switch (op->opcode)
+        {
+        case PUSH_TRUE:
+        case PUSH_FALSE:
+        case PUSH_INT:
+        case PUSH_CLOSURE:
+            pushes = 1;
+            break;
+        case PUSH_VAR:
+            pushes = 1;
+            if (op->operand[0] < 0 || op->operand[1] < 0 || op->operand[1] > JIT_OPERAND_LIMIT)
+                result = 0;
+            break;
+        case MAKE_CLOSURE:
+            pops = op->operand[1];
+            pushes = 1;
+            if (op->operand[1] < 0)
+                result = 0;
+            break;
+        case PUSH_FREE:
+            pushes = 1;
+            if (op->operand[0] < 0 || op->operand[0] > JIT_OPERAND_LIMIT)
+                result = 0;
+            break;
+        case ADD:
+        case SUB:
+        case MUL:
+        case DIV:
+        case EQ:
+            pops = 2;
+            pushes = 1;
+            break;
+        case JMP:
+            next[0] = op->operand[0];
+            break;
+        case JMP_TRUE:
+            pops = 1;
+            next[1] = op->operand[0];
+            break;
+        case SWAP_CALL:
+            pops = 2;
+            pushes = 1;
+            break;
+        case ENTER:
+            break;
+        case STORE_VAR:
+            pops = 1;
+            if (op->operand[0] < 0 || op->operand[0] > JIT_OPERAND_LIMIT)
+                result = 0;
+            break;
+        case TAIL_CALL:
+            pops = 2;
+            next[0] = -1;
+            break;
+        case RET:
+            pops = 1;
+            next[0] = -1;
+            break;
+        default:
+            result = 0;
+            break;
+        }
+
+        if (d < pops)
+            result = 0;
+        d += pushes - pops;
+        if (d > *deepest)
+            *deepest = d;
+
+        for (int i = 0; result && i < 2; i++)
+        {
+            if (next[i] < 0)
+                continue;
+            if (depth[next[i]] == -1)
+            {
+                depth[next[i]] = d;
+                worklist[worklistSize++] = next[i];
+            }
+            else if (depth[next[i]] != d)
+                result = 0;
+        }
+    }
+
+    FREE(worklist);
+
+    return result;
+}
+
+/*
+ * Anything that compiled code does not handle itself, such as a check that
+ * fails in unverified code or a divisor of 0 or -1 that idiv would fault on,
+ * deoptimises: the interpreter carries on from the instruction.
+ */
+static void compileInstruction(Assembler *a, Jit *jit, int32_t ip)
+{
+    Op *op = &jit->code.ops[ip];
+    int checked = !jit->verified;
+
+    switch (op->opcode)
+    {
+    case PUSH_TRUE:
+        pushImmediate(a, value_True);
+        break;
+    case PUSH_FALSE:
+        pushImmediate(a, value_False);
+        break;
+    case PUSH_INT:
+        pushImmediate(a, value_fromInt(op->operand[0]));
+        break;
+    case PUSH_VAR:
+        loadActivation(a, RAX);
+        for (int32_t i = 0; i < op->operand[0]; i++)
+        {
+            load(a, RAX, RAX, ACTIVATION_OFFSET(closure));
+            if (checked)
+            {
+                opRegister(a, 1, 0x85, RAX, RAX);
+                jumpTo(a, CC_E, TO_DEOPTIMISE, ip);
+            }
+            load(a, RAX, RAX, CLOSURE_OFFSET(previousActivation));
+            if (checked)
+            {
+                opRegister(a, 1, 0x85, RAX, RAX);
+                jumpTo(a, CC_E, TO_DEOPTIMISE, ip);
+            }
+        }
+        if (checked)
+        {
+            compareMemory32(a, RAX, ACTIVATION_OFFSET(stateSize), op->operand[1]);
+            jumpTo(a, CC_LE, TO_DEOPTIMISE, ip);
+        }
+        load(a, RCX, RAX, ACTIVATION_OFFSET(state));
+        load(a, RAX, RCX, op->operand[1] * 8);
+        pushShaded(a);
+        break;
+    case PUSH_CLOSURE:
+        flush(a);
+        loadActivation(a, RDI);
+        moveImmediate(a, RSI, op->operand[0]);
+        move(a, RDX, MM);
+        callFunction(a, (void (*)(void))value_newClosure);
+        reload(a);
+        break;
+    case MAKE_CLOSURE:
+        flush(a);
+        moveImmediate(a, RDI, op->operand[0]);
+        moveImmediate(a, RSI, op->operand[1]);
+        move(a, RDX, MM);
+        callFunction(a, (void (*)(void))value_newFlatClosure);
+        reload(a);
+        break;
+    case PUSH_FREE:
+        loadActivation(a, RAX);
+        load(a, RAX, RAX, ACTIVATION_OFFSET(closure));
+        if (checked)
+        {
+            opRegister(a, 1, 0x85, RAX, RAX);
+            jumpTo(a, CC_E, TO_DEOPTIMISE, ip);
+            compareMemory32(a, RAX, CLOSURE_OFFSET(freeSize), op->operand[0]);
+            jumpTo(a, CC_LE, TO_DEOPTIMISE, ip);
+        }
+        load(a, RCX, RAX, CLOSURE_OFFSET(free));
+        load(a, RAX, RCX, op->operand[0] * 8);
+        pushShaded(a);
+        break;
+    case ADD:
+    case SUB:
+    case MUL:
+    case DIV:
+    case EQ:
+        loadSlot(a, RCX, 1);
+        loadSlot(a, RAX, 2);
+        if (checked)
+        {
+            opRegister(a, 0, 0x89, RAX, RDX);
+            opRegister(a, 0, 0x21, RCX, RDX);
+            opRegister(a, 0, 0xF7, 0, RDX);
+            emitInt32(a, VALUE_INT_TAG);
+            jumpTo(a, CC_E, TO_DEOPTIMISE, ip);
+        }
+        if (op->opcode == DIV)
+        {
+            move(a, RDX, RCX);
+            shift(a, 1, RDX, 32);
+            addImmediate(a, RDX, 1);
+            compareImmediate(a, RDX, 2);
+            jumpTo(a, CC_B, TO_DEOPTIMISE, ip);
+        }
+        addImmediate(a, SP, -2);
+        lowerWater(a);
+
+        switch (op->opcode)
+        {
+        case ADD:
+            opMemory(a, 1, 0x8D, RAX, RAX, RCX, 0, -VALUE_INT_TAG);
+            break;
+        case SUB:
+            opRegister(a, 1, 0x29, RCX, RAX);
+            orOne(a, RAX);
+            break;
+        case MUL:
+            shift(a, 1, RAX, 32);
+            shift(a, 1, RCX, 32);
+            opRegister(a, 0, 0x0FAF, RAX, RCX);
+            shift(a, 0, RAX, 32);
+            orOne(a, RAX);
+            break;
+        case DIV:
+            shift(a, 1, RAX, 32);
+            shift(a, 1, RCX, 32);
+            emitByte(a, 0x99);
+            opRegister(a, 0, 0xF7, 7, RCX);
+            shift(a, 0, RAX, 32);
+            orOne(a, RAX);
+            break;
+        default:
+            opRegister(a, 1, 0x39, RCX, RAX);
+            moveImmediate(a, RAX, (int64_t)(intptr_t)value_False);
+            moveImmediate(a, RDX, (int64_t)(intptr_t)value_True);
+            opRegister(a, 0, 0x0F44, RAX, RDX);
+            break;
+        }
+
+        storeSlot(a, 0, RAX);
+        addImmediate(a, SP, 1);
+        break;
+    case JMP:
+        jumpTo(a, -1, TO_INSTRUCTION, op->operand[0]);
+        break;
+    case JMP_TRUE:
+    {
+        loadSlot(a, RAX, 1);
+        if (checked)
+        {
+            compareImmediate(a, RAX, (int32_t)(intptr_t)value_False);
+            int32_t isBool = jumpForward(a, CC_E);
+            compareImmediate(a, RAX, (int32_t)(intptr_t)value_True);
+            jumpTo(a, CC_NE, TO_DEOPTIMISE, ip);
+            landHere(a, isBool);
+        }
+        addImmediate(a, SP, -1);
+        lowerWater(a);
+        compareImmediate(a, RAX, (int32_t)(intptr_t)value_True);
+        jumpTo(a, CC_E, TO_INSTRUCTION, op->operand[0]);
+        break;
+    }
+    case SWAP_CALL:
+    {
+        Jumps slow = {0, {0}};
+
+        jumpIfMarking(a, &slow);
+        loadSlot(a, RCX, 2);
+        if (checked)
+            jumpUnlessClosure(a, RCX, &slow);
+        jumpUnlessFrameRoom(a, &slow);
+        loadActivation(a, RDI);
+        moveImmediate(a, RSI, ip + 1);
+        pushFrame(a);
+        enterCallee(a);
+
+        landAll(a, &slow);
+        flush(a);
+        move(a, RDI, JIT);
+        move(a, RSI, MM);
+        moveImmediate(a, RDX, ip + 1);
+        callFunction(a, (void (*)(void))jitCall);
+        continueAt(a);
+        break;
+    }
+    case TAIL_CALL:
+    {
+        Jumps slow = {0, {0}};
+
+        jumpIfMarking(a, &slow);
+        loadSlot(a, RCX, 2);
+        if (checked)
+            jumpUnlessClosure(a, RCX, &slow);
+        jumpUnlessFrameRoom(a, &slow);
+        loadActivation(a, RAX);
+        load(a, RDI, RAX, ACTIVATION_OFFSET(parentActivation));
+        load32(a, RSI, RAX, ACTIVATION_OFFSET(nextIP));
+        popFrame(a);
+        pushFrame(a);
+        enterCallee(a);
+
+        landAll(a, &slow);
+        flush(a);
+        move(a, RDI, JIT);
+        move(a, RSI, MM);
+        callFunction(a, (void (*)(void))jitTailCall);
+        continueAt(a);
+        break;
+    }
+    case ENTER:
+    {
+        int32_t size = op->operand[0];
+        Jumps slow = {0, {0}};
+
+        loadActivation(a, RAX);
+        if (checked)
+        {
+            compareMemory64(a, RAX, ACTIVATION_OFFSET(state), 0);
+            jumpTo(a, CC_NE, TO_DEOPTIMISE, ip);
+        }
+        if (size >= 0 && size <= JIT_INLINE_STATE_LIMIT)
+        {
+            jumpUnlessFrame(a, RAX, &slow);
+            load(a, RCX, MM, FRAMES_OFFSET(top));
+            opMemory(a, 1, 0x8D, RDX, RCX, NO_INDEX, 0, size * 8);
+            compareRegisterMemory(a, RDX, MM, FRAMES_OFFSET(end));
+            jumpLater(a, &slow, CC_A);
+            store(a, MM, FRAMES_OFFSET(top), RDX);
+            compareRegisterMemory(a, RCX, MM, MEMORY_OFFSET(frameCursor));
+            int32_t elsewhere = jumpForward(a, CC_NE);
+            store(a, MM, MEMORY_OFFSET(frameCursor), RDX);
+            landHere(a, elsewhere);
+            for (int32_t i = 0; i < size; i++)
+                storeImmediate(a, 1, RCX, i * 8, 0);
+            storeImmediate(a, 0, RAX, ACTIVATION_OFFSET(stateSize), size);
+            store(a, RAX, ACTIVATION_OFFSET(state), RCX);
+            int32_t done = jumpForward(a, -1);
+
+            landAll(a, &slow);
+            flush(a);
+            moveImmediate(a, RDI, (uint32_t)size);
+            move(a, RSI, MM);
+            callFunction(a, (void (*)(void))value_newState);
+            reload(a);
+            landHere(a, done);
+        }
+        else
+        {
+            flush(a);
+            moveImmediate(a, RDI, (uint32_t)size);
+            move(a, RSI, MM);
+            callFunction(a, (void (*)(void))value_newState);
+            reload(a);
+        }
+        break;
+    }
+    case RET:
+    {
+        Jumps slow = {0, {0}};
+
+        loadActivation(a, RAX);
+        compareMemory64(a, RAX, ACTIVATION_OFFSET(parentActivation), 0);
+        jumpTo(a, CC_E, TO_DEOPTIMISE, ip);
+        jumpIfMarking(a, &slow);
+        load(a, RDI, RAX, ACTIVATION_OFFSET(parentActivation));
+        load32(a, RSI, RAX, ACTIVATION_OFFSET(nextIP));
+        popFrame(a);
+        store(a, MM, MEMORY_OFFSET(activation), RDI);
+        opRegister(a, 0, 0x89, RSI, RAX);
+        flush(a);
+        continueAt(a);
+
+        landAll(a, &slow);
+        flush(a);
+        move(a, RDI, MM);
+        callFunction(a, (void (*)(void))jitReturn);
+        continueAt(a);
+        break;
+    }
+    case STORE_VAR:
+    {
+        loadActivation(a, RAX);
+        if (checked)
+        {
+            compareMemory64(a, RAX, ACTIVATION_OFFSET(state), 0);
+            jumpTo(a, CC_E, TO_DEOPTIMISE, ip);
+            compareMemory32(a, RAX, ACTIVATION_OFFSET(stateSize), op->operand[0]);
+            jumpTo(a, CC_LE, TO_DEOPTIMISE, ip);
+        }
+        loadSlot(a, RCX, 1);
+        addImmediate(a, SP, -1);
+        lowerWater(a);
+        load(a, RDX, RAX, ACTIVATION_OFFSET(state));
+        store(a, RDX, op->operand[0] * 8, RCX);
+
+        opRegister(a, 0, 0xF7, 0, RCX);
+        emitInt32(a, VALUE_TAG_MASK);
+        int32_t immediate = jumpForward(a, CC_NE);
+        flush(a);
+        move(a, RDI, RAX);
+        move(a, RSI, RCX);
+        move(a, RDX, MM);
+        callFunction(a, (void (*)(void))jitWriteBarrier);
+        reload(a);
+        landHere(a, immediate);
+        break;
+    }
+    }
+}
+
+/*
+ * Each entry from the interpreter saves the registers that compiled code lives
+ * in, which leaves the native stack aligned for calls, before reaching the
+ * point that compiled code resumes from.  That makes sure that the stack has
+ * room for the deepest the function can push it so that the templates need
+ * not check.  Returns the offset of the resume point.
+ *
+ * measure only compiles a function that never pops below the point that it
+ * was entered at, so from an instruction at depth the compiled code pops at
+ * most depth values more than it pushes.  Unverified code may still reach a
+ * resume point with fewer values than that on the whole stack, such as after
+ * a callee that popped its caller's, so when checked the entry leaves the
+ * instruction to the interpreter, which fails it as it would have.  Like the
+ * interpreter's own check, this is against the whole stack, as no activation
+ * records where its part of the stack starts.
+ */
+static int32_t compileEntry(Assembler *a, int checked, int32_t ip, int32_t depth, int32_t deepest)
+{
+    pushRegister(a, MM);
+    pushRegister(a, STACK);
+    pushRegister(a, SP);
+    pushRegister(a, JIT);
+    pushRegister(a, LOW_WATER);
+    move(a, MM, RDI);
+    move(a, JIT, RSI);
+
+    int32_t resumeAt = a->size;
+    reload(a);
+
+    if (checked)
+    {
+        compareImmediate(a, SP, depth);
+        jumpTo(a, CC_L, TO_DEOPTIMISE, ip);
+    }
+
+    opMemory(a, 1, 0x8D, RAX, SP, NO_INDEX, 0, deepest - depth);
+    opMemory(a, 0, 0x3B, RAX, MM, NO_INDEX, 0, MEMORY_OFFSET(stackSize));
+    jumpTo(a, CC_LE, TO_INSTRUCTION, ip);
+    flush(a);
+    moveImmediate(a, RDI, deepest - depth);
+    move(a, RSI, MM);
+    callFunction(a, (void (*)(void))value_reserveStack);
+    reload(a);
+    jumpTo(a, -1, TO_INSTRUCTION, ip);
+
+    return resumeAt;
+}
+
+static void addRegion(Jit *jit, void *memory, size_t size)
+{
+    if (jit->regionCount == jit->regionCapacity)
+    {
+        jit->regionCapacity = jit->regionCapacity == 0 ? 8 : jit->regionCapacity * 2;
+        jit->regions = jit->regions == NULL ? ALLOCATE(JitRegion, jit->regionCapacity) : REALLOCATE(jit->regions, JitRegion, jit->regionCapacity);
+    }
+
+    jit->regions[jit->regionCount].memory = memory;
+    jit->regions[jit->regionCount].size = size;
+    jit->regionCount++;
+}
+
+/*
+ * The body is laid out in instruction order, so that falling through to the
+ * next instruction needs no jump, followed by an entry for the function and
+ * for the return from each of its calls, the exits that hand an instruction
+ * back to the interpreter and the common exit.
+ */
+void jit_compile(Jit *jit, int32_t entry)
+{
+    Code *code = &jit->code;
+    int32_t *depth = ALLOCATE(int32_t, code->size + 1);
+    int32_t deepest;
+
+    if (!measure(code, entry, depth, &deepest))
+    {
+        FREE(depth);
+        return;
+    }
+
+    int32_t *nativeAt = ALLOCATE(int32_t, code->size + 1);
+    int32_t *deoptimiseAt = ALLOCATE(int32_t, code->size + 1);
+    int32_t *entryAt = ALLOCATE(int32_t, code->size + 1);
+    int32_t *resumeAt = ALLOCATE(int32_t, code->size + 1);
+    for (int32_t i = 0; i <= code->size; i++)
+    {
+        nativeAt[i] = -1;
+        deoptimiseAt[i] = -1;
+        entryAt[i] = -1;
+        resumeAt[i] = -1;
+    }
+
+    Assembler a;
+    a.size = 0;
+    a.capacity = 4096;
+    a.bytes = ALLOCATE(unsigned char, a.capacity);
+    a.fixupCount = 0;
+    a.fixupCapacity = 256;
+    a.fixups = ALLOCATE(Fixup, a.fixupCapacity);
+
+    for (int32_t ip = 0; ip < code->size; ip++)
+    {
+        if (depth[ip] >= 0)
+        {
+            nativeAt[ip] = a.size;
+            compileInstruction(&a, jit, ip);
+        }
+    }
+
+    for (int32_t ip = 0; ip < code->size; ip++)
+    {
+        if (ip == entry || (depth[ip] >= 0 && ip > 0 && depth[ip - 1] >= 0 && code->ops[ip - 1].opcode == SWAP_CALL))
+        {
+            entryAt[ip] = a.size;
+            resumeAt[ip] = compileEntry(&a, !jit->verified, ip, depth[ip], deepest);
+        }
+    }
+
+    int32_t exitAt = a.size;
+    flush(&a);
+    returnToInterpreter(&a);
+
+    for (int32_t i = 0; i < a.fixupCount; i++)
+    {
+        Fixup *fixup = &a.fixups[i];
+
+        if (fixup->kind == TO_DEOPTIMISE && deoptimiseAt[fixup->target] == -1)
+        {
+            deoptimiseAt[fixup->target] = a.size;
+            moveImmediate(&a, RAX, (uint32_t)(-fixup->target - 1));
+            jumpTo(&a, -1, TO_EXIT, 0);
+        }
+    }
+
+    for (int32_t i = 0; i < a.fixupCount; i++)
+    {
+        Fixup *fixup = &a.fixups[i];
+        int32_t target = fixup->kind == TO_INSTRUCTION ? nativeAt[fixup->target] : fixup->kind == TO_DEOPTIMISE ? deoptimiseAt[fixup->target] : exitAt;
+
+        patchInt32(&a, fixup->at, target - (fixup->at + 4));
+    }
+
+    void *memory = mmap(NULL, a.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory != MAP_FAILED)
+    {
+        memcpy(memory, a.bytes, a.size);
+        if (mprotect(memory, a.size, PROT_READ | PROT_EXEC) == 0)
+        {
+            addRegion(jit, memory, a.size);
+            for (int32_t ip = 0; ip < code->size; ip++)
+            {
+                if (entryAt[ip] >= 0)
+                {
+                    jit->entries[ip] = (JitEntry)(uintptr_t)((unsigned char *)memory + entryAt[ip]);
+                    jit->resume[ip] = (unsigned char *)memory + resumeAt[ip];
+                }
+            }
+        }
+        else
+            munmap(memory, a.size);
+    }
+
+    FREE(a.fixups);
+    FREE(a.bytes);
+    FREE(resumeAt);
+    FREE(entryAt);
+    FREE(deoptimiseAt);
+    FREE(nativeAt);
+    FREE(depth);
+}
+
+void jit_free(Jit *jit)
+{
+    for (int32_t i = 0; i < jit->regionCount; i++)
+        munmap(jit->regions[i].memory, jit->regions[i].size);
+    if (jit->regions != NULL)
+        FREE(jit->regions);
+
+    FREE(jit->resume);
+    FREE(jit->entries);
+    FREE(jit->counts);
+    code_destroy(&jit->code);
+    FREE(jit);
+}
+
+#else
+
+void jit_compile(Jit *jit, int32_t entry)
+{
+    (void)jit;
+    (void)entry;
+}
+
+void jit_free(Jit *jit)
+{
+    FREE(jit->resume);
+    FREE(jit->entries);
+    FREE(jit->counts);
+    code_destroy(&jit->code);
+    FREE(jit);
+}
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stddef.h>
+
+#include "code.h"
+#include "value.h"
+
+/*
+ * A baseline compiler from the bytecode of hot functions into x86-64.  The
+ * entry of a closure is compiled once it has been called threshold times:
+ * the instructions reachable from it, up to its returns, are translated one
+ * at a time from templates into native code that keeps the stack pointer in a
+ * register and calls back into the runtime to allocate, call and return.
+ *
+ * A compiled function is entered at its entry or at the return from any of
+ * its calls.  A call or return that lands in compiled code jumps straight to
+ * it, through resume, and otherwise hands back to the interpreter the index of
+ * the next instruction to run.  An instruction whose check fails is instead
+ * handed back as minus one less its index, for the interpreter to run.  A
+ * function with an instruction that the compiler does not support, or on a
+ * platform other than x86-64, is left to the interpreter.
+ */
+
+#define JIT_DEFAULT_THRESHOLD 1000
+
+struct Jit;
+
+typedef int32_t (*JitEntry)(MemoryState *mm, struct Jit *jit);
+
+typedef struct
+{
+    void *memory;
+    size_t size;
+} JitRegion;
+
+typedef struct Jit
+{
+    Code code;
+    int verified;
+
+    int32_t *counts;
+    JitEntry *entries;
+    void **resume;
+
+    int32_t regionCount;
+    int32_t regionCapacity;
+    JitRegion *regions;
+} Jit;
+
+/*
+ * The compiler works from its own undecorated decoding of code's block so
+ * that it is unaffected by fusing and quickening.  Verified code, for which
+ * verify has returned 1, is compiled without checks.
+ */
+extern Jit *jit_new(Code *code, int threshold, int verified);
+extern void jit_free(Jit *jit);
+
+extern void jit_compile(Jit *jit, int32_t entry);
+
+static inline void jit_count(Jit *jit, int32_t ip)
+{
+    if (jit->counts[ip] > 0 && --jit->counts[ip] == 0)
+        jit_compile(jit, ip);
+}
+
+/*
+ * Run compiled code for as long as control stays in it, returning the index
+ * of the instruction that the interpreter is to continue from.
+ */
+static inline int32_t jit_run(Jit *jit, int32_t ip, MemoryState *mm)
+{
+    while (jit->entries[ip] != NULL)
+    {
+        int32_t next = jit->entries[ip](mm, jit);
+
+        if (next < 0)
+            return -next - 1;
+        ip = next;
+    }
+
+    return ip;
+}
+
+#endif
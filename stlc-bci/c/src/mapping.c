@@ -0,0 +1,65 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "memory.h"
+
+#include "mapping.h"
+
+static char *errorFor(char *format, char *fileName)
+{
+    int length = snprintf(NULL, 0, format, fileName);
+    char *error = ALLOCATE(char, length + 1);
+
+    snprintf(error, length + 1, format, fileName);
+
+    return error;
+}
+
+char *mapping_open(char *fileName, Mapping *mapping)
+{
+    struct stat status;
+
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0)
+        return errorFor(errno == ENOENT ? "File not found: %s" : "Unable to open file: %s", fileName);
+
+    if (fstat(fd, &status) != 0 || !S_ISREG(status.st_mode))
+    {
+        close(fd);
+        return errorFor("Unable to read file: %s", fileName);
+    }
+    if (status.st_size > INT32_MAX)
+    {
+        close(fd);
+        return errorFor("File too large: %s", fileName);
+    }
+
+    mapping->size = (int32_t)status.st_size;
+    mapping->block = NULL;
+    if (mapping->size > 0)
+    {
+        void *block = mmap(NULL, mapping->size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (block == MAP_FAILED)
+        {
+            close(fd);
+            return errorFor("Unable to map file: %s", fileName);
+        }
+        mapping->block = block;
+    }
+    close(fd);
+
+    return NULL;
+}
+
+void mapping_close(Mapping *mapping)
+{
+    if (mapping->block != NULL)
+        munmap(mapping->block, mapping->size);
+    mapping->block = NULL;
+    mapping->size = 0;
+}
@@ -0,0 +1,26 @@
+#ifndef MAPPING_H
+#define MAPPING_H
+
+#include <stdint.h>
+
+/*
+ * A file of bytecode mapped read-only into memory rather than read into a
+ * copy.  Decoding only reads the block, writing the instructions into the
+ * code's own arrays, so the block is run in place.  Every process and VM that
+ * maps the same file shares its pages, and mapping a file takes the same time
+ * whatever its size: pages are only read as decoding reaches them.  An empty
+ * file maps to a NULL block.
+ *
+ * mapping_open returns NULL, or the message explaining why the file could not
+ * be mapped, which the caller is to FREE.
+ */
+typedef struct
+{
+    unsigned char *block;
+    int32_t size;
+} Mapping;
+
+extern char *mapping_open(char *fileName, Mapping *mapping);
+extern void mapping_close(Mapping *mapping);
+
+#endif
@@ -3,7 +3,11 @@
 
 #include "memory.h"
 
-static int32_t memory_allocated_count = 0;
+/*
+ * Allocations are counted per thread so that threads running programs side by
+ * side neither share a counter nor confuse each other's leak checks.
+ */
+static _Thread_local int32_t memory_allocated_count = 0;
 
 char *memory_alloc(int32_t size, char *file, int32_t line)
 {
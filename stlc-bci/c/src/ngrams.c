@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "memory.h"
+#include "op.h"
+
+#include "ngrams.h"
+
+#define NGRAMS_LINE_LENGTH 1024
+
+static int32_t tableSize(int n)
+{
+    int32_t size = 1;
+
+    for (int i = 0; i < n; i++)
+        size *= NGRAMS_OPCODES;
+
+    return size;
+}
+
+void ngrams_initialise(NGrams *ngrams)
+{
+    for (int n = 0; n <= NGRAMS_MAXIMUM; n++)
+    {
+        ngrams->counts[n] = NULL;
+        if (n >= NGRAMS_MINIMUM)
+        {
+            int32_t size = tableSize(n);
+
+            ngrams->counts[n] = ALLOCATE(uint64_t, size);
+            for (int32_t i = 0; i < size; i++)
+                ngrams->counts[n][i] = 0;
+        }
+    }
+
+    ngrams->window = 0;
+    ngrams->length = 0;
+}
+
+void ngrams_destroy(NGrams *ngrams)
+{
+    for (int n = NGRAMS_MINIMUM; n <= NGRAMS_MAXIMUM; n++)
+    {
+        FREE(ngrams->counts[n]);
+        ngrams->counts[n] = NULL;
+    }
+}
+
+/*
+ * Each line of the file is a count followed by the names of the instructions
+ * in the sequence.  A missing file is treated as holding no counts.
+ */
+void ngrams_load(NGrams *ngrams, char *fileName)
+{
+    FILE *fp = fopen(fileName, "r");
+    if (fp == NULL)
+        return;
+
+    char line[NGRAMS_LINE_LENGTH];
+    int lineNumber = 0;
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        lineNumber++;
+
+        char *token = strtok(line, " \t\r\n");
+        if (token == NULL)
+            continue;
+
+        char *end;
+        unsigned long long count = strtoull(token, &end, 10);
+        int n = 0;
+        int32_t index = 0;
+
+        while (*end == '\0' && (token = strtok(NULL, " \t\r\n")) != NULL)
+        {
+            const Instruction *instruction = findOnName(token);
+
+            if (instruction == NULL || n == NGRAMS_MAXIMUM)
+                break;
+
+            index = index * NGRAMS_OPCODES + instruction->opcode;
+            n++;
+        }
+
+        if (*end != '\0' || token != NULL || n < NGRAMS_MINIMUM)
+        {
+            printf("Invalid n-gram file: %s:%d\n", fileName, lineNumber);
+            exit(1);
+        }
+
+        ngrams->counts[n][index] += count;
+    }
+
+    fclose(fp);
+}
+
+typedef struct
+{
+    int n;
+    int32_t index;
+    uint64_t count;
+} Entry;
+
+static int compareEntries(const void *a, const void *b)
+{
+    const Entry *x = a;
+    const Entry *y = b;
+
+    if (x->n != y->n)
+        return x->n - y->n;
+    if (x->count != y->count)
+        return x->count < y->count ? 1 : -1;
+    return x->index - y->index;
+}
+
+/*
+ * Write the counts out, shortest sequences first and most frequent first
+ * within each length.
+ */
+void ngrams_save(NGrams *ngrams, char *fileName)
+{
+    int32_t entryCount = 0;
+    for (int n = NGRAMS_MINIMUM; n <= NGRAMS_MAXIMUM; n++)
+    {
+        for (int32_t i = 0; i < tableSize(n); i++)
+            entryCount += ngrams->counts[n][i] != 0;
+    }
+
+    Entry *entries = ALLOCATE(Entry, entryCount > 0 ? entryCount : 1);
+    int32_t e = 0;
+    for (int n = NGRAMS_MINIMUM; n <= NGRAMS_MAXIMUM; n++)
+    {
+        for (int32_t i = 0; i < tableSize(n); i++)
+        {
+            if (ngrams->counts[n][i] != 0)
+            {
+                entries[e].n = n;
+                entries[e].index = i;
+                entries[e].count = ngrams->counts[n][i];
+                e++;
+            }
+        }
+    }
+
+    qsort(entries, entryCount, sizeof(Entry), compareEntries);
+
+    FILE *fp = fopen(fileName, "w");
+    if (fp == NULL)
+    {
+        printf("Unable to write n-gram file: %s\n", fileName);
+        exit(1);
+    }
+
+    for (int32_t i = 0; i < entryCount; i++)
+    {
+        int32_t opcodes[NGRAMS_MAXIMUM];
+        int32_t index = entries[i].index;
+
+        for (int j = entries[i].n - 1; j >= 0; j--)
+        {
+            opcodes[j] = index % NGRAMS_OPCODES;
+            index /= NGRAMS_OPCODES;
+        }
+
+        fprintf(fp, "%llu", (unsigned long long)entries[i].count);
+        for (int j = 0; j < entries[i].n; j++)
+            fprintf(fp, " %s", find(opcodes[j])->name);
+        fprintf(fp, "\n");
+    }
+
+    fclose(fp);
+    FREE(entries);
+}
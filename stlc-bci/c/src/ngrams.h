@@ -0,0 +1,49 @@
+#ifndef NGRAMS_H
+#define NGRAMS_H
+
+#include <stdint.h>
+
+#include "code.h"
+
+/*
+ * Counts of the sequences of two, three and four instructions executed by a
+ * program, used to pick the sequences worth fusing into superinstructions.
+ * Sequences are counted as executed, following jumps, calls and returns, and
+ * the counts are accumulated in a file across runs.
+ */
+#define NGRAMS_MINIMUM 2
+#define NGRAMS_MAXIMUM 4
+#define NGRAMS_OPCODES CODE_INVALID
+
+typedef struct
+{
+    uint64_t *counts[NGRAMS_MAXIMUM + 1];
+    int32_t window;
+    int64_t length;
+} NGrams;
+
+extern void ngrams_initialise(NGrams *ngrams);
+extern void ngrams_destroy(NGrams *ngrams);
+
+extern void ngrams_load(NGrams *ngrams, char *fileName);
+extern void ngrams_save(NGrams *ngrams, char *fileName);
+
+static inline void ngrams_record(NGrams *ngrams, int32_t opcode)
+{
+    int32_t size = NGRAMS_OPCODES;
+
+    if (opcode >= NGRAMS_OPCODES)
+        return;
+
+    ngrams->window = (ngrams->window * NGRAMS_OPCODES + opcode) % (NGRAMS_OPCODES * NGRAMS_OPCODES * NGRAMS_OPCODES * NGRAMS_OPCODES);
+    ngrams->length++;
+
+    for (int n = 2; n <= NGRAMS_MAXIMUM; n++)
+    {
+        size *= NGRAMS_OPCODES;
+        if (ngrams->length >= n)
+            ngrams->counts[n][ngrams->window % size]++;
+    }
+}
+
+#endif
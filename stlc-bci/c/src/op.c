@@ -1,87 +1,56 @@
-#include <stdlib.h>
 #include <string.h>
 
-#include "memory.h"
-
 #include "op.h"
 
-Instruction **instructions;
-
-static void initInstruction(InstructionOpCode opcode, char *name, int arity, OpParameter *parameters)
-{
-    Instruction *i = ALLOCATE(Instruction, 1);
-
-    i->opcode = opcode;
-    i->name = name;
-    i->arity = arity;
-    i->parameters = parameters;
-
-    instructions[opcode] = i;
-}
-
-void op_initialise(void)
-{
-    instructions = ALLOCATE(Instruction *, 18);
-
-#define init(name, arity, parameters) initInstruction(name, #name, arity, parameters)
-    init(PUSH_TRUE, 0, NULL);
-    init(PUSH_FALSE, 0, NULL);
-    init(PUSH_INT, 1, (OpParameter[]){OPInt});
-    init(PUSH_VAR, 2, ((OpParameter[]){OPInt, OPInt}));
-    init(PUSH_CLOSURE, 1, (OpParameter[]){OPLabel});
-    init(PUSH_TUPLE, 1, (OpParameter[]){OPInt});
-    init(ADD, 0, NULL);
-    init(SUB, 0, NULL);
-    init(MUL, 0, NULL);
-    init(DIV, 0, NULL);
-    init(EQ, 0, NULL);
-    init(JMP, 1, (OpParameter[]){OPLabel});
-    init(JMP_TRUE, 1, (OpParameter[]){OPLabel});
-    init(SWAP_CALL, 0, NULL);
-    init(ENTER, 1, (OpParameter[]){OPInt});
-    init(RET, 0, NULL);
-    init(STORE_VAR, 1, (OpParameter[]){OPInt});
-    instructions[17] = NULL;
-#undef init
-}
-
-void op_finalise(void)
-{
-    Instruction **i = instructions;
-    while (*i != NULL)
-    {
-        FREE(*i);
-        i++;
-    }
-
-    FREE(instructions);
-    instructions = NULL;
-}
-
-Instruction *find(InstructionOpCode opcode)
+static const OpParameter intParameters[] = {OPInt};
+static const OpParameter intIntParameters[] = {OPInt, OPInt};
+static const OpParameter labelParameters[] = {OPLabel};
+static const OpParameter labelIntParameters[] = {OPLabel, OPInt};
+
+/*
+ * The instruction set is immutable and shared by every thread, indexed by
+ * opcode.
+ */
+#define INSTRUCTION(name, arity, parameters) [name] = {#name, name, arity, parameters}
+
+static const Instruction instructions[] = {
+    INSTRUCTION(PUSH_TRUE, 0, NULL),
+    INSTRUCTION(PUSH_FALSE, 0, NULL),
+    INSTRUCTION(PUSH_INT, 1, intParameters),
+    INSTRUCTION(PUSH_VAR, 2, intIntParameters),
+    INSTRUCTION(PUSH_CLOSURE, 1, labelParameters),
+    INSTRUCTION(PUSH_TUPLE, 1, intParameters),
+    INSTRUCTION(ADD, 0, NULL),
+    INSTRUCTION(SUB, 0, NULL),
+    INSTRUCTION(MUL, 0, NULL),
+    INSTRUCTION(DIV, 0, NULL),
+    INSTRUCTION(EQ, 0, NULL),
+    INSTRUCTION(JMP, 1, labelParameters),
+    INSTRUCTION(JMP_TRUE, 1, labelParameters),
+    INSTRUCTION(SWAP_CALL, 0, NULL),
+    INSTRUCTION(ENTER, 1, intParameters),
+    INSTRUCTION(RET, 0, NULL),
+    INSTRUCTION(STORE_VAR, 1, intParameters),
+    INSTRUCTION(TAIL_CALL, 0, NULL),
+    INSTRUCTION(MAKE_CLOSURE, 2, labelIntParameters),
+    INSTRUCTION(PUSH_FREE, 1, intParameters),
+    INSTRUCTION(STORE_FREE, 1, intParameters)};
+
+#undef INSTRUCTION
+
+#define INSTRUCTION_COUNT ((int)(sizeof(instructions) / sizeof(instructions[0])))
+
+const Instruction *find(InstructionOpCode opcode)
 {
-    Instruction **i = instructions;
-    while (*i != NULL)
-    {
-        if ((*i)->opcode == opcode)
-        {
-            return *i;
-        }
-        i++;
-    }
-    return NULL;
+    return (int)opcode >= 0 && (int)opcode < INSTRUCTION_COUNT ? &instructions[opcode] : NULL;
 }
 
-Instruction *findOnName(char *name)
+const Instruction *findOnName(char *name)
 {
-    Instruction **i = instructions;
-    while (*i != NULL)
+    for (int i = 0; i < INSTRUCTION_COUNT; i++)
     {
-        if (strcmp((*i)->name, name) == 0)
-        {
-            return *i;
-        }
-        i++;
+        if (strcmp(instructions[i].name, name) == 0)
+            return &instructions[i];
     }
     return NULL;
 }
@@ -19,7 +19,11 @@ typedef enum
     SWAP_CALL,
     ENTER,
     RET,
-    STORE_VAR
+    STORE_VAR,
+    TAIL_CALL,
+    MAKE_CLOSURE,
+    PUSH_FREE,
+    STORE_FREE
 } InstructionOpCode;
 
 typedef enum {
@@ -28,16 +32,13 @@ typedef enum {
 } OpParameter;
 
 typedef struct {
-    char *name;
+    const char *name;
     InstructionOpCode opcode;
     int arity;
-    OpParameter *parameters;
+    const OpParameter *parameters;
 } Instruction;
 
-extern void op_initialise(void);
-extern void op_finalise(void);
-
-extern Instruction* find(InstructionOpCode opcode);
-extern Instruction* findOnName(char *name);
+extern const Instruction* find(InstructionOpCode opcode);
+extern const Instruction* findOnName(char *name);
 
 #endif
@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "memory.h"
+#include "op.h"
+
+#include "profile.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <x86intrin.h>
+
+#define TICKS_UNIT "cycles"
+
+static inline uint64_t ticks(void)
+{
+    return __rdtsc();
+}
+#else
+#define TICKS_UNIT "ns"
+
+static inline uint64_t ticks(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+#define INITIAL_CAPACITY 16
+
+/*
+ * Context 0 is the root of every calling context and stands for no function.
+ */
+void profile_initialise(Profile *profile, Code *code)
+{
+    profile->code = code;
+    for (int32_t i = 0; i < CODE_OPCODES; i++)
+        profile->counts[i] = 0;
+    profile->instructions = 0;
+
+    profile->functionAt = ALLOCATE(int32_t, code->size + 1);
+    for (int32_t i = 0; i <= code->size; i++)
+        profile->functionAt[i] = -1;
+    profile->functions = ALLOCATE(ProfileFunction, INITIAL_CAPACITY);
+    profile->functionCount = 0;
+    profile->functionCapacity = INITIAL_CAPACITY;
+
+    profile->contexts = ALLOCATE(ProfileContext, INITIAL_CAPACITY);
+    profile->contexts[0].function = -1;
+    profile->contexts[0].parent = -1;
+    profile->contexts[0].child = -1;
+    profile->contexts[0].sibling = -1;
+    profile->contexts[0].instructions = 0;
+    profile->contexts[0].ticks = 0;
+    profile->contextCount = 1;
+    profile->contextCapacity = INITIAL_CAPACITY;
+
+    profile->frames = ALLOCATE(ProfileFrame, INITIAL_CAPACITY);
+    profile->depth = 0;
+    profile->frameCapacity = INITIAL_CAPACITY;
+
+    profile->startTicks = ticks();
+    profile->chargedInstructions = 0;
+    profile->chargedTicks = profile->startTicks;
+
+    profile_call(profile, 0);
+}
+
+void profile_destroy(Profile *profile)
+{
+    FREE(profile->functionAt);
+    FREE(profile->functions);
+    FREE(profile->contexts);
+    FREE(profile->frames);
+}
+
+static int32_t functionFor(Profile *profile, int32_t entry)
+{
+    int32_t function = profile->functionAt[entry];
+
+    if (function >= 0)
+        return function;
+
+    if (profile->functionCount == profile->functionCapacity)
+    {
+        profile->functionCapacity *= 2;
+        profile->functions = REALLOCATE(profile->functions, ProfileFunction, profile->functionCapacity);
+    }
+
+    function = profile->functionCount++;
+    profile->functions[function] = (ProfileFunction){entry, 0, 0, 0, 0, 0, 0};
+    profile->functionAt[entry] = function;
+
+    return function;
+}
+
+/*
+ * A function already in the calling context is reentered rather than given a
+ * context of its own, so that recursion, direct or not, adds no depth.
+ */
+static int32_t contextFor(Profile *profile, int32_t parent, int32_t function)
+{
+    for (int32_t c = parent; c >= 0; c = profile->contexts[c].parent)
+    {
+        if (profile->contexts[c].function == function)
+            return c;
+    }
+
+    for (int32_t c = profile->contexts[parent].child; c >= 0; c = profile->contexts[c].sibling)
+    {
+        if (profile->contexts[c].function == function)
+            return c;
+    }
+
+    if (profile->contextCount == profile->contextCapacity)
+    {
+        profile->contextCapacity *= 2;
+        profile->contexts = REALLOCATE(profile->contexts, ProfileContext, profile->contextCapacity);
+    }
+
+    int32_t context = profile->contextCount++;
+    profile->contexts[context] = (ProfileContext){function, parent, -1, profile->contexts[parent].child, 0, 0};
+    profile->contexts[parent].child = context;
+
+    return context;
+}
+
+/*
+ * Charges the instructions and ticks since the previous call or return to the
+ * function running in between, returning the time now.
+ */
+static uint64_t charge(Profile *profile)
+{
+    uint64_t now = ticks();
+
+    if (profile->depth > 0)
+    {
+        ProfileFrame *frame = &profile->frames[profile->depth - 1];
+        uint64_t instructions = profile->instructions - profile->chargedInstructions;
+        uint64_t elapsed = now - profile->chargedTicks;
+
+        profile->functions[frame->function].instructions += instructions;
+        profile->functions[frame->function].ticks += elapsed;
+        profile->contexts[frame->context].instructions += instructions;
+        profile->contexts[frame->context].ticks += elapsed;
+    }
+    profile->chargedInstructions = profile->instructions;
+    profile->chargedTicks = now;
+
+    return now;
+}
+
+static void enter(Profile *profile, int32_t entry, uint64_t now)
+{
+    int32_t function = functionFor(profile, entry);
+    int32_t parent = profile->depth > 0 ? profile->frames[profile->depth - 1].context : 0;
+
+    if (profile->depth == profile->frameCapacity)
+    {
+        profile->frameCapacity *= 2;
+        profile->frames = REALLOCATE(profile->frames, ProfileFrame, profile->frameCapacity);
+    }
+
+    profile->functions[function].calls++;
+    profile->functions[function].active++;
+    profile->frames[profile->depth++] = (ProfileFrame){function, contextFor(profile, parent, function), profile->instructions, now};
+}
+
+static void leave(Profile *profile, uint64_t now)
+{
+    if (profile->depth == 0)
+        return;
+
+    ProfileFrame *frame = &profile->frames[--profile->depth];
+    ProfileFunction *function = &profile->functions[frame->function];
+
+    if (--function->active == 0)
+    {
+        function->inclusiveInstructions += profile->instructions - frame->instructions;
+        function->inclusiveTicks += now - frame->ticks;
+    }
+}
+
+void profile_call(Profile *profile, int32_t entry)
+{
+    enter(profile, entry, charge(profile));
+}
+
+void profile_tailCall(Profile *profile, int32_t entry)
+{
+    uint64_t now = charge(profile);
+
+    leave(profile, now);
+    enter(profile, entry, now);
+}
+
+void profile_return(Profile *profile)
+{
+    leave(profile, charge(profile));
+}
+
+#define NAME_LENGTH 32
+
+/*
+ * A function is named by the symbol at its entry, should the code have one.
+ */
+static char *nameOf(Profile *profile, int32_t entry, char *name)
+{
+    char *symbol = code_symbolAt(profile->code, profile->code->offsets[entry]);
+
+    if (symbol != NULL)
+        return symbol;
+    if (entry == 0)
+        snprintf(name, NAME_LENGTH, "top");
+    else
+        snprintf(name, NAME_LENGTH, "@%d", profile->code->offsets[entry]);
+
+    return name;
+}
+
+static double percentage(uint64_t part, uint64_t whole)
+{
+    return whole == 0 ? 0.0 : 100.0 * part / whole;
+}
+
+static int compareFunctions(const void *a, const void *b)
+{
+    const ProfileFunction *x = a;
+    const ProfileFunction *y = b;
+
+    if (x->ticks != y->ticks)
+        return x->ticks < y->ticks ? 1 : -1;
+    return x->entry - y->entry;
+}
+
+typedef struct
+{
+    int32_t opcode;
+    uint64_t count;
+} Entry;
+
+static int compareEntries(const void *a, const void *b)
+{
+    const Entry *x = a;
+    const Entry *y = b;
+
+    if (x->count != y->count)
+        return x->count < y->count ? 1 : -1;
+    return x->opcode - y->opcode;
+}
+
+/*
+ * Functions are listed from the most exclusive time to the least, and
+ * instructions from the most executed to the least.
+ */
+void profile_report(Profile *profile, FILE *fp)
+{
+    uint64_t total = profile->chargedTicks - profile->startTicks;
+
+    ProfileFunction *functions = ALLOCATE(ProfileFunction, profile->functionCount);
+    for (int32_t i = 0; i < profile->functionCount; i++)
+        functions[i] = profile->functions[i];
+    qsort(functions, profile->functionCount, sizeof(ProfileFunction), compareFunctions);
+
+    fprintf(fp, "profile: %llu instructions, %llu %s\n", (unsigned long long)profile->instructions, (unsigned long long)total, TICKS_UNIT);
+    fprintf(fp, "%-12s %10s %14s %6s %14s %14s %6s %14s\n", "function", "calls", "instructions", "%", "inclusive", TICKS_UNIT, "%", "inclusive");
+    for (int32_t i = 0; i < profile->functionCount; i++)
+    {
+        ProfileFunction *f = &functions[i];
+        char name[NAME_LENGTH];
+
+        fprintf(fp, "%-12s %10llu %14llu %6.2f %14llu %14llu %6.2f %14llu\n",
+                nameOf(profile, f->entry, name),
+                (unsigned long long)f->calls,
+                (unsigned long long)f->instructions, percentage(f->instructions, profile->instructions),
+                (unsigned long long)f->inclusiveInstructions,
+                (unsigned long long)f->ticks, percentage(f->ticks, total),
+                (unsigned long long)f->inclusiveTicks);
+    }
+    FREE(functions);
+
+    Entry entries[CODE_INVALID];
+    int32_t entryCount = 0;
+    for (int32_t i = 0; i < CODE_INVALID; i++)
+    {
+        if (profile->counts[i] > 0)
+            entries[entryCount++] = (Entry){i, profile->counts[i]};
+    }
+    qsort(entries, entryCount, sizeof(Entry), compareEntries);
+
+    fprintf(fp, "%-12s %14s %6s\n", "instruction", "count", "%");
+    for (int32_t i = 0; i < entryCount; i++)
+        fprintf(fp, "%-12s %14llu %6.2f\n", find(entries[i].opcode)->name, (unsigned long long)entries[i].count, percentage(entries[i].count, profile->instructions));
+}
+
+/*
+ * Each calling context in which time was spent is written as the names of
+ * the functions from the top level down.
+ */
+void profile_writeStacks(Profile *profile, char *fileName)
+{
+    FILE *fp = fopen(fileName, "w");
+    if (fp == NULL)
+    {
+        printf("Unable to write profile stacks: %s\n", fileName);
+        exit(1);
+    }
+
+    int32_t *path = ALLOCATE(int32_t, profile->functionCount + 1);
+    char name[NAME_LENGTH];
+    for (int32_t c = 1; c < profile->contextCount; c++)
+    {
+        if (profile->contexts[c].ticks == 0)
+            continue;
+
+        int32_t length = 0;
+        for (int32_t p = c; p > 0; p = profile->contexts[p].parent)
+            path[length++] = profile->contexts[p].function;
+
+        for (int32_t i = length - 1; i >= 0; i--)
+        {
+            fprintf(fp, "%s%c", nameOf(profile, profile->functions[path[i]].entry, name), i > 0 ? ';' : ' ');
+        }
+        fprintf(fp, "%llu\n", (unsigned long long)profile->contexts[c].ticks);
+    }
+    FREE(path);
+
+    fclose(fp);
+}
@@ -0,0 +1,95 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "code.h"
+
+/*
+ * A profile of a program's run: how often each instruction is executed and,
+ * for each function, how often it is called and the instructions and clock
+ * ticks spent in it.  Functions are told apart by their entry, the top level
+ * being the function entered at 0, and named by the symbol at their entry or
+ * otherwise by its byte offset.  Exclusive counts are those spent in the
+ * function itself and inclusive counts add those of the functions it calls,
+ * counted once for a function that is on the stack more than once.  A call
+ * made in tail position replaces its caller on the stack.
+ *
+ * Time is read only on calls and returns, as the time stamp counter's cycles
+ * on x86-64 and as nanoseconds elsewhere.  Counts are also kept for every
+ * calling context, with recursive calls folded into the call of the same
+ * function further down the stack, and are written as collapsed stacks, one
+ * line of names separated by semicolons and the ticks spent there, as flame
+ * graph tools read them.
+ */
+typedef struct
+{
+    int32_t entry;
+    uint64_t calls;
+    uint64_t instructions;
+    uint64_t ticks;
+    uint64_t inclusiveInstructions;
+    uint64_t inclusiveTicks;
+    int32_t active;
+} ProfileFunction;
+
+typedef struct
+{
+    int32_t function;
+    int32_t parent;
+    int32_t child;
+    int32_t sibling;
+    uint64_t instructions;
+    uint64_t ticks;
+} ProfileContext;
+
+typedef struct
+{
+    int32_t function;
+    int32_t context;
+    uint64_t instructions;
+    uint64_t ticks;
+} ProfileFrame;
+
+typedef struct
+{
+    Code *code;
+    uint64_t counts[CODE_OPCODES];
+    uint64_t instructions;
+
+    uint64_t startTicks;
+    uint64_t chargedInstructions;
+    uint64_t chargedTicks;
+
+    int32_t *functionAt;
+    ProfileFunction *functions;
+    int32_t functionCount;
+    int32_t functionCapacity;
+
+    ProfileContext *contexts;
+    int32_t contextCount;
+    int32_t contextCapacity;
+
+    ProfileFrame *frames;
+    int32_t depth;
+    int32_t frameCapacity;
+} Profile;
+
+extern void profile_initialise(Profile *profile, Code *code);
+extern void profile_destroy(Profile *profile);
+
+extern void profile_call(Profile *profile, int32_t entry);
+extern void profile_tailCall(Profile *profile, int32_t entry);
+extern void profile_return(Profile *profile);
+
+extern void profile_report(Profile *profile, FILE *fp);
+extern void profile_writeStacks(Profile *profile, char *fileName);
+
+static inline void profile_record(Profile *profile, int32_t opcode)
+{
+    profile->counts[opcode]++;
+    profile->instructions++;
+}
+
+#endif
@@ -0,0 +1,594 @@
+#include <stdio.h>
+
+#include "memory.h"
+
+#include "regcode.h"
+
+#define INITIAL_CAPACITY 64
+
+/*
+ * Each function is translated with a symbolic stack that holds, for every slot
+ * of the stack, the operand that the slot would hold.  Pushing a constant or
+ * a local emits nothing, leaving the instruction that pops it to read it
+ * directly.  A slot is only moved into its temporary when the operand might
+ * change before it is popped, on a store into the local, or must be in a known
+ * place, at a jump or a label.
+ */
+typedef struct
+{
+    Code code;
+    RegCode *regCode;
+    int32_t capacity;
+    int32_t constantCapacity;
+
+    int32_t *entries;
+    int32_t *depths;
+    char *labelled;
+    int32_t *labels;
+    int32_t *worklist;
+
+    int32_t frameSize;
+    int32_t *operands;
+    int32_t depth;
+    int32_t offset;
+    int pinned;
+} Translator;
+
+static RegOp *emit(Translator *t, int32_t opcode)
+{
+    RegCode *regCode = t->regCode;
+
+    if (regCode->size == t->capacity)
+    {
+        t->capacity *= 2;
+        regCode->ops = REALLOCATE(regCode->ops, RegOp, t->capacity);
+        regCode->offsets = REALLOCATE(regCode->offsets, int32_t, t->capacity);
+    }
+
+    RegOp *op = &regCode->ops[regCode->size];
+    op->opcode = opcode;
+    for (int i = 0; i < 4; i++)
+        op->operand[i] = 0;
+
+    regCode->offsets[regCode->size] = t->offset;
+    regCode->size++;
+    t->pinned = 0;
+
+    return op;
+}
+
+static int32_t constant(Translator *t, Value *value)
+{
+    RegCode *regCode = t->regCode;
+
+    for (int32_t i = 0; i < regCode->constantCount; i++)
+    {
+        if (regCode->constants[i] == value)
+            return regcode_operand(REG_CONSTANT, i);
+    }
+
+    if (regCode->constantCount == t->constantCapacity)
+    {
+        t->constantCapacity *= 2;
+        regCode->constants = REALLOCATE(regCode->constants, Value *, t->constantCapacity);
+    }
+    regCode->constants[regCode->constantCount] = value;
+
+    return regcode_operand(REG_CONSTANT, regCode->constantCount++);
+}
+
+static int32_t temporary(int32_t index)
+{
+    return regcode_operand(REG_TEMPORARY, index);
+}
+
+static void materialise(Translator *t, int32_t slot)
+{
+    if (t->operands[slot] != temporary(slot))
+    {
+        int32_t operand = t->operands[slot];
+        RegOp *op = emit(t, REG_MOVE);
+
+        op->operand[0] = slot;
+        op->operand[1] = operand;
+        t->operands[slot] = temporary(slot);
+    }
+}
+
+static void materialiseAll(Translator *t, int32_t depth)
+{
+    for (int32_t slot = 0; slot < depth; slot++)
+        materialise(t, slot);
+}
+
+static void materialiseLocal(Translator *t, int32_t index, int32_t depth)
+{
+    for (int32_t slot = 0; slot < depth; slot++)
+    {
+        if (t->operands[slot] == regcode_operand(REG_LOCAL, index))
+            materialise(t, slot);
+    }
+}
+
+static void canonical(Translator *t, int32_t depth)
+{
+    for (int32_t slot = 0; slot < depth; slot++)
+        t->operands[slot] = temporary(slot);
+    t->depth = depth;
+}
+
+static int32_t effect(Op *op)
+{
+    switch (op->opcode)
+    {
+    case PUSH_TRUE:
+    case PUSH_FALSE:
+    case PUSH_INT:
+    case PUSH_VAR:
+    case PUSH_CLOSURE:
+    case PUSH_FREE:
+        return 1;
+    case MAKE_CLOSURE:
+        return 1 - op->operand[1];
+    case STORE_FREE:
+        return -2;
+    case ADD:
+    case SUB:
+    case MUL:
+    case DIV:
+    case EQ:
+    case JMP_TRUE:
+    case SWAP_CALL:
+    case STORE_VAR:
+        return -1;
+    default:
+        return 0;
+    }
+}
+
+static void reach(Translator *t, int32_t ip, int32_t depth, int32_t *size)
+{
+    if (t->depths[ip] == -1)
+    {
+        t->depths[ip] = depth;
+        t->worklist[(*size)++] = ip;
+    }
+}
+
+/*
+ * Find the depth of the stack at each instruction of the function with the
+ * given entry, the jump targets among them and the number of temporaries the
+ * function needs.  Verified code has the same depth on every path to an
+ * instruction.
+ */
+static int findBody(Translator *t, int32_t entry, int32_t depth, int32_t *frameSize)
+{
+    Code *code = &t->code;
+    int32_t size = 0;
+
+    for (int32_t i = 0; i <= code->size; i++)
+    {
+        t->depths[i] = -1;
+        t->labelled[i] = 0;
+    }
+
+    *frameSize = depth;
+    reach(t, entry, depth, &size);
+    while (size > 0)
+    {
+        int32_t ip = t->worklist[--size];
+        Op *op = &code->ops[ip];
+        int32_t after = t->depths[ip] + effect(op);
+
+        if (after > *frameSize)
+            *frameSize = after;
+
+        switch (op->opcode)
+        {
+        case JMP:
+            t->labelled[op->operand[0]] = 1;
+            reach(t, op->operand[0], after, &size);
+            break;
+        case JMP_TRUE:
+            t->labelled[op->operand[0]] = 1;
+            reach(t, op->operand[0], after, &size);
+            reach(t, ip + 1, after, &size);
+            break;
+        case RET:
+        case TAIL_CALL:
+            break;
+        case PUSH_TUPLE:
+        case CODE_INVALID:
+            return 0;
+        default:
+            reach(t, ip + 1, after, &size);
+            break;
+        }
+    }
+
+    return 1;
+}
+
+static int fusable(Translator *t, int32_t ip, int32_t opcode)
+{
+    return t->code.ops[ip].opcode == opcode && t->depths[ip] != -1 && !t->labelled[ip];
+}
+
+/*
+ * Where an instruction that pops consumed values off the stack is to put its
+ * result.  A STORE_VAR that follows it is folded in so that the result is
+ * written straight into the local.
+ */
+static int32_t result(Translator *t, int32_t ip, int32_t consumed, int32_t *last)
+{
+    int32_t slot = t->depth - consumed;
+
+    if (fusable(t, ip + 1, STORE_VAR))
+    {
+        int32_t index = t->code.ops[ip + 1].operand[0];
+
+        materialiseLocal(t, index, slot);
+        t->depth = slot;
+        *last = ip + 1;
+
+        return regcode_operand(REG_LOCAL, index);
+    }
+
+    t->operands[slot] = temporary(slot);
+    t->depth = slot + 1;
+
+    return temporary(slot);
+}
+
+static void binary(Translator *t, int32_t opcode, int32_t ip, int32_t *last)
+{
+    int32_t a = t->operands[t->depth - 2];
+    int32_t b = t->operands[t->depth - 1];
+    int32_t d = result(t, ip, 2, last);
+    RegOp *op = emit(t, opcode);
+
+    op->operand[0] = d;
+    op->operand[1] = a;
+    op->operand[2] = b;
+}
+
+/*
+ * Translate the instruction at ip, and any that it is fused with, returning
+ * the index of the last instruction translated.  next is set to the
+ * instruction that control falls through to, or -1 should it not.
+ */
+static int32_t translateInstruction(Translator *t, int32_t ip, int32_t *next)
+{
+    Op *op = &t->code.ops[ip];
+    int32_t *operands = t->operands;
+    int32_t last = ip;
+    RegOp *r;
+
+    switch (op->opcode)
+    {
+    case PUSH_TRUE:
+        operands[t->depth++] = constant(t, value_True);
+        break;
+    case PUSH_FALSE:
+        operands[t->depth++] = constant(t, value_False);
+        break;
+    case PUSH_INT:
+        operands[t->depth++] = constant(t, value_fromInt(op->operand[0]));
+        break;
+    case PUSH_VAR:
+        if (op->operand[0] == 0)
+            operands[t->depth++] = regcode_operand(REG_LOCAL, op->operand[1]);
+        else
+        {
+            r = emit(t, REG_LOAD);
+            r->operand[0] = t->depth;
+            r->operand[1] = op->operand[0];
+            r->operand[2] = op->operand[1];
+            operands[t->depth] = temporary(t->depth);
+            t->depth++;
+        }
+        break;
+    case PUSH_CLOSURE:
+    {
+        int32_t d = result(t, ip, 0, &last);
+
+        r = emit(t, REG_CLOSURE);
+        r->operand[0] = d;
+        r->operand[1] = op->operand[0];
+        break;
+    }
+    case MAKE_CLOSURE:
+    {
+        int32_t first = t->depth - op->operand[1];
+
+        for (int32_t slot = first; slot < t->depth; slot++)
+            materialise(t, slot);
+
+        int32_t d = result(t, ip, op->operand[1], &last);
+
+        r = emit(t, REG_FLAT_CLOSURE);
+        r->operand[0] = d;
+        r->operand[1] = op->operand[0];
+        r->operand[2] = first;
+        r->operand[3] = op->operand[1];
+        break;
+    }
+    case PUSH_FREE:
+        r = emit(t, REG_LOAD_FREE);
+        r->operand[0] = t->depth;
+        r->operand[1] = op->operand[0];
+        operands[t->depth] = temporary(t->depth);
+        t->depth++;
+        break;
+    case STORE_FREE:
+        r = emit(t, REG_STORE_FREE);
+        r->operand[0] = operands[t->depth - 2];
+        r->operand[1] = op->operand[0];
+        r->operand[2] = operands[t->depth - 1];
+        t->depth -= 2;
+        break;
+    case ADD:
+        binary(t, REG_ADD, ip, &last);
+        break;
+    case SUB:
+        binary(t, REG_SUB, ip, &last);
+        break;
+    case MUL:
+        binary(t, REG_MUL, ip, &last);
+        break;
+    case DIV:
+        binary(t, REG_DIV, ip, &last);
+        break;
+    case EQ:
+        if (fusable(t, ip + 1, JMP_TRUE))
+        {
+            int32_t a = operands[t->depth - 2];
+            int32_t b = operands[t->depth - 1];
+
+            t->depth -= 2;
+            materialiseAll(t, t->depth);
+            r = emit(t, REG_JMP_EQ);
+            r->operand[0] = a;
+            r->operand[1] = b;
+            r->operand[2] = t->code.ops[ip + 1].operand[0];
+            last = ip + 1;
+        }
+        else
+            binary(t, REG_EQ, ip, &last);
+        break;
+    case JMP:
+        materialiseAll(t, t->depth);
+        r = emit(t, REG_JMP);
+        r->operand[0] = op->operand[0];
+        *next = -1;
+        return last;
+    case JMP_TRUE:
+    {
+        int32_t a = operands[--t->depth];
+
+        materialiseAll(t, t->depth);
+        r = emit(t, REG_JMP_TRUE);
+        r->operand[0] = a;
+        r->operand[1] = op->operand[0];
+        break;
+    }
+    case SWAP_CALL:
+    {
+        int32_t c = operands[t->depth - 2];
+        int32_t a = operands[t->depth - 1];
+        int32_t d = result(t, ip, 2, &last);
+
+        r = emit(t, REG_CALL);
+        r->operand[0] = c;
+        r->operand[1] = a;
+        r->operand[2] = d;
+        r->operand[3] = t->frameSize;
+
+        /*
+         * The call returns to the instruction after it, which stands for the
+         * instruction after the call in printed activations.
+         */
+        t->offset = t->code.offsets[last + 1];
+        t->pinned = 1;
+        break;
+    }
+    case TAIL_CALL:
+        r = emit(t, REG_TAIL_CALL);
+        r->operand[0] = operands[t->depth - 2];
+        r->operand[1] = operands[t->depth - 1];
+        *next = -1;
+        return last;
+    case ENTER:
+        r = emit(t, REG_ENTER);
+        r->operand[0] = op->operand[0];
+        break;
+    case RET:
+        r = emit(t, REG_RET);
+        r->operand[0] = operands[t->depth - 1];
+        *next = -1;
+        return last;
+    case STORE_VAR:
+    {
+        int32_t a = operands[--t->depth];
+
+        materialiseLocal(t, op->operand[0], t->depth);
+        if (a != regcode_operand(REG_LOCAL, op->operand[0]))
+        {
+            r = emit(t, REG_STORE);
+            r->operand[0] = op->operand[0];
+            r->operand[1] = a;
+        }
+        break;
+    }
+    }
+
+    *next = last + 1;
+    return last;
+}
+
+static void resolveJumps(Translator *t, int32_t start)
+{
+    RegCode *regCode = t->regCode;
+
+    for (int32_t i = start; i < regCode->size; i++)
+    {
+        RegOp *op = &regCode->ops[i];
+
+        switch (op->opcode)
+        {
+        case REG_JMP:
+            op->operand[0] = t->labels[op->operand[0]];
+            break;
+        case REG_JMP_TRUE:
+            op->operand[1] = t->labels[op->operand[1]];
+            break;
+        case REG_JMP_EQ:
+            op->operand[2] = t->labels[op->operand[2]];
+            break;
+        }
+    }
+}
+
+/*
+ * A function starts with REG_ENTRY, into which an ENTER at its entry and the
+ * STORE_VAR of its argument that follows are folded.  The rest of its body is
+ * laid out in the order of the block, as bci aot does, jumping to its entry
+ * should the body start before it.
+ */
+static int translateFunction(Translator *t, int32_t entry)
+{
+    Code *code = &t->code;
+    int32_t depth = entry == 0 ? 0 : 1;
+    int32_t frameSize;
+
+    if (!findBody(t, entry, depth, &frameSize))
+        return 0;
+
+    int32_t start = t->regCode->size;
+
+    t->offset = code->offsets[entry];
+    t->pinned = 0;
+    RegOp *r = emit(t, REG_ENTRY);
+    r->operand[0] = frameSize;
+    r->operand[1] = -1;
+    r->operand[2] = -1;
+    t->entries[entry] = start;
+    t->frameSize = frameSize;
+
+    int32_t ip = entry;
+    if (fusable(t, ip, ENTER))
+    {
+        r->operand[1] = code->ops[ip].operand[0];
+        t->depths[ip++] = -1;
+
+        if (depth == 1 && fusable(t, ip, STORE_VAR))
+        {
+            r->operand[2] = code->ops[ip].operand[0];
+            t->depths[ip++] = -1;
+            depth = 0;
+        }
+    }
+
+    int32_t first = 0;
+    while (first < code->size && t->depths[first] == -1)
+        first++;
+
+    int32_t next = ip;
+    canonical(t, depth);
+    if (first != ip)
+    {
+        t->labelled[ip] = 1;
+        r = emit(t, REG_JMP);
+        r->operand[0] = ip;
+        next = -1;
+    }
+
+    for (ip = first; ip <= code->size; ip++)
+    {
+        if (t->depths[ip] == -1)
+            continue;
+
+        if (!t->pinned)
+            t->offset = code->offsets[ip];
+        if (t->labelled[ip])
+        {
+            if (next == ip)
+                materialiseAll(t, t->depth);
+            t->labels[ip] = t->regCode->size;
+            canonical(t, t->depths[ip]);
+        }
+        else if (next != ip)
+            canonical(t, t->depths[ip]);
+
+        ip = translateInstruction(t, ip, &next);
+    }
+
+    resolveJumps(t, start);
+
+    return 1;
+}
+
+int regcode_translate(Code *code, RegCode *regCode)
+{
+    Translator t;
+
+    t.code = code_decode(code->block, code->blockSize);
+    code_rewriteTailCalls(&t.code);
+
+    int32_t size = t.code.size + 1;
+
+    t.regCode = regCode;
+    t.capacity = INITIAL_CAPACITY;
+    t.constantCapacity = INITIAL_CAPACITY;
+    regCode->size = 0;
+    regCode->ops = ALLOCATE(RegOp, t.capacity);
+    regCode->offsets = ALLOCATE(int32_t, t.capacity);
+    regCode->constantCount = 0;
+    regCode->constants = ALLOCATE(Value *, t.constantCapacity);
+
+    t.entries = ALLOCATE(int32_t, size);
+    t.depths = ALLOCATE(int32_t, size);
+    t.labelled = ALLOCATE(char, size);
+    t.labels = ALLOCATE(int32_t, size);
+    t.worklist = ALLOCATE(int32_t, size);
+    t.operands = ALLOCATE(int32_t, size);
+
+    for (int32_t i = 0; i < size; i++)
+        t.entries[i] = -1;
+
+    int translated = translateFunction(&t, 0);
+    for (int32_t i = 0; translated && i < t.code.size; i++)
+    {
+        int32_t opcode = t.code.ops[i].opcode;
+        int32_t target = t.code.ops[i].operand[0];
+
+        if ((opcode == PUSH_CLOSURE || opcode == MAKE_CLOSURE) && t.entries[target] == -1)
+            translated = translateFunction(&t, target);
+    }
+
+    for (int32_t i = 0; translated && i < regCode->size; i++)
+    {
+        if (regCode->ops[i].opcode == REG_CLOSURE || regCode->ops[i].opcode == REG_FLAT_CLOSURE)
+            regCode->ops[i].operand[1] = t.entries[regCode->ops[i].operand[1]];
+    }
+
+    FREE(t.entries);
+    FREE(t.depths);
+    FREE(t.labelled);
+    FREE(t.labels);
+    FREE(t.worklist);
+    FREE(t.operands);
+    code_destroy(&t.code);
+
+    if (!translated)
+        regcode_destroy(regCode);
+
+    return translated;
+}
+
+void regcode_destroy(RegCode *regCode)
+{
+    FREE(regCode->ops);
+    FREE(regCode->offsets);
+    FREE(regCode->constants);
+}
@@ -0,0 +1,113 @@
+#ifndef REGCODE_H
+#define REGCODE_H
+
+#include <stdint.h>
+
+#include "code.h"
+#include "value.h"
+
+/*
+ * A register based form of the bytecode in which each instruction names the
+ * values it reads and the slot it writes rather than passing them through the
+ * stack.  An operand is a temporary of the current function, a slot of the
+ * current activation's state or a constant, packed with its kind in the low
+ * two bits.  A function's temporaries are the stack slots that it would
+ * otherwise have pushed onto, so the first holds its argument and they remain
+ * roots of the collector.
+ *
+ *   REG_ENTRY size enter store     reserve size temporaries, then ENTER enter
+ *                                  and STORE_VAR store the argument unless -1
+ *   REG_MOVE t a                   temporary t = a
+ *   REG_STORE i a                  STORE_VAR i a
+ *   REG_LOAD t index offset        temporary t = PUSH_VAR index offset
+ *   REG_CLOSURE d entry            d = PUSH_CLOSURE entry
+ *   REG_FLAT_CLOSURE d entry t n   d = MAKE_CLOSURE entry n over the
+ *                                  temporaries from t
+ *   REG_LOAD_FREE t index          temporary t = PUSH_FREE index
+ *   REG_STORE_FREE c index a       STORE_FREE index into closure c of a
+ *   REG_ADD d a b                  d = a + b, and likewise SUB, MUL, DIV, EQ
+ *   REG_JMP target
+ *   REG_JMP_TRUE a target
+ *   REG_JMP_EQ a b target          jump should a equal b
+ *   REG_CALL c a d size            d = c a, the callee's temporaries starting
+ *                                  size slots after the caller's
+ *   REG_TAIL_CALL c a
+ *   REG_ENTER size
+ *   REG_RET a
+ */
+typedef enum
+{
+    REG_ENTRY,
+    REG_MOVE,
+    REG_STORE,
+    REG_LOAD,
+    REG_CLOSURE,
+    REG_FLAT_CLOSURE,
+    REG_LOAD_FREE,
+    REG_STORE_FREE,
+    REG_ADD,
+    REG_SUB,
+    REG_MUL,
+    REG_DIV,
+    REG_EQ,
+    REG_JMP,
+    REG_JMP_TRUE,
+    REG_JMP_EQ,
+    REG_CALL,
+    REG_TAIL_CALL,
+    REG_ENTER,
+    REG_RET,
+    REG_OPCODES
+} RegOpCode;
+
+#define REG_TEMPORARY 0
+#define REG_LOCAL 1
+#define REG_CONSTANT 2
+
+static inline int32_t regcode_operand(int32_t kind, int32_t index)
+{
+    return (index << 2) | kind;
+}
+
+static inline int32_t regcode_kind(int32_t operand)
+{
+    return operand & 3;
+}
+
+static inline int32_t regcode_index(int32_t operand)
+{
+    return operand >> 2;
+}
+
+typedef struct
+{
+    int32_t opcode;
+    int32_t operand[4];
+} RegOp;
+
+/*
+ * The top level starts at instruction 0.  offsets holds the byte offset in the
+ * block of the instruction that each was translated from so that closures and
+ * activations print as they do when run on the stack.
+ */
+typedef struct
+{
+    int32_t size;
+    RegOp *ops;
+    int32_t *offsets;
+
+    int32_t constantCount;
+    Value **constants;
+} RegCode;
+
+/*
+ * Translate the code's block, from its own undecorated decoding, into
+ * registers.  Only code that verify has proven to pass every check can be
+ * translated as the translation relies on the depth of the stack at every
+ * instruction being known.  Returns 1 on success and 0 should code contain an
+ * instruction that the register form does not support.
+ */
+extern int regcode_translate(Code *code, RegCode *regCode);
+extern void regcode_destroy(RegCode *regCode);
+
+#endif
@@ -0,0 +1,301 @@
+/*
+ * The body of the register interpreter loop.  This file has no include guard
+ * as regrun.c includes it once for each loop it needs, defining REG_LOOP as
+ * the name of the function and REG_LOOP_COUNTED as 1 when the instructions
+ * dispatched are to be counted into options->dispatched.
+ * THREADED_DISPATCH selects direct threading over the switch.
+ */
+
+#ifdef THREADED_DISPATCH
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#ifdef __clang__
+#pragma clang diagnostic ignored "-Wgnu-label-as-value"
+#endif
+
+#define OPCODE(op) op_##op:
+#define NEXT()                          \
+    do                                  \
+    {                                   \
+        op = &ops[ip++];                \
+        if (REG_LOOP_COUNTED)           \
+            dispatched++;               \
+        goto *dispatch[op->opcode];     \
+    } while (0)
+
+#else
+
+#define OPCODE(op) case op:
+#define NEXT() break
+
+#endif
+
+#define READ(operand) (bases[regcode_kind(operand)][regcode_index(operand)])
+
+/*
+ * The activation, its state and the stack may all move whenever something is
+ * allocated, and the activation changes on every call and return.
+ */
+#define RELOAD()                                           \
+    do                                                     \
+    {                                                      \
+        bases[REG_TEMPORARY] = mm->stack + base;           \
+        bases[REG_LOCAL] = mm->activation->data.a.state;   \
+        if (mm->stackLowWater > base)                      \
+            mm->stackLowWater = base;                      \
+    } while (0)
+
+static void REG_LOOP(RegCode *code, RunOptions *options)
+{
+    MemoryState memoryState = value_newMemoryManager(DEFAULT_STACK_SIZE, options->gcPolicy);
+    MemoryState *mm = &memoryState;
+    RegOp *ops = code->ops;
+    RegOp *op;
+    int32_t ip = 0;
+    Value **bases[3];
+    uint64_t dispatched = 0;
+
+    mm->activation = value_newActivation(NULL, NULL, -1, mm);
+
+    int32_t base = mm->sp;
+
+    bases[REG_CONSTANT] = code->constants;
+    RELOAD();
+
+#ifdef THREADED_DISPATCH
+    static const void *const dispatch[] = {
+        [REG_ENTRY] = &&op_REG_ENTRY,
+        [REG_MOVE] = &&op_REG_MOVE,
+        [REG_STORE] = &&op_REG_STORE,
+        [REG_LOAD] = &&op_REG_LOAD,
+        [REG_CLOSURE] = &&op_REG_CLOSURE,
+        [REG_FLAT_CLOSURE] = &&op_REG_FLAT_CLOSURE,
+        [REG_LOAD_FREE] = &&op_REG_LOAD_FREE,
+        [REG_STORE_FREE] = &&op_REG_STORE_FREE,
+        [REG_ADD] = &&op_REG_ADD,
+        [REG_SUB] = &&op_REG_SUB,
+        [REG_MUL] = &&op_REG_MUL,
+        [REG_DIV] = &&op_REG_DIV,
+        [REG_EQ] = &&op_REG_EQ,
+        [REG_JMP] = &&op_REG_JMP,
+        [REG_JMP_TRUE] = &&op_REG_JMP_TRUE,
+        [REG_JMP_EQ] = &&op_REG_JMP_EQ,
+        [REG_CALL] = &&op_REG_CALL,
+        [REG_TAIL_CALL] = &&op_REG_TAIL_CALL,
+        [REG_ENTER] = &&op_REG_ENTER,
+        [REG_RET] = &&op_REG_RET};
+
+    NEXT();
+#else
+    while (1)
+    {
+        op = &ops[ip++];
+        if (REG_LOOP_COUNTED)
+            dispatched++;
+
+        switch (op->opcode)
+        {
+#endif
+
+    OPCODE(REG_ENTRY)
+    {
+        int32_t top = base + op->operand[0];
+
+        if (top > mm->stackSize)
+            value_reserveStack(top - mm->sp, mm);
+        for (int32_t i = mm->sp; i < top; i++)
+            mm->stack[i] = NULL;
+        mm->sp = top;
+        RELOAD();
+        if (op->operand[1] >= 0)
+        {
+            enterState(op->operand[1], mm);
+            RELOAD();
+        }
+        if (op->operand[2] >= 0)
+        {
+            Value *argument = bases[REG_TEMPORARY][0];
+
+            bases[REG_LOCAL][op->operand[2]] = argument;
+            value_writeBarrier(mm->activation, argument, mm);
+        }
+        NEXT();
+    }
+    OPCODE(REG_MOVE)
+    {
+        Value *v = READ(op->operand[1]);
+
+        bases[REG_TEMPORARY][op->operand[0]] = v;
+        value_shade(v, mm);
+        NEXT();
+    }
+    OPCODE(REG_STORE)
+    {
+        Value *v = READ(op->operand[1]);
+
+        bases[REG_LOCAL][op->operand[0]] = v;
+        value_writeBarrier(mm->activation, v, mm);
+        NEXT();
+    }
+    OPCODE(REG_LOAD)
+    {
+        Value *a = mm->activation;
+
+        for (int32_t i = op->operand[1]; i > 0; i--)
+            a = a->data.a.closure->data.c.previousActivation;
+
+        Value *v = a->data.a.state[op->operand[2]];
+        bases[REG_TEMPORARY][op->operand[0]] = v;
+        value_shade(v, mm);
+        NEXT();
+    }
+    OPCODE(REG_CLOSURE)
+    {
+        Value *v = value_newClosure(mm->activation, op->operand[1], mm);
+
+        popUnchecked(mm);
+        RELOAD();
+        writeOperand(bases, op->operand[0], v, mm);
+        NEXT();
+    }
+    OPCODE(REG_FLAT_CLOSURE)
+    {
+        int32_t count = op->operand[3];
+
+        value_reserveStack(count, mm);
+        for (int32_t i = 0; i < count; i++)
+            push(mm->stack[base + op->operand[2] + i], mm);
+
+        Value *v = value_newFlatClosure(op->operand[1], count, mm);
+
+        popUnchecked(mm);
+        RELOAD();
+        writeOperand(bases, op->operand[0], v, mm);
+        NEXT();
+    }
+    OPCODE(REG_LOAD_FREE)
+    {
+        Value *v = mm->activation->data.a.closure->data.c.free[op->operand[1]];
+
+        bases[REG_TEMPORARY][op->operand[0]] = v;
+        value_shade(v, mm);
+        NEXT();
+    }
+    OPCODE(REG_STORE_FREE)
+    {
+        Value *closure = READ(op->operand[0]);
+        Value *v = READ(op->operand[2]);
+
+        closure->data.c.free[op->operand[1]] = v;
+        value_writeBarrier(closure, v, mm);
+        NEXT();
+    }
+    OPCODE(REG_ADD)
+        READ(op->operand[0]) = value_fromInt(value_asInt(READ(op->operand[1])) + value_asInt(READ(op->operand[2])));
+        NEXT();
+    OPCODE(REG_SUB)
+        READ(op->operand[0]) = value_fromInt(value_asInt(READ(op->operand[1])) - value_asInt(READ(op->operand[2])));
+        NEXT();
+    OPCODE(REG_MUL)
+        READ(op->operand[0]) = value_fromInt(value_asInt(READ(op->operand[1])) * value_asInt(READ(op->operand[2])));
+        NEXT();
+    OPCODE(REG_DIV)
+        if (value_asInt(READ(op->operand[2])) == 0)
+        {
+            value_destroyMemoryManager(mm);
+            error_raise("Run: DIV: division by zero");
+        }
+        READ(op->operand[0]) = value_fromInt(value_divide(value_asInt(READ(op->operand[1])), value_asInt(READ(op->operand[2]))));
+        NEXT();
+    OPCODE(REG_EQ)
+        READ(op->operand[0]) = value_fromBool(value_asInt(READ(op->operand[1])) == value_asInt(READ(op->operand[2])));
+        NEXT();
+    OPCODE(REG_JMP)
+        ip = op->operand[0];
+        NEXT();
+    OPCODE(REG_JMP_TRUE)
+        if (value_asBool(READ(op->operand[0])))
+            ip = op->operand[1];
+        NEXT();
+    OPCODE(REG_JMP_EQ)
+        if (value_asInt(READ(op->operand[0])) == value_asInt(READ(op->operand[1])))
+            ip = op->operand[2];
+        NEXT();
+    OPCODE(REG_CALL)
+    {
+        Value *closure = READ(op->operand[0]);
+        Value *argument = READ(op->operand[1]);
+
+        if (mm->sp == mm->stackSize)
+            value_reserveStack(1, mm);
+        mm->stack[mm->sp++] = argument;
+        value_shade(argument, mm);
+
+        Value *newActivation = newFrame(mm->activation, closure, ip, mm);
+        mm->activation = newActivation;
+        ip = newActivation->data.a.closure->data.c.ip;
+        base += op->operand[3];
+        RELOAD();
+        NEXT();
+    }
+    OPCODE(REG_TAIL_CALL)
+    {
+        Value *closure = READ(op->operand[0]);
+        Value *argument = READ(op->operand[1]);
+
+        mm->stack[base] = argument;
+        value_shade(argument, mm);
+        mm->sp = base + 1;
+
+        Value *newActivation = newTailFrame(closure, mm);
+        mm->activation = newActivation;
+        ip = newActivation->data.a.closure->data.c.ip;
+        RELOAD();
+        NEXT();
+    }
+    OPCODE(REG_ENTER)
+        enterState(op->operand[0], mm);
+        RELOAD();
+        NEXT();
+    OPCODE(REG_RET)
+    {
+        Value *v = READ(op->operand[0]);
+
+        if (mm->activation->data.a.parentActivation == NULL)
+        {
+            run_writeResult(v, code->offsets, options);
+            if (options->gcPolicy.pauseBudget > 0)
+                value_reportGCPauses(mm);
+            value_destroyMemoryManager(mm);
+            if (REG_LOOP_COUNTED)
+                *options->dispatched += dispatched;
+
+            return;
+        }
+
+        ip = mm->activation->data.a.nextIP;
+        value_return(mm);
+
+        RegOp *call = &ops[ip - 1];
+        mm->sp = base;
+        base -= call->operand[3];
+        RELOAD();
+        writeOperand(bases, call->operand[2], v, mm);
+        NEXT();
+    }
+
+#ifndef THREADED_DISPATCH
+        }
+    }
+#endif
+}
+
+#undef OPCODE
+#undef NEXT
+#undef READ
+#undef RELOAD
+
+#ifdef THREADED_DISPATCH
+#pragma GCC diagnostic pop
+#endif
@@ -0,0 +1,109 @@
+#include <stdio.h>
+
+#include "memory.h"
+#include "value.h"
+
+#include "error.h"
+#include "regrun.h"
+
+#define DEFAULT_STACK_SIZE 256
+
+/*
+ * The temporaries of the running function are the stack slots from base, so
+ * they are scanned by the collector as the stack is.  Every write of a value
+ * that may be on the heap into a temporary shades it, as push does, and the
+ * stack's low water mark is kept at or below base after anything that may
+ * collect so that a minor collection always rescans them.  The results of
+ * arithmetic are immediate and need neither.
+ */
+static inline void writeOperand(Value ***bases, int32_t operand, Value *value, MemoryState *mm)
+{
+    bases[regcode_kind(operand)][regcode_index(operand)] = value;
+    if (regcode_kind(operand) == REG_LOCAL)
+        value_writeBarrier(mm->activation, value, mm);
+    else
+        value_shade(value, mm);
+}
+
+/*
+ * ENTER and the calls allocate from the frame stack in line, as bci aot's
+ * runtime does, leaving the runtime to handle a full frame stack, an
+ * activation that is not a frame and incremental marking.
+ */
+static inline void enterState(int32_t size, MemoryState *mm)
+{
+    Value *activation = mm->activation;
+    Value **state;
+
+    if (mm->phase == GC_MARKING || !frames_contains(&mm->frames, activation) ||
+        (state = frames_allocate(&mm->frames, size * sizeof(Value *))) == NULL)
+    {
+        value_newState(size, mm);
+        return;
+    }
+
+    if (mm->frameCursor == (char *)state)
+        mm->frameCursor = mm->frames.top;
+    for (int32_t i = 0; i < size; i++)
+        state[i] = NULL;
+
+    activation->data.a.stateSize = size;
+    activation->data.a.state = state;
+}
+
+static inline Value *newFrame(Value *parentActivation, Value *closure, int32_t nextIP, MemoryState *mm)
+{
+    Value *v;
+
+    if (mm->phase == GC_MARKING || (v = frames_allocate(&mm->frames, sizeof(Value))) == NULL)
+        return value_newFrame(parentActivation, closure, nextIP, mm);
+
+    v->type = VActivation | VALUE_REMEMBERED;
+    v->data.a.parentActivation = parentActivation;
+    v->data.a.closure = closure;
+    v->data.a.nextIP = nextIP;
+    v->data.a.stateSize = -1;
+    v->data.a.state = NULL;
+
+    return v;
+}
+
+static inline Value *newTailFrame(Value *closure, MemoryState *mm)
+{
+    Value *activation = mm->activation;
+    Value *parentActivation = activation->data.a.parentActivation;
+    int32_t nextIP = activation->data.a.nextIP;
+
+    value_return(mm);
+
+    return newFrame(parentActivation, closure, nextIP, mm);
+}
+
+/*
+ * The register loop is written once, in regloop.h, and instantiated twice: a
+ * fast loop and a loop that counts the instructions it dispatches for the
+ * benchmarks.  Dispatch is threaded, or a switch, as in run.c.
+ */
+#if defined(__GNUC__) && !defined(BCI_SWITCH_DISPATCH)
+#define THREADED_DISPATCH
+#endif
+
+#define REG_LOOP executeRegistersFast
+#define REG_LOOP_COUNTED 0
+#include "regloop.h"
+#undef REG_LOOP
+#undef REG_LOOP_COUNTED
+
+#define REG_LOOP executeRegistersCounted
+#define REG_LOOP_COUNTED 1
+#include "regloop.h"
+#undef REG_LOOP
+#undef REG_LOOP_COUNTED
+
+void executeRegisters(RegCode *code, RunOptions *options)
+{
+    if (options->dispatched != NULL)
+        executeRegistersCounted(code, options);
+    else
+        executeRegistersFast(code, options);
+}
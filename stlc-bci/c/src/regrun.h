@@ -0,0 +1,14 @@
+#ifndef REGRUN_H
+#define REGRUN_H
+
+#include "regcode.h"
+#include "run.h"
+
+/*
+ * Run code translated into registers.  The code must have been translated
+ * from code that verify has proven to pass every check as the register
+ * interpreter makes none of them.
+ */
+extern void executeRegisters(RegCode *code, RunOptions *options);
+
+#endif
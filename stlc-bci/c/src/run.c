@@ -3,68 +3,58 @@
 #include "memory.h"
 #include "value.h"
 
+#include "code.h"
+#include "error.h"
+#include "jit.h"
 #include "op.h"
+#include "regrun.h"
+#include "run.h"
 
 #define DEFAULT_STACK_SIZE 256
 
 struct State
 {
-    unsigned char *block;
+    Code *code;
     int32_t ip;
 
     MemoryState memoryState;
 };
 
-static struct State initState(unsigned char *block)
+struct Fiber
+{
+    struct State state;
+    RunOptions *options;
+    int64_t executed;
+    int finished;
+};
+
+static struct State initState(Code *code, GCPolicy gcPolicy)
 {
     struct State state;
 
-    state.block = block;
+    state.code = code;
     state.ip = 0;
-    state.memoryState = value_newMemoryManager(DEFAULT_STACK_SIZE);
+    state.memoryState = value_newMemoryManager(DEFAULT_STACK_SIZE, gcPolicy);
     state.memoryState.activation = value_newActivation(NULL, NULL, -1, &state.memoryState);
 
     return state;
 }
 
-static int32_t readIntFrom(struct State *state, int offset)
-{
-    unsigned char *block = state->block;
-
-    int32_t size = (int32_t)(block[offset] |
-                             ((block[offset + 1]) << 8) |
-                             ((block[offset + 2]) << 16) |
-                             ((block[offset + 3]) << 24));
-
-    return size;
-}
-
+/*
+ * Instructions are logged as they appear in the block, followed by the stack
+ * and the activation.
+ */
 static void logInstruction(struct State *state)
 {
-    printf("%d: ", state->ip);
-    Instruction *instruction = find(state->block[state->ip]);
-    if (instruction == NULL)
-        printf("Unknown opcode: %d", state->block[state->ip]);
-    else
-    {
-        printf("%s", instruction->name);
-        if (instruction->arity > 0)
-        {
-            printf(" ");
-            for (int i = 0; i < instruction->arity; i++)
-            {
-                if (i > 0)
-                    printf(" ");
-                printf("%d", readIntFrom(state, state->ip + 1 + i * 4));
-            }
-        }
-    }
+    Code *code = state->code;
+
+    code_printInstruction(code, state->ip);
     printf(": [");
 
     for (int i = 0; i < state->memoryState.sp; i++)
     {
         // printf("--- %d of %d\n", i, state->memoryState.sp);
-        char *value = value_toString(state->memoryState.stack[i]);
+        char *value = value_toStringWithOffsets(state->memoryState.stack[i], code->offsets);
         printf("%s", value);
         FREE(value);
         // printf("\n");
@@ -74,255 +64,582 @@ static void logInstruction(struct State *state)
     printf("] ");
     // printf("\n");
 
-    char *a = value_toString(state->memoryState.activation);
+    char *a = value_toStringWithOffsets(state->memoryState.activation, code->offsets);
     printf("%s ", a);
     FREE(a);
 
     printf("\n");
 }
 
-static int32_t readInt(struct State *state)
+/*
+ * An activation has no enclosing scope at the top level, where it has no
+ * closure, and in a call of a flat closure, which closes over no activation.
+ */
+static inline int hasParentScope(Value *a)
 {
-    int32_t result = readIntFrom(state, state->ip);
-    state->ip += 4;
-    return result;
+    return a->data.a.closure != NULL && a->data.a.closure->data.c.previousActivation != NULL;
 }
 
-void execute(unsigned char *block, int debug)
+/*
+ * The work of PUSH_VAR, ENTER and STORE_VAR, shared between the instructions
+ * and the superinstructions built from them.  The checks are made unless the
+ * code has been verified.
+ */
+static inline Value *loadVar(struct State *state, int32_t index, int32_t offset)
 {
-    struct State state = initState(block);
-
-    while (1)
+    Value *a = state->memoryState.activation;
+    while (index > 0)
     {
-        // forceGC(&state.memoryState);
-        if (debug)
-        {
-            logInstruction(&state);
-        }
-        int opcode = (int)block[state.ip++];
-
-        switch (opcode)
-        {
-        case PUSH_TRUE:
-            push(value_True, &state.memoryState);
-            break;
-        case PUSH_FALSE:
-            push(value_False, &state.memoryState);
-            break;
-        case PUSH_INT:
-        {
-            int32_t value = readInt(&state);
-            value_newInt(value, &state.memoryState);
-            break;
-        }
-        case PUSH_VAR:
-        {
-            int32_t index = readInt(&state);
-            int32_t offset = readInt(&state);
-
-            Value *a = state.memoryState.activation;
-            while (index > 0)
-            {
-                if (value_getType(a) != VActivation)
-                {
-                    printf("Run: PUSH_VAR: intermediate not an activation record: %d\n", index);
-                    exit(1);
-                }
-                a = a->data.a.closure->data.c.previousActivation;
-                index--;
-            }
-            if (value_getType(a) != VActivation)
-            {
-                printf("Run: PUSH_VAR: not an activation record: %d\n", index);
-                exit(1);
-            }
-            if (a->data.a.state == NULL)
-            {
-                printf("Run: PUSH_VAR: activation has no state\n");
-                exit(1);
-            }
-            if (offset >= a->data.a.stateSize)
-            {
-                printf("Run: PUSH_VAR: offset out of bounds: %d >= %d\n", offset, a->data.a.stateSize);
-                exit(1);
-            }
-            push(a->data.a.state[offset], &state.memoryState);
-
-            break;
-        }
-        case PUSH_CLOSURE:
+        if (value_getType(a) != VActivation)
         {
-            int32_t targetIP = readInt(&state);
-            value_newClosure(state.memoryState.activation, targetIP, &state.memoryState);
-            break;
-        }
-        case ADD:
-        {
-            Value *b = pop(&state.memoryState);
-            Value *a = pop(&state.memoryState);
-            if (value_getType(a) != VInt || value_getType(b) != VInt)
-            {
-                printf("Run: ADD: not an int\n");
-                exit(1);
-            }
-            value_newInt(a->data.i + b->data.i, &state.memoryState);
-            break;
-        }
-        case SUB:
-        {
-            Value *b = pop(&state.memoryState);
-            Value *a = pop(&state.memoryState);
-            if (value_getType(a) != VInt || value_getType(b) != VInt)
-            {
-                printf("Run: SUB: not an int\n");
-                exit(1);
-            }
-            value_newInt(a->data.i - b->data.i, &state.memoryState);
-            break;
-        }
-        case MUL:
-        {
-            Value *b = pop(&state.memoryState);
-            Value *a = pop(&state.memoryState);
-            if (value_getType(a) != VInt || value_getType(b) != VInt)
-            {
-                printf("Run: MUL: not an int\n");
-                exit(1);
-            }
-            value_newInt(a->data.i * b->data.i, &state.memoryState);
-            break;
-        }
-        case DIV:
-        {
-            Value *b = pop(&state.memoryState);
-            Value *a = pop(&state.memoryState);
-            if (value_getType(a) != VInt || value_getType(b) != VInt)
-            {
-                printf("Run: DIV: not an int\n");
-                exit(1);
-            }
-            value_newInt(a->data.i / b->data.i, &state.memoryState);
-            break;
-        }
-        case EQ:
-        {
-            Value *b = pop(&state.memoryState);
-            Value *a = pop(&state.memoryState);
-            if (value_getType(a) != VInt || value_getType(b) != VInt)
-            {
-                printf("Run: EQ: not an int\n");
-                exit(1);
-            }
-            push(a->data.i == b->data.i ? value_True : value_False, &state.memoryState);
-            break;
-        }
-        case JMP:
-        {
-            int32_t targetIP = readInt(&state);
-            state.ip = targetIP;
-            break;
-        }
-        case JMP_TRUE:
-        {
-            int32_t targetIP = readInt(&state);
-            Value *v = pop(&state.memoryState);
-            if (value_getType(v) != VBool)
-            {
-                printf("Run: JMP_TRUE: not a bool\n");
-                exit(1);
-            }
-            if (v->data.b)
-                state.ip = targetIP;
-            break;
-        }
-        case SWAP_CALL:
-        {
-            Value *newActivation = value_newActivation(state.memoryState.activation, peek(1, &state.memoryState), state.ip, &state.memoryState);
-            state.ip = peek(2, &state.memoryState)->data.c.ip;
-            state.memoryState.activation = newActivation;
-            state.memoryState.stack[state.memoryState.sp - 3] = state.memoryState.stack[state.memoryState.sp - 2];
-            popN(2, &state.memoryState);
-            break;
-        }
-        case ENTER:
-        {
-            int32_t size = readInt(&state);
-
-            if (state.memoryState.activation->data.a.state == NULL)
-            {
-                state.memoryState.activation->data.a.stateSize = size;
-                state.memoryState.activation->data.a.state = ALLOCATE(Value *, size);
-
-                for (int i = 0; i < size; i++)
-                    state.memoryState.activation->data.a.state[i] = NULL;
-            }
-            else
-            {
-                printf("Run: ENTER: activation already has state\n");
-                exit(1);
-            }
-            break;
-        }
-        case RET:
-        {
-            if (state.memoryState.activation->data.a.parentActivation == NULL)
-            {
-                Value *v = pop(&state.memoryState);
-                switch (value_getType(v))
-                {
-                case VInt:
-                    printf("%d: Int\n", v->data.i);
-                    break;
-                case VBool:
-                    printf("%s: Bool\n", v->data.b ? "true" : "false");
-                    break;
-                case VClosure:
-                case VActivation:
-                {
-                    char *s = value_toString(v);
-
-                    printf("%s\n", s);
-                    FREE(s);
-                    break;
-                }
-                }
-                value_destroyMemoryManager(&state.memoryState);
-
-                return;
-            }
-            state.ip = state.memoryState.activation->data.a.nextIP;
-            state.memoryState.activation = state.memoryState.activation->data.a.parentActivation;
-            break;
-        }
-        case STORE_VAR:
-        {
-            int32_t index = readInt(&state);
-            Value *value = pop(&state.memoryState);
-
-            if (state.memoryState.activation->data.a.state == NULL)
-            {
-                printf("Run: STORE_VAR: activation has no state\n");
-                exit(1);
-            }
-            if (index >= state.memoryState.activation->data.a.stateSize)
-            {
-                printf("Run: STORE_VAR: index out of bounds: %d\n", index);
-                exit(1);
-            }
-
-            state.memoryState.activation->data.a.state[index] = value;
-            break;
+            printf("Run: PUSH_VAR: intermediate not an activation record: %d\n", index);
+            exit(1);
         }
-        default:
+        if (!hasParentScope(a))
         {
-            Instruction *instruction = find(opcode);
-            if (instruction == NULL)
-                printf("Run: Invalid opcode: %d\n", opcode);
-            else
-                printf("Run: ip=%d: Unknown opcode: %s (%d)\n", state.ip - 1, instruction->name, instruction->opcode);
-
+            printf("Run: PUSH_VAR: no enclosing activation: %d\n", index);
             exit(1);
         }
-        }
+        a = a->data.a.closure->data.c.previousActivation;
+        index--;
+    }
+    if (value_getType(a) != VActivation)
+    {
+        printf("Run: PUSH_VAR: not an activation record: %d\n", index);
+        exit(1);
+    }
+    if (a->data.a.state == NULL)
+    {
+        printf("Run: PUSH_VAR: activation has no state\n");
+        exit(1);
+    }
+    if (offset >= a->data.a.stateSize)
+    {
+        printf("Run: PUSH_VAR: offset out of bounds: %d >= %d\n", offset, a->data.a.stateSize);
+        exit(1);
+    }
+    return a->data.a.state[offset];
+}
+
+/*
+ * Every scope enclosing an activation is itself an activation, so the
+ * quickened forms of PUSH_VAR only check that each level has an enclosing
+ * scope as they walk out.  A state that is missing, which has a size of -1,
+ * or too small fails the single bounds check at the end.  Either way the
+ * access is repeated by loadVar to report the error.  Verified code has no
+ * need of any of these checks.
+ */
+static inline Value *lookupVar(struct State *state, Value *a, int32_t index, int32_t offset, int checked)
+{
+    if (!checked || offset < a->data.a.stateSize)
+        return a->data.a.state[offset];
+
+    return loadVar(state, index, offset);
+}
+
+static inline Value *parentScope(Value *a)
+{
+    return a->data.a.closure->data.c.previousActivation;
+}
+
+static inline Value *quickLoadVar(struct State *state, int32_t index, int32_t offset, int checked)
+{
+    Value *a = state->memoryState.activation;
+
+    for (int32_t i = index; i > 0; i--)
+    {
+        if (checked && !hasParentScope(a))
+            return loadVar(state, index, offset);
+        a = parentScope(a);
+    }
+
+    return lookupVar(state, a, index, offset, checked);
+}
+
+static inline int32_t quickenPushVar(int32_t index)
+{
+    return index == 0 ? CODE_PUSH_LOCAL : index == 1 ? CODE_PUSH_PARENT : CODE_PUSH_DEPTH;
+}
+
+static inline void enter(struct State *state, int32_t size, int checked)
+{
+    if (!checked || state->memoryState.activation->data.a.state == NULL)
+    {
+        value_newState(size, &state->memoryState);
+    }
+    else
+    {
+        printf("Run: ENTER: activation already has state\n");
+        exit(1);
     }
 }
+
+static inline void storeVar(struct State *state, int32_t index, Value *value, int checked)
+{
+    Value *activation = state->memoryState.activation;
+
+    if (checked && activation->data.a.state == NULL)
+    {
+        printf("Run: STORE_VAR: activation has no state\n");
+        exit(1);
+    }
+    if (checked && index >= activation->data.a.stateSize)
+    {
+        printf("Run: STORE_VAR: index out of bounds: %d\n", index);
+        exit(1);
+    }
+
+    activation->data.a.state[index] = value;
+    value_writeBarrier(activation, value, &state->memoryState);
+}
+
+/*
+ * The work of MAKE_CLOSURE, PUSH_FREE and STORE_FREE.  A flat closure reaches
+ * the values it captures through the closure of the current activation, which
+ * the top level does not have.
+ */
+static inline void makeClosure(struct State *state, int32_t ip, int32_t freeSize, int checked)
+{
+    if (checked && freeSize < 0)
+    {
+        printf("Run: MAKE_CLOSURE: negative size: %d\n", freeSize);
+        exit(1);
+    }
+    if (checked && freeSize > state->memoryState.sp)
+    {
+        printf("Run: MAKE_CLOSURE: stack is too small\n");
+        exit(1);
+    }
+
+    value_newFlatClosure(ip, freeSize, &state->memoryState);
+}
+
+static inline Value *loadFree(struct State *state, int32_t index, int checked)
+{
+    Value *closure = state->memoryState.activation->data.a.closure;
+
+    if (checked && closure == NULL)
+    {
+        printf("Run: PUSH_FREE: activation has no closure\n");
+        exit(1);
+    }
+    if (checked && (index < 0 || index >= closure->data.c.freeSize))
+    {
+        printf("Run: PUSH_FREE: index out of bounds: %d >= %d\n", index, closure->data.c.freeSize);
+        exit(1);
+    }
+
+    return closure->data.c.free[index];
+}
+
+static inline void storeFree(struct State *state, Value *closure, int32_t index, Value *value, int checked)
+{
+    if (checked && (closure == NULL || value_getType(closure) != VClosure))
+    {
+        printf("Run: STORE_FREE: not a closure\n");
+        exit(1);
+    }
+    if (checked && (index < 0 || index >= closure->data.c.freeSize))
+    {
+        printf("Run: STORE_FREE: index out of bounds: %d >= %d\n", index, closure->data.c.freeSize);
+        exit(1);
+    }
+
+    closure->data.c.free[index] = value;
+    value_writeBarrier(closure, value, &state->memoryState);
+}
+
+static void invalidInstruction(struct State *state)
+{
+    Code *code = state->code;
+    int32_t offset = code->offsets[state->ip - 1];
+
+    if (offset >= code->blockSize)
+    {
+        printf("Run: ip=%d: End of code\n", offset);
+    }
+    else
+    {
+        const Instruction *instruction = find(code->block[offset]);
+        if (instruction == NULL)
+            printf("Run: Invalid opcode: %d\n", code->block[offset]);
+        else
+            printf("Run: ip=%d: Unknown opcode: %s (%d)\n", offset, instruction->name, instruction->opcode);
+    }
+
+    exit(1);
+}
+
+/*
+ * The limited loop checks its limits every LIMIT_INTERVAL instructions, or
+ * sooner should fewer remain, rather than before every instruction.  Returns
+ * the message to stop with should a limit have been exceeded and otherwise
+ * grants the instructions that may be dispatched before the next check,
+ * including the one about to be.
+ */
+#define LIMIT_INTERVAL 4096
+
+static char *checkLimits(struct State *state, RunOptions *options, int64_t *remaining, int32_t *countdown)
+{
+    MemoryState *mm = &state->memoryState;
+    int64_t held = (int64_t)mm->heap.pageCount * HEAP_PAGE_SIZE + (int64_t)mm->stackSize * sizeof(Value *);
+
+    if (*remaining == 0)
+        return "Run: instruction limit exceeded";
+    if (options->memoryLimit > 0 && held > options->memoryLimit)
+        return "Run: memory limit exceeded";
+
+    int32_t granted = *remaining < LIMIT_INTERVAL ? (int32_t)*remaining : LIMIT_INTERVAL;
+
+    *remaining -= granted;
+    *countdown = granted - 1;
+
+    return NULL;
+}
+
+void run_writeResult(Value *v, int32_t *offsets, RunOptions *options)
+{
+    StringBuilder *sb = options->output == NULL ? stringbuilder_new() : options->output;
+
+    switch (value_getType(v))
+    {
+    case VInt:
+        stringbuilder_append_int(sb, value_asInt(v));
+        stringbuilder_append(sb, ": Int");
+        break;
+    case VBool:
+        stringbuilder_append(sb, value_asBool(v) ? "true: Bool" : "false: Bool");
+        break;
+    case VClosure:
+    case VActivation:
+    {
+        char *s = value_toStringWithOffsets(v, offsets);
+
+        stringbuilder_append(sb, s);
+        FREE(s);
+        break;
+    }
+    }
+    stringbuilder_append_char(sb, '\n');
+
+    if (options->output == NULL)
+    {
+        char *s = stringbuilder_free_use(sb);
+
+        printf("%s", s);
+        FREE(s);
+    }
+}
+
+void run_writeLimitExceeded(char *message, RunOptions *options)
+{
+    options->limitExceeded = 1;
+    if (options->output == NULL)
+        printf("%s\n", message);
+    else
+    {
+        stringbuilder_append(options->output, message);
+        stringbuilder_append_char(options->output, '\n');
+    }
+}
+
+/*
+ * The interpreter loop is written once, in runloop.h, and instantiated nine
+ * times: a fast loop, the same loop without the checks that verified code
+ * cannot fail, that loop stopping at the run's limits, both loops resuming a
+ * fiber, a loop that hands hot functions to the JIT, a loop that logs every
+ * instruction for -d, a loop that counts instruction sequences and a loop
+ * that profiles the run, so that the fast loops carry no per-instruction
+ * check on any of them.  Where the compiler supports
+ * labels as values each handler jumps directly to the next through a table of
+ * handler addresses.  Building with -DBCI_SWITCH_DISPATCH, or with a compiler
+ * without the extension, falls back to a portable switch.
+ */
+#if defined(__GNUC__) && !defined(BCI_SWITCH_DISPATCH)
+#define THREADED_DISPATCH
+#endif
+
+#define RUN_LOOP executeFast
+#define RUN_LOOP_TRACE 0
+#define RUN_LOOP_NGRAMS 0
+#define RUN_LOOP_PROFILE 0
+#define RUN_LOOP_VERIFIED 0
+#define RUN_LOOP_JIT 0
+#define RUN_LOOP_LIMITED 0
+#define RUN_LOOP_FIBER 0
+#define RUN_LOOP_RECORD 0
+#include "runloop.h"
+#undef RUN_LOOP
+#undef RUN_LOOP_TRACE
+#undef RUN_LOOP_NGRAMS
+#undef RUN_LOOP_PROFILE
+#undef RUN_LOOP_VERIFIED
+#undef RUN_LOOP_JIT
+#undef RUN_LOOP_LIMITED
+#undef RUN_LOOP_FIBER
+#undef RUN_LOOP_RECORD
+
+#define RUN_LOOP executeVerified
+#define RUN_LOOP_TRACE 0
+#define RUN_LOOP_NGRAMS 0
+#define RUN_LOOP_PROFILE 0
+#define RUN_LOOP_VERIFIED 1
+#define RUN_LOOP_JIT 0
+#define RUN_LOOP_LIMITED 0
+#define RUN_LOOP_FIBER 0
+#define RUN_LOOP_RECORD 0
+#include "runloop.h"
+#undef RUN_LOOP
+#undef RUN_LOOP_TRACE
+#undef RUN_LOOP_NGRAMS
+#undef RUN_LOOP_PROFILE
+#undef RUN_LOOP_VERIFIED
+#undef RUN_LOOP_JIT
+#undef RUN_LOOP_LIMITED
+#undef RUN_LOOP_FIBER
+#undef RUN_LOOP_RECORD
+
+#define RUN_LOOP executeLimited
+#define RUN_LOOP_TRACE 0
+#define RUN_LOOP_NGRAMS 0
+#define RUN_LOOP_PROFILE 0
+#define RUN_LOOP_VERIFIED 1
+#define RUN_LOOP_JIT 0
+#define RUN_LOOP_LIMITED 1
+#define RUN_LOOP_FIBER 0
+#define RUN_LOOP_RECORD 0
+#include "runloop.h"
+#undef RUN_LOOP
+#undef RUN_LOOP_TRACE
+#undef RUN_LOOP_NGRAMS
+#undef RUN_LOOP_PROFILE
+#undef RUN_LOOP_VERIFIED
+#undef RUN_LOOP_JIT
+#undef RUN_LOOP_LIMITED
+#undef RUN_LOOP_FIBER
+#undef RUN_LOOP_RECORD
+
+#define RUN_LOOP resumeFiber
+#define RUN_LOOP_TRACE 0
+#define RUN_LOOP_NGRAMS 0
+#define RUN_LOOP_PROFILE 0
+#define RUN_LOOP_VERIFIED 0
+#define RUN_LOOP_JIT 0
+#define RUN_LOOP_LIMITED 0
+#define RUN_LOOP_FIBER 1
+#define RUN_LOOP_RECORD 0
+#include "runloop.h"
+#undef RUN_LOOP
+#undef RUN_LOOP_TRACE
+#undef RUN_LOOP_NGRAMS
+#undef RUN_LOOP_PROFILE
+#undef RUN_LOOP_VERIFIED
+#undef RUN_LOOP_JIT
+#undef RUN_LOOP_LIMITED
+#undef RUN_LOOP_FIBER
+#undef RUN_LOOP_RECORD
+
+#define RUN_LOOP resumeVerifiedFiber
+#define RUN_LOOP_TRACE 0
+#define RUN_LOOP_NGRAMS 0
+#define RUN_LOOP_PROFILE 0
+#define RUN_LOOP_VERIFIED 1
+#define RUN_LOOP_JIT 0
+#define RUN_LOOP_LIMITED 0
+#define RUN_LOOP_FIBER 1
+#define RUN_LOOP_RECORD 0
+#include "runloop.h"
+#undef RUN_LOOP
+#undef RUN_LOOP_TRACE
+#undef RUN_LOOP_NGRAMS
+#undef RUN_LOOP_PROFILE
+#undef RUN_LOOP_VERIFIED
+#undef RUN_LOOP_JIT
+#undef RUN_LOOP_LIMITED
+#undef RUN_LOOP_FIBER
+#undef RUN_LOOP_RECORD
+
+#define RUN_LOOP executeJit
+#define RUN_LOOP_TRACE 0
+#define RUN_LOOP_NGRAMS 0
+#define RUN_LOOP_PROFILE 0
+#define RUN_LOOP_VERIFIED 0
+#define RUN_LOOP_JIT 1
+#define RUN_LOOP_LIMITED 0
+#define RUN_LOOP_FIBER 0
+#define RUN_LOOP_RECORD 0
+#include "runloop.h"
+#undef RUN_LOOP
+#undef RUN_LOOP_TRACE
+#undef RUN_LOOP_NGRAMS
+#undef RUN_LOOP_PROFILE
+#undef RUN_LOOP_VERIFIED
+#undef RUN_LOOP_JIT
+#undef RUN_LOOP_LIMITED
+#undef RUN_LOOP_FIBER
+#undef RUN_LOOP_RECORD
+
+#define RUN_LOOP executeTraced
+#define RUN_LOOP_TRACE 1
+#define RUN_LOOP_NGRAMS 0
+#define RUN_LOOP_PROFILE 0
+#define RUN_LOOP_VERIFIED 0
+#define RUN_LOOP_JIT 0
+#define RUN_LOOP_LIMITED 0
+#define RUN_LOOP_FIBER 0
+#define RUN_LOOP_RECORD 0
+#include "runloop.h"
+#undef RUN_LOOP
+#undef RUN_LOOP_TRACE
+#undef RUN_LOOP_NGRAMS
+#undef RUN_LOOP_PROFILE
+#undef RUN_LOOP_VERIFIED
+#undef RUN_LOOP_JIT
+#undef RUN_LOOP_LIMITED
+#undef RUN_LOOP_FIBER
+#undef RUN_LOOP_RECORD
+
+#define RUN_LOOP executeCounted
+#define RUN_LOOP_TRACE 0
+#define RUN_LOOP_NGRAMS 1
+#define RUN_LOOP_PROFILE 0
+#define RUN_LOOP_VERIFIED 0
+#define RUN_LOOP_JIT 0
+#define RUN_LOOP_LIMITED 0
+#define RUN_LOOP_FIBER 0
+#define RUN_LOOP_RECORD 0
+#include "runloop.h"
+#undef RUN_LOOP
+#undef RUN_LOOP_TRACE
+#undef RUN_LOOP_NGRAMS
+#undef RUN_LOOP_PROFILE
+#undef RUN_LOOP_VERIFIED
+#undef RUN_LOOP_JIT
+#undef RUN_LOOP_LIMITED
+#undef RUN_LOOP_FIBER
+#undef RUN_LOOP_RECORD
+
+#define RUN_LOOP executeProfiled
+#define RUN_LOOP_TRACE 0
+#define RUN_LOOP_NGRAMS 0
+#define RUN_LOOP_PROFILE 1
+#define RUN_LOOP_VERIFIED 0
+#define RUN_LOOP_JIT 0
+#define RUN_LOOP_LIMITED 0
+#define RUN_LOOP_FIBER 0
+#define RUN_LOOP_RECORD 0
+#include "runloop.h"
+#undef RUN_LOOP
+#undef RUN_LOOP_TRACE
+#undef RUN_LOOP_NGRAMS
+#undef RUN_LOOP_PROFILE
+#undef RUN_LOOP_VERIFIED
+#undef RUN_LOOP_JIT
+#undef RUN_LOOP_LIMITED
+#undef RUN_LOOP_FIBER
+#undef RUN_LOOP_RECORD
+
+#define RUN_LOOP executeRecorded
+#define RUN_LOOP_TRACE 0
+#define RUN_LOOP_NGRAMS 0
+#define RUN_LOOP_PROFILE 0
+#define RUN_LOOP_VERIFIED 0
+#define RUN_LOOP_JIT 0
+#define RUN_LOOP_LIMITED 0
+#define RUN_LOOP_FIBER 0
+#define RUN_LOOP_RECORD 1
+#include "runloop.h"
+#undef RUN_LOOP
+#undef RUN_LOOP_TRACE
+#undef RUN_LOOP_NGRAMS
+#undef RUN_LOOP_PROFILE
+#undef RUN_LOOP_VERIFIED
+#undef RUN_LOOP_JIT
+#undef RUN_LOOP_LIMITED
+#undef RUN_LOOP_FIBER
+#undef RUN_LOOP_RECORD
+
+#define RUN_LOOP executeRecordedVerified
+#define RUN_LOOP_TRACE 0
+#define RUN_LOOP_NGRAMS 0
+#define RUN_LOOP_PROFILE 0
+#define RUN_LOOP_VERIFIED 1
+#define RUN_LOOP_JIT 0
+#define RUN_LOOP_LIMITED 0
+#define RUN_LOOP_FIBER 0
+#define RUN_LOOP_RECORD 1
+#include "runloop.h"
+#undef RUN_LOOP
+#undef RUN_LOOP_TRACE
+#undef RUN_LOOP_NGRAMS
+#undef RUN_LOOP_PROFILE
+#undef RUN_LOOP_VERIFIED
+#undef RUN_LOOP_JIT
+#undef RUN_LOOP_LIMITED
+#undef RUN_LOOP_FIBER
+#undef RUN_LOOP_RECORD
+
+void execute(Code *code, RunOptions *options)
+{
+    RegCode regCode;
+
+    options->limitExceeded = 0;
+    if (options->debug)
+        executeTraced(code, options);
+    else if (options->ngrams != NULL)
+        executeCounted(code, options);
+    else if (options->profile != NULL)
+        executeProfiled(code, options);
+    else if (options->trace != NULL && options->verified)
+        executeRecordedVerified(code, options);
+    else if (options->trace != NULL)
+        executeRecorded(code, options);
+    else if (options->jitThreshold > 0)
+        executeJit(code, options);
+    else if (options->verified && (options->instructionLimit > 0 || options->memoryLimit > 0))
+        executeLimited(code, options);
+    else if (options->registers && options->verified && regcode_translate(code, &regCode))
+    {
+        executeRegisters(&regCode, options);
+        regcode_destroy(&regCode);
+    }
+    else if (options->verified)
+        executeVerified(code, options);
+    else
+        executeFast(code, options);
+}
+
+Fiber *run_newFiber(Code *code, RunOptions *options)
+{
+    Fiber *fiber = ALLOCATE(Fiber, 1);
+
+    fiber->state = initState(code, options->gcPolicy);
+    fiber->options = options;
+    fiber->executed = 0;
+    fiber->finished = 0;
+
+    return fiber;
+}
+
+int run_resume(Fiber *fiber, int64_t fuel)
+{
+    if (!fiber->finished)
+        fiber->finished = fiber->options->verified ? resumeVerifiedFiber(fiber, fuel) : resumeFiber(fiber, fuel);
+
+    return fiber->finished;
+}
+
+int64_t run_executed(Fiber *fiber)
+{
+    return fiber->executed;
+}
+
+/*
+ * A fiber that has finished has already destroyed its memory manager.
+ */
+void run_freeFiber(Fiber *fiber)
+{
+    if (!fiber->finished)
+        value_destroyMemoryManager(&fiber->state.memoryState);
+    FREE(fiber);
+}
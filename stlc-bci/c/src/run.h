@@ -1,6 +1,71 @@
 #ifndef RUN_H
 #define RUN_H
 
-extern void execute(unsigned char *block, int debug);
+#include "code.h"
+#include "ngrams.h"
+#include "profile.h"
+#include "stringbuilder.h"
+#include "trace.h"
+#include "value.h"
+
+typedef struct
+{
+    int debug;
+    GCPolicy gcPolicy;
+    NGrams *ngrams;
+    Profile *profile;
+    Trace *trace;
+    int verified;
+    int jitThreshold;
+    int registers;
+    uint64_t *dispatched;
+    StringBuilder *output;
+    int64_t instructionLimit;
+    int64_t memoryLimit;
+    int limitExceeded;
+} RunOptions;
+
+/*
+ * Superinstructions are only understood by the fast loop.  Code run with
+ * tracing, n-gram counting or profiling enabled must not have been fused so
+ * that it is reported in terms of the original instructions.  A profile, unless
+ * NULL, is recorded by a loop of its own.  Setting verified, which is only
+ * safe when verify has returned 1 for the code, runs the fast loop without
+ * its checks.  A trace, unless NULL, also has a loop of its own, which records
+ * every instruction dispatched and every allocation and collection in it and
+ * runs fused code, without the checks should it be verified.  A jitThreshold
+ * above 0 compiles each function into native code once it has been called
+ * that many times.  Setting registers runs verified code on the register
+ * interpreter, translating it from the code's block, which counts the
+ * instructions it dispatches into dispatched unless it is NULL.  The
+ * program's result is printed, or appended to output should it not be NULL.
+ *
+ * Verified code is stopped, with a message in place of its result, once it
+ * has dispatched more than instructionLimit instructions or holds more than
+ * memoryLimit bytes in heap pages and stack, where either limit is above 0.
+ * limitExceeded is then set to 1, and otherwise to 0.
+ */
+
+extern void execute(Code *code, RunOptions *options);
+
+/*
+ * A fiber runs a program a slice at a time, so that many programs can take
+ * turns on one thread.  Each fiber has its own heap, stack and frames, and
+ * runs code as execute would without the JIT, the register interpreter or
+ * limits.  run_resume runs the fiber until its program returns, writing the
+ * result as execute does, and returns 1.  It otherwise returns 0 at the
+ * first call or backward jump after fuel instructions, from where the next
+ * run_resume continues.  run_executed counts the instructions that a fiber
+ * has dispatched.
+ */
+typedef struct Fiber Fiber;
+
+extern Fiber *run_newFiber(Code *code, RunOptions *options);
+extern int run_resume(Fiber *fiber, int64_t fuel);
+extern int64_t run_executed(Fiber *fiber);
+extern void run_freeFiber(Fiber *fiber);
+
+extern void run_writeResult(Value *v, int32_t *offsets, RunOptions *options);
+extern void run_writeLimitExceeded(char *message, RunOptions *options);
 
 #endif
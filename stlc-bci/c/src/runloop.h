@@ -0,0 +1,512 @@
+/*
+ * The body of the interpreter loop.  This file has no include guard as run.c
+ * includes it once for each loop it needs, defining RUN_LOOP as the name of the
+ * function, RUN_LOOP_TRACE as 1 when every instruction is to be logged
+ * before it is executed and RUN_LOOP_NGRAMS as 1 when the sequences of
+ * executed instructions are to be counted.  RUN_LOOP_PROFILE is 1 when
+ * instructions, calls and returns are to be recorded in the profile.
+ * RUN_LOOP_LIMITED is 1 when the
+ * run is to be stopped once it exceeds its instruction or memory limit.
+ * RUN_LOOP_FIBER is 1 when the loop resumes a fiber, counting down its fuel,
+ * and suspends it at a call or backward jump once the fuel has run out.
+ * RUN_LOOP_RECORD is 1 when every instruction dispatched is recorded in the
+ * options' trace.
+ * RUN_LOOP_VERIFIED is 1 when the
+ * code has been proven by the verifier to pass every check so they are left
+ * out.  RUN_LOOP_JIT is 1 when calls are counted so that hot functions are
+ * compiled, and compiled code is run on every call and return that reaches
+ * it.  THREADED_DISPATCH selects direct threading over the switch.
+ */
+
+#ifdef THREADED_DISPATCH
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#ifdef __clang__
+#pragma clang diagnostic ignored "-Wgnu-label-as-value"
+#endif
+
+#define OPCODE(op) op_##op:
+#define INVALID_OPCODE op_invalid:
+#define NEXT()                                            \
+    do                                                    \
+    {                                                     \
+        if (RUN_LOOP_TRACE)                               \
+            logInstruction(&state);                       \
+        CHECK_LIMITS();                                   \
+        if (RUN_LOOP_FIBER)                               \
+            fuel--;                                       \
+        op = &ops[state.ip++];                            \
+        if (RUN_LOOP_RECORD)                              \
+            RECORD();                                     \
+        if (RUN_LOOP_NGRAMS)                              \
+            ngrams_record(options->ngrams, op->opcode);   \
+        if (RUN_LOOP_PROFILE)                             \
+            profile_record(options->profile, op->opcode); \
+        goto *dispatch[op->opcode];                       \
+    } while (0)
+
+#else
+
+#define OPCODE(op) case op:
+#define INVALID_OPCODE default:
+#define NEXT() break
+
+#endif
+
+/*
+ * Every loop quickens except those that log, count or profile instructions,
+ * which report them as they appear in the block.
+ */
+#define RUN_LOOP_QUICKEN (!RUN_LOOP_TRACE && !RUN_LOOP_NGRAMS && !RUN_LOOP_PROFILE)
+
+#define RUN_LOOP_CHECKED (!RUN_LOOP_VERIFIED)
+
+#define CHECK_LIMITS()                                                                      \
+    do                                                                                      \
+    {                                                                                       \
+        if (RUN_LOOP_LIMITED && --countdown < 0 &&                                          \
+            (limitMessage = checkLimits(&state, options, &remaining, &countdown)) != NULL)  \
+            goto limitExceeded;                                                             \
+    } while (0)
+
+#define JIT_CALL()                                                      \
+    do                                                                  \
+    {                                                                   \
+        if (RUN_LOOP_JIT)                                               \
+        {                                                               \
+            jit_count(jit, state.ip);                                   \
+            state.ip = jit_run(jit, state.ip, &state.memoryState);      \
+        }                                                               \
+    } while (0)
+#define JIT_RETURN()                                                    \
+    do                                                                  \
+    {                                                                   \
+        if (RUN_LOOP_JIT)                                               \
+            state.ip = jit_run(jit, state.ip, &state.memoryState);      \
+    } while (0)
+#define RECORD() (traceHead = trace_recordInstruction(trace, traceEvents, traceMask, traceHead, op->opcode, state.ip - 1, state.memoryState.sp))
+#define PROFILE_CALL(record)                            \
+    do                                                  \
+    {                                                   \
+        if (RUN_LOOP_PROFILE)                           \
+            record(options->profile, state.ip);         \
+    } while (0)
+/*
+ * A fiber's state is copied back into the fiber when it is suspended, ready
+ * to continue from state.ip, or when it finishes.
+ */
+#if RUN_LOOP_FIBER
+#define SUSPEND()                                   \
+    do                                              \
+    {                                               \
+        if (fuel <= 0)                              \
+        {                                           \
+            fiber->state = state;                   \
+            fiber->executed += granted - fuel;      \
+            return 0;                               \
+        }                                           \
+    } while (0)
+#define FINISHED()                                  \
+    do                                              \
+    {                                               \
+        fiber->executed += granted - fuel;          \
+        return 1;                                   \
+    } while (0)
+#else
+#define SUSPEND() \
+    do            \
+    {             \
+    } while (0)
+#define FINISHED() return
+#endif
+
+#if RUN_LOOP_VERIFIED
+#define POP() popUnchecked(&state.memoryState)
+#define PEEK(offset) peekUnchecked(offset, &state.memoryState)
+#else
+#define POP() pop(&state.memoryState)
+#define PEEK(offset) peek(offset, &state.memoryState)
+#endif
+
+#if RUN_LOOP_FIBER
+static int RUN_LOOP(Fiber *fiber, int64_t granted)
+{
+    struct State state = fiber->state;
+    Code *code = state.code;
+    RunOptions *options = fiber->options;
+    int64_t fuel = granted;
+#else
+static void RUN_LOOP(Code *code, RunOptions *options)
+{
+    struct State state = initState(code, options->gcPolicy);
+    int64_t fuel = 0;
+#endif
+    Jit *jit = RUN_LOOP_JIT ? jit_new(code, options->jitThreshold, options->verified) : NULL;
+    Op *ops = code->ops;
+    Op *op;
+    int64_t remaining = options->instructionLimit > 0 ? options->instructionLimit : INT64_MAX;
+    int32_t countdown = 0;
+    char *limitMessage = NULL;
+    Trace *trace = RUN_LOOP_RECORD ? options->trace : NULL;
+    TraceEvent *traceEvents = RUN_LOOP_RECORD ? trace->events : NULL;
+    uint64_t traceMask = RUN_LOOP_RECORD ? trace->mask : 0;
+    uint64_t traceHead = RUN_LOOP_RECORD ? atomic_load_explicit(&trace->head, memory_order_relaxed) : 0;
+
+    if (RUN_LOOP_RECORD)
+        state.memoryState.trace = trace;
+
+#ifdef THREADED_DISPATCH
+    static const void *const dispatch[] = {
+        [PUSH_TRUE] = &&op_PUSH_TRUE,
+        [PUSH_FALSE] = &&op_PUSH_FALSE,
+        [PUSH_INT] = &&op_PUSH_INT,
+        [PUSH_VAR] = &&op_PUSH_VAR,
+        [PUSH_CLOSURE] = &&op_PUSH_CLOSURE,
+        [PUSH_TUPLE] = &&op_invalid,
+        [ADD] = &&op_ADD,
+        [SUB] = &&op_SUB,
+        [MUL] = &&op_MUL,
+        [DIV] = &&op_DIV,
+        [EQ] = &&op_EQ,
+        [JMP] = &&op_JMP,
+        [JMP_TRUE] = &&op_JMP_TRUE,
+        [SWAP_CALL] = &&op_SWAP_CALL,
+        [ENTER] = &&op_ENTER,
+        [RET] = &&op_RET,
+        [STORE_VAR] = &&op_STORE_VAR,
+        [TAIL_CALL] = &&op_TAIL_CALL,
+        [MAKE_CLOSURE] = &&op_MAKE_CLOSURE,
+        [PUSH_FREE] = &&op_PUSH_FREE,
+        [STORE_FREE] = &&op_STORE_FREE,
+        [CODE_INVALID] = &&op_invalid,
+        [CODE_PUSH_LOCAL] = &&op_CODE_PUSH_LOCAL,
+        [CODE_PUSH_PARENT] = &&op_CODE_PUSH_PARENT,
+        [CODE_PUSH_DEPTH] = &&op_CODE_PUSH_DEPTH,
+        [CODE_ENTER_STORE_VAR] = &&op_CODE_ENTER_STORE_VAR,
+        [CODE_PUSH_VAR_PUSH_VAR_EQ_JMP_TRUE] = &&op_CODE_PUSH_VAR_PUSH_VAR_EQ_JMP_TRUE,
+        [CODE_PUSH_VAR_PUSH_INT_EQ_JMP_TRUE] = &&op_CODE_PUSH_VAR_PUSH_INT_EQ_JMP_TRUE,
+        [CODE_PUSH_INT_ADD] = &&op_CODE_PUSH_INT_ADD,
+        [CODE_PUSH_INT_SUB] = &&op_CODE_PUSH_INT_SUB,
+        [CODE_PUSH_VAR_PUSH_INT_SWAP_CALL] = &&op_CODE_PUSH_VAR_PUSH_INT_SWAP_CALL};
+
+    NEXT();
+#else
+    while (1)
+    {
+        if (RUN_LOOP_TRACE)
+            logInstruction(&state);
+        CHECK_LIMITS();
+        if (RUN_LOOP_FIBER)
+            fuel--;
+        op = &ops[state.ip++];
+        if (RUN_LOOP_RECORD)
+            RECORD();
+        if (RUN_LOOP_NGRAMS)
+            ngrams_record(options->ngrams, op->opcode);
+        if (RUN_LOOP_PROFILE)
+            profile_record(options->profile, op->opcode);
+
+        switch (op->opcode)
+        {
+#endif
+
+    OPCODE(PUSH_TRUE)
+        push(value_True, &state.memoryState);
+        NEXT();
+    OPCODE(PUSH_FALSE)
+        push(value_False, &state.memoryState);
+        NEXT();
+    OPCODE(PUSH_INT)
+    {
+        int32_t value = op->operand[0];
+        push(value_fromInt(value), &state.memoryState);
+        NEXT();
+    }
+    OPCODE(PUSH_VAR)
+        push(loadVar(&state, op->operand[0], op->operand[1]), &state.memoryState);
+        if (RUN_LOOP_QUICKEN)
+            op->opcode = quickenPushVar(op->operand[0]);
+        NEXT();
+    OPCODE(CODE_PUSH_LOCAL)
+    {
+        Value *a = state.memoryState.activation;
+        push(lookupVar(&state, a, 0, op->operand[1], RUN_LOOP_CHECKED), &state.memoryState);
+        NEXT();
+    }
+    OPCODE(CODE_PUSH_PARENT)
+        push(quickLoadVar(&state, 1, op->operand[1], RUN_LOOP_CHECKED), &state.memoryState);
+        NEXT();
+    OPCODE(CODE_PUSH_DEPTH)
+        push(quickLoadVar(&state, op->operand[0], op->operand[1], RUN_LOOP_CHECKED), &state.memoryState);
+        NEXT();
+    OPCODE(PUSH_CLOSURE)
+    {
+        int32_t targetIP = op->operand[0];
+        value_newClosure(state.memoryState.activation, targetIP, &state.memoryState);
+        NEXT();
+    }
+    OPCODE(MAKE_CLOSURE)
+        makeClosure(&state, op->operand[0], op->operand[1], RUN_LOOP_CHECKED);
+        NEXT();
+    OPCODE(PUSH_FREE)
+        push(loadFree(&state, op->operand[0], RUN_LOOP_CHECKED), &state.memoryState);
+        NEXT();
+    OPCODE(STORE_FREE)
+    {
+        Value *value = POP();
+        Value *closure = POP();
+        storeFree(&state, closure, op->operand[0], value, RUN_LOOP_CHECKED);
+        NEXT();
+    }
+    OPCODE(ADD)
+    {
+        Value *b = POP();
+        Value *a = POP();
+        if (RUN_LOOP_CHECKED && (value_getType(a) != VInt || value_getType(b) != VInt))
+        {
+            printf("Run: ADD: not an int\n");
+            exit(1);
+        }
+        push(value_fromInt(value_asInt(a) + value_asInt(b)), &state.memoryState);
+        NEXT();
+    }
+    OPCODE(SUB)
+    {
+        Value *b = POP();
+        Value *a = POP();
+        if (RUN_LOOP_CHECKED && (value_getType(a) != VInt || value_getType(b) != VInt))
+        {
+            printf("Run: SUB: not an int\n");
+            exit(1);
+        }
+        push(value_fromInt(value_asInt(a) - value_asInt(b)), &state.memoryState);
+        NEXT();
+    }
+    OPCODE(MUL)
+    {
+        Value *b = POP();
+        Value *a = POP();
+        if (RUN_LOOP_CHECKED && (value_getType(a) != VInt || value_getType(b) != VInt))
+        {
+            printf("Run: MUL: not an int\n");
+            exit(1);
+        }
+        push(value_fromInt(value_asInt(a) * value_asInt(b)), &state.memoryState);
+        NEXT();
+    }
+    OPCODE(DIV)
+    {
+        Value *b = POP();
+        Value *a = POP();
+        if (RUN_LOOP_CHECKED && (value_getType(a) != VInt || value_getType(b) != VInt))
+        {
+            printf("Run: DIV: not an int\n");
+            exit(1);
+        }
+        if (value_asInt(b) == 0)
+            goto divisionByZero;
+        push(value_fromInt(value_divide(value_asInt(a), value_asInt(b))), &state.memoryState);
+        NEXT();
+    }
+    OPCODE(EQ)
+    {
+        Value *b = POP();
+        Value *a = POP();
+        if (RUN_LOOP_CHECKED && (value_getType(a) != VInt || value_getType(b) != VInt))
+        {
+            printf("Run: EQ: not an int\n");
+            exit(1);
+        }
+        push(value_fromBool(value_asInt(a) == value_asInt(b)), &state.memoryState);
+        NEXT();
+    }
+    OPCODE(JMP)
+    {
+        int32_t targetIP = op->operand[0];
+        int backward = targetIP < state.ip;
+        state.ip = targetIP;
+        if (backward)
+            SUSPEND();
+        NEXT();
+    }
+    OPCODE(JMP_TRUE)
+    {
+        int32_t targetIP = op->operand[0];
+        Value *v = POP();
+        if (RUN_LOOP_CHECKED && value_getType(v) != VBool)
+        {
+            printf("Run: JMP_TRUE: not a bool\n");
+            exit(1);
+        }
+        if (value_asBool(v))
+        {
+            int backward = targetIP < state.ip;
+            state.ip = targetIP;
+            if (backward)
+                SUSPEND();
+        }
+        NEXT();
+    }
+    OPCODE(SWAP_CALL)
+    {
+        Value *newActivation = value_newFrame(state.memoryState.activation, PEEK(1), state.ip, &state.memoryState);
+        Value *argument = POP();
+        Value *closure = POP();
+        state.ip = closure->data.c.ip;
+        state.memoryState.activation = newActivation;
+        push(argument, &state.memoryState);
+        PROFILE_CALL(profile_call);
+        JIT_CALL();
+        SUSPEND();
+        NEXT();
+    }
+    OPCODE(TAIL_CALL)
+    {
+        Value *newActivation = value_newTailFrame(PEEK(1), &state.memoryState);
+        Value *argument = POP();
+        Value *closure = POP();
+        state.ip = closure->data.c.ip;
+        state.memoryState.activation = newActivation;
+        push(argument, &state.memoryState);
+        PROFILE_CALL(profile_tailCall);
+        JIT_CALL();
+        SUSPEND();
+        NEXT();
+    }
+    OPCODE(ENTER)
+        enter(&state, op->operand[0], RUN_LOOP_CHECKED);
+        NEXT();
+    OPCODE(RET)
+    {
+        if (RUN_LOOP_PROFILE)
+            profile_return(options->profile);
+        if (state.memoryState.activation->data.a.parentActivation == NULL)
+        {
+            run_writeResult(POP(), code->offsets, options);
+            if (options->gcPolicy.pauseBudget > 0)
+                value_reportGCPauses(&state.memoryState);
+            value_destroyMemoryManager(&state.memoryState);
+            if (RUN_LOOP_JIT)
+                jit_free(jit);
+
+            FINISHED();
+        }
+        state.ip = state.memoryState.activation->data.a.nextIP;
+        value_return(&state.memoryState);
+        JIT_RETURN();
+        NEXT();
+    }
+    OPCODE(STORE_VAR)
+        storeVar(&state, op->operand[0], POP(), RUN_LOOP_CHECKED);
+        NEXT();
+    OPCODE(CODE_ENTER_STORE_VAR)
+        enter(&state, op->operand[0], RUN_LOOP_CHECKED);
+        storeVar(&state, op->operand[1], POP(), RUN_LOOP_CHECKED);
+        state.ip += 1;
+        NEXT();
+    OPCODE(CODE_PUSH_VAR_PUSH_VAR_EQ_JMP_TRUE)
+    {
+        Value *a = quickLoadVar(&state, code_varIndex(op->operand[0]), code_varOffset(op->operand[0]), RUN_LOOP_CHECKED);
+        Value *b = quickLoadVar(&state, code_varIndex(op->operand[1]), code_varOffset(op->operand[1]), RUN_LOOP_CHECKED);
+        if (RUN_LOOP_CHECKED && (value_getType(a) != VInt || value_getType(b) != VInt))
+        {
+            printf("Run: EQ: not an int\n");
+            exit(1);
+        }
+        state.ip = value_asInt(a) == value_asInt(b) ? op->operand[2] : state.ip + 3;
+        if (state.ip <= op - ops)
+            SUSPEND();
+        NEXT();
+    }
+    OPCODE(CODE_PUSH_VAR_PUSH_INT_EQ_JMP_TRUE)
+    {
+        Value *a = quickLoadVar(&state, code_varIndex(op->operand[0]), code_varOffset(op->operand[0]), RUN_LOOP_CHECKED);
+        if (RUN_LOOP_CHECKED && value_getType(a) != VInt)
+        {
+            printf("Run: EQ: not an int\n");
+            exit(1);
+        }
+        state.ip = value_asInt(a) == op->operand[1] ? op->operand[2] : state.ip + 3;
+        if (state.ip <= op - ops)
+            SUSPEND();
+        NEXT();
+    }
+    OPCODE(CODE_PUSH_INT_ADD)
+    {
+        Value *a = POP();
+        if (RUN_LOOP_CHECKED && value_getType(a) != VInt)
+        {
+            printf("Run: ADD: not an int\n");
+            exit(1);
+        }
+        push(value_fromInt(value_asInt(a) + op->operand[0]), &state.memoryState);
+        state.ip += 1;
+        NEXT();
+    }
+    OPCODE(CODE_PUSH_INT_SUB)
+    {
+        Value *a = POP();
+        if (RUN_LOOP_CHECKED && value_getType(a) != VInt)
+        {
+            printf("Run: SUB: not an int\n");
+            exit(1);
+        }
+        push(value_fromInt(value_asInt(a) - op->operand[0]), &state.memoryState);
+        state.ip += 1;
+        NEXT();
+    }
+    OPCODE(CODE_PUSH_VAR_PUSH_INT_SWAP_CALL)
+    {
+        Value *closure = quickLoadVar(&state, op->operand[0], op->operand[1], RUN_LOOP_CHECKED);
+        Value *newActivation = value_newFrame(state.memoryState.activation, closure, state.ip + 2, &state.memoryState);
+        state.ip = newActivation->data.a.closure->data.c.ip;
+        state.memoryState.activation = newActivation;
+        push(value_fromInt(op->operand[2]), &state.memoryState);
+        PROFILE_CALL(profile_call);
+        JIT_CALL();
+        SUSPEND();
+        NEXT();
+    }
+    INVALID_OPCODE
+    {
+        invalidInstruction(&state);
+    }
+
+#ifndef THREADED_DISPATCH
+        }
+    }
+#endif
+
+limitExceeded:
+    run_writeLimitExceeded(limitMessage, options);
+    value_destroyMemoryManager(&state.memoryState);
+    if (RUN_LOOP_JIT)
+        jit_free(jit);
+    FINISHED();
+
+divisionByZero:
+    value_destroyMemoryManager(&state.memoryState);
+    if (RUN_LOOP_JIT)
+        jit_free(jit);
+    error_raise("Run: DIV: division by zero");
+}
+
+#undef OPCODE
+#undef INVALID_OPCODE
+#undef NEXT
+#undef RECORD
+#undef RUN_LOOP_QUICKEN
+#undef RUN_LOOP_CHECKED
+#undef CHECK_LIMITS
+#undef SUSPEND
+#undef FINISHED
+#undef JIT_CALL
+#undef JIT_RETURN
+#undef PROFILE_CALL
+#undef POP
+#undef PEEK
+
+#ifdef THREADED_DISPATCH
+#pragma GCC diagnostic pop
+#endif
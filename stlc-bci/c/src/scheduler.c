@@ -0,0 +1,51 @@
+#include "memory.h"
+
+#include "scheduler.h"
+
+void scheduler_initialise(Scheduler *scheduler, int64_t quantum)
+{
+    scheduler->quantum = quantum;
+    scheduler->switches = 0;
+    scheduler->size = 0;
+    scheduler->capacity = 16;
+    scheduler->fibers = ALLOCATE(Fiber *, scheduler->capacity);
+}
+
+void scheduler_destroy(Scheduler *scheduler)
+{
+    FREE(scheduler->fibers);
+}
+
+void scheduler_spawn(Scheduler *scheduler, Fiber *fiber)
+{
+    if (scheduler->size == scheduler->capacity)
+    {
+        scheduler->capacity *= 2;
+        scheduler->fibers = REALLOCATE(scheduler->fibers, Fiber *, scheduler->capacity);
+    }
+    scheduler->fibers[scheduler->size++] = fiber;
+}
+
+/*
+ * Each round resumes every fiber once and then closes the gaps left by those
+ * that finished, keeping the rest in order.
+ */
+void scheduler_run(Scheduler *scheduler, void (*finished)(Fiber *fiber, void *context), void *context)
+{
+    while (scheduler->size > 0)
+    {
+        int32_t running = 0;
+
+        for (int32_t i = 0; i < scheduler->size; i++)
+        {
+            Fiber *fiber = scheduler->fibers[i];
+
+            scheduler->switches++;
+            if (run_resume(fiber, scheduler->quantum))
+                finished(fiber, context);
+            else
+                scheduler->fibers[running++] = fiber;
+        }
+        scheduler->size = running;
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+
+#include "run.h"
+
+/*
+ * Runs many fibers on the calling thread, resuming each in turn, in the order
+ * that they were spawned, with quantum instructions of fuel.  As a fiber only
+ * stops at a call or backward jump, a long computation is preempted within a
+ * few instructions of its quantum and cannot starve the others.
+ *
+ * scheduler_run returns once every fiber has finished, calling finished with
+ * each as it does.  switches counts the times that a fiber was resumed.
+ */
+typedef struct
+{
+    int64_t quantum;
+    int64_t switches;
+
+    int32_t size;
+    int32_t capacity;
+    Fiber **fibers;
+} Scheduler;
+
+extern void scheduler_initialise(Scheduler *scheduler, int64_t quantum);
+extern void scheduler_destroy(Scheduler *scheduler);
+
+extern void scheduler_spawn(Scheduler *scheduler, Fiber *fiber);
+extern void scheduler_run(Scheduler *scheduler, void (*finished)(Fiber *fiber, void *context), void *context);
+
+#endif
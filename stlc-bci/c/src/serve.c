@@ -0,0 +1,661 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memory.h"
+
+#include "serve.h"
+#include "stringbuilder.h"
+#include "vm.h"
+
+/*
+ * The queue holds at most QUEUE_PER_WORKER requests for each worker, so that
+ * reading stays only a little ahead of running.
+ */
+#define QUEUE_PER_WORKER 16
+
+/*
+ * Latencies are counted into buckets by the power of two of microseconds
+ * that they are at most, the last bucket counting everything longer.
+ */
+#define LATENCY_BUCKETS 40
+
+/*
+ * A request is the path of a program or its bytecode, or the error that
+ * reading it met, which is then its response.
+ */
+typedef struct Job
+{
+    int64_t id;
+    char *path;
+    unsigned char *block;
+    int32_t size;
+    char *error;
+
+    int64_t read;
+    struct Connection *connection;
+    struct Job *next;
+} Job;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    Job *head;
+    Job *tail;
+    int size;
+    int capacity;
+    int closed;
+} Queue;
+
+/*
+ * A connection is read by a thread of its own, which queues each request and
+ * once the input ends waits for every response to be written before closing
+ * it.
+ */
+typedef struct Connection
+{
+    FILE *input;
+    int output;
+    Queue *queue;
+
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    int pending;
+
+    struct Clients *clients;
+    struct Connection *next;
+} Connection;
+
+/*
+ * The connections open to the socket, so that they can be shut down and
+ * waited for when the server stops.
+ */
+typedef struct Clients
+{
+    pthread_mutex_t lock;
+    pthread_cond_t closed;
+    Connection *open;
+} Clients;
+
+typedef struct
+{
+    int64_t ok;
+    int64_t stopped;
+    int64_t failed;
+    int64_t latencies[LATENCY_BUCKETS];
+    int64_t longest;
+} Stats;
+
+typedef struct
+{
+    pthread_t thread;
+    Queue *queue;
+    ServeOptions *options;
+    Stats stats;
+} Worker;
+
+static volatile sig_atomic_t stopping = 0;
+
+static int64_t now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void queue_initialise(Queue *queue, int capacity)
+{
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->notEmpty, NULL);
+    pthread_cond_init(&queue->notFull, NULL);
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->size = 0;
+    queue->capacity = capacity;
+    queue->closed = 0;
+}
+
+static void queue_destroy(Queue *queue)
+{
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->notEmpty);
+    pthread_cond_destroy(&queue->notFull);
+}
+
+static void queue_put(Queue *queue, Job *job)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->size == queue->capacity)
+        pthread_cond_wait(&queue->notFull, &queue->lock);
+
+    job->next = NULL;
+    if (queue->tail == NULL)
+        queue->head = job;
+    else
+        queue->tail->next = job;
+    queue->tail = job;
+    queue->size++;
+
+    pthread_cond_signal(&queue->notEmpty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/*
+ * Returns NULL once the queue has been closed and emptied.
+ */
+static Job *queue_take(Queue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->head == NULL && !queue->closed)
+        pthread_cond_wait(&queue->notEmpty, &queue->lock);
+
+    Job *job = queue->head;
+    if (job != NULL)
+    {
+        queue->head = job->next;
+        if (queue->head == NULL)
+            queue->tail = NULL;
+        queue->size--;
+        pthread_cond_signal(&queue->notFull);
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return job;
+}
+
+static void queue_close(Queue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->notEmpty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static char *errorFor(char *format, char *argument)
+{
+    int length = snprintf(NULL, 0, format, argument);
+    char *error = ALLOCATE(char, length + 1);
+
+    snprintf(error, length + 1, format, argument);
+
+    return error;
+}
+
+static void writeFully(int fd, char *s, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fd, s, length);
+
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return;
+        s += written;
+        length -= written;
+    }
+}
+
+static void record(Stats *stats, int64_t latency)
+{
+    int64_t microseconds = latency / 1000;
+    int bucket = 0;
+
+    while (bucket < LATENCY_BUCKETS - 1 && ((int64_t)1 << bucket) < microseconds)
+        bucket++;
+
+    stats->latencies[bucket]++;
+    if (latency > stats->longest)
+        stats->longest = latency;
+}
+
+/*
+ * The response is the request's number, its outcome and then text, without
+ * the newline that a result ends with.
+ */
+static void respond(Worker *worker, Job *job, char *outcome, char *text)
+{
+    Connection *connection = job->connection;
+    StringBuilder *sb = stringbuilder_new();
+    size_t length = strlen(text);
+
+    if (length > 0 && text[length - 1] == '\n')
+        length--;
+
+    stringbuilder_append_int64(sb, job->id);
+    stringbuilder_append_char(sb, ' ');
+    stringbuilder_append(sb, outcome);
+    stringbuilder_append_char(sb, ' ');
+    for (size_t i = 0; i < length; i++)
+        stringbuilder_append_char(sb, text[i]);
+    stringbuilder_append_char(sb, '\n');
+
+    char *response = stringbuilder_free_use(sb);
+
+    pthread_mutex_lock(&connection->lock);
+    writeFully(connection->output, response, strlen(response));
+    connection->pending--;
+    if (connection->pending == 0)
+        pthread_cond_signal(&connection->finished);
+    pthread_mutex_unlock(&connection->lock);
+
+    record(&worker->stats, now() - job->read);
+    FREE(response);
+}
+
+static void runJob(Worker *worker, BciVM *vm, Job *job)
+{
+    char *error = job->error;
+
+    if (error == NULL)
+        error = job->path != NULL ? bci_vm_loadFile(vm, job->path) : bci_vm_load(vm, job->block, job->size);
+    if (error == NULL && !bci_vm_verified(vm))
+        error = STRDUP("Serve: not proven to pass every check");
+
+    if (error != NULL)
+    {
+        worker->stats.failed++;
+        respond(worker, job, "error", error);
+        FREE(error);
+    }
+    else
+    {
+        char *result = bci_vm_run(vm);
+        int stopped = bci_vm_stopped(vm);
+        int failed = bci_vm_failed(vm);
+
+        if (failed)
+            worker->stats.failed++;
+        else if (stopped)
+            worker->stats.stopped++;
+        else
+            worker->stats.ok++;
+        respond(worker, job, failed ? "error" : stopped ? "stopped" : "ok", result);
+        FREE(result);
+    }
+
+    if (job->path != NULL)
+        FREE(job->path);
+    if (job->block != NULL)
+        FREE(job->block);
+    FREE(job);
+}
+
+static void *work(void *argument)
+{
+    Worker *worker = argument;
+    BciVM *vm = bci_vm_new(worker->options->gcPolicy);
+    Job *job;
+
+    bci_vm_setLimits(vm, worker->options->instructionLimit, worker->options->memoryLimit);
+    while ((job = queue_take(worker->queue)) != NULL)
+        runJob(worker, vm, job);
+    bci_vm_free(vm);
+
+    return NULL;
+}
+
+static Job *newJob(int64_t id, Connection *connection)
+{
+    Job *job = ALLOCATE(Job, 1);
+
+    job->id = id;
+    job->path = NULL;
+    job->block = NULL;
+    job->size = 0;
+    job->error = NULL;
+    job->read = now();
+    job->connection = connection;
+
+    return job;
+}
+
+static int parseSize(char *s, int32_t *size)
+{
+    char *end;
+    long value = strtol(s, &end, 10);
+
+    if (*s == '\0' || *end != '\0' || value < 0 || value > INT32_MAX)
+        return 0;
+
+    *size = (int32_t)value;
+    return 1;
+}
+
+static Connection *newConnection(FILE *input, int output, Queue *queue, Clients *clients)
+{
+    Connection *connection = ALLOCATE(Connection, 1);
+
+    connection->input = input;
+    connection->output = output;
+    connection->queue = queue;
+    pthread_mutex_init(&connection->lock, NULL);
+    pthread_cond_init(&connection->finished, NULL);
+    connection->pending = 0;
+    connection->clients = clients;
+    connection->next = NULL;
+
+    return connection;
+}
+
+static void freeConnection(Connection *connection)
+{
+    pthread_mutex_destroy(&connection->lock);
+    pthread_cond_destroy(&connection->finished);
+    FREE(connection);
+}
+
+/*
+ * Queue every request read from the connection's input, responding on the
+ * connection, until the input ends, and then wait for the responses.  A blob
+ * whose size cannot be read, or that is cut short, leaves no way to find the
+ * next request, so its error is the last response.
+ */
+static void serveConnection(Connection *connection)
+{
+    FILE *input = connection->input;
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    int64_t id = 0;
+
+    while ((length = getline(&line, &capacity, input)) != -1)
+    {
+        if (length > 0 && line[length - 1] == '\n')
+            line[--length] = '\0';
+        if (length == 0)
+            continue;
+
+        Job *job = newJob(++id, connection);
+        int last = 0;
+
+        if (line[0] == '#')
+        {
+            if (!parseSize(line + 1, &job->size))
+            {
+                job->error = errorFor("Serve: invalid size: %s", line + 1);
+                last = 1;
+            }
+            else
+            {
+                job->block = ALLOCATE(unsigned char, job->size);
+                if (fread(job->block, 1, job->size, input) != (size_t)job->size)
+                {
+                    job->error = errorFor("Serve: bytecode cut short: %s", line + 1);
+                    last = 1;
+                }
+            }
+        }
+        else
+            job->path = STRDUP(line);
+
+        pthread_mutex_lock(&connection->lock);
+        connection->pending++;
+        pthread_mutex_unlock(&connection->lock);
+        queue_put(connection->queue, job);
+
+        if (last)
+            break;
+    }
+    free(line);
+
+    pthread_mutex_lock(&connection->lock);
+    while (connection->pending > 0)
+        pthread_cond_wait(&connection->finished, &connection->lock);
+    pthread_mutex_unlock(&connection->lock);
+}
+
+/*
+ * The thread reading a connection to the socket, which takes the connection
+ * out of the open ones and closes it once it has been served.
+ */
+static void *readConnection(void *argument)
+{
+    Connection *connection = argument;
+    Clients *clients = connection->clients;
+
+    serveConnection(connection);
+
+    pthread_mutex_lock(&clients->lock);
+    Connection **link = &clients->open;
+    while (*link != connection)
+        link = &(*link)->next;
+    *link = connection->next;
+    if (clients->open == NULL)
+        pthread_cond_signal(&clients->closed);
+    pthread_mutex_unlock(&clients->lock);
+
+    fclose(connection->input);
+    freeConnection(connection);
+
+    return NULL;
+}
+
+/*
+ * Start a thread to read the connection on fd, with the signals that stop the
+ * server blocked so that they are taken by the thread accepting connections.
+ */
+static int accepted(int fd, Queue *queue, Clients *clients, sigset_t *signals)
+{
+    FILE *input = fdopen(fd, "r");
+    Connection *connection = newConnection(input, fd, queue, clients);
+    pthread_attr_t attributes;
+    pthread_t thread;
+
+    pthread_mutex_lock(&clients->lock);
+    connection->next = clients->open;
+    clients->open = connection;
+    pthread_mutex_unlock(&clients->lock);
+
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    pthread_sigmask(SIG_BLOCK, signals, NULL);
+    int created = pthread_create(&thread, &attributes, readConnection, connection);
+    pthread_sigmask(SIG_UNBLOCK, signals, NULL);
+    pthread_attr_destroy(&attributes);
+
+    if (created == 0)
+        return 1;
+
+    pthread_mutex_lock(&clients->lock);
+    clients->open = connection->next;
+    pthread_mutex_unlock(&clients->lock);
+    fclose(input);
+    freeConnection(connection);
+
+    return 0;
+}
+
+static void stop(int signal)
+{
+    (void)signal;
+    stopping = 1;
+}
+
+static int serveSocket(char *path, Queue *queue)
+{
+    struct sockaddr_un address;
+    struct sigaction action;
+    sigset_t signals;
+    Clients clients;
+    int result = 0;
+
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Serve: socket path too long: %s\n", path);
+        return 1;
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    unlink(path);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0)
+    {
+        fprintf(stderr, "Serve: unable to listen on %s: %s\n", path, strerror(errno));
+        if (listener >= 0)
+            close(listener);
+        return 1;
+    }
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_mutex_init(&clients.lock, NULL);
+    pthread_cond_init(&clients.closed, NULL);
+    clients.open = NULL;
+
+    while (!stopping)
+    {
+        int fd = accept(listener, NULL, NULL);
+
+        if (fd < 0 && errno == EINTR)
+            continue;
+        if (fd < 0)
+        {
+            fprintf(stderr, "Serve: unable to accept on %s: %s\n", path, strerror(errno));
+            result = 1;
+            break;
+        }
+
+        if (!accepted(fd, queue, &clients, &signals))
+            fprintf(stderr, "Serve: unable to start a thread for a connection on %s\n", path);
+    }
+
+    close(listener);
+    unlink(path);
+
+    pthread_mutex_lock(&clients.lock);
+    for (Connection *connection = clients.open; connection != NULL; connection = connection->next)
+        shutdown(connection->output, SHUT_RD);
+    while (clients.open != NULL)
+        pthread_cond_wait(&clients.closed, &clients.lock);
+    pthread_mutex_unlock(&clients.lock);
+
+    pthread_mutex_destroy(&clients.lock);
+    pthread_cond_destroy(&clients.closed);
+
+    return result;
+}
+
+static void report(Worker *workers, int count, int64_t elapsed)
+{
+    Stats total;
+
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < count; i++)
+    {
+        Stats *stats = &workers[i].stats;
+
+        total.ok += stats->ok;
+        total.stopped += stats->stopped;
+        total.failed += stats->failed;
+        for (int b = 0; b < LATENCY_BUCKETS; b++)
+            total.latencies[b] += stats->latencies[b];
+        if (stats->longest > total.longest)
+            total.longest = stats->longest;
+    }
+
+    int64_t jobs = total.ok + total.stopped + total.failed;
+    double seconds = elapsed / 1e9;
+
+    fprintf(stderr, "serve: %lld jobs in %.3fs, %.1f jobs/s, on %d workers: %lld ok, %lld stopped, %lld error\n",
+            (long long)jobs, seconds, seconds > 0 ? jobs / seconds : 0.0, count,
+            (long long)total.ok, (long long)total.stopped, (long long)total.failed);
+    if (jobs == 0)
+        return;
+
+    fprintf(stderr, "serve: latency        jobs\n");
+    for (int b = 0; b < LATENCY_BUCKETS; b++)
+    {
+        if (total.latencies[b] == 0)
+            continue;
+        if (b == LATENCY_BUCKETS - 1)
+            fprintf(stderr, "serve:   > %8lldus %8lld\n", (long long)1 << (b - 1), (long long)total.latencies[b]);
+        else
+            fprintf(stderr, "serve:  <= %8lldus %8lld\n", (long long)1 << b, (long long)total.latencies[b]);
+    }
+
+    double percentiles[] = {0.5, 0.9, 0.99};
+    fprintf(stderr, "serve:");
+    for (int p = 0; p < 3; p++)
+    {
+        int64_t seen = 0;
+        int b = 0;
+
+        while ((seen += total.latencies[b]) < percentiles[p] * jobs)
+            b++;
+        fprintf(stderr, " p%g <= %lldus,", percentiles[p] * 100, (long long)1 << b);
+    }
+    fprintf(stderr, " max %lldus\n", (long long)(total.longest / 1000));
+}
+
+int serve(ServeOptions *options)
+{
+    Queue queue;
+    Worker *workers = ALLOCATE(Worker, options->workers);
+    sigset_t signals;
+    int result = 0;
+
+    queue_initialise(&queue, options->workers * QUEUE_PER_WORKER);
+
+    /*
+     * The workers block the signals that stop the server so that they are
+     * always taken by the thread waiting on the socket.
+     */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    for (int i = 0; i < options->workers; i++)
+    {
+        workers[i].queue = &queue;
+        workers[i].options = options;
+        memset(&workers[i].stats, 0, sizeof(Stats));
+        pthread_create(&workers[i].thread, NULL, work, &workers[i]);
+    }
+    pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+
+    int64_t start = now();
+
+    if (options->socketPath == NULL)
+    {
+        Connection *connection = newConnection(stdin, STDOUT_FILENO, &queue, NULL);
+
+        serveConnection(connection);
+        freeConnection(connection);
+    }
+    else
+        result = serveSocket(options->socketPath, &queue);
+
+    queue_close(&queue);
+    for (int i = 0; i < options->workers; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    report(workers, options->workers, now() - start);
+
+    queue_destroy(&queue);
+    FREE(workers);
+
+    return result;
+}
@@ -0,0 +1,41 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <stdint.h>
+
+#include "value.h"
+
+/*
+ * Run many programs in one process on a fixed pool of worker threads, each
+ * with its own VM.  Programs are read from standard input, or from the
+ * connections to the Unix domain socket at socketPath should it not be NULL,
+ * each read by a thread of its own so that a client holding its connection
+ * open holds up no other.  Every request is a line holding the path of a program, or a line
+ * holding # and a byte count followed by that many bytes of bytecode.
+ *
+ * Requests are numbered from 1, per connection, and each response is a line
+ * holding the number of its request, then ok and the program's result,
+ * stopped and the limit that the program exceeded, or error and why the
+ * program could not be run.  Responses are written as programs finish, so
+ * not necessarily in the order requested.  Only programs that the verifier
+ * proves to pass every check are run so that no program can end the process.
+ *
+ * Each program run is limited to instructionLimit instructions and
+ * memoryLimit bytes, where above 0.  On the end of standard input, or on
+ * SIGINT or SIGTERM when listening on a socket, which stops reading from every
+ * connection still open, the requests already read are finished and the throughput and a histogram of the latencies of the
+ * requests, from being read to being responded to, are reported on standard
+ * error.
+ */
+typedef struct
+{
+    GCPolicy gcPolicy;
+    int workers;
+    char *socketPath;
+    int64_t instructionLimit;
+    int64_t memoryLimit;
+} ServeOptions;
+
+extern int serve(ServeOptions *options);
+
+#endif
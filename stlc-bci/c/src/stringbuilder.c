@@ -33,3 +33,9 @@ void stringbuilder_append_int(StringBuilder *sb, int i) {
     sprintf(buffer, "%d", i);
     stringbuilder_append(sb, buffer);
 }
+
+void stringbuilder_append_int64(StringBuilder *sb, int64_t i) {
+    char buffer[24];
+    sprintf(buffer, "%lld", (long long)i);
+    stringbuilder_append(sb, buffer);
+}
@@ -1,6 +1,8 @@
 #ifndef STRINGBUILDER_H
 #define STRINGBUILDER_H
 
+#include <stdint.h>
+
 #include "buffer.h"
 
 typedef Buffer StringBuilder;
@@ -13,5 +15,6 @@ extern char *stringbuilder_free_use(StringBuilder *sb);
 extern void stringbuilder_append(StringBuilder *sb, char *s);
 extern void stringbuilder_append_char(StringBuilder *sb, char c);
 extern void stringbuilder_append_int(StringBuilder *sb, int i);
+extern void stringbuilder_append_int64(StringBuilder *sb, int64_t i);
 
 #endif
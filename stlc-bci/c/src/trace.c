@@ -0,0 +1,298 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "memory.h"
+
+#include "trace.h"
+
+#define TRACE_VERSION 2
+
+typedef struct
+{
+    char magic[4];
+    uint16_t version;
+    uint16_t eventSize;
+    uint16_t memoryEventSize;
+    uint16_t unused;
+    uint32_t memoryCount;
+    uint64_t recorded;
+    uint64_t memoryRecorded;
+} TraceHeader;
+
+static const int crashSignals[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+
+#define CRASH_SIGNAL_COUNT ((int)(sizeof(crashSignals) / sizeof(crashSignals[0])))
+
+static Trace *volatile crashTrace = NULL;
+static volatile int crashFd = -1;
+static int handlersInstalled = 0;
+
+void trace_initialise(Trace *trace, int32_t events)
+{
+    uint32_t capacity = 2;
+
+    while (capacity < (uint32_t)events + 1 && capacity < 0x80000000u)
+        capacity *= 2;
+
+    trace->events = ALLOCATE(TraceEvent, capacity);
+    memset(trace->events, 0, sizeof(TraceEvent) * capacity);
+    trace->memoryEvents = ALLOCATE(TraceMemoryEvent, capacity);
+    memset(trace->memoryEvents, 0, sizeof(TraceMemoryEvent) * capacity);
+    trace->mask = capacity - 1;
+    trace->kept = (uint64_t)events < capacity - 1 ? (uint64_t)events : capacity - 1;
+    atomic_init(&trace->head, 0);
+    atomic_init(&trace->memoryHead, 0);
+}
+
+void trace_destroy(Trace *trace)
+{
+    FREE(trace->events);
+    FREE(trace->memoryEvents);
+}
+
+static int writeAll(int fd, const void *data, size_t size)
+{
+    const char *p = data;
+
+    while (size > 0)
+    {
+        ssize_t written = write(fd, p, size);
+
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return -1;
+        p += written;
+        size -= (size_t)written;
+    }
+
+    return 0;
+}
+
+/*
+ * A ring is a power of two in size and larger than the events it keeps, so
+ * that the slot that the writer may be part way through overwriting, the one
+ * at its head, is never among those written.
+ */
+static int writeRing(int fd, void *events, size_t eventSize, uint64_t mask, uint64_t first, uint64_t head)
+{
+    uint64_t capacity = mask + 1;
+    uint64_t start = first & mask;
+    uint64_t count = head - first;
+    uint64_t untilEnd = capacity - start < count ? capacity - start : count;
+
+    if (writeAll(fd, (char *)events + start * eventSize, untilEnd * eventSize) < 0)
+        return -1;
+
+    return writeAll(fd, events, (count - untilEnd) * eventSize);
+}
+
+int trace_write(Trace *trace, int fd)
+{
+    uint64_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+    uint64_t memoryHead = atomic_load_explicit(&trace->memoryHead, memory_order_relaxed);
+    uint64_t first = head > trace->kept ? head - trace->kept : 0;
+    uint64_t memoryFirst = memoryHead > trace->kept ? memoryHead - trace->kept : 0;
+    TraceHeader header = {{'B', 'C', 'I', 'T'}, TRACE_VERSION, sizeof(TraceEvent), sizeof(TraceMemoryEvent), 0, (uint32_t)(memoryHead - memoryFirst), head, memoryHead};
+
+    atomic_signal_fence(memory_order_acquire);
+
+    if (lseek(fd, 0, SEEK_SET) < 0 || ftruncate(fd, 0) < 0)
+        return -1;
+    if (writeAll(fd, &header, sizeof(header)) < 0)
+        return -1;
+    if (writeRing(fd, trace->memoryEvents, sizeof(TraceMemoryEvent), trace->mask, memoryFirst, memoryHead) < 0)
+        return -1;
+
+    return writeRing(fd, trace->events, sizeof(TraceEvent), trace->mask, first, head);
+}
+
+static void writeCrashTrace(void)
+{
+    Trace *trace = crashTrace;
+
+    if (trace != NULL)
+        trace_write(trace, crashFd);
+}
+
+static void onDump(int signal)
+{
+    int saved = errno;
+
+    (void)signal;
+    writeCrashTrace();
+    errno = saved;
+}
+
+/*
+ * A crash writes the trace once and then takes the signal's default action, so
+ * that the process ends as it would have.
+ */
+static void onCrash(int signal)
+{
+    writeCrashTrace();
+    crashTrace = NULL;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_DFL;
+    sigemptyset(&action.sa_mask);
+    sigaction(signal, &action, NULL);
+    raise(signal);
+}
+
+static void onExit(void)
+{
+    writeCrashTrace();
+    crashTrace = NULL;
+}
+
+void trace_writeOnCrash(Trace *trace, int fd)
+{
+    crashTrace = NULL;
+    crashFd = fd;
+    crashTrace = trace;
+
+    if (trace == NULL || handlersInstalled)
+        return;
+    handlersInstalled = 1;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+
+    action.sa_handler = onCrash;
+    for (int i = 0; i < CRASH_SIGNAL_COUNT; i++)
+        sigaction(crashSignals[i], &action, NULL);
+
+    action.sa_handler = onDump;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &action, NULL);
+
+    atexit(onExit);
+}
+
+/*
+ * The stack effect of an instruction that a superinstruction performs before
+ * its last, so that the stack pointer can be given for each of them.
+ */
+static int32_t stackEffect(int opcode)
+{
+    switch (opcode)
+    {
+    case PUSH_INT:
+    case PUSH_VAR:
+        return 1;
+    case EQ:
+    case STORE_VAR:
+        return -1;
+    default:
+        return 0;
+    }
+}
+
+static void printInstruction(Code *code, TraceEvent *event)
+{
+    int32_t sp = event->sp;
+    int32_t length = code_fusedLength(event->opcode);
+
+    if (event->ip < 0 || event->ip + length > code->size + 1)
+    {
+        printf(". Instruction out of range: %d\n", event->ip);
+        return;
+    }
+    for (int32_t i = 0; i < length; i++)
+    {
+        int32_t ip = event->ip + i;
+
+        code_printInstruction(code, ip);
+        printf(": sp %d\n", sp);
+        if (ip < code->size)
+            sp += stackEffect(code->ops[ip].opcode);
+    }
+}
+
+static void printMemoryEvent(TraceMemoryEvent *event)
+{
+    switch (event->kind)
+    {
+    case TRACE_ALLOCATE:
+        printf(". allocate %lld bytes: sp %d\n", (long long)event->value, event->sp);
+        break;
+    case TRACE_MINOR_GC:
+        printf(". minor collection: %lld objects in the heap: sp %d\n", (long long)event->value, event->sp);
+        break;
+    case TRACE_MAJOR_GC:
+        printf(". major collection: %lld objects live: sp %d\n", (long long)event->value, event->sp);
+        break;
+    default:
+        printf(". Unknown event: %d\n", event->kind);
+    }
+}
+
+/*
+ * A memory event that happened during an instruction older than those kept is
+ * left out, and one recorded before the first instruction of the run is shown
+ * first.
+ */
+void trace_print(Code *code, char *fileName)
+{
+    FILE *fp = fopen(fileName, "rb");
+    TraceHeader header;
+
+    if (fp == NULL)
+    {
+        printf("Unable to read trace: %s\n", fileName);
+        exit(1);
+    }
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, "BCIT", 4) != 0)
+    {
+        printf("Not a trace: %s\n", fileName);
+        exit(1);
+    }
+    if (header.version != TRACE_VERSION || header.eventSize != sizeof(TraceEvent) || header.memoryEventSize != sizeof(TraceMemoryEvent))
+    {
+        printf("Unsupported trace version: %d\n", header.version);
+        exit(1);
+    }
+
+    TraceMemoryEvent *memoryEvents = ALLOCATE(TraceMemoryEvent, header.memoryCount + 1);
+    if (fread(memoryEvents, sizeof(TraceMemoryEvent), header.memoryCount, fp) != header.memoryCount)
+    {
+        printf("Not a trace: %s\n", fileName);
+        exit(1);
+    }
+
+    long start = ftell(fp);
+    fseek(fp, 0, SEEK_END);
+    uint64_t count = ((uint64_t)ftell(fp) - (uint64_t)start) / sizeof(TraceEvent);
+    fseek(fp, start, SEEK_SET);
+
+    uint64_t first = header.recorded - count;
+    uint32_t next = 0;
+
+    if (count < header.recorded)
+        printf(". The last %llu of %llu instructions\n", (unsigned long long)count, (unsigned long long)header.recorded);
+    if (header.memoryCount < header.memoryRecorded)
+        printf(". The last %u of %llu memory events\n", header.memoryCount, (unsigned long long)header.memoryRecorded);
+
+    while (next < header.memoryCount && memoryEvents[next].instructions <= first && first > 0)
+        next++;
+
+    TraceEvent event;
+    for (uint64_t index = first; fread(&event, sizeof(event), 1, fp) == 1; index++)
+    {
+        for (; next < header.memoryCount && memoryEvents[next].instructions <= index; next++)
+            printMemoryEvent(&memoryEvents[next]);
+        printInstruction(code, &event);
+    }
+    for (; next < header.memoryCount; next++)
+        printMemoryEvent(&memoryEvents[next]);
+
+    FREE(memoryEvents);
+    fclose(fp);
+}
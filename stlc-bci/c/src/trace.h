@@ -0,0 +1,117 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "code.h"
+
+/*
+ * A trace keeps the most recent events of a run in rings of fixed size binary
+ * records, without the cost of printing each instruction.  An instruction
+ * event holds the index of the instruction dispatched, the opcode that it was
+ * dispatched as, which may be a quickened form or a superinstruction, and the
+ * stack pointer before it ran.  The memory manager records, in a ring of its
+ * own, an allocation with its size in bytes and the end of a minor or a major
+ * collection with the objects then in the paged heap, each with the stack
+ * pointer and the count of instructions recorded before it, which places it
+ * among them.
+ *
+ * Each ring has a single writer, the thread running the program, which never
+ * waits: each event is written into the slot after the last and only then
+ * published by advancing the ring's head.  trace_write can so be called from
+ * a signal handler that interrupts the writer, as it only uses write and, of
+ * the events published, leaves out the oldest should its slot be the one
+ * being written.  Since the only reader runs on the writer's thread, a signal
+ * fence orders an event before the head that publishes it, and heads are
+ * otherwise stored and loaded relaxed.
+ *
+ * trace_recordInstruction takes the ring, its mask and its head from the
+ * caller, so that a run loop can keep them in registers, only storing the
+ * head to publish an event.  An allocation reads that head but never writes
+ * it, which is why it has a ring of its own.
+ */
+typedef enum
+{
+    TRACE_ALLOCATE = 1,
+    TRACE_MINOR_GC,
+    TRACE_MAJOR_GC
+} TraceEventKind;
+
+typedef struct
+{
+    int32_t ip;
+    int32_t sp;
+    int32_t opcode;
+} TraceEvent;
+
+typedef struct
+{
+    uint64_t instructions;
+    int32_t kind;
+    int32_t sp;
+    int64_t value;
+} TraceMemoryEvent;
+
+typedef struct
+{
+    TraceEvent *events;
+    uint64_t mask;
+    uint64_t kept;
+    _Atomic uint64_t head;
+    TraceMemoryEvent *memoryEvents;
+    _Atomic uint64_t memoryHead;
+} Trace;
+
+#define TRACE_DEFAULT_EVENTS 65536
+
+static inline uint64_t trace_recordInstruction(Trace *trace, TraceEvent *events, uint64_t mask, uint64_t head, int32_t opcode, int32_t ip, int32_t sp)
+{
+    events[head & mask] = (TraceEvent){ip, sp, opcode};
+    atomic_signal_fence(memory_order_release);
+    atomic_store_explicit(&trace->head, head + 1, memory_order_relaxed);
+
+    return head + 1;
+}
+
+static inline void trace_recordMemory(Trace *trace, int kind, int32_t sp, int64_t value)
+{
+    uint64_t head = atomic_load_explicit(&trace->memoryHead, memory_order_relaxed);
+    uint64_t instructions = atomic_load_explicit(&trace->head, memory_order_relaxed);
+
+    trace->memoryEvents[head & trace->mask] = (TraceMemoryEvent){instructions, kind, sp, value};
+    atomic_signal_fence(memory_order_release);
+    atomic_store_explicit(&trace->memoryHead, head + 1, memory_order_relaxed);
+}
+
+/*
+ * trace_initialise makes rings that each keep the last events events.
+ *
+ * trace_write writes the events in the rings, oldest first, to fd from its
+ * start, replacing what was there, and returns 0, or -1 should a write fail.
+ * The file starts with a header of the magic bytes "BCIT", a 16 bit version,
+ * the 16 bit sizes of an instruction and of a memory event, the 32 bit number
+ * of memory events in the file and the 64 bit counts of the instruction and
+ * of the memory events ever recorded, so that a reader can tell how many were
+ * overwritten.  The memory events follow and then the instruction events, all
+ * in the byte order of the machine that wrote them.
+ *
+ * Until trace_writeOnCrash is called again with NULL, the trace is written to
+ * fd should the process exit or crash, and whenever it receives SIGUSR1.
+ * There is only the one such trace in a process.
+ *
+ * trace_print renders the trace in a file for the code that it was recorded
+ * running, as bci run -d logs instructions but with the stack pointer in place
+ * of the stack and the activation.  Every instruction that a superinstruction
+ * stands for is shown, and memory events are shown after the instruction
+ * during which they happened.
+ */
+extern void trace_initialise(Trace *trace, int32_t events);
+extern void trace_destroy(Trace *trace);
+
+extern int trace_write(Trace *trace, int fd);
+extern void trace_writeOnCrash(Trace *trace, int fd);
+
+extern void trace_print(Code *code, char *fileName);
+
+#endif
@@ -1,22 +1,28 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include "memory.h"
 #include "stringbuilder.h"
 
 #include "value.h"
 
-Value *value_True;
-Value *value_False;
+#define DEFAULT_INITIAL_HEAP 4096
+#define DEFAULT_NURSERY_SIZE (256 * 1024)
+#define MINIMUM_NURSERY_SIZE 1024
+#define DEFAULT_MARK_STACK_LIMIT (1024 * 1024)
+#define DEFAULT_GROWTH_FACTOR 2.0
+#define DEFAULT_TARGET_OCCUPANCY 0.5
+#define DEFAULT_PAUSE_BUDGET 0
+#define DEFAULT_FRAME_STACK_SIZE (8 * 1024 * 1024)
 
-#define DEFAULT_CAPACITY 256
+#define INCREMENTAL_STEP_ALLOCATIONS 1024
+#define PAUSE_CLOCK_INTERVAL 64
 
 // #define TIME_GC
 // #define DEBUG_GC
-#define GC_FORCE
-
-static MemoryState internalMM;
 
 static int activationDepth(Value *v)
 {
@@ -34,7 +40,7 @@ static int activationDepth(Value *v)
     }
 }
 
-char *value_toString(Value *v)
+static char *toString(Value *v, int32_t *offsets)
 {
     if (v == NULL)
     {
@@ -46,12 +52,11 @@ char *value_toString(Value *v)
     case VInt:
     {
         char buffer[256];
-        // sprintf(buffer, "%d (%p)", v->data.i, (void *)v);
-        sprintf(buffer, "%d", v->data.i);
+        sprintf(buffer, "%d", value_asInt(v));
         return STRDUP(buffer);
     }
     case VBool:
-        if (v->data.b)
+        if (value_asBool(v))
             return STRDUP("true");
         else
             return STRDUP("false");
@@ -59,15 +64,15 @@ char *value_toString(Value *v)
     {
         char buffer[256];
         // sprintf(buffer, "c%d#%d (%p)", v->data.c.ip, activationDepth(v->data.c.previousActivation), (void *)v);
-        sprintf(buffer, "c%d#%d", v->data.c.ip, activationDepth(v->data.c.previousActivation));
+        sprintf(buffer, "c%d#%d", offsets == NULL ? v->data.c.ip : offsets[v->data.c.ip], activationDepth(v->data.c.previousActivation));
         return STRDUP(buffer);
     }
     case VActivation:
     {
         StringBuilder *sb = stringbuilder_new();
 
-        char *parentActivation = value_toString(v->data.a.parentActivation);
-        char *closure = value_toString(v->data.a.closure);
+        char *parentActivation = toString(v->data.a.parentActivation, offsets);
+        char *closure = toString(v->data.a.closure, offsets);
 
         stringbuilder_append(sb, "<");
         stringbuilder_append(sb, parentActivation);
@@ -77,7 +82,7 @@ char *value_toString(Value *v)
         if (v->data.a.nextIP == -1)
             stringbuilder_append(sb, "-");
         else
-            stringbuilder_append_int(sb, v->data.a.nextIP);
+            stringbuilder_append_int(sb, offsets == NULL ? v->data.a.nextIP : offsets[v->data.a.nextIP]);
         stringbuilder_append(sb, ", ");
 
         FREE(closure);
@@ -92,7 +97,7 @@ char *value_toString(Value *v)
             stringbuilder_append(sb, "[");
             for (int i = 0; i < v->data.a.stateSize; i++)
             {
-                char *state = value_toString(v->data.a.state[i]);
+                char *state = toString(v->data.a.state[i], offsets);
                 stringbuilder_append(sb, state);
                 FREE(state);
                 if (i < v->data.a.stateSize - 1)
@@ -113,20 +118,158 @@ char *value_toString(Value *v)
     }
 }
 
-MemoryState value_newMemoryManager(int initialStackSize)
+char *value_toString(Value *v)
+{
+    return toString(v, NULL);
+}
+
+/*
+ * Instruction pointers held in closures and activations are indices into the
+ * decoded code.  offsets maps them back to byte offsets in the block so that a
+ * value prints the same however the code is held.
+ */
+char *value_toStringWithOffsets(Value *v, int32_t *offsets)
+{
+    return toString(v, offsets);
+}
+
+GCPolicy value_defaultGCPolicy(void)
+{
+    GCPolicy policy;
+
+    policy.initialHeap = DEFAULT_INITIAL_HEAP;
+    policy.nurserySize = DEFAULT_NURSERY_SIZE;
+    policy.growthFactor = DEFAULT_GROWTH_FACTOR;
+    policy.targetOccupancy = DEFAULT_TARGET_OCCUPANCY;
+    policy.stress = 0;
+    policy.pauseBudget = DEFAULT_PAUSE_BUDGET;
+    policy.frameStackSize = DEFAULT_FRAME_STACK_SIZE;
+    policy.stats = NULL;
+
+    return policy;
+}
+
+char *value_validateGCPolicy(GCPolicy *policy)
+{
+    if (policy->initialHeap < 1)
+        return "initial heap must be at least 1 object";
+    if (policy->nurserySize < MINIMUM_NURSERY_SIZE)
+        return "nursery must be at least 1024 bytes";
+    if (policy->growthFactor <= 1.0)
+        return "growth factor must be greater than 1";
+    if (policy->targetOccupancy <= 0.0 || policy->targetOccupancy > 1.0)
+        return "target occupancy must be in the range (0, 1]";
+    if (policy->pauseBudget < 0)
+        return "pause budget must not be negative";
+    if (policy->frameStackSize < 0)
+        return "frame stack must not be negative";
+
+    return NULL;
+}
+
+static void valueList_initialise(ValueList *list)
+{
+    list->size = 0;
+    list->capacity = 0;
+    list->items = NULL;
+}
+
+static void valueList_destroy(ValueList *list)
+{
+    if (list->items != NULL)
+        FREE(list->items);
+
+    valueList_initialise(list);
+}
+
+static void valueList_append(ValueList *list, Value *v)
+{
+    if (list->size == list->capacity)
+    {
+        if (list->items == NULL)
+        {
+            list->capacity = 64;
+            list->items = ALLOCATE(Value *, list->capacity);
+        }
+        else
+        {
+            list->capacity *= 2;
+            list->items = REALLOCATE(list->items, Value *, list->capacity);
+        }
+    }
+
+    list->items[list->size++] = v;
+}
+
+static void pauseList_initialise(PauseList *list)
+{
+    list->size = 0;
+    list->capacity = 0;
+    list->items = NULL;
+}
+
+static void pauseList_destroy(PauseList *list)
+{
+    if (list->items != NULL)
+        FREE(list->items);
+
+    pauseList_initialise(list);
+}
+
+static void pauseList_append(PauseList *list, int64_t pause)
+{
+    if (list->size == list->capacity)
+    {
+        if (list->items == NULL)
+        {
+            list->capacity = 64;
+            list->items = ALLOCATE(int64_t, list->capacity);
+        }
+        else
+        {
+            list->capacity *= 2;
+            list->items = REALLOCATE(list->items, int64_t, list->capacity);
+        }
+    }
+
+    list->items[list->size++] = pause;
+}
+
+MemoryState value_newMemoryManager(int initialStackSize, GCPolicy policy)
 {
     MemoryState mm;
 
-    mm.colour = VWhite;
+    mm.policy = policy;
 
     mm.size = 0;
-    mm.capacity = DEFAULT_CAPACITY;
+    mm.capacity = policy.initialHeap;
+
+    heap_initialise(&mm.heap);
+    nursery_initialise(&mm.nursery, policy.nurserySize);
+    if (policy.pauseBudget > 0)
+        nursery_setLimit(&mm.nursery, MINIMUM_NURSERY_SIZE);
+    frames_initialise(&mm.frames, policy.frameStackSize);
+    mm.framesLowWater = mm.frames.start;
+    valueList_initialise(&mm.remembered);
+    valueList_initialise(&mm.promoted);
+    valueList_initialise(&mm.markStack);
+    mm.markStackLimit = DEFAULT_MARK_STACK_LIMIT;
+    mm.markOverflow = 0;
+
+    mm.phase = GC_IDLE;
+    mm.stepCountdown = 0;
+    mm.stackCursor = 0;
+    mm.stackSnapshot = 0;
+    mm.frameCursor = mm.frames.start;
+    pauseList_initialise(&mm.pauses);
+    mm.stats = (GCStats){0, 0, 0, 0, 0};
+    mm.trace = NULL;
 
-    mm.root = NULL;
     mm.activation = NULL;
 
     mm.sp = 0;
     mm.stackSize = initialStackSize;
+    mm.stackLowWater = 0;
     mm.stack = ALLOCATE(Value *, initialStackSize);
 
     for (int i = 0; i < initialStackSize; i++)
@@ -135,19 +278,45 @@ MemoryState value_newMemoryManager(int initialStackSize)
     return mm;
 }
 
+static void addStats(MemoryState *mm)
+{
+    GCStats *stats = mm->policy.stats;
+    int64_t peakHeap = (int64_t)mm->heap.peakPageCount * HEAP_PAGE_SIZE;
+
+    stats->allocations += mm->stats.allocations;
+    stats->minorCollections += mm->stats.minorCollections;
+    stats->majorCollections += mm->stats.majorCollections;
+    stats->gcTime += mm->stats.gcTime;
+    if (peakHeap > stats->peakHeap)
+        stats->peakHeap = peakHeap;
+}
+
 void value_destroyMemoryManager(MemoryState *mm)
 {
+    if (mm->policy.stats != NULL)
+        addStats(mm);
+
     mm->stackSize = 0;
     mm->sp = 0;
     mm->activation = NULL;
 
-    forceGC(mm);
+    heap_destroy(&mm->heap);
+    nursery_destroy(&mm->nursery);
+    frames_destroy(&mm->frames);
+    valueList_destroy(&mm->remembered);
+    valueList_destroy(&mm->promoted);
+    valueList_destroy(&mm->markStack);
+    pauseList_destroy(&mm->pauses);
+    mm->phase = GC_IDLE;
+    mm->size = 0;
 
     FREE(mm->stack);
 }
 
 void push(Value *value, MemoryState *mm)
 {
+    value_shade(value, mm);
+
     if (mm->sp == mm->stackSize)
     {
         mm->stackSize *= 2;
@@ -160,6 +329,21 @@ void push(Value *value, MemoryState *mm)
     mm->stack[mm->sp++] = value;
 }
 
+void value_reserveStack(int n, MemoryState *mm)
+{
+    if (mm->sp + n <= mm->stackSize)
+        return;
+
+    int32_t stackSize = mm->stackSize;
+    while (mm->sp + n > stackSize)
+        stackSize *= 2;
+
+    mm->stack = REALLOCATE(mm->stack, Value *, stackSize);
+    for (int i = mm->stackSize; i < stackSize; i++)
+        mm->stack[i] = NULL;
+    mm->stackSize = stackSize;
+}
+
 Value *pop(MemoryState *mm)
 {
     if (mm->sp == 0)
@@ -168,7 +352,12 @@ Value *pop(MemoryState *mm)
         exit(1);
     }
 
-    return mm->stack[--mm->sp];
+    Value *result = mm->stack[--mm->sp];
+
+    if (mm->sp < mm->stackLowWater)
+        mm->stackLowWater = mm->sp;
+
+    return result;
 }
 
 void popN(int n, MemoryState *mm)
@@ -180,6 +369,9 @@ void popN(int n, MemoryState *mm)
     }
 
     mm->sp -= n;
+
+    if (mm->sp < mm->stackLowWater)
+        mm->stackLowWater = mm->sp;
 }
 
 Value *peek(int offset, MemoryState *mm)
@@ -201,149 +393,272 @@ long long timeInMilliseconds(void)
     return (((long long)tv.tv_sec) * 1000) + (tv.tv_usec / 1000);
 }
 
-static void mark(Value *v, Colour colour)
+static int64_t timeInNanoseconds(void)
 {
-    if (v == NULL)
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t)ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Marking is driven by an explicit mark stack of grey objects - objects that
+ * are marked but whose references have not yet been scanned - so that the depth
+ * of the object graph, such as a long chain of activations, is not limited by
+ * the C stack.  The mark stack is bounded: when it is full the object is left
+ * marked but unscanned and the overflow is recovered from by rescanning the
+ * marked objects in the heap once the mark stack has drained.  Young objects
+ * are left to the minor collector and frames, which are roots, are scanned
+ * directly.
+ */
+static void mark(Value *v, MemoryState *mm)
+{
+    if (v == NULL || value_isImmediate(v) || nursery_contains(&mm->nursery, v) || frames_contains(&mm->frames, v))
         return;
 
-    if (value_getColour(v) == colour)
+    if (!heap_mark(v))
         return;
 
+    mm->size++;
+
 #ifdef DEBUG_GC
-    ValueType oldValueType = value_getType(v);
-    Colour oldColour = value_getColour(v);
+    char *s = value_toString(v);
+    printf("gc: marking %s\n", s);
+    FREE(s);
 #endif
 
-    v->type = (value_getType(v) & 7) | colour;
+    v->type |= VALUE_GREY;
 
-#ifdef DEBUG_GC
-    if (oldValueType != value_getType(v))
+    if (mm->markStack.size < mm->markStackLimit)
     {
-        printf("gc: mark: type changed.\n");
-        exit(1);
+        __builtin_prefetch(v);
+        valueList_append(&mm->markStack, v);
     }
-    else if (oldColour == value_getColour(v))
+    else
     {
-        printf("gc: mark: colour did not change.\n");
-        exit(1);
+        mm->markOverflow = 1;
     }
-#endif
+}
 
-#ifdef DEBUG_GC
-    char *s = value_toString(v);
-    printf("gc: marking %s\n", s);
-    FREE(s);
-#endif
+static void scan(Value *v, MemoryState *mm)
+{
+    v->type &= ~VALUE_GREY;
 
     if (value_getType(v) == VActivation)
     {
-        mark(v->data.a.parentActivation, colour);
-        mark(v->data.a.closure, colour);
+        mark(v->data.a.parentActivation, mm);
+        mark(v->data.a.closure, mm);
         if (v->data.a.state != NULL)
         {
             for (int i = 0; i < v->data.a.stateSize; i++)
-                mark(v->data.a.state[i], colour);
+                mark(v->data.a.state[i], mm);
         }
     }
     else if (value_getType(v) == VClosure)
     {
-        mark(v->data.c.previousActivation, colour);
+        mark(v->data.c.previousActivation, mm);
+        for (int i = 0; i < v->data.c.freeSize; i++)
+            mark(v->data.c.free[i], mm);
     }
 }
 
-static void sweep(MemoryState *mm)
+static void drainMarkStack(MemoryState *mm)
 {
-    Value *v;
-#ifdef DEBUG_GC
-    v = mm->root;
-    while (v != NULL)
+    while (mm->markStack.size > 0)
+        scan(mm->markStack.items[--mm->markStack.size], mm);
+}
+
+static void rescanMarked(Value *v, void *context)
+{
+    MemoryState *mm = context;
+
+    scan(v, mm);
+    drainMarkStack(mm);
+}
+
+static inline int frameSize(Value *frame)
+{
+    return sizeof(Value) + (frame->data.a.state == NULL ? 0 : frame->data.a.stateSize * sizeof(Value *));
+}
+
+static void markFromRoots(MemoryState *mm)
+{
+    mark(mm->activation, mm);
+    drainMarkStack(mm);
+
+    for (char *p = mm->frames.start; p < mm->frames.top; p += frameSize((Value *)p))
     {
-        Value *nextV = v->next;
-        if (value_getColour(v) != mm->colour)
-        {
-            char *s = value_toString(v);
-            printf("gc: releasing %s\n", s);
-            FREE(s);
-        }
-        v = nextV;
+        scan((Value *)p, mm);
+        drainMarkStack(mm);
     }
-#endif
 
-    Value *newRoot = NULL;
-    int newSize = 0;
+    for (int i = 0; i < mm->sp; i++)
+    {
+        mark(mm->stack[i], mm);
+        drainMarkStack(mm);
+    }
 
-    v = mm->root;
-    while (v != NULL)
+    while (mm->markOverflow)
     {
-        Value *nextV = v->next;
-        if (value_getColour(v) == mm->colour)
-        {
-            v->next = newRoot;
-            newRoot = v;
-            newSize++;
-        }
-        else
-        {
-            switch (value_getType(v))
-            {
-            case VInt:
-            case VBool:
-#ifdef DEBUG_GC
-                v->data.i = -1;
+#ifdef TIME_GC
+        printf("gc: mark stack overflowed - rescanning the heap\n");
 #endif
-                break;
+        mm->markOverflow = 0;
+        heap_forEachMarked(&mm->heap, rescanMarked, mm);
+    }
+}
 
-            case VClosure:
-#ifdef DEBUG_GC
-                v->data.c.ip = -1;
-                v->data.c.previousActivation = NULL;
-#endif
-                break;
-            case VActivation:
-                if (v->data.a.state != NULL)
-                {
-                    FREE(v->data.a.state);
-                }
-#ifdef DEBUG_GC
-                v->data.a.parentActivation = NULL;
-                v->data.a.closure = NULL;
-                v->data.a.nextIP = -1;
-                v->data.a.stateSize = -1;
-                v->data.a.state = NULL;
-#endif
-                break;
-            }
-            v->type = 0;
+/*
+ * Copy a young object into the paged heap, leaving a forwarding pointer
+ * behind in the nursery.  An activation's state, and the values captured by a
+ * flat closure, are held in the nursery while young and so are moved into
+ * their own allocation.  The copy is queued so
+ * that its own references are forwarded in turn.  While incremental marking
+ * is under way the copy is allocated black: the barriers ensure that anything
+ * a young object refers to has already been shaded.
+ */
+static Value *forward(Value *v, MemoryState *mm)
+{
+    if (!value_isYoung(v, mm))
+        return v;
 
-            FREE(v);
-        }
-        v = nextV;
+    if (v->type & VALUE_FORWARDED)
+        return v->data.c.previousActivation;
+
+    Value *copy = heap_allocate(&mm->heap);
+    *copy = *v;
+    mm->size++;
+
+    if (mm->phase == GC_MARKING)
+        heap_mark(copy);
+
+    if (value_getType(v) == VActivation && v->data.a.state != NULL)
+    {
+        copy->data.a.state = ALLOCATE(Value *, v->data.a.stateSize);
+        for (int i = 0; i < v->data.a.stateSize; i++)
+            copy->data.a.state[i] = v->data.a.state[i];
+    }
+    else if (value_getType(v) == VClosure && v->data.c.freeSize > 0)
+    {
+        copy->data.c.free = ALLOCATE(Value *, v->data.c.freeSize);
+        for (int i = 0; i < v->data.c.freeSize; i++)
+            copy->data.c.free[i] = v->data.c.free[i];
     }
 
-#ifdef TIME_GC
-    if (mm->size != newSize)
+    v->type |= VALUE_FORWARDED;
+    v->data.c.previousActivation = copy;
+
+    valueList_append(&mm->promoted, copy);
+
+    return copy;
+}
+
+static void forwardReferences(Value *v, MemoryState *mm)
+{
+    if (value_getType(v) == VActivation)
     {
-        printf("gc: collected %d objects, %d remaining\n", mm->size - newSize, newSize);
+        v->data.a.parentActivation = forward(v->data.a.parentActivation, mm);
+        v->data.a.closure = forward(v->data.a.closure, mm);
+        if (v->data.a.state != NULL)
+        {
+            for (int i = 0; i < v->data.a.stateSize; i++)
+                v->data.a.state[i] = forward(v->data.a.state[i], mm);
+        }
+    }
+    else if (value_getType(v) == VClosure)
+    {
+        v->data.c.previousActivation = forward(v->data.c.previousActivation, mm);
+        for (int i = 0; i < v->data.c.freeSize; i++)
+            v->data.c.free[i] = forward(v->data.c.free[i], mm);
     }
+}
+
+/*
+ * Size the part of the nursery in use from the minor collection just done, so
+ * that the next one should take no more than a quarter of the policy's pause
+ * budget if the young objects survive and are copied at the rate that these
+ * were.  The margin absorbs the variation from one collection to the next and
+ * the work that shares the pause.  The size shrinks at once but grows by an
+ * eighth at a time, and stays between the minimum and the policy's nursery
+ * size.
+ */
+static void sizeNursery(MemoryState *mm, int64_t used, int64_t pause)
+{
+    int64_t target = (int64_t)mm->policy.pauseBudget * 250;
+    int64_t limit = nursery_limit(&mm->nursery);
+    int64_t size = limit + limit / 8;
+
+    if (used == 0)
+        return;
+    if (pause > 0 && used * target / pause < size)
+        size = used * target / pause;
+    if (size < MINIMUM_NURSERY_SIZE)
+        size = MINIMUM_NURSERY_SIZE;
+    if (size > mm->policy.nurserySize)
+        size = mm->policy.nurserySize;
+
+    nursery_setLimit(&mm->nursery, (int)size);
+}
+
+/*
+ * Evacuate every live young object into the paged heap.  The roots are the
+ * current activation, the parts of the stack and the frame stack that have
+ * been written since the last minor collection and the old objects recorded by
+ * the write barrier, so the cost is proportional to the surviving young data
+ * rather than to the heap or the stack depth.  Only the current activation can
+ * be written to so a frame below it is left unchanged until its callees have
+ * returned.
+ */
+static void minorGC(MemoryState *mm)
+{
+#ifdef TIME_GC
+    long long start = timeInMilliseconds();
+    int oldSize = mm->size;
 #endif
+    int64_t begin = mm->policy.pauseBudget > 0 ? timeInNanoseconds() : 0;
+    int64_t used = mm->nursery.top - mm->nursery.start;
 
-    mm->root = newRoot;
-    mm->size = newSize;
+    mm->stats.minorCollections++;
 
-#ifdef DEBUG_GC
-    v = mm->root;
-    while (v != NULL)
+    mm->activation = forward(mm->activation, mm);
+    for (int i = mm->stackLowWater; i < mm->sp; i++)
+        mm->stack[i] = forward(mm->stack[i], mm);
+    mm->stackLowWater = mm->sp;
+    for (char *p = mm->framesLowWater; p < mm->frames.top; p += frameSize((Value *)p))
+        forwardReferences((Value *)p, mm);
+    mm->framesLowWater = frames_contains(&mm->frames, mm->activation) ? (char *)mm->activation : mm->frames.top;
+
+    for (int i = 0; i < mm->remembered.size; i++)
     {
-        Value *nextV = v->next;
-        char *s = value_toString(v);
-        printf("gc: --- %s\n", s);
-        FREE(s);
-        v = nextV;
+        Value *v = mm->remembered.items[i];
+        v->type &= ~VALUE_REMEMBERED;
+        forwardReferences(v, mm);
     }
+    mm->remembered.size = 0;
+
+    for (int i = 0; i < mm->promoted.size; i++)
+        forwardReferences(mm->promoted.items[i], mm);
+    mm->promoted.size = 0;
+
+    nursery_reset(&mm->nursery);
+    if (mm->policy.pauseBudget > 0)
+        sizeNursery(mm, used, timeInNanoseconds() - begin);
+
+    if (mm->trace != NULL)
+        trace_recordMemory(mm->trace, TRACE_MINOR_GC, mm->sp, mm->size);
+
+#ifdef TIME_GC
+    printf("gc: minor promoted %d objects in %lldms\n", mm->size - oldSize, timeInMilliseconds() - start);
 #endif
 }
 
-void forceGC(MemoryState *mm)
+/*
+ * Mark everything in the paged heap reachable from the stack and the current
+ * activation.  The heap is then swept lazily as the allocator needs space, so
+ * a collection only costs time proportional to the live objects.  The nursery
+ * must be empty when this is called.
+ */
+static void majorGC(MemoryState *mm)
 {
 #ifdef DEBUG_GC
     printf("gc: forcing garbage collection ------------------------------\n");
@@ -353,116 +668,429 @@ void forceGC(MemoryState *mm)
     long long start = timeInMilliseconds();
 #endif
 
-    Colour newColour = (mm->colour == VWhite) ? VBlack : VWhite;
+    mm->stats.majorCollections++;
+
+    heap_finishSweep(&mm->heap);
 
-    if (mm->activation != NULL)
+#ifdef TIME_GC
+    long long endSweep = timeInMilliseconds();
+    int oldSize = mm->size;
+#endif
+
+    mm->size = 0;
+
+    markFromRoots(mm);
+
+    heap_startSweep(&mm->heap);
+
+    if (mm->trace != NULL)
+        trace_recordMemory(mm->trace, TRACE_MAJOR_GC, mm->sp, mm->size);
+
+#ifdef TIME_GC
+    long long endMark = timeInMilliseconds();
+
+    if (oldSize != mm->size)
     {
-        mark(mm->activation, newColour);
+        printf("gc: collected %d objects, %d remaining\n", oldSize - mm->size, mm->size);
     }
-    for (int i = 0; i < mm->sp; i++)
+    printf("gc: sweep took %lldms, mark took %lldms, %d pages\n", endSweep - start, endMark - endSweep, mm->heap.pageCount);
+#endif
+}
+
+/*
+ * Resize the heap so that, after a collection, the live objects occupy no more
+ * than the policy's target fraction of the capacity.  The capacity grows by the
+ * growth factor and shrinks the same way once the heap has emptied out, but
+ * never below the initial heap.
+ */
+static void resizeHeap(MemoryState *mm)
+{
+    GCPolicy *policy = &mm->policy;
+
+    while (mm->size > mm->capacity * policy->targetOccupancy)
     {
-        mark(mm->stack[i], newColour);
+        int newCapacity = (int)(mm->capacity * policy->growthFactor);
+        mm->capacity = newCapacity > mm->capacity ? newCapacity : mm->capacity + 1;
     }
 
-    mm->colour = newColour;
+    while (mm->capacity > policy->initialHeap && mm->size < (mm->capacity / (policy->growthFactor * policy->growthFactor)) * policy->targetOccupancy)
+    {
+        int newCapacity = (int)(mm->capacity / policy->growthFactor);
+        mm->capacity = newCapacity < policy->initialHeap ? policy->initialHeap : newCapacity;
+    }
 
-#ifdef TIME_GC
-    long long endMark = timeInMilliseconds();
-#endif
 #ifdef DEBUG_GC
-    printf("gc: sweeping\n");
+    printf("gc: %d live objects, heap capacity now %d\n", mm->size, mm->capacity);
 #endif
-    sweep(mm);
+}
 
-#ifdef TIME_GC
-    long long endSweep = timeInMilliseconds();
+void value_shadeGrey(Value *v, MemoryState *mm)
+{
+    mark(v, mm);
+}
 
-    printf("gc: mark took %lldms, sweep took %lldms\n", endMark - start, endSweep - endMark);
-#endif
+static void recordPause(MemoryState *mm, int64_t start)
+{
+    int64_t pause = timeInNanoseconds() - start;
+
+    mm->stats.gcTime += pause;
+    if (mm->policy.pauseBudget > 0)
+        pauseList_append(&mm->pauses, pause);
 }
 
-static void gc(MemoryState *mm)
+/*
+ * Incremental marking begins with a minor collection so that no young object
+ * can refer to an old object that marking has not seen.  From then on the
+ * barriers shade every value that is pushed onto the stack, stored into an
+ * object, captured by a new object or made the current activation, so the
+ * stack and the frame stack as they stood at the start are the only roots
+ * left to scan and they can be scanned a slot or a frame at a time between
+ * slices.
+ */
+static void startMarking(MemoryState *mm)
 {
-#ifdef GC_FORCE
-    forceGC(mm);
-#else
-    if (mm->size >= mm->capacity)
+    minorGC(mm);
+
+    mm->phase = GC_MARKING;
+    mm->size = 0;
+    mm->stackCursor = 0;
+    mm->stackSnapshot = mm->sp;
+    mm->frameCursor = mm->frames.start;
+
+    mark(mm->activation, mm);
+}
+
+/*
+ * Scan grey objects, the stack snapshot and then the frames until there is no
+ * marking left to do or the deadline passes.  Returns 1 if marking is
+ * complete.  A frame popped before the cursor reaches it moves the cursor back
+ * down, so the cursor always rests on a frame or the top of the frame stack,
+ * and any frame pushed since marking started holds nothing but shaded values.
+ */
+static int markSlice(MemoryState *mm, int64_t deadline)
+{
+    int work = 0;
+    int32_t limit = mm->stackSnapshot < mm->sp ? mm->stackSnapshot : mm->sp;
+
+    while (1)
     {
-        forceGC(mm);
+        if (mm->markStack.size > 0)
+        {
+            scan(mm->markStack.items[--mm->markStack.size], mm);
+        }
+        else if (mm->stackCursor < limit)
+        {
+            mark(mm->stack[mm->stackCursor++], mm);
+        }
+        else if (mm->frameCursor < mm->frames.top)
+        {
+            Value *frame = (Value *)mm->frameCursor;
 
-        if (mm->size >= mm->capacity)
+            mm->frameCursor += frameSize(frame);
+            scan(frame, mm);
+        }
+        else
         {
-#ifdef DEBUG_GC
-            printf("gc: memory still full after gc... increasing heap capacity to %d\n", mm->capacity * 2);
-#endif
-            mm->capacity *= 2;
+            return 1;
         }
+
+        if (++work % PAUSE_CLOCK_INTERVAL == 0 && timeInNanoseconds() >= deadline)
+            return 0;
     }
-#endif
 }
 
-static void attachValue(Value *v, MemoryState *mm)
+/*
+ * Sweep pages until none are left or sweeping another as slowly as the last
+ * would pass the deadline.  At least one page is swept.
+ */
+static void sweepSlice(MemoryState *mm, int64_t deadline)
 {
-    mm->size++;
-    v->next = mm->root;
-    mm->root = v;
+    int64_t now = timeInNanoseconds();
+    int64_t last;
+    int more;
+
+    do
+    {
+        last = now;
+        more = heap_sweepStep(&mm->heap);
+        now = timeInNanoseconds();
+    } while (more && now + (now - last) < deadline);
 }
 
-Value *value_newInt(int i, MemoryState *mm)
+static void finishMarking(MemoryState *mm)
 {
-    gc(mm);
+    while (mm->markOverflow)
+    {
+        mm->markOverflow = 0;
+        heap_forEachMarked(&mm->heap, rescanMarked, mm);
+    }
 
-    Value *v = ALLOCATE(Value, 1);
-    v->type = VInt | mm->colour;
-    v->data.i = i;
+    heap_startSweep(&mm->heap);
+    mm->phase = GC_IDLE;
+    mm->stats.majorCollections++;
+    if (mm->trace != NULL)
+        trace_recordMemory(mm->trace, TRACE_MAJOR_GC, mm->sp, mm->size);
 
-    push(v, mm);
+    resizeHeap(mm);
+}
 
-    attachValue(v, mm);
+/*
+ * Perform one slice of an incremental collection of the paged heap, stopping
+ * once seven eighths of the policy's pause budget is used up, which leaves the
+ * rest for the work done between looks at the clock.  The slice that starts
+ * marking is a minor collection, which is kept within the budget by the size
+ * of the nursery in use.
+ */
+static void collectStep(MemoryState *mm)
+{
+    int64_t start = timeInNanoseconds();
+    int64_t deadline = start + (int64_t)mm->policy.pauseBudget * 875;
 
-    return v;
+    if (mm->phase == GC_SWEEPING)
+    {
+        if (mm->heap.unswept == NULL)
+            startMarking(mm);
+        else
+            sweepSlice(mm, deadline);
+    }
+    else if (markSlice(mm, deadline))
+    {
+        finishMarking(mm);
+    }
+
+    recordPause(mm, start);
 }
-Value *value_newBool(int b, MemoryState *mm)
+
+/*
+ * Bring an incremental collection that is under way to an end without regard
+ * to the pause budget.
+ */
+static void finishCollection(MemoryState *mm)
 {
-    gc(mm);
+    if (mm->phase == GC_MARKING)
+    {
+        markSlice(mm, INT64_MAX);
+        finishMarking(mm);
+    }
 
-    Value *v = ALLOCATE(Value, 1);
+    mm->phase = GC_IDLE;
+}
 
-    v->type = VBool | mm->colour;
-    v->data.b = b;
-    attachValue(v, mm);
+void forceGC(MemoryState *mm)
+{
+    int64_t start = timeInNanoseconds();
 
-    push(v, mm);
+    finishCollection(mm);
+    minorGC(mm);
+    majorGC(mm);
+
+    mm->stats.gcTime += timeInNanoseconds() - start;
+}
+
+void value_remember(Value *object, MemoryState *mm)
+{
+    object->type |= VALUE_REMEMBERED;
+    valueList_append(&mm->remembered, object);
+}
+
+/*
+ * Allocate size bytes in the nursery.  When the nursery is full the young
+ * objects are evacuated and, should that push the paged heap over its
+ * capacity, the paged heap is collected as well - all at once or, when the
+ * policy has a pause budget, in slices spread across the following
+ * allocations.  Any young object that the caller holds outside of the stack
+ * and the current activation is moved by this.  Returns NULL if the request
+ * will not fit even in an empty nursery.
+ */
+static void *allocateYoung(int size, MemoryState *mm)
+{
+    mm->stats.allocations++;
+    if (mm->trace != NULL)
+        trace_recordMemory(mm->trace, TRACE_ALLOCATE, mm->sp, size);
+
+    if (mm->policy.stress)
+    {
+        forceGC(mm);
+        return nursery_allocate(&mm->nursery, size);
+    }
+
+    if (mm->phase != GC_IDLE && --mm->stepCountdown <= 0)
+    {
+        mm->stepCountdown = INCREMENTAL_STEP_ALLOCATIONS;
+        collectStep(mm);
+    }
+
+    void *result = nursery_allocate(&mm->nursery, size);
+
+    if (result == NULL)
+    {
+        int64_t start = timeInNanoseconds();
+
+        minorGC(mm);
+
+        if (mm->size >= mm->capacity && mm->phase == GC_IDLE)
+        {
+            if (mm->policy.pauseBudget > 0)
+            {
+                mm->phase = GC_SWEEPING;
+                mm->stepCountdown = INCREMENTAL_STEP_ALLOCATIONS;
+            }
+            else
+            {
+                majorGC(mm);
+                resizeHeap(mm);
+            }
+        }
+
+        recordPause(mm, start);
+
+        result = nursery_allocate(&mm->nursery, size);
+    }
+
+    return result;
+}
+
+static Value *newValue(ValueType type, MemoryState *mm)
+{
+    Value *v = allocateYoung(sizeof(Value), mm);
+
+    v->type = type;
 
     return v;
 }
 
-Value *value_newClosure(Value *previousActivation, int ip, MemoryState *mm)
+/*
+ * Move every frame into the paged heap, from the bottom up so that each copy's
+ * parent has already been copied, leaving a forwarding pointer in the frame.
+ * The frame stack is then empty.  Done once a frame is captured by a closure,
+ * and so must outlive its call, or when the frame stack is full.  The copies
+ * are remembered as a frame may refer to young objects and, while marking is
+ * under way, are allocated grey as a frame may refer to unmarked objects.
+ * Each copy counts as an allocation, as the frame itself did not.
+ */
+static void evacuateFrames(MemoryState *mm)
 {
-    gc(mm);
+    Value *parent = NULL;
+    char *p = mm->frames.start;
+
+    while (p < mm->frames.top)
+    {
+        Value *frame = (Value *)p;
+        p += frameSize(frame);
+
+        Value *copy = heap_allocate(&mm->heap);
+        *copy = *frame;
+        copy->type = VActivation;
+        mm->stats.allocations++;
+
+        if (parent != NULL)
+            copy->data.a.parentActivation = parent;
+
+        if (frame->data.a.state != NULL)
+        {
+            copy->data.a.state = ALLOCATE(Value *, frame->data.a.stateSize);
+            for (int i = 0; i < frame->data.a.stateSize; i++)
+                copy->data.a.state[i] = frame->data.a.state[i];
+        }
+
+        if (mm->phase == GC_MARKING)
+            mark(copy, mm);
+        else
+            mm->size++;
+        value_remember(copy, mm);
 
+        frame->type |= VALUE_FORWARDED;
+        frame->data.c.previousActivation = copy;
+
+        parent = copy;
+    }
+
+    if (frames_contains(&mm->frames, mm->activation))
+        mm->activation = mm->activation->data.c.previousActivation;
+
+    mm->frames.top = mm->frames.start;
+    mm->framesLowWater = mm->frames.start;
+    mm->frameCursor = mm->frames.start;
+}
+
+Value *value_newClosure(Value *previousActivation, int ip, MemoryState *mm)
+{
     if (previousActivation != NULL && value_getType(previousActivation) != VActivation)
     {
         printf("Error: value_newClosure: previousActivation is not an activation: %s\n", value_toString(previousActivation));
         exit(1);
     }
 
-    Value *v = ALLOCATE(Value, 1);
+    if (frames_contains(&mm->frames, previousActivation))
+    {
+        evacuateFrames(mm);
+        previousActivation = previousActivation->data.c.previousActivation;
+    }
+
+    push(previousActivation, mm);
+    Value *v = newValue(VClosure, mm);
+    previousActivation = pop(mm);
+    value_shade(previousActivation, mm);
 
-    v->type = VClosure | mm->colour;
     v->data.c.previousActivation = previousActivation;
     v->data.c.ip = ip;
-    attachValue(v, mm);
+    v->data.c.freeSize = 0;
+    v->data.c.free = NULL;
 
     push(v, mm);
 
     return v;
 }
 
-Value *value_newActivation(Value *parentActivation, Value *closure, int nextIp, MemoryState *mm)
+/*
+ * Replace the freeSize values on the top of the stack, the deepest first,
+ * with a flat closure that captures them.  The values stay on the stack while
+ * the closure is allocated so that a collection keeps them up to date.
+ * Unlike PUSH_CLOSURE no activation is captured so frames stay on the frame
+ * stack.  A closure too large for the nursery is allocated straight into the
+ * paged heap, where it is treated as frames are when they are evacuated.
+ */
+Value *value_newFlatClosure(int ip, int freeSize, MemoryState *mm)
 {
-    gc(mm);
+    Value *v = allocateYoung(sizeof(Value) + freeSize * sizeof(Value *), mm);
+
+    if (v == NULL)
+    {
+        v = heap_allocate(&mm->heap);
+        v->type = VClosure;
+        v->data.c.free = ALLOCATE(Value *, freeSize);
+
+        if (mm->phase == GC_MARKING)
+            mark(v, mm);
+        else
+            mm->size++;
+        value_remember(v, mm);
+    }
+    else
+    {
+        v->type = VClosure;
+        v->data.c.free = freeSize > 0 ? (Value **)(v + 1) : NULL;
+    }
+
+    v->data.c.previousActivation = NULL;
+    v->data.c.ip = ip;
+    v->data.c.freeSize = freeSize;
 
+    Value **captured = mm->stack + mm->sp - freeSize;
+    for (int i = 0; i < freeSize; i++)
+    {
+        v->data.c.free[i] = captured[i];
+        value_shade(captured[i], mm);
+    }
+
+    popN(freeSize, mm);
+    push(v, mm);
+
+    return v;
+}
+
+Value *value_newActivation(Value *parentActivation, Value *closure, int nextIp, MemoryState *mm)
+{
     if (parentActivation != NULL && value_getType(parentActivation) != VActivation)
     {
         printf("Error: value_newActivation: parentActivation is not an activation: %s\n", value_toString(parentActivation));
@@ -474,44 +1102,172 @@ Value *value_newActivation(Value *parentActivation, Value *closure, int nextIp,
         exit(1);
     }
 
-    Value *v = ALLOCATE(Value, 1);
+    push(parentActivation, mm);
+    push(closure, mm);
+    Value *v = newValue(VActivation, mm);
+    closure = pop(mm);
+    parentActivation = pop(mm);
+    value_shade(closure, mm);
+    value_shade(parentActivation, mm);
 
-    v->type = VActivation | mm->colour;
     v->data.a.parentActivation = parentActivation;
     v->data.a.closure = closure;
     v->data.a.nextIP = nextIp;
     v->data.a.stateSize = -1;
     v->data.a.state = NULL;
 
-    attachValue(v, mm);
-
     push(v, mm);
 
     return v;
 }
 
-void value_initialise(void)
+/*
+ * Push an activation for a call onto the frame stack.  The frame is not pushed
+ * onto the stack as, unlike a young object, it is never moved by a
+ * collection.  Should the frame stack be full its frames are evacuated into
+ * the paged heap to make room and, should it have no room at all, the
+ * activation is allocated in the nursery instead.
+ */
+Value *value_newFrame(Value *parentActivation, Value *closure, int nextIp, MemoryState *mm)
 {
-    internalMM = value_newMemoryManager(2);
+    if (parentActivation != NULL && value_getType(parentActivation) != VActivation)
+    {
+        printf("Error: value_newActivation: parentActivation is not an activation: %s\n", value_toString(parentActivation));
+        exit(1);
+    }
+    if (closure != NULL && value_getType(closure) != VClosure)
+    {
+        printf("Error: value_newActivation: closure is not a closure: %s\n", value_toString(closure));
+        exit(1);
+    }
 
-    value_True = value_newBool(1, &internalMM);
-    value_False = value_newBool(0, &internalMM);
+    Value *v = frames_allocate(&mm->frames, sizeof(Value));
+
+    if (v == NULL)
+    {
+        if (frames_contains(&mm->frames, parentActivation))
+        {
+            evacuateFrames(mm);
+            parentActivation = parentActivation->data.c.previousActivation;
+        }
+
+        v = frames_allocate(&mm->frames, sizeof(Value));
+
+        if (v == NULL)
+        {
+            v = value_newActivation(parentActivation, closure, nextIp, mm);
+            popN(1, mm);
+            return v;
+        }
+    }
+
+    value_shade(closure, mm);
+    value_shade(parentActivation, mm);
+
+    v->type = VActivation | VALUE_REMEMBERED;
+    v->data.a.parentActivation = parentActivation;
+    v->data.a.closure = closure;
+    v->data.a.nextIP = nextIp;
+    v->data.a.stateSize = -1;
+    v->data.a.state = NULL;
+
+    return v;
 }
 
-void value_finalise(void)
+/*
+ * Replace the current activation with a frame for a call to closure that
+ * returns to wherever the current activation would have returned to.  Should
+ * the current activation be a frame the new frame takes its place on the
+ * frame stack, so a tail recursive loop runs in constant space.
+ */
+Value *value_newTailFrame(Value *closure, MemoryState *mm)
 {
-    value_destroyMemoryManager(&internalMM);
+    Value *activation = mm->activation;
+    Value *parentActivation = activation->data.a.parentActivation;
+    int nextIp = activation->data.a.nextIP;
+
+    value_return(mm);
 
-    value_True = NULL;
-    value_False = NULL;
+    return value_newFrame(parentActivation, closure, nextIp, mm);
 }
 
-ValueType value_getType(Value *v)
+/*
+ * Reserve size state slots in the current activation.  A frame keeps its state
+ * alongside it on the frame stack, as does a young activation in the nursery,
+ * whereas old activations, including one promoted or evacuated by the
+ * allocation itself, own a separate allocation that is released when the
+ * activation is swept.  The slots are only ever initialised to NULL so the
+ * generational barrier is not needed but the activation is shaded so that
+ * incremental marking cannot miss the state it now owns.
+ */
+void value_newState(int size, MemoryState *mm)
 {
-    return v->type & 0x7;
+    Value **state = NULL;
+
+    if (frames_contains(&mm->frames, mm->activation))
+    {
+        state = frames_allocate(&mm->frames, size * sizeof(Value *));
+
+        if (state == NULL)
+            evacuateFrames(mm);
+        else if (mm->frameCursor == (char *)state)
+            mm->frameCursor = mm->frames.top;
+    }
+
+    if (state == NULL)
+    {
+        state = allocateYoung(size * sizeof(Value *), mm);
+
+        if (!value_isYoung(mm->activation, mm))
+            state = ALLOCATE(Value *, size);
+    }
+
+    Value *activation = mm->activation;
+
+    for (int i = 0; i < size; i++)
+        state[i] = NULL;
+
+    activation->data.a.stateSize = size;
+    activation->data.a.state = state;
+
+    value_shade(activation, mm);
+}
+
+Colour value_getColour(Value *v, MemoryState *mm)
+{
+    if (frames_contains(&mm->frames, v))
+        return VBlack;
+    if (value_isYoung(v, mm) || !heap_isMarked(v))
+        return VWhite;
+
+    return (v->type & VALUE_GREY) ? VGrey : VBlack;
 }
 
-Colour value_getColour(Value *v)
+static int comparePauses(const void *a, const void *b)
 {
-    return v->type & 0x8;
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+void value_reportGCPauses(MemoryState *mm)
+{
+    PauseList *pauses = &mm->pauses;
+
+    if (pauses->size == 0)
+    {
+        printf("gc: 0 pauses, budget %dus\n", mm->policy.pauseBudget);
+        return;
+    }
+
+    qsort(pauses->items, pauses->size, sizeof(int64_t), comparePauses);
+
+    int32_t p99 = (int32_t)((pauses->size * 99 + 99) / 100) - 1;
+
+    printf("gc: %d pauses, max %.1fus, p99 %.1fus, budget %dus\n",
+           pauses->size,
+           pauses->items[pauses->size - 1] / 1000.0,
+           pauses->items[p99] / 1000.0,
+           mm->policy.pauseBudget);
 }
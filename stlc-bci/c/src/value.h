@@ -1,9 +1,15 @@
 #ifndef VALUE_H
 #define VALUE_H
 
+#include <stdint.h>
+
+#include "heap.h"
+#include "trace.h"
+
 typedef enum {
-    VBlack = 8,
-    VWhite = 0
+    VWhite,
+    VGrey,
+    VBlack
 } Colour;
 
 typedef enum {
@@ -21,61 +27,284 @@ typedef struct Activation {
     struct Value **state;
 } Activation;
 
+/*
+ * A closure made by PUSH_CLOSURE holds the activation that it was made in and
+ * reaches its variables through it.  A flat closure, made by MAKE_CLOSURE,
+ * holds no activation but a copy of each value that it captures, so that it
+ * keeps nothing else alive.  The captured values are held alongside a young
+ * closure in the nursery and in a separate allocation once it is old.
+ */
 typedef struct Closure {
     struct Value *previousActivation;
     int ip;
+    int freeSize;
+    struct Value **free;
 } Closure;
 
+/*
+ * Flags kept above the type in a heap object's type word.  A remembered object
+ * is an old object that has been added to the remembered set by the write
+ * barrier, a forwarded object is a young object that has been copied out of
+ * the nursery and a grey object is marked but its references are yet to be
+ * scanned.
+ */
+#define VALUE_TYPE_MASK 0x7
+#define VALUE_REMEMBERED 0x10
+#define VALUE_FORWARDED 0x20
+#define VALUE_GREY 0x40
+
 typedef struct Value {
-    Colour colour;
-    ValueType type;
+    int type;
     union {
-        int i;
-        int b;
         struct Closure c;
         struct Activation a;
     } data;
-    struct Value *next;
 } Value;
 
+/*
+ * Counts kept by a memory manager over its life: the objects allocated in the
+ * nursery or straight into the paged heap, frames aside until they are
+ * evacuated into the paged heap, when each copy counts, the minor and major
+ * collections, the nanoseconds spent collecting and the most bytes held in
+ * heap pages at once.  Unless the policy's stats is NULL they are added into
+ * it as the memory manager is destroyed, peakHeap keeping the larger of the
+ * two.
+ */
+typedef struct {
+    int64_t allocations;
+    int64_t minorCollections;
+    int64_t majorCollections;
+    int64_t gcTime;
+    int64_t peakHeap;
+} GCStats;
+
 typedef struct {
-    Colour colour;
+    int initialHeap;
+    int nurserySize;
+    double growthFactor;
+    double targetOccupancy;
+    int stress;
+    int pauseBudget;
+    int frameStackSize;
+    GCStats *stats;
+} GCPolicy;
+
+typedef struct {
+    int32_t size;
+    int32_t capacity;
+    Value **items;
+} ValueList;
+
+/*
+ * The phase of an incremental collection of the paged heap.  A collection
+ * first finishes sweeping the previous cycle's pages so that every mark bit is
+ * clear and then marks in slices until no grey objects remain.
+ */
+typedef enum {
+    GC_IDLE,
+    GC_SWEEPING,
+    GC_MARKING
+} GCPhase;
+
+typedef struct {
+    int32_t size;
+    int32_t capacity;
+    int64_t *items;
+} PauseList;
+
+typedef struct {
+    GCPolicy policy;
 
     int size;
     int capacity;
 
-    Value *root;
+    Heap heap;
+    Nursery nursery;
+    FrameStack frames;
+    char *framesLowWater;
+    ValueList remembered;
+    ValueList promoted;
+    ValueList markStack;
+    int markStackLimit;
+    int markOverflow;
+
+    GCPhase phase;
+    int stepCountdown;
+    int32_t stackCursor;
+    int32_t stackSnapshot;
+    char *frameCursor;
+    PauseList pauses;
+    GCStats stats;
+    Trace *trace;
+
     Value *activation;
 
     int32_t sp;
     int32_t stackSize;
+    int32_t stackLowWater;
     Value **stack;
 } MemoryState;
 
-extern Value *value_True;
-extern Value *value_False;
+/*
+ * Ints and bools are never heap allocated - they are encoded directly into the
+ * Value pointer word.  Heap objects are at least 8 byte aligned so a set low bit
+ * marks an immediate int, held in the upper 32 bits, and the tag 0b10 an
+ * immediate bool, held in bit 2.  Only closures and activations are real
+ * pointers that the garbage collector needs to trace.
+ */
+#define VALUE_INT_TAG 1
+#define VALUE_BOOL_TAG 2
+#define VALUE_TAG_MASK 3
+
+#define value_True ((Value *)(uintptr_t)(4 | VALUE_BOOL_TAG))
+#define value_False ((Value *)(uintptr_t)VALUE_BOOL_TAG)
+
+static inline int value_isImmediate(Value *v)
+{
+    return ((uintptr_t)v & VALUE_TAG_MASK) != 0;
+}
+
+static inline Value *value_fromInt(int32_t i)
+{
+    return (Value *)(((uintptr_t)(uint32_t)i << 32) | VALUE_INT_TAG);
+}
+
+static inline int32_t value_asInt(Value *v)
+{
+    return (int32_t)((uintptr_t)v >> 32);
+}
+
+/*
+ * The quotient of a and b, which must not be 0, rounded towards zero.  The
+ * least int divided by -1 wraps around to itself, as it does on the JVM,
+ * rather than overflowing.
+ */
+static inline int32_t value_divide(int32_t a, int32_t b)
+{
+    return b == -1 ? (int32_t)(0u - (uint32_t)a) : a / b;
+}
+
+static inline Value *value_fromBool(int b)
+{
+    return b ? value_True : value_False;
+}
+
+static inline int value_asBool(Value *v)
+{
+    return v == value_True;
+}
+
+static inline ValueType value_getType(Value *v)
+{
+    if ((uintptr_t)v & VALUE_INT_TAG)
+        return VInt;
+    if ((uintptr_t)v & VALUE_BOOL_TAG)
+        return VBool;
+    return v->type & VALUE_TYPE_MASK;
+}
 
 extern char *value_toString(Value *v);
+extern char *value_toStringWithOffsets(Value *v, int32_t *offsets);
+
+extern GCPolicy value_defaultGCPolicy(void);
+extern char *value_validateGCPolicy(GCPolicy *policy);
 
-extern MemoryState value_newMemoryManager(int initialStackSize);
+extern MemoryState value_newMemoryManager(int initialStackSize, GCPolicy policy);
 extern void value_destroyMemoryManager(MemoryState *mm);
 
+extern void value_remember(Value *object, MemoryState *mm);
+
+static inline int value_isYoung(Value *v, MemoryState *mm)
+{
+    return v != NULL && !value_isImmediate(v) && nursery_contains(&mm->nursery, v);
+}
+
+extern void value_shadeGrey(Value *v, MemoryState *mm);
+
+/*
+ * Must be called whenever a value becomes reachable from a root or an object
+ * that incremental marking may already have scanned, so that it cannot be
+ * missed by the marking in progress.
+ */
+static inline void value_shade(Value *v, MemoryState *mm)
+{
+    if (mm->phase == GC_MARKING)
+        value_shadeGrey(v, mm);
+}
+
+/*
+ * Must be called whenever a value is stored into an existing heap object so
+ * that old objects pointing at young objects are treated as roots by the next
+ * minor collection.  Frames are created remembered as the frames that can
+ * have been written to since the last minor collection are scanned anyway.
+ */
+static inline void value_writeBarrier(Value *object, Value *value, MemoryState *mm)
+{
+    value_shade(value, mm);
+
+    if (value_isYoung(value, mm) && !value_isYoung(object, mm) && (object->type & VALUE_REMEMBERED) == 0)
+        value_remember(object, mm);
+}
+
 extern void push(Value *value, MemoryState *mm);
 extern Value *pop(MemoryState *mm);
 extern void popN(int n, MemoryState *mm);
 extern Value *peek(int offset, MemoryState *mm);
+extern void value_reserveStack(int n, MemoryState *mm);
+
+/*
+ * pop and peek without the check that the stack holds enough values, for code
+ * that the verifier has proven never to underflow it.
+ */
+static inline Value *popUnchecked(MemoryState *mm)
+{
+    Value *result = mm->stack[--mm->sp];
+
+    if (mm->sp < mm->stackLowWater)
+        mm->stackLowWater = mm->sp;
+
+    return result;
+}
+
+static inline Value *peekUnchecked(int offset, MemoryState *mm)
+{
+    return mm->stack[mm->sp - 1 - offset];
+}
 
 extern void forceGC(MemoryState *mm);
+extern void value_reportGCPauses(MemoryState *mm);
 
-extern Value *value_newInt(int i, MemoryState *mm);
-extern Value *value_newBool(int b, MemoryState *mm);
 extern Value *value_newClosure(Value *previousActivation, int ip, MemoryState *mm);
+extern Value *value_newFlatClosure(int ip, int freeSize, MemoryState *mm);
 extern Value *value_newActivation(Value *parentActivation, Value *closure, int nextIp, MemoryState *mm);
+extern Value *value_newFrame(Value *parentActivation, Value *closure, int nextIp, MemoryState *mm);
+extern void value_newState(int size, MemoryState *mm);
+extern Value *value_newTailFrame(Value *closure, MemoryState *mm);
+
+/*
+ * Return from the current activation to its parent, popping the current
+ * activation off the frame stack if it is a frame.
+ */
+static inline void value_return(MemoryState *mm)
+{
+    Value *activation = mm->activation;
+    Value *parent = activation->data.a.parentActivation;
+
+    if (frames_contains(&mm->frames, activation))
+    {
+        char *current = frames_contains(&mm->frames, parent) ? (char *)parent : mm->frames.start;
+
+        mm->frames.top = (char *)activation;
+        if (current < mm->framesLowWater)
+            mm->framesLowWater = current;
+        if (mm->frameCursor > mm->frames.top)
+            mm->frameCursor = mm->frames.top;
+    }
 
-extern void value_initialise(void);
-extern void value_finalise(void);
+    mm->activation = parent;
+    value_shade(parent, mm);
+}
 
-extern ValueType value_getType(Value *v);
-extern Colour value_getColour(Value *v);
+extern Colour value_getColour(Value *v, MemoryState *mm);
 
 #endif
@@ -0,0 +1,865 @@
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "memory.h"
+
+#include "error.h"
+#include "verify.h"
+
+/*
+ * The verifier is an abstract interpretation of the code.  Each value is
+ * approximated by the kinds of value that it may be and, should it be a
+ * closure, by the function that it is a closure over.  The top level, and
+ * every function that a PUSH_CLOSURE or MAKE_CLOSURE creates and a call can
+ * reach, is interpreted from its entry with its own abstract stack.  A
+ * function is summarised by the kinds of its parameter, of its result and of
+ * each of its state slots, by the function whose activation it closes over
+ * and by the smallest that activation's state can be when it does.  A flat
+ * closure closes over no activation, so a function is also summarised by the
+ * fewest values that a closure over it captures and the kinds of each.  The
+ * functions are
+ * interpreted until the summaries stop changing and then once more to check
+ * every reachable instruction against them.
+ *
+ * Like the interpreter the verifier takes no account of a variable being read
+ * before it is stored.
+ */
+
+#define KIND_INT 1
+#define KIND_BOOL 2
+#define KIND_CLOSURE 4
+#define KIND_ANY (KIND_INT | KIND_BOOL | KIND_CLOSURE)
+
+#define FUNCTION_NONE -1
+#define FUNCTION_ANY -2
+
+#define TOP_LEVEL 0
+
+typedef struct
+{
+    int32_t kinds;
+    int32_t function;
+} Abstract;
+
+typedef struct
+{
+    int32_t entry;
+    int called;
+    Abstract parameter;
+    Abstract result;
+
+    int32_t parent;
+    int32_t capturedStateSize;
+
+    int32_t slotCount;
+    Abstract *slots;
+
+    int32_t freeSize;
+    int32_t freeCount;
+    Abstract *frees;
+} Function;
+
+/*
+ * The abstract state on reaching an instruction.  The stack, which has a fixed
+ * depth once an instruction has been reached, is held in the verifier's
+ * arena.
+ */
+typedef struct
+{
+    int visited;
+    int entered;
+    int32_t stateSize;
+    int32_t depth;
+    int32_t stack;
+} AbstractState;
+
+typedef struct
+{
+    int entered;
+    int32_t stateSize;
+    int32_t depth;
+    Abstract *stack;
+} Working;
+
+typedef struct
+{
+    Code *code;
+
+    int32_t functionCount;
+    int32_t functionCapacity;
+    Function *functions;
+    int32_t *functionAt;
+
+    AbstractState *states;
+    int32_t *worklist;
+    int32_t worklistSize;
+    char *queued;
+
+    int32_t arenaSize;
+    int32_t arenaCapacity;
+    Abstract *arena;
+
+    int32_t scratchCapacity;
+    Abstract *scratch;
+
+    int changed;
+    int checking;
+    int proven;
+
+    int32_t *targets;
+} Verifier;
+
+static const Abstract nothing = {0, FUNCTION_NONE};
+static const Abstract anything = {KIND_ANY, FUNCTION_ANY};
+
+static Abstract kind(int32_t kinds)
+{
+    Abstract result = {kinds, FUNCTION_NONE};
+
+    return result;
+}
+
+static int32_t joinFunction(int32_t a, int32_t b)
+{
+    if (a == FUNCTION_NONE)
+        return b;
+    if (b == FUNCTION_NONE || a == b)
+        return a;
+    return FUNCTION_ANY;
+}
+
+static Abstract join(Abstract a, Abstract b)
+{
+    Abstract result = {a.kinds | b.kinds, joinFunction(a.function, b.function)};
+
+    return result;
+}
+
+static int same(Abstract a, Abstract b)
+{
+    return a.kinds == b.kinds && a.function == b.function;
+}
+
+static void joinInto(Verifier *v, Abstract *into, Abstract value)
+{
+    Abstract joined = join(*into, value);
+
+    if (!same(joined, *into))
+    {
+        *into = joined;
+        v->changed = 1;
+    }
+}
+
+static char *kindName(int32_t kinds)
+{
+    static char *names[] = {"nothing", "an Int", "a Bool", "an Int or Bool", "a closure", "an Int or closure", "a Bool or closure", "any value"};
+
+    return names[kinds & KIND_ANY];
+}
+
+static const char *instructionName(Verifier *v, int32_t ip)
+{
+    Code *code = v->code;
+    int32_t offset = code->offsets[ip];
+    const Instruction *instruction = offset < code->blockSize ? find(code->block[offset]) : NULL;
+
+    return instruction == NULL ? "?" : instruction->name;
+}
+
+static void destroy(Verifier *v)
+{
+    for (int32_t f = 0; f < v->functionCount; f++)
+    {
+        if (v->functions[f].slots != NULL)
+            FREE(v->functions[f].slots);
+        if (v->functions[f].frees != NULL)
+            FREE(v->functions[f].frees);
+    }
+    FREE(v->functions);
+    FREE(v->functionAt);
+    FREE(v->states);
+    FREE(v->worklist);
+    FREE(v->queued);
+    FREE(v->arena);
+    FREE(v->scratch);
+}
+
+static void reject(Verifier *v, int32_t ip, char *format, ...)
+{
+    char reason[ERROR_MESSAGE_SIZE];
+    va_list args;
+    int32_t offset = v->code->offsets[ip];
+    const char *name = instructionName(v, ip);
+
+    va_start(args, format);
+    vsnprintf(reason, sizeof(reason), format, args);
+    va_end(args);
+
+    destroy(v);
+    error_raise("Verify: ip=%d: %s: %s", offset, name, reason);
+}
+
+static void invalid(Verifier *v, int32_t ip)
+{
+    Code *code = v->code;
+    int32_t offset = code->offsets[ip];
+    int known = offset < code->blockSize && find(code->block[offset]) != NULL;
+    const char *name = instructionName(v, ip);
+
+    destroy(v);
+    if (offset >= code->blockSize)
+        error_raise("Verify: ip=%d: End of code", offset);
+    else if (!known)
+        error_raise("Verify: Invalid opcode: %d", code->block[offset]);
+    else
+        error_raise("Verify: ip=%d: Unsupported instruction: %s", offset, name);
+}
+
+/*
+ * A check that may or may not pass depending on the values at runtime, so the
+ * code must be run with the interpreter's checks in place.
+ */
+static void unproven(Verifier *v)
+{
+    if (v->checking)
+        v->proven = 0;
+}
+
+static void require(Verifier *v, int32_t ip, Abstract value, int32_t kinds)
+{
+    if (!v->checking || (value.kinds != 0 && (value.kinds & ~kinds) == 0))
+        return;
+
+    if ((value.kinds & kinds) == 0)
+        reject(v, ip, "expected %s but found %s", kindName(kinds), kindName(value.kinds));
+
+    v->proven = 0;
+}
+
+static int need(Verifier *v, int32_t ip, Working *w, int32_t n)
+{
+    if (w->depth >= n)
+        return 1;
+
+    if (v->checking)
+        reject(v, ip, "stack underflow");
+
+    return 0;
+}
+
+static void push(Verifier *v, Working *w, Abstract value)
+{
+    if (w->depth == v->scratchCapacity)
+    {
+        v->scratchCapacity *= 2;
+        v->scratch = REALLOCATE(v->scratch, Abstract, v->scratchCapacity);
+        w->stack = v->scratch;
+    }
+
+    w->stack[w->depth++] = value;
+}
+
+static Abstract *top(Working *w, int32_t offset)
+{
+    return &w->stack[w->depth - 1 - offset];
+}
+
+static int32_t functionFor(Verifier *v, int32_t entry)
+{
+    if (v->functionAt[entry] >= 0)
+        return v->functionAt[entry];
+
+    if (v->functionCount == v->functionCapacity)
+    {
+        v->functionCapacity *= 2;
+        v->functions = REALLOCATE(v->functions, Function, v->functionCapacity);
+    }
+
+    Function *function = &v->functions[v->functionCount];
+
+    function->entry = entry;
+    function->called = 0;
+    function->parameter = nothing;
+    function->result = nothing;
+    function->parent = FUNCTION_NONE;
+    function->capturedStateSize = INT32_MAX;
+    function->slotCount = 0;
+    function->slots = NULL;
+    function->freeSize = INT32_MAX;
+    function->freeCount = 0;
+    function->frees = NULL;
+
+    v->functionAt[entry] = v->functionCount;
+    v->changed = 1;
+
+    return v->functionCount++;
+}
+
+static void ensureSlots(Function *function, int32_t count)
+{
+    if (count <= function->slotCount)
+        return;
+
+    function->slots = function->slots == NULL ? ALLOCATE(Abstract, count) : REALLOCATE(function->slots, Abstract, count);
+    for (int32_t i = function->slotCount; i < count; i++)
+        function->slots[i] = nothing;
+    function->slotCount = count;
+}
+
+static Abstract slot(Function *function, int32_t offset)
+{
+    return offset < function->slotCount ? function->slots[offset] : nothing;
+}
+
+static void ensureFrees(Function *function, int32_t count)
+{
+    if (count <= function->freeCount)
+        return;
+
+    function->frees = function->frees == NULL ? ALLOCATE(Abstract, count) : REALLOCATE(function->frees, Abstract, count);
+    for (int32_t i = function->freeCount; i < count; i++)
+        function->frees[i] = nothing;
+    function->freeCount = count;
+}
+
+static void captureSize(Verifier *v, Function *function, int32_t freeSize)
+{
+    if (freeSize < function->freeSize)
+    {
+        function->freeSize = freeSize;
+        v->changed = 1;
+    }
+}
+
+static void capture(Verifier *v, int32_t f, int32_t parent, Working *w)
+{
+    Function *function = &v->functions[f];
+    int32_t joined = joinFunction(function->parent, parent);
+    int32_t stateSize = w->entered ? w->stateSize : -1;
+
+    if (joined != function->parent)
+    {
+        function->parent = joined;
+        v->changed = 1;
+    }
+    if (stateSize < function->capturedStateSize)
+    {
+        function->capturedStateSize = stateSize;
+        v->changed = 1;
+    }
+    captureSize(v, function, 0);
+}
+
+/*
+ * A flat closure over function f captures the count values on the top of the
+ * stack and no activation, so f reaching out of its own activation can only
+ * be checked at runtime.
+ */
+static void captureFree(Verifier *v, int32_t f, Working *w, int32_t count)
+{
+    Function *function = &v->functions[f];
+
+    if (function->parent != FUNCTION_ANY)
+    {
+        function->parent = FUNCTION_ANY;
+        v->changed = 1;
+    }
+    captureSize(v, function, count);
+
+    ensureFrees(function, count);
+    for (int32_t i = 0; i < count; i++)
+        joinInto(v, &function->frees[i], *top(w, count - 1 - i));
+}
+
+/*
+ * The value of PUSH_FREE index in function f, which is only known to be in
+ * every closure over f once each captures more than index values.
+ */
+static Abstract captured(Verifier *v, int32_t f, int32_t ip, int32_t index)
+{
+    if (f == TOP_LEVEL || index < 0)
+    {
+        if (v->checking)
+            reject(v, ip, f == TOP_LEVEL ? "activation has no closure" : "index out of bounds: %d", index);
+        return anything;
+    }
+
+    Function *function = &v->functions[f];
+
+    if (index >= function->freeSize || index >= function->freeCount)
+    {
+        unproven(v);
+        return anything;
+    }
+
+    return function->frees[index];
+}
+
+/*
+ * STORE_FREE index of value into a closure over any of the functions that the
+ * closure could be over, which is only known to have room should it be over
+ * the one function.
+ */
+static void storeFree(Verifier *v, int32_t ip, Abstract closure, int32_t index, Abstract value)
+{
+    if (index < 0)
+    {
+        if (v->checking)
+            reject(v, ip, "index out of bounds: %d", index);
+        return;
+    }
+    if ((closure.kinds & KIND_CLOSURE) == 0)
+        return;
+
+    for (int32_t f = TOP_LEVEL + 1; f < v->functionCount; f++)
+    {
+        Function *function = &v->functions[f];
+
+        if (closure.function != FUNCTION_ANY && closure.function != f)
+            continue;
+
+        if (closure.function == FUNCTION_ANY || index >= function->freeSize)
+            unproven(v);
+        ensureFrees(function, index + 1);
+        joinInto(v, &function->frees[index], value);
+    }
+}
+
+/*
+ * Calling a closure over function f passes the argument to f's parameter and
+ * results in whatever f returns.  Should the closure be over any one of a
+ * number of functions every one of them could be called.
+ */
+static Abstract call(Verifier *v, Abstract callee, Abstract argument)
+{
+    Abstract result = nothing;
+
+    if ((callee.kinds & KIND_CLOSURE) == 0)
+        return result;
+
+    for (int32_t f = TOP_LEVEL + 1; f < v->functionCount; f++)
+    {
+        Function *function = &v->functions[f];
+
+        if (callee.function != FUNCTION_ANY && callee.function != f)
+            continue;
+
+        if (!function->called)
+        {
+            function->called = 1;
+            v->changed = 1;
+        }
+        joinInto(v, &function->parameter, argument);
+        result = join(result, function->result);
+    }
+
+    return result;
+}
+
+/*
+ * Record the entry of the function that the call at ip calls, should it only
+ * ever be a closure over the one function, or VERIFY_UNKNOWN_TARGET.
+ */
+static void target(Verifier *v, int32_t ip, Abstract callee)
+{
+    int32_t entry = callee.function >= 0 ? v->functions[callee.function].entry : VERIFY_UNKNOWN_TARGET;
+
+    if (v->targets[ip] == VERIFY_NO_TARGET)
+        v->targets[ip] = entry;
+    else if (v->targets[ip] != entry)
+        v->targets[ip] = VERIFY_UNKNOWN_TARGET;
+}
+
+/*
+ * The value of PUSH_VAR index offset in function f.  The current activation's
+ * state is known exactly but an enclosing activation's state is only known to
+ * be at least as large as it was when it was captured.
+ */
+static Abstract variable(Verifier *v, int32_t f, int32_t ip, Working *w, int32_t index, int32_t offset)
+{
+    if (index == 0)
+    {
+        if (!w->entered)
+        {
+            if (v->checking)
+                reject(v, ip, "activation has no state");
+            return anything;
+        }
+        if (offset < 0 || offset >= w->stateSize)
+        {
+            if (v->checking)
+                reject(v, ip, "offset out of bounds: %d >= %d", offset, w->stateSize);
+            return anything;
+        }
+
+        return slot(&v->functions[f], offset);
+    }
+
+    int32_t stateSize = -1;
+
+    for (int32_t level = 0; level < index; level++)
+    {
+        Function *function = &v->functions[f];
+
+        if (function->parent < 0)
+        {
+            unproven(v);
+            return anything;
+        }
+
+        stateSize = function->capturedStateSize;
+        f = function->parent;
+    }
+
+    if (offset < 0 || offset >= stateSize)
+    {
+        unproven(v);
+        return anything;
+    }
+
+    return slot(&v->functions[f], offset);
+}
+
+static void enqueue(Verifier *v, int32_t ip)
+{
+    if (!v->queued[ip])
+    {
+        v->queued[ip] = 1;
+        v->worklist[v->worklistSize++] = ip;
+    }
+}
+
+/*
+ * Carry the working state over to the instruction at ip, joining it with the
+ * state that the instruction has already been reached with.
+ */
+static void flowTo(Verifier *v, int32_t ip, Working *w)
+{
+    AbstractState *state = &v->states[ip];
+
+    if (!state->visited)
+    {
+        if (v->arenaSize + w->depth > v->arenaCapacity)
+        {
+            while (v->arenaSize + w->depth > v->arenaCapacity)
+                v->arenaCapacity *= 2;
+            v->arena = REALLOCATE(v->arena, Abstract, v->arenaCapacity);
+        }
+
+        state->visited = 1;
+        state->entered = w->entered;
+        state->stateSize = w->stateSize;
+        state->depth = w->depth;
+        state->stack = v->arenaSize;
+        for (int32_t i = 0; i < w->depth; i++)
+            v->arena[state->stack + i] = w->stack[i];
+        v->arenaSize += w->depth;
+
+        enqueue(v, ip);
+        return;
+    }
+
+    if (state->depth != w->depth)
+    {
+        if (v->checking)
+            reject(v, ip, "stack depth differs between paths: %d and %d", state->depth, w->depth);
+        return;
+    }
+    if (state->entered != w->entered || state->stateSize != w->stateSize)
+    {
+        if (v->checking)
+            reject(v, ip, "activation state differs between paths");
+        return;
+    }
+
+    for (int32_t i = 0; i < w->depth; i++)
+    {
+        Abstract *into = &v->arena[state->stack + i];
+        Abstract joined = join(*into, w->stack[i]);
+
+        if (!same(joined, *into))
+        {
+            *into = joined;
+            enqueue(v, ip);
+        }
+    }
+}
+
+static void step(Verifier *v, int32_t f, int32_t ip, Working *w)
+{
+    Op *op = &v->code->ops[ip];
+
+    switch (op->opcode)
+    {
+    case PUSH_TRUE:
+    case PUSH_FALSE:
+        push(v, w, kind(KIND_BOOL));
+        flowTo(v, ip + 1, w);
+        break;
+    case PUSH_INT:
+        push(v, w, kind(KIND_INT));
+        flowTo(v, ip + 1, w);
+        break;
+    case PUSH_VAR:
+        push(v, w, variable(v, f, ip, w, op->operand[0], op->operand[1]));
+        flowTo(v, ip + 1, w);
+        break;
+    case PUSH_CLOSURE:
+    {
+        int32_t closure = functionFor(v, op->operand[0]);
+        Abstract value = {KIND_CLOSURE, closure};
+
+        capture(v, closure, f, w);
+        push(v, w, value);
+        flowTo(v, ip + 1, w);
+        break;
+    }
+    case MAKE_CLOSURE:
+    {
+        int32_t count = op->operand[1];
+
+        if (count < 0)
+        {
+            if (v->checking)
+                reject(v, ip, "negative size: %d", count);
+            return;
+        }
+        if (!need(v, ip, w, count))
+            return;
+
+        int32_t closure = functionFor(v, op->operand[0]);
+        Abstract value = {KIND_CLOSURE, closure};
+
+        captureFree(v, closure, w, count);
+        w->depth -= count;
+        push(v, w, value);
+        flowTo(v, ip + 1, w);
+        break;
+    }
+    case PUSH_FREE:
+        push(v, w, captured(v, f, ip, op->operand[0]));
+        flowTo(v, ip + 1, w);
+        break;
+    case STORE_FREE:
+        if (!need(v, ip, w, 2))
+            return;
+        require(v, ip, *top(w, 1), KIND_CLOSURE);
+        storeFree(v, ip, *top(w, 1), op->operand[0], *top(w, 0));
+        w->depth -= 2;
+        flowTo(v, ip + 1, w);
+        break;
+    case ADD:
+    case SUB:
+    case MUL:
+    case DIV:
+    case EQ:
+        if (!need(v, ip, w, 2))
+            return;
+        require(v, ip, *top(w, 1), KIND_INT);
+        require(v, ip, *top(w, 0), KIND_INT);
+        w->depth -= 2;
+        push(v, w, kind(op->opcode == EQ ? KIND_BOOL : KIND_INT));
+        flowTo(v, ip + 1, w);
+        break;
+    case JMP:
+        flowTo(v, op->operand[0], w);
+        break;
+    case JMP_TRUE:
+        if (!need(v, ip, w, 1))
+            return;
+        require(v, ip, *top(w, 0), KIND_BOOL);
+        w->depth -= 1;
+        flowTo(v, op->operand[0], w);
+        flowTo(v, ip + 1, w);
+        break;
+    case SWAP_CALL:
+    case TAIL_CALL:
+    {
+        if (!need(v, ip, w, 2))
+            return;
+        if (op->opcode == TAIL_CALL && f != TOP_LEVEL && w->depth != 2)
+        {
+            if (v->checking)
+                reject(v, ip, "stack depth is %d rather than 2", w->depth);
+            return;
+        }
+
+        Abstract callee = *top(w, 1);
+        require(v, ip, callee, KIND_CLOSURE);
+        if (v->checking && v->targets != NULL)
+            target(v, ip, callee);
+        Abstract result = call(v, callee, *top(w, 0));
+        w->depth -= 2;
+
+        if (op->opcode == TAIL_CALL)
+        {
+            joinInto(v, &v->functions[f].result, result);
+        }
+        else
+        {
+            push(v, w, result);
+            flowTo(v, ip + 1, w);
+        }
+        break;
+    }
+    case ENTER:
+        if (w->entered)
+        {
+            if (v->checking)
+                reject(v, ip, "activation already has state");
+            return;
+        }
+        if (op->operand[0] < 0)
+        {
+            if (v->checking)
+                reject(v, ip, "negative size: %d", op->operand[0]);
+            return;
+        }
+        w->entered = 1;
+        w->stateSize = op->operand[0];
+        ensureSlots(&v->functions[f], op->operand[0]);
+        flowTo(v, ip + 1, w);
+        break;
+    case RET:
+        if (!need(v, ip, w, 1))
+            return;
+        if (f != TOP_LEVEL && w->depth != 1)
+        {
+            if (v->checking)
+                reject(v, ip, "stack depth is %d rather than 1", w->depth);
+            return;
+        }
+        joinInto(v, &v->functions[f].result, *top(w, 0));
+        break;
+    case STORE_VAR:
+        if (!need(v, ip, w, 1))
+            return;
+        if (!w->entered)
+        {
+            if (v->checking)
+                reject(v, ip, "activation has no state");
+            return;
+        }
+        if (op->operand[0] < 0 || op->operand[0] >= w->stateSize)
+        {
+            if (v->checking)
+                reject(v, ip, "index out of bounds: %d", op->operand[0]);
+            return;
+        }
+        joinInto(v, &v->functions[f].slots[op->operand[0]], *top(w, 0));
+        w->depth -= 1;
+        flowTo(v, ip + 1, w);
+        break;
+    default:
+        if (v->checking)
+            invalid(v, ip);
+        break;
+    }
+}
+
+static void interpret(Verifier *v, int32_t f)
+{
+    Code *code = v->code;
+
+    for (int32_t i = 0; i <= code->size; i++)
+    {
+        v->states[i].visited = 0;
+        v->queued[i] = 0;
+    }
+    v->worklistSize = 0;
+    v->arenaSize = 0;
+
+    Working w;
+    w.entered = 0;
+    w.stateSize = -1;
+    w.depth = 0;
+    w.stack = v->scratch;
+    if (f != TOP_LEVEL)
+        push(v, &w, v->functions[f].parameter);
+
+    flowTo(v, v->functions[f].entry, &w);
+
+    while (v->worklistSize > 0)
+    {
+        int32_t ip = v->worklist[--v->worklistSize];
+        AbstractState *state = &v->states[ip];
+
+        v->queued[ip] = 0;
+
+        w.entered = state->entered;
+        w.stateSize = state->stateSize;
+        w.depth = 0;
+        w.stack = v->scratch;
+        for (int32_t i = 0; i < state->depth; i++)
+            push(v, &w, v->arena[state->stack + i]);
+
+        step(v, f, ip, &w);
+    }
+}
+
+static void interpretAll(Verifier *v)
+{
+    for (int32_t f = 0; f < v->functionCount; f++)
+    {
+        if (v->functions[f].called)
+            interpret(v, f);
+    }
+}
+
+int verify(Code *code)
+{
+    return verify_callTargets(code, NULL);
+}
+
+int verify_callTargets(Code *code, int32_t *targets)
+{
+    Verifier v;
+
+    v.code = code;
+    v.targets = targets;
+    if (targets != NULL)
+    {
+        for (int32_t i = 0; i <= code->size; i++)
+            targets[i] = VERIFY_NO_TARGET;
+    }
+
+    v.functionCount = 0;
+    v.functionCapacity = 16;
+    v.functions = ALLOCATE(Function, v.functionCapacity);
+    v.functionAt = ALLOCATE(int32_t, code->size + 1);
+    for (int32_t i = 0; i <= code->size; i++)
+        v.functionAt[i] = -1;
+
+    v.states = ALLOCATE(AbstractState, code->size + 1);
+    v.worklist = ALLOCATE(int32_t, code->size + 1);
+    v.queued = ALLOCATE(char, code->size + 1);
+
+    v.arenaSize = 0;
+    v.arenaCapacity = 256;
+    v.arena = ALLOCATE(Abstract, v.arenaCapacity);
+
+    v.scratchCapacity = 64;
+    v.scratch = ALLOCATE(Abstract, v.scratchCapacity);
+
+    v.checking = 0;
+    v.proven = 1;
+
+    functionFor(&v, 0);
+    v.functionAt[0] = -1;
+    v.functions[TOP_LEVEL].called = 1;
+
+    do
+    {
+        v.changed = 0;
+        interpretAll(&v);
+    } while (v.changed);
+
+    v.checking = 1;
+    interpretAll(&v);
+
+    destroy(&v);
+
+    return v.proven;
+}
@@ -0,0 +1,30 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include "code.h"
+
+/*
+ * Check decoded, but not yet fused, code before it is run.  Both ways out of
+ * every conditional jump are followed whatever the condition, and code in
+ * which an instruction on any of those paths would fail one of the
+ * interpreter's checks for every value that could reach it is rejected with a
+ * message naming the instruction, even should that path never be taken at
+ * runtime.  Returns 1 if every check that the interpreter makes is proven to
+ * pass, so that the code can be run without them, and 0 if some can only be
+ * made at runtime.
+ */
+extern int verify(Code *code);
+
+/*
+ * verify, also filling targets, which has room for an entry for every
+ * instruction and the sentinel, with the entry of the function that each
+ * reachable call is proven to call.  Calls whose callee could be more than
+ * one function are VERIFY_UNKNOWN_TARGET and any other instruction is
+ * VERIFY_NO_TARGET.
+ */
+#define VERIFY_NO_TARGET -1
+#define VERIFY_UNKNOWN_TARGET -2
+
+extern int verify_callTargets(Code *code, int32_t *targets);
+
+#endif
@@ -0,0 +1,230 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "memory.h"
+
+#include "code.h"
+#include "error.h"
+#include "mapping.h"
+#include "run.h"
+#include "verify.h"
+#include "vm.h"
+
+struct BciVM
+{
+    RunOptions options;
+
+    int loaded;
+    Mapping mapping;
+    int mapped;
+    Code code;
+    int failed;
+
+    Trace trace;
+};
+
+BciVM *bci_vm_new(GCPolicy gcPolicy)
+{
+    BciVM *vm = ALLOCATE(BciVM, 1);
+
+    vm->options.debug = 0;
+    vm->options.gcPolicy = gcPolicy;
+    vm->options.ngrams = NULL;
+    vm->options.profile = NULL;
+    vm->options.trace = NULL;
+    vm->options.verified = 0;
+    vm->options.jitThreshold = 0;
+    vm->options.registers = 0;
+    vm->options.dispatched = NULL;
+    vm->options.output = NULL;
+    vm->options.instructionLimit = 0;
+    vm->options.memoryLimit = 0;
+    vm->options.limitExceeded = 0;
+
+    vm->loaded = 0;
+    vm->failed = 0;
+
+    return vm;
+}
+
+/*
+ * A block is either mapped from a file or the VM's own copy.
+ */
+static void release(Mapping *mapping, int mapped)
+{
+    if (mapped)
+        mapping_close(mapping);
+    else
+        FREE(mapping->block);
+}
+
+static void unload(BciVM *vm)
+{
+    if (vm->loaded)
+    {
+        code_destroy(&vm->code);
+        release(&vm->mapping, vm->mapped);
+        vm->loaded = 0;
+    }
+}
+
+/*
+ * The VM only holds the block once it has been decoded and verified, so that
+ * a trapped error leaves no program loaded.
+ */
+static char *load(BciVM *vm, Mapping mapping, int mapped)
+{
+    ErrorTrap trap;
+    volatile int decoded = 0;
+
+    error_setTrap(&trap);
+    if (setjmp(trap.target))
+    {
+        if (decoded)
+            code_destroy(&vm->code);
+        release(&mapping, mapped);
+
+        return STRDUP(trap.message);
+    }
+
+    vm->code = code_decode(mapping.block, mapping.size);
+    decoded = 1;
+    code_rewriteTailCalls(&vm->code);
+    vm->options.verified = verify(&vm->code);
+    error_clearTrap();
+
+    code_fuse(&vm->code);
+    vm->mapping = mapping;
+    vm->mapped = mapped;
+    vm->loaded = 1;
+
+    return NULL;
+}
+
+char *bci_vm_load(BciVM *vm, unsigned char *block, int32_t blockSize)
+{
+    Mapping copy;
+
+    unload(vm);
+
+    copy.block = ALLOCATE(unsigned char, blockSize);
+    copy.size = blockSize;
+    memcpy(copy.block, block, blockSize);
+
+    return load(vm, copy, 0);
+}
+
+char *bci_vm_loadFile(BciVM *vm, char *fileName)
+{
+    Mapping mapping;
+
+    unload(vm);
+
+    char *error = mapping_open(fileName, &mapping);
+    if (error != NULL)
+        return error;
+
+    return load(vm, mapping, 1);
+}
+
+int bci_vm_verified(BciVM *vm)
+{
+    return vm->loaded && vm->options.verified;
+}
+
+void bci_vm_setLimits(BciVM *vm, int64_t instructions, int64_t memory)
+{
+    vm->options.instructionLimit = instructions;
+    vm->options.memoryLimit = memory;
+}
+
+/*
+ * A run that raises an error has already released its heap, stack and frames,
+ * so only the output written so far is left to free.
+ */
+char *bci_vm_run(BciVM *vm)
+{
+    ErrorTrap trap;
+
+    if (!vm->loaded)
+    {
+        printf("Error: bci_vm_run: no program loaded\n");
+        exit(1);
+    }
+
+    vm->options.output = stringbuilder_new();
+    vm->failed = 0;
+
+    error_setTrap(&trap);
+    if (setjmp(trap.target))
+    {
+        stringbuilder_free(vm->options.output);
+        vm->options.output = NULL;
+        vm->failed = 1;
+
+        return STRDUP(trap.message);
+    }
+
+    execute(&vm->code, &vm->options);
+    error_clearTrap();
+
+    char *result = stringbuilder_free_use(vm->options.output);
+    vm->options.output = NULL;
+
+    return result;
+}
+
+int bci_vm_stopped(BciVM *vm)
+{
+    return vm->options.limitExceeded;
+}
+
+int bci_vm_failed(BciVM *vm)
+{
+    return vm->failed;
+}
+
+void bci_vm_setTrace(BciVM *vm, int32_t events)
+{
+    if (vm->options.trace != NULL)
+    {
+        trace_destroy(&vm->trace);
+        vm->options.trace = NULL;
+    }
+    if (events > 0)
+    {
+        trace_initialise(&vm->trace, events);
+        vm->options.trace = &vm->trace;
+    }
+}
+
+char *bci_vm_writeTrace(BciVM *vm, char *fileName)
+{
+    if (vm->options.trace == NULL)
+        return STRDUP("Error: bci_vm_writeTrace: not tracing");
+
+    int fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int written = fd >= 0 && trace_write(&vm->trace, fd) == 0;
+
+    if (fd >= 0 && close(fd) != 0)
+        written = 0;
+    if (!written)
+    {
+        int length = snprintf(NULL, 0, "Unable to write trace: %s", fileName);
+        char *error = ALLOCATE(char, length + 1);
+
+        snprintf(error, length + 1, "Unable to write trace: %s", fileName);
+        return error;
+    }
+
+    return NULL;
+}
+
+void bci_vm_free(BciVM *vm)
+{
+    unload(vm);
+    bci_vm_setTrace(vm, 0);
+    FREE(vm);
+}
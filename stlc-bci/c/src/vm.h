@@ -0,0 +1,53 @@
+#ifndef VM_H
+#define VM_H
+
+#include <stdint.h>
+
+#include "value.h"
+
+/*
+ * An interpreter that can be embedded, any number of times, in a program.  A
+ * VM holds its program and the options to run it with, and every run builds
+ * its own heap, stack and frames, so VMs share nothing mutable and each can
+ * be used by a different thread at the same time.  A single VM must only be
+ * used by one thread at a time.
+ *
+ * bci_vm_load copies the block, decodes and verifies it and replaces any
+ * program already loaded.  It returns NULL, or the message that bci run would
+ * report for a block that cannot be decoded or that the verifier rejects,
+ * which the caller is to FREE, leaving no program loaded.  bci_vm_loadFile does
+ * the same for a file, which is mapped rather than copied so that every VM
+ * loading the same file shares its pages.  bci_vm_verified is 1
+ * when every type check of the loaded program has been proven to pass.
+ *
+ * bci_vm_run runs the loaded program from the start and returns its result as
+ * bci run prints it, which the caller is to FREE.  Dividing by zero, which
+ * even a verified program can do, ends the run with the message that bci run
+ * would report in place of the result, and bci_vm_failed is then 1 until the
+ * next run.  Any other error that an unverified program meets as it runs is
+ * reported as it is by bci run, ending the process.  bci_vm_setLimits stops
+ * every later run of a verified program once it has dispatched more than
+ * instructions instructions, or holds more than memory bytes, with 0 for no
+ * limit.  The result is then the message saying which, and bci_vm_stopped
+ * is 1 until the next run.
+ *
+ * bci_vm_setTrace records the last events events of every later run, across
+ * runs, or stops recording with 0.  bci_vm_writeTrace writes them to a file
+ * for bci trace to render, returning NULL or the message saying why it could
+ * not, which the caller is to FREE.
+ */
+typedef struct BciVM BciVM;
+
+extern BciVM *bci_vm_new(GCPolicy gcPolicy);
+extern char *bci_vm_load(BciVM *vm, unsigned char *block, int32_t blockSize);
+extern char *bci_vm_loadFile(BciVM *vm, char *fileName);
+extern int bci_vm_verified(BciVM *vm);
+extern void bci_vm_setLimits(BciVM *vm, int64_t instructions, int64_t memory);
+extern char *bci_vm_run(BciVM *vm);
+extern int bci_vm_stopped(BciVM *vm);
+extern int bci_vm_failed(BciVM *vm);
+extern void bci_vm_setTrace(BciVM *vm, int32_t events);
+extern char *bci_vm_writeTrace(BciVM *vm, char *fileName);
+extern void bci_vm_free(BciVM *vm);
+
+#endif
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "../src/memory.h"
+#include "../src/vm.h"
+#include "minunit.h"
+
+/*
+ * A container of PUSH_TRUE; RET with its code section at 32 followed by a
+ * symbols section of the bytes given, which the tests make malformed.
+ */
+static int32_t container(unsigned char *block, unsigned char *symbols, int32_t symbolsSize)
+{
+    unsigned char header[] = {
+        0x7F, 'B', 'C', 'I', 2, 0, 2, 0,
+        1, 0, 0, 0, 32, 0, 0, 0, 3, 0, 0, 0,
+        3, 0, 0, 0, 35, 0, 0, 0, 0, 0, 0, 0,
+        2, 0, 15};
+
+    header[28] = (unsigned char)symbolsSize;
+    memcpy(block, header, sizeof(header));
+    memcpy(block + sizeof(header), symbols, symbolsSize);
+
+    return (int32_t)sizeof(header) + symbolsSize;
+}
+
+/*
+ * Loads the block, returning whether the error, should there be one, is the
+ * message expected and nothing is left allocated.
+ */
+static int rejects(unsigned char *block, int32_t size, char *expected)
+{
+    int32_t allocated = memory_allocated();
+    BciVM *vm = bci_vm_new(value_defaultGCPolicy());
+    char *error = bci_vm_load(vm, block, size);
+    int result = error != NULL && strcmp(error, expected) == 0;
+
+    if (error == NULL)
+        printf(". Loaded: expected %s\n", expected);
+    else if (!result)
+        printf(". %s: expected %s\n", error, expected);
+
+    if (error != NULL)
+        FREE(error);
+    bci_vm_free(vm);
+
+    return result && memory_allocated() == allocated;
+}
+
+static char *test_symbols(void)
+{
+    unsigned char block[64];
+    unsigned char symbols[] = {1, 0, 1, 'a'};
+    BciVM *vm = bci_vm_new(value_defaultGCPolicy());
+    char *error = bci_vm_load(vm, block, container(block, symbols, sizeof(symbols)));
+
+    mu_assert_label(error == NULL);
+
+    char *result = bci_vm_run(vm);
+    mu_assert_label(strcmp(result, "true: Bool\n") == 0);
+
+    FREE(result);
+    bci_vm_free(vm);
+
+    return NULL;
+}
+
+static char *test_truncatedSymbols(void)
+{
+    unsigned char block[64];
+    unsigned char symbols[] = {3, 0, 1, 'a'};
+
+    mu_assert_label(rejects(block, container(block, symbols, sizeof(symbols)), "Code: container: symbols: truncated"));
+
+    return NULL;
+}
+
+static char *test_symbolOutOfRange(void)
+{
+    unsigned char block[64];
+    unsigned char symbols[] = {2, 0, 1, 'a', 9, 1, 'b'};
+
+    mu_assert_label(rejects(block, container(block, symbols, sizeof(symbols)), "Code: container: symbols: symbol 1 out of range"));
+
+    return NULL;
+}
+
+static char *test_symbolCountTooLarge(void)
+{
+    unsigned char block[64];
+    unsigned char symbols[] = {9, 0, 1, 'a'};
+
+    mu_assert_label(rejects(block, container(block, symbols, sizeof(symbols)), "Code: container: symbols: count too large: 9"));
+
+    return NULL;
+}
+
+static char *test_unknownOpcode(void)
+{
+    unsigned char block[64];
+    unsigned char symbols[] = {0};
+    int32_t size = container(block, symbols, sizeof(symbols));
+
+    block[34] = 99;
+    mu_assert_label(rejects(block, size, "Code: container: instruction 1: unknown opcode: 99"));
+
+    return NULL;
+}
+
+static char *test_sectionOutOfBounds(void)
+{
+    unsigned char block[64];
+    unsigned char symbols[] = {0};
+    int32_t size = container(block, symbols, sizeof(symbols));
+
+    block[28] = 40;
+    mu_assert_label(rejects(block, size, "Code: container: section 3 out of bounds"));
+
+    return NULL;
+}
+
+static char *test_truncatedHeader(void)
+{
+    unsigned char block[] = {0x7F, 'B', 'C', 'I', 2};
+
+    mu_assert_label(rejects(block, sizeof(block), "Code: container: truncated header"));
+
+    return NULL;
+}
+
+char *test_format(void)
+{
+    mu_run_test(test_symbols);
+    mu_run_test(test_truncatedSymbols);
+    mu_run_test(test_symbolOutOfRange);
+    mu_run_test(test_symbolCountTooLarge);
+    mu_run_test(test_unknownOpcode);
+    mu_run_test(test_sectionOutOfBounds);
+    mu_run_test(test_truncatedHeader);
+
+    return NULL;
+}
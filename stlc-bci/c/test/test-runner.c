@@ -24,6 +24,9 @@ int main(void)
     printf(". Memory allocated delta: %d\n", start_memory_allocated);
 #endif
 
+    TEST_SUITE(test_vm);
+    TEST_SUITE(test_format);
+
     if (result == NULL)
     {
         printf(". All tests passed\n");
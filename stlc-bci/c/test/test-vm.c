@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../src/memory.h"
+#include "../src/op.h"
+#include "../src/trace.h"
+#include "../src/vm.h"
+#include "minunit.h"
+
+/*
+ * PUSH_INT a; PUSH_INT b; DIV; RET with a and b in the operands at offsets 1
+ * and 6.
+ */
+static void divide(unsigned char *block, int32_t a, int32_t b)
+{
+    block[0] = PUSH_INT;
+    block[5] = PUSH_INT;
+    block[10] = DIV;
+    block[11] = RET;
+    for (int i = 0; i < 4; i++)
+    {
+        block[1 + i] = (unsigned char)((uint32_t)a >> (8 * i));
+        block[6 + i] = (unsigned char)((uint32_t)b >> (8 * i));
+    }
+}
+
+static char *run(BciVM *vm, int32_t a, int32_t b)
+{
+    unsigned char block[12];
+
+    divide(block, a, b);
+
+    char *error = bci_vm_load(vm, block, sizeof(block));
+    if (error != NULL)
+        return error;
+
+    return bci_vm_run(vm);
+}
+
+static char *test_divide(void)
+{
+    BciVM *vm = bci_vm_new(value_defaultGCPolicy());
+    char *result = run(vm, 100, 5);
+
+    mu_assert_label(bci_vm_verified(vm));
+    mu_assert_label(strcmp(result, "20: Int\n") == 0);
+    mu_assert_label(!bci_vm_failed(vm));
+
+    FREE(result);
+    bci_vm_free(vm);
+
+    return NULL;
+}
+
+static char *test_divideByZero(void)
+{
+    int32_t allocated = memory_allocated();
+    BciVM *vm = bci_vm_new(value_defaultGCPolicy());
+    char *result = run(vm, 1, 0);
+
+    mu_assert_label(bci_vm_verified(vm));
+    mu_assert_label(strcmp(result, "Run: DIV: division by zero") == 0);
+    mu_assert_label(bci_vm_failed(vm));
+    FREE(result);
+
+    result = run(vm, 7, 2);
+    mu_assert_label(strcmp(result, "3: Int\n") == 0);
+    mu_assert_label(!bci_vm_failed(vm));
+    FREE(result);
+
+    bci_vm_free(vm);
+    mu_assert_label(memory_allocated() == allocated);
+
+    return NULL;
+}
+
+static char *test_divideLeastIntByMinusOne(void)
+{
+    BciVM *vm = bci_vm_new(value_defaultGCPolicy());
+    char *result = run(vm, INT32_MIN, -1);
+
+    mu_assert_label(strcmp(result, "-2147483648: Int\n") == 0);
+    mu_assert_label(!bci_vm_failed(vm));
+
+    FREE(result);
+    bci_vm_free(vm);
+
+    return NULL;
+}
+
+/*
+ * A run of more instructions than the trace keeps leaves exactly the number
+ * asked for in the file, after its 32 byte header and the memory events that
+ * the header counts at offset 12, of which no more are kept.
+ */
+static char *test_traceKeepsEventsAskedFor(void)
+{
+    char fileName[] = "/tmp/test-vm-traceXXXXXX";
+    int fd = mkstemp(fileName);
+    struct stat status;
+    uint32_t memoryCount = 0;
+
+    mu_assert_label(fd >= 0);
+
+    BciVM *vm = bci_vm_new(value_defaultGCPolicy());
+    bci_vm_setTrace(vm, 2);
+
+    char *result = run(vm, 100, 5);
+    FREE(result);
+
+    char *error = bci_vm_writeTrace(vm, fileName);
+    mu_assert_label(error == NULL);
+    mu_assert_label(stat(fileName, &status) == 0);
+    mu_assert_label(pread(fd, &memoryCount, sizeof(memoryCount), 12) == sizeof(memoryCount));
+    mu_assert_label(memoryCount <= 2);
+    mu_assert_label(status.st_size == 32 + 2 * (off_t)sizeof(TraceEvent) + memoryCount * (off_t)sizeof(TraceMemoryEvent));
+
+    close(fd);
+    unlink(fileName);
+    bci_vm_free(vm);
+
+    return NULL;
+}
+
+char *test_vm(void)
+{
+    mu_run_test(test_divide);
+    mu_run_test(test_divideByZero);
+    mu_run_test(test_divideLeastIntByMinusOne);
+    mu_run_test(test_traceKeepsEventsAskedFor);
+
+    return NULL;
+}
@@ -1,6 +1,17 @@
+import { encode, VERSION } from "./format.ts";
 import { findOnName as findInstruction, OpParameter } from "./instructions.ts";
 
-export const asm = (text: string): Uint8Array => {
+export type AsmOptions = {
+  version?: number;
+  strip?: boolean;
+};
+
+// Assembles into a version 2 container, naming each label in its symbols
+// unless stripped, or into the bare version 1 block.
+export const asm = (
+  text: string,
+  options: AsmOptions = { version: VERSION },
+): Uint8Array => {
   const lines = text.split("\n");
   const result: Array<number> = [];
   const labels = new Map<string, number>();
@@ -62,7 +73,16 @@ export const asm = (text: string): Uint8Array => {
     writeIntAt(labels.get(label)!, pos);
   }
 
-  return new Uint8Array(result);
+  const block = new Uint8Array(result);
+  if (options.version === 1) {
+    return block;
+  }
+
+  const symbols = options.strip === true
+    ? []
+    : [...labels.entries()].map(([name, offset]) => ({ name, offset }));
+
+  return encode(block, symbols);
 };
 
 export const writeBinary = (filename: string, data: Uint8Array) => {
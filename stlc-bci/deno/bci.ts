@@ -2,6 +2,7 @@ import * as CLI from "https://raw.githubusercontent.com/littlelanguages/deno-lib
 
 import { asm, writeBinary } from "./asm.ts";
 import { dis, readBinary } from "./dis.ts";
+import { expand, isContainer, VERSION } from "./format.ts";
 import { execute } from "./run.ts";
 
 const asmCmd = new CLI.ValueCommand(
@@ -12,6 +13,14 @@ const asmCmd = new CLI.ValueCommand(
       ["--output", "-o"],
       "The name of the binary file to write to",
     ),
+    new CLI.FlagOption(
+      ["--v1"],
+      "Write the bare version 1 block rather than a version 2 container",
+    ),
+    new CLI.FlagOption(
+      ["--strip"],
+      "Leave the label names out of the version 2 container",
+    ),
   ],
   {
     name: "FileName",
@@ -27,7 +36,13 @@ const asmCmd = new CLI.ValueCommand(
       ? file!.endsWith(".bci") ? file!.replace(/\.bci$/, ".bin") : `${file}.bin`
       : vals.get("output") as string;
 
-    writeBinary(outputFileName, asm(Deno.readTextFileSync(file!)));
+    writeBinary(
+      outputFileName,
+      asm(Deno.readTextFileSync(file!), {
+        version: vals.get("v1") === true ? 1 : VERSION,
+        strip: vals.get("strip") === true,
+      }),
+    );
   },
 );
 
@@ -68,7 +83,11 @@ const runCmd = new CLI.ValueCommand(
     file: string | undefined,
     _vals: Map<string, unknown>,
   ) => {
-    execute(readBinary(file!), 0, { debug: _vals.get("debug") === true });
+    const data = readBinary(file!);
+
+    execute(isContainer(data) ? expand(data).block : data, 0, {
+      debug: _vals.get("debug") === true,
+    });
   },
 );
 
@@ -1,3 +1,4 @@
+import { type CodeSymbol, expand, isContainer } from "./format.ts";
 import { find as findInstruction } from "./instructions.ts";
 
 export const readBinary = (filename: string): Uint8Array => {
@@ -15,10 +16,25 @@ export const readBinary = (filename: string): Uint8Array => {
   return data;
 };
 
+// A container is disassembled as the block that it encodes, with each symbol
+// listed as a label ahead of the instruction that it names.
 export const dis = (data: Uint8Array) => {
+  let symbols: Array<CodeSymbol> = [];
   let lp = 0;
+  let symbol = 0;
+
+  if (isContainer(data)) {
+    ({ block: data, symbols } = expand(data));
+  }
+
+  const disSymbols = () => {
+    for (; symbol < symbols.length && symbols[symbol].offset <= lp; symbol++) {
+      console.log(`:${symbols[symbol].name}`);
+    }
+  };
 
   while (lp < data.length) {
+    disSymbols();
     const op = data[lp++];
     const instruction = findInstruction(op);
     if (instruction === undefined) {
@@ -34,4 +50,5 @@ export const dis = (data: Uint8Array) => {
       }),
     );
   }
+  disSymbols();
 };
@@ -0,0 +1,315 @@
+import { find as findInstruction, InstructionOpCode, OpParameter } from "./instructions.ts";
+
+// Version 2 of the bytecode format wraps a compact encoding of the version 1
+// block in a container of sections.  See stlc-bci/c/src/format.h for the
+// layout.
+
+export const VERSION = 2;
+
+const MAGIC = [0x7F, 0x42, 0x43, 0x49];
+const HEADER_SIZE = 8;
+const SECTION_ENTRY_SIZE = 12;
+
+enum Section {
+  CODE = 1,
+  CONSTANTS = 2,
+  SYMBOLS = 3,
+}
+
+export type CodeSymbol = {
+  offset: number;
+  name: string;
+};
+
+export const isContainer = (data: Uint8Array): boolean =>
+  data.length >= 4 && MAGIC.every((b, i) => data[i] === b);
+
+const readInt = (block: Uint8Array, at: number): number =>
+  block[at] | (block[at + 1] << 8) | (block[at + 2] << 16) |
+  (block[at + 3] << 24);
+
+const writeInt = (block: Uint8Array, at: number, n: number) => {
+  block[at] = n & 0xFF;
+  block[at + 1] = (n >> 8) & 0xFF;
+  block[at + 2] = (n >> 16) & 0xFF;
+  block[at + 3] = (n >> 24) & 0xFF;
+};
+
+const appendVarint = (result: Array<number>, n: number) => {
+  n = n >>> 0;
+  while (n >= 0x80) {
+    result.push((n & 0x7F) | 0x80);
+    n = n >>> 7;
+  }
+  result.push(n);
+};
+
+const appendSigned = (result: Array<number>, n: number) =>
+  appendVarint(result, (n << 1) ^ (n >> 31));
+
+type Instr = {
+  opcode: InstructionOpCode;
+  operands: Array<number>;
+};
+
+const decodeBlock = (
+  block: Uint8Array,
+): [Array<Instr>, Map<number, number>] => {
+  const instrs: Array<Instr> = [];
+  const indexAt = new Map<number, number>();
+  let lp = 0;
+
+  while (lp < block.length) {
+    const instruction = findInstruction(block[lp]);
+    if (instruction === undefined) {
+      throw new Error(`Unknown opcode: ${lp}: ${block[lp]}`);
+    }
+    indexAt.set(lp, instrs.length);
+    instrs.push({
+      opcode: instruction.opcode,
+      operands: instruction.args.map((_, i) => readInt(block, lp + 1 + i * 4)),
+    });
+    lp += 1 + instruction.args.length * 4;
+  }
+  indexAt.set(lp, instrs.length);
+
+  return [instrs, indexAt];
+};
+
+// Labels become instruction indices and every distinct PUSH_INT literal is
+// kept once in the constant pool.  Symbols are written in order of offset.
+export const encode = (block: Uint8Array, symbols: Array<CodeSymbol>): Uint8Array => {
+  const [instrs, indexAt] = decodeBlock(block);
+  const constants = new Map<number, number>();
+
+  const indexOf = (offset: number): number => {
+    const index = indexAt.get(offset);
+    if (index === undefined) {
+      throw new Error(`Label does not start an instruction: ${offset}`);
+    }
+    return index;
+  };
+
+  const code: Array<number> = [];
+  appendVarint(code, instrs.length);
+  for (const instr of instrs) {
+    const instruction = findInstruction(instr.opcode)!;
+
+    code.push(instr.opcode);
+    for (const [i, operand] of instr.operands.entries()) {
+      if (instruction.args[i] === OpParameter.OPLabel) {
+        appendVarint(code, indexOf(operand));
+      } else if (instr.opcode === InstructionOpCode.PUSH_INT) {
+        if (!constants.has(operand)) {
+          constants.set(operand, constants.size);
+        }
+        appendVarint(code, constants.get(operand)!);
+      } else {
+        appendSigned(code, operand);
+      }
+    }
+  }
+
+  const pool: Array<number> = [];
+  appendVarint(pool, constants.size);
+  for (const constant of constants.keys()) {
+    appendSigned(pool, constant);
+  }
+
+  const names: Array<number> = [];
+  const encoder = new TextEncoder();
+  appendVarint(names, symbols.length);
+  for (const symbol of [...symbols].sort((a, b) => a.offset - b.offset)) {
+    const name = encoder.encode(symbol.name);
+
+    appendVarint(names, indexOf(symbol.offset));
+    appendVarint(names, name.length);
+    names.push(...name);
+  }
+
+  const sections: Array<[Section, Array<number>]> = [
+    [Section.CODE, code],
+    [Section.CONSTANTS, pool],
+    [Section.SYMBOLS, names],
+  ];
+  const size = HEADER_SIZE + sections.length * SECTION_ENTRY_SIZE +
+    sections.reduce((n, [_, data]) => n + data.length, 0);
+  const result = new Uint8Array(size);
+
+  result.set(MAGIC);
+  result[4] = VERSION & 0xFF;
+  result[5] = VERSION >> 8;
+  result[6] = sections.length & 0xFF;
+  result[7] = sections.length >> 8;
+
+  let offset = HEADER_SIZE + sections.length * SECTION_ENTRY_SIZE;
+  for (const [i, [kind, data]] of sections.entries()) {
+    const entry = HEADER_SIZE + i * SECTION_ENTRY_SIZE;
+
+    writeInt(result, entry, kind);
+    writeInt(result, entry + 4, offset);
+    writeInt(result, entry + 8, data.length);
+    result.set(data, offset);
+    offset += data.length;
+  }
+
+  return result;
+};
+
+class Reader {
+  at: number;
+  end: number;
+
+  constructor(private data: Uint8Array, private section: string, at: number, end: number) {
+    this.at = at;
+    this.end = end;
+  }
+
+  byte(): number {
+    if (this.at >= this.end) {
+      throw new Error(`Container: ${this.section}: truncated`);
+    }
+    return this.data[this.at++];
+  }
+
+  varint(): number {
+    let value = 0;
+
+    for (let shift = 0; shift < 35; shift += 7) {
+      const byte = this.byte();
+
+      value = (value | ((byte & 0x7F) << shift)) >>> 0;
+      if ((byte & 0x80) === 0) {
+        return value;
+      }
+    }
+    throw new Error(`Container: ${this.section}: number too long`);
+  }
+
+  signed(): number {
+    const value = this.varint();
+
+    return (value >>> 1) ^ -(value & 1);
+  }
+}
+
+// Rebuilds the version 1 block from a container, with its symbols by the
+// byte offset of the instruction each names in that block.
+export const expand = (
+  data: Uint8Array,
+): { block: Uint8Array; symbols: Array<CodeSymbol> } => {
+  if (data.length < HEADER_SIZE) {
+    throw new Error("Container: truncated header");
+  }
+  const version = data[4] | (data[5] << 8);
+  if (version !== VERSION) {
+    throw new Error(`Container: unsupported version: ${version}`);
+  }
+
+  const sections = data[6] | (data[7] << 8);
+  if (HEADER_SIZE + sections * SECTION_ENTRY_SIZE > data.length) {
+    throw new Error("Container: truncated section table");
+  }
+  const section = (kind: Section, name: string): Reader | undefined => {
+    let reader: Reader | undefined = undefined;
+
+    for (let i = 0; i < sections; i++) {
+      const entry = HEADER_SIZE + i * SECTION_ENTRY_SIZE;
+      const offset = readInt(data, entry + 4) >>> 0;
+      const size = readInt(data, entry + 8) >>> 0;
+
+      if (offset + size > data.length) {
+        throw new Error(`Container: section ${readInt(data, entry)} out of bounds`);
+      }
+      if (readInt(data, entry) === kind) {
+        reader = new Reader(data, name, offset, offset + size);
+      }
+    }
+    return reader;
+  };
+
+  const constants: Array<number> = [];
+  const pool = section(Section.CONSTANTS, "constants");
+  if (pool !== undefined) {
+    const count = pool.varint();
+    for (let i = 0; i < count; i++) {
+      constants.push(pool.signed());
+    }
+  }
+
+  const code = section(Section.CODE, "code");
+  if (code === undefined) {
+    throw new Error("Container: no code section");
+  }
+  const count = code.varint();
+  const instrs: Array<Instr> = [];
+  const offsets: Array<number> = [];
+  let offset = 0;
+  for (let i = 0; i < count; i++) {
+    const opcode = code.byte();
+    const instruction = findInstruction(opcode);
+    if (instruction === undefined) {
+      throw new Error(`Container: instruction ${i}: unknown opcode: ${opcode}`);
+    }
+
+    const operands = instruction.args.map((arg) => {
+      if (arg === OpParameter.OPLabel) {
+        const target = code.varint();
+        if (target > count) {
+          throw new Error(`Container: instruction ${i}: ${instruction.name}: label out of range: ${target}`);
+        }
+        return target;
+      } else if (opcode === InstructionOpCode.PUSH_INT) {
+        const index = code.varint();
+        if (index >= constants.length) {
+          throw new Error(`Container: instruction ${i}: PUSH_INT: constant out of range: ${index}`);
+        }
+        return constants[index];
+      } else {
+        return code.signed();
+      }
+    });
+
+    instrs.push({ opcode, operands });
+    offsets.push(offset);
+    offset += 1 + instruction.args.length * 4;
+  }
+  offsets.push(offset);
+
+  const block = new Uint8Array(offset);
+  for (const [i, instr] of instrs.entries()) {
+    const instruction = findInstruction(instr.opcode)!;
+
+    block[offsets[i]] = instr.opcode;
+    for (const [j, operand] of instr.operands.entries()) {
+      writeInt(
+        block,
+        offsets[i] + 1 + j * 4,
+        instruction.args[j] === OpParameter.OPLabel ? offsets[operand] : operand,
+      );
+    }
+  }
+
+  const symbols: Array<CodeSymbol> = [];
+  const names = section(Section.SYMBOLS, "symbols");
+  if (names !== undefined) {
+    const decoder = new TextDecoder();
+    const count = names.varint();
+
+    for (let i = 0; i < count; i++) {
+      const index = names.varint();
+      const length = names.varint();
+      if (index > instrs.length || length > names.end - names.at) {
+        throw new Error(`Container: symbols: symbol ${i} out of range`);
+      }
+      symbols.push({
+        offset: offsets[index],
+        name: decoder.decode(data.subarray(names.at, names.at + length)),
+      });
+      names.at += length;
+    }
+    symbols.sort((a, b) => a.offset - b.offset);
+  }
+
+  return { block, symbols };
+};
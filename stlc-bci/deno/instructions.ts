@@ -16,6 +16,10 @@ export enum InstructionOpCode {
   ENTER,
   RET,
   STORE_VAR,
+  TAIL_CALL,
+  MAKE_CLOSURE,
+  PUSH_FREE,
+  STORE_FREE,
 }
 
 export enum OpParameter {
@@ -67,6 +71,22 @@ const instructions: Array<Instruction> = [
     opcode: InstructionOpCode.STORE_VAR,
     args: [OpParameter.OPInt],
   },
+  { name: "TAIL_CALL", opcode: InstructionOpCode.TAIL_CALL, args: [] },
+  {
+    name: "MAKE_CLOSURE",
+    opcode: InstructionOpCode.MAKE_CLOSURE,
+    args: [OpParameter.OPLabel, OpParameter.OPInt],
+  },
+  {
+    name: "PUSH_FREE",
+    opcode: InstructionOpCode.PUSH_FREE,
+    args: [OpParameter.OPInt],
+  },
+  {
+    name: "STORE_FREE",
+    opcode: InstructionOpCode.STORE_FREE,
+    args: [OpParameter.OPInt],
+  },
 ];
 
 export const find = (opCode: InstructionOpCode): Instruction | undefined =>
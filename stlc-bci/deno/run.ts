@@ -18,7 +18,8 @@ type BoolValue = {
 type ClosureValue = {
   tag: "ClosureValue";
   ip: number;
-  previous: Activation;
+  previous: Activation | null;
+  free: Array<Value>;
 };
 
 const valueToString = (v: Value): string => {
@@ -53,8 +54,8 @@ export const execute = (
 
   const stackToString = (): string => {
     const valueToString = (v: Value | null): string => {
-      const activationDepth = (a: Activation | undefined): number =>
-        a === undefined
+      const activationDepth = (a: Activation | null | undefined): number =>
+        a === undefined || a === null
           ? 0
           : a[1] === null
           ? 1
@@ -151,10 +152,38 @@ export const execute = (
           tag: "ClosureValue",
           ip: targetIP,
           previous: activation,
+          free: [],
         };
         stack.push(argument);
         break;
       }
+      case InstructionOpCode.MAKE_CLOSURE: {
+        const targetIP = readInt();
+        const size = readInt();
+
+        const closure: ClosureValue = {
+          tag: "ClosureValue",
+          ip: targetIP,
+          previous: null,
+          free: stack.splice(stack.length - size, size),
+        };
+        stack.push(closure);
+        break;
+      }
+      case InstructionOpCode.PUSH_FREE: {
+        const index = readInt();
+
+        stack.push(activation[1]!.free[index]);
+        break;
+      }
+      case InstructionOpCode.STORE_FREE: {
+        const index = readInt();
+        const v = stack.pop()!;
+        const closure = stack.pop() as ClosureValue;
+
+        closure.free[index] = v;
+        break;
+      }
       case InstructionOpCode.PUSH_TRUE: {
         stack.push({ tag: "BoolValue", value: true });
         break;
@@ -175,7 +204,7 @@ export const execute = (
 
         let a = activation;
         while (index > 0) {
-          a = a[1]!.previous;
+          a = a[1]!.previous!;
           index -= 1;
         }
         stack.push(a![3]![offset]);
@@ -225,6 +254,20 @@ export const execute = (
         activation = newActivation;
         break;
       }
+      case InstructionOpCode.TAIL_CALL: {
+        const v = stack.pop()!;
+        const closure = stack.pop() as ClosureValue;
+        stack.push(v);
+        const newActivation: Activation = [
+          activation[0],
+          closure,
+          activation[2],
+          null,
+        ];
+        ip = closure.ip;
+        activation = newActivation;
+        break;
+      }
       case InstructionOpCode.ENTER: {
         const size = readInt();
 